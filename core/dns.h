@@ -44,6 +44,7 @@ typedef enum rr_section {
 #define RCODE_NXRRSET		8	/* rrset does not exist */
 #define RCODE_NOTAUTH		9	/* server not authoritative */
 #define RCODE_NOTZONE		10	/* name not inside zone */
+#define RCODE_BADVERS		16	/* bad EDNS version, extended rcode rfc6891 */
 
 /* RFC1035 */
 #define CLASS_IN	1	/* Class IN */
@@ -59,6 +60,7 @@ typedef enum rr_section {
 #define TYPE_SOA	6	/* marks the start of a zone of authority */
 #define TYPE_PTR	12	/* pointer records are used to map a network interface (IP) to a host name. */
 #define TYPE_SRV	33	/* SRV record RFC2782 */
+#define TYPE_OPT	41	/* EDNS0 pseudo record RFC6891, never stored */
 
 
 #define TYPE_SUPPORT_MAX  5
@@ -34,7 +34,6 @@ allocate_domain_info(domain_table_type* table,
 	d->usage = 0;
 	d->is_existing = 0;
 	d->is_apex = 0;
-    d->compressed_offset =0;
     table->number_total++;
 	return d;
 }
@@ -91,14 +90,9 @@ domain_table_deldomain(domain_store_type* db, domain_type* domain)
 void
 add_rdata_to_recyclebin(rr_type* rr)
 {
-	/* add rdatas to recycle bin. */
-	size_t i;
-	for(i=0; i<rr->rdata_count; i++)
-	{
-		if(!rdata_atom_is_domain(rr->type, i))
-            free(rr->rdatas[i].data);
-	}
-	free(rr->rdatas);
+	/* the names are referenced, not owned */
+	free(rr->rdata);
+	rr->rdata = NULL;
 }
 
 /* this routine determines if below a domain there exist names with
@@ -133,14 +127,20 @@ apex_rrset_checks( rrset_type* rrset, domain_type* domain)
 			zone->soa_nx_rrset = xalloc(
 				sizeof(rrset_type));
 			zone->soa_nx_rrset->rr_count = 1;
+			zone->soa_nx_rrset->default_count = 1;
+			zone->soa_nx_rrset->view_count = 0;
+			zone->soa_nx_rrset->views = NULL;
+			zone->soa_nx_rrset->lb_mode = 0;
 			zone->soa_nx_rrset->next = 0;
 			zone->soa_nx_rrset->zone = zone;
 			zone->soa_nx_rrset->rrs = xalloc(sizeof(rr_type));
 		}
 		memcpy(zone->soa_nx_rrset->rrs, rrset->rrs, sizeof(rr_type));
 
-		memcpy(&soa_minimum, rdata_atomdata(rrset->rrs->rdatas[6]),
-				rdata_atom_size(rrset->rrs->rdatas[6]));
+		/* the last field, after serial, refresh, retry and expire */
+		memcpy(&soa_minimum, rdata_wire_bytes(rrset->rrs->rdata) +
+				rrset->rrs->rdata->size - sizeof(soa_minimum),
+				sizeof(soa_minimum));
 		if (rrset->rrs->ttl > ntohl(soa_minimum)) {
 			zone->soa_nx_rrset->rrs[0].ttl = ntohl(soa_minimum);
 		}
@@ -202,23 +202,72 @@ rrset_delete(domain_store_type* db, domain_type* domain, rrset_type* rrset)
 	for (i = 0; i < rrset->rr_count; ++i)
 		add_rdata_to_recyclebin( &rrset->rrs[i]);
     free(rrset->rrs);
+    free(rrset->views);
     free(rrset);
 }
 
+void
+rrset_views_update(rrset_type* rrset)
+{
+	uint16_t i, n;
+
+	free(rrset->views);
+	rrset->views = NULL;
+	rrset->view_count = 0;
+	for (i = 0; i < rrset->rr_count && rrset->rrs[i].view_id == 0; ++i)
+		;
+	rrset->default_count = i;
+	if (i == rrset->rr_count)
+		return;
+
+	for (n = 1; i + 1 < rrset->rr_count; ++i) {
+		if (rrset->rrs[i].view_id != rrset->rrs[i + 1].view_id)
+			n++;
+	}
+	rrset->views = xalloc_array_zero(n, sizeof(rrset_view_type));
+	for (i = rrset->default_count; i < rrset->rr_count; ++i) {
+		rrset_view_type* view = &rrset->views[rrset->view_count];
+		if (view->count == 0) {
+			view->view_id = rrset->rrs[i].view_id;
+			view->start = i;
+		}
+		view->count++;
+		if (i + 1 < rrset->rr_count &&
+		    rrset->rrs[i].view_id != rrset->rrs[i + 1].view_id)
+			rrset->view_count++;
+	}
+	rrset->view_count++;
+}
+
+const rrset_view_type*
+rrset_find_view(const rrset_type* rrset, uint16_t view_id)
+{
+	uint16_t lo = 0, hi = rrset->view_count;
+
+	while (lo < hi) {
+		uint16_t mid = lo + (hi - lo) / 2;
+		if (rrset->views[mid].view_id == view_id)
+			return &rrset->views[mid];
+		if (rrset->views[mid].view_id < view_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
 
 /* fixup usage lower for domain names in the rdata */
 void
 rr_lower_usage(domain_store_type* db, rr_type* rr)
 {
 	unsigned i;
-	for(i=0; i<rr->rdata_count; i++) {
-		if(rdata_atom_is_domain(rr->type, i)) {
-			assert(rdata_atom_domain(rr->rdatas[i])->usage > 0);
-			rdata_atom_domain(rr->rdatas[i])->usage --;
-			if(rdata_atom_domain(rr->rdatas[i])->usage == 0)
-				domain_table_deldomain(db,
-					rdata_atom_domain(rr->rdatas[i]));
-		}
+	for(i=0; i<rr->rdata->fixup_count; i++) {
+		domain_type* domain = rr->rdata->fixups[i].domain;
+		assert(domain->usage > 0);
+		domain->usage --;
+		if(domain->usage == 0)
+			domain_table_deldomain(db, domain);
 	}
 }
 
@@ -488,3 +537,10 @@ domain_store_lookup(struct  domain_store* db,
 	return domain_table_search(
 		db->domains, dname, closest_match, closest_encloser);
 }
+
+void
+domain_store_prefetch(struct domain_store* db, const domain_name_st* dname)
+{
+	radomain_name_prefetch(db->domains->nametree, domain_name_get(dname),
+		dname->name_size);
+}
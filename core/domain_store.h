@@ -26,7 +26,6 @@ typedef struct domain
 	struct domain* wildcard_child_closest_match;
 	struct rrset * rrsets;
 	size_t     usage;     
-    uint16_t    compressed_offset;
     uint32_t maxAnswer;
 	unsigned     is_existing : 1;
 	unsigned     is_apex : 1;
@@ -45,20 +44,46 @@ typedef struct zone
 	unsigned     is_changed : 1; /* zone was changed by AXFR */
 }zone_type;
 
+/*
+ * A domain name in the rdata. It is not part of the wire bytes, the
+ * encoder writes it at offset, compressed when the rr type allows it.
+ */
+typedef struct rdata_fixup {
+	struct domain *  domain;
+	uint16_t         offset;    /* into the wire bytes */
+	uint8_t          index;     /* rdata field, as in the rrtype descriptor */
+	uint8_t          compress;
+}rdata_fixup_type;
+
+/* the rdata in wire format, one allocation: the fixups, then the bytes */
+typedef struct rdata_wire {
+	uint16_t         size;      /* wire bytes, names not included */
+	uint16_t         fixup_count;
+	rdata_fixup_type fixups[];
+}rdata_wire_type;
+
 /* a RR in DNS */
 typedef struct rr {
 	struct domain *     owner;
-	union rdata_atom* rdatas;
-    char  view_name[MAX_VIEW_NAME_LEN];
+	rdata_wire_type*  rdata;
 	uint32_t         ttl;
 	uint16_t         type;
 	uint16_t         klass;
-	uint16_t         rdata_count;
+	uint16_t         lb_weight;   /* answer selection weight, 0 counts as 1 */
+	uint16_t         view_id;     /* 0: no view, answered to every client */
 }rr_type;
 
+/* the RRs of one view, a slice of the rrset's rrs */
+typedef struct rrset_view {
+	uint16_t view_id;
+	uint16_t start;
+	uint16_t count;
+}rrset_view_type;
+
 /*
  * An RRset consists of at least one RR.  All RRs are from the same
- * zone.
+ * zone. The RRs are kept ordered by view: the ones of no view first,
+ * then one slice per view, indexed by views (see rrset_views_update).
  */
 typedef struct rrset
 {
@@ -66,16 +91,12 @@ typedef struct rrset
 	struct zone*  zone;
 	struct rr*    rrs;
 	uint16_t    rr_count;
+	uint16_t    default_count;  /* rrs[0, default_count) are of no view */
+	uint16_t    view_count;
+	uint8_t     lb_mode;    /* LB_MODE_*, how the first answer is chosen */
+	rrset_view_type *views;     /* sorted by view_id */
 }rrset_type;
 
-typedef union rdata_atom
-{
-	domain_type* domain;
-
-	/* Default. */
-	uint16_t*    data;
-}rdata_atom_type;
-
 typedef struct domain_table
 {
     struct radtree *nametree;
@@ -115,6 +136,10 @@ domain_table_count(domain_table_type* table)
 	return table->nametree->count;
 }
 
+/* rebuild default_count and views after the rrs changed, keeping them sorted */
+void rrset_views_update(rrset_type* rrset);
+/* the rrs of view_id, NULL if it has none */
+const rrset_view_type* rrset_find_view(const rrset_type* rrset, uint16_t view_id);
 void rrset_lower_usage(domain_store_type* db, rrset_type* rrset);
 void rrset_delete(domain_store_type* db, domain_type* domain, rrset_type* rrset);
 void rr_lower_usage(domain_store_type* db, rr_type* rr);
@@ -181,30 +206,43 @@ domain_next(domain_type* domain)
 /* easy comparison for subdomain, true if d1 is subdomain of d2. */
 static inline int domain_is_subdomain(domain_type* d1, domain_type* d2)
 { return domain_name_is_subdomain(domain_dname(d1), domain_dname(d2)); }
+/*
+ * The "*" child of domain, if it has one. wildcard_child_closest_match
+ * is the largest child sorting at or before "*", so it is the wildcard
+ * itself when there is one.
+ */
+static inline domain_type *
+domain_wildcard_child(domain_type* domain)
+{
+	domain_type* wildcard_child = domain->wildcard_child_closest_match;
+
+	if (wildcard_child != domain
+	    && label_is_wildcard(domain_name_get(domain_dname(wildcard_child))))
+		return wildcard_child;
+	return NULL;
+}
 /* easy printout, to static buffer of domain_name_to_string, fqdn. */
 static inline const char* domain_to_string(domain_type* domain)
 { return domain_name_to_string(domain_dname(domain), NULL); }
 
 
-static inline int rdata_atom_is_domain(uint16_t type, size_t index);
-static inline int rdata_atom_is_literal_domain(uint16_t type, size_t index);
-
-static inline domain_type *
-rdata_atom_domain(rdata_atom_type atom)
+static inline const uint8_t *
+rdata_wire_bytes(const rdata_wire_type *rdata)
 {
-	return atom.domain;
+	return (const uint8_t *) &rdata->fixups[rdata->fixup_count];
 }
 
-static inline uint16_t
-rdata_atom_size(rdata_atom_type atom)
+/* the domain in rdata field index, NULL when that field is not a name */
+static inline domain_type *
+rr_rdata_domain(const rr_type *rr, unsigned index)
 {
-	return *atom.data;
-}
+	uint16_t i;
 
-static inline uint8_t *
-rdata_atomdata(rdata_atom_type atom)
-{
-	return (uint8_t *) (atom.data + 1);
+	for (i = 0; i < rr->rdata->fixup_count; i++) {
+		if (rr->rdata->fixups[i].index == index)
+			return rr->rdata->fixups[i].domain;
+	}
+	return NULL;
 }
 
 
@@ -226,6 +264,8 @@ int domain_store_lookup (struct  domain_store* db,
 		   const domain_name_st* dname,
 		   domain_type     **closest_match,
 		   domain_type     **closest_encloser);
+/* the first nodes domain_store_lookup visits, for a lookup a few queries on */
+void domain_store_prefetch(struct domain_store* db, const domain_name_st* dname);
 /* pass number of children (to alloc in dirty array */
 struct  domain_store *domain_store_open(void);
 void domain_store_close(struct  domain_store* db);
@@ -236,25 +276,6 @@ void apex_rrset_checks(rrset_type* rrset,domain_type* domain);
 zone_type* domain_store_zone_create(domain_store_type* db, const domain_name_st* dname);
 void domain_store_zone_delete(domain_store_type* db, zone_type* zone);
 
-static inline int
-rdata_atom_is_domain(uint16_t type, size_t index)
-{
-	const rrtype_descriptor_st *descriptor
-		= rrtype_descriptor_by_type(type);
-	return (index < descriptor->maximum
-		&& (descriptor->wireformat[index] == RDATA_WF_COMPRESSED_DNAME
-		    || descriptor->wireformat[index] == RDATA_WF_UNCOMPRESSED_DNAME));
-}
-
-static inline int
-rdata_atom_is_literal_domain(uint16_t type, size_t index)
-{
-	const rrtype_descriptor_st *descriptor
-		= rrtype_descriptor_by_type(type);
-	return (index < descriptor->maximum
-		&& (descriptor->wireformat[index] == RDATA_WF_LITERAL_DNAME));
-}
-
 static inline rdata_wireformat_type
 rdata_atom_wireformat_type(uint16_t type, size_t index)
 {
@@ -0,0 +1,109 @@
+/*
+ * edns.c -- EDNS0 (OPT record) handling, RFC 6891.
+ *
+ * Copyright (c) 2018 tiglabs All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+
+#include "dns.h"
+#include "kdns.h"
+#include "edns.h"
+
+static uint16_t edns_udp_size = EDNS_MAX_MESSAGE_LEN;
+
+void
+edns_init(uint16_t max_udp_size)
+{
+	if (max_udp_size < UDP_MAX_MESSAGE_LEN)
+		max_udp_size = UDP_MAX_MESSAGE_LEN;
+	if (max_udp_size > EDNS_MAX_MESSAGE_LEN)
+		max_udp_size = EDNS_MAX_MESSAGE_LEN;
+	edns_udp_size = max_udp_size;
+}
+
+uint16_t
+edns_max_udp_size(void)
+{
+	return edns_udp_size;
+}
+
+void
+edns_reset(edns_record_st *edns)
+{
+	edns->status = EDNS_NOT_PRESENT;
+	edns->udp_size = 0;
+	edns->version = 0;
+	edns->dnssec_ok = 0;
+}
+
+/* skip a possibly compressed owner name, returns 0 when it runs off the packet */
+static int
+edns_skip_dname(buffer_st *packet)
+{
+	uint8_t label_size;
+
+	while (buffer_available(packet, 1)) {
+		label_size = buffer_read_u8(packet);
+		if (label_size == 0)
+			return 1;
+		if ((label_size & 0xc0) == 0xc0) {
+			if (!buffer_available(packet, 1))
+				return 0;
+			buffer_skip(packet, 1);
+			return 1;
+		}
+		if ((label_size & 0xc0) || !buffer_available(packet, label_size))
+			return 0;
+		buffer_skip(packet, label_size);
+	}
+	return 0;
+}
+
+int
+edns_parse_record(edns_record_st *edns, buffer_st *packet)
+{
+	size_t owner = buffer_get_position(packet);
+	uint16_t type, klass, rdlength;
+	uint32_t ttl;
+
+	if (!edns_skip_dname(packet) || !buffer_available(packet, 10))
+		return 0;
+	type = buffer_read_u16(packet);
+	klass = buffer_read_u16(packet);
+	ttl = buffer_read_u32(packet);
+	rdlength = buffer_read_u16(packet);
+	if (!buffer_available(packet, rdlength))
+		return 0;
+	buffer_skip(packet, rdlength);
+
+	if (type != TYPE_OPT)
+		return 1;
+
+	/* the owner must be the root and there can be only one OPT */
+	if (*buffer_at(packet, owner) != 0 || edns->status != EDNS_NOT_PRESENT) {
+		edns->status = EDNS_ERROR;
+		return 1;
+	}
+	/* options (cookies, client subnet...) are not supported and ignored */
+	edns->status = EDNS_OK;
+	edns->udp_size = klass;
+	edns->version = (ttl >> 16) & 0xff;
+	edns->dnssec_ok = (ttl & EDNS_DO_MASK) ? 1 : 0;
+	return 1;
+}
+
+void
+edns_write_record(const edns_record_st *edns, buffer_st *packet, int rcode)
+{
+	uint32_t ttl = ((uint32_t)(rcode >> 4) & 0xff) << 24 | (uint32_t)EDNS_VERSION << 16;
+
+	if (edns->dnssec_ok)
+		ttl |= EDNS_DO_MASK;
+	buffer_write_u8(packet, 0);		/* root owner */
+	buffer_write_u16(packet, TYPE_OPT);
+	buffer_write_u16(packet, edns_udp_size);
+	buffer_write_u32(packet, ttl);
+	buffer_write_u16(packet, 0);		/* no options */
+}
@@ -0,0 +1,55 @@
+/*
+ * edns.h -- EDNS0 (OPT record) handling, RFC 6891.
+ *
+ * Copyright (c) 2018 tiglabs All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+
+#ifndef _EDNS_H_
+#define _EDNS_H_
+
+#include <stdint.h>
+#include "buffer.h"
+
+#define OPT_LEN 11U		/* length of an OPT record without options */
+#define EDNS_VERSION 0
+#define EDNS_DO_MASK 0x8000U	/* DNSSEC OK bit in the OPT ttl flags */
+
+typedef enum edns_status {
+	EDNS_NOT_PRESENT,
+	EDNS_OK,
+	EDNS_ERROR		/* malformed or duplicate OPT record */
+}edns_status_type;
+
+typedef struct edns_record {
+	edns_status_type status;
+	uint16_t udp_size;	/* payload size advertised by the client */
+	uint8_t  version;
+	uint8_t  dnssec_ok;
+}edns_record_st;
+
+/*
+ * Set the UDP payload size we advertise and accept at most (clamped to
+ * UDP_MAX_MESSAGE_LEN..EDNS_MAX_MESSAGE_LEN).
+ */
+void edns_init(uint16_t max_udp_size);
+uint16_t edns_max_udp_size(void);
+
+void edns_reset(edns_record_st *edns);
+
+/*
+ * Read one resource record of the additional section at the current
+ * position of PACKET. OPT records are parsed into EDNS, other records are
+ * skipped. Returns 0 when the record is truncated or malformed.
+ */
+int edns_parse_record(edns_record_st *edns, buffer_st *packet);
+
+/*
+ * Write our OPT record at the current position, echoing the DO bit of the
+ * query. RCODE is the full (possibly extended) response code.
+ */
+void edns_write_record(const edns_record_st *edns, buffer_st *packet, int rcode);
+
+#endif /* _EDNS_H_ */
@@ -20,9 +20,12 @@
 
 /*  configuration and run-time variables */
 typedef struct kdns kdns_type;
+struct filter;
+
 struct	kdns
 {
 	struct  domain_store	*db;
+	struct  filter		*filter;	/* ingress filter tables of this copy */
     /*
     uint16_t *compressed_domain_name_offsets ;
     uint32_t compression_tablecapacity ;
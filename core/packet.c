@@ -8,6 +8,7 @@
  */
 
 #include <string.h>
+#include <math.h>
 
 #include "packet.h"
 #include "query.h"
@@ -18,20 +19,66 @@ int round_robin = 1;
 
 
 
+/*
+ * Compression state is kept per query, the domains are shared by all
+ * lcores and never written on the query path.
+ */
+static inline uint32_t
+compression_slot(const domain_type *domain)
+{
+	uint64_t key = (uintptr_t)domain >> 4;
+
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (COMPRESSION_TABLE_SIZE - 1);
+}
+
+/* the slot holding domain, or the empty slot it would go in */
+static inline uint32_t
+compression_find(const kdns_query_st *q, const domain_type *domain)
+{
+	uint32_t slot = compression_slot(domain);
+
+	while (q->compression_table[slot].domain != NULL &&
+	       q->compression_table[slot].domain != domain)
+		slot = (slot + 1) & (COMPRESSION_TABLE_SIZE - 1);
+	return slot;
+}
+
+void
+query_put_dname_offset(kdns_query_st *q, domain_type *domain, uint16_t offset)
+{
+	uint32_t slot = compression_find(q, domain);
+
+	if (q->compression_table[slot].domain != NULL ||
+	    q->compressed_count >= MAX_COMPRESSED_DNAMES)
+		return;
+	q->compression_table[slot].domain = domain;
+	q->compression_table[slot].offset = offset;
+	q->compressed_slots[q->compressed_count++] = slot;
+}
+
 static void
 do_dname_data_encode(kdns_query_st *q, domain_type *domain)
 {
-	while (domain->parent && domain->compressed_offset == 0) {
-		domain->compressed_offset =  buffer_get_position(q->packet);
-        q->compressed_dnames[q->compressed_count] = domain;
-        q->compressed_count++;
-        
+	uint32_t slot = 0;
+	size_t position;
+
+	while (domain->parent &&
+	       q->compression_table[slot = compression_find(q, domain)].domain == NULL) {
+		position = buffer_get_position(q->packet);
+		/* pointers only reach the first 16k */
+		if (position <= MAX_COMPRESSION_OFFSET &&
+		    q->compressed_count < MAX_COMPRESSED_DNAMES) {
+			q->compression_table[slot].domain = domain;
+			q->compression_table[slot].offset = position;
+			q->compressed_slots[q->compressed_count++] = slot;
+		}
+
 		buffer_write(q->packet, domain_name_get(domain_dname(domain)),
 			     label_length(domain_name_get(domain_dname(domain))) + 1U);
 		domain = domain->parent;
 	}
 	if (domain->parent) {
-		buffer_write_u16(q->packet,0xc000 | domain->compressed_offset);
+		buffer_write_u16(q->packet,0xc000 | q->compression_table[slot].offset);
 	} else {
 		buffer_write_u8(q->packet, 0);
 	}
@@ -45,7 +92,9 @@ packet_encode_rr(kdns_query_st *q, domain_type *owner, rr_type *rr, uint32_t ttl
 	size_t truncation_mark;
 	uint16_t rdlength = 0;
 	size_t rdlength_pos;
-	uint16_t j;
+	const rdata_wire_type *rdata = rr->rdata;
+	const uint8_t *bytes = rdata_wire_bytes(rdata);
+	uint16_t j, pos = 0;
 	/*
 	 * If the record does not in fit in the packet the packet size
 	 * will be restored to the mark.
@@ -63,26 +112,21 @@ packet_encode_rr(kdns_query_st *q, domain_type *owner, rr_type *rr, uint32_t ttl
 	rdlength_pos = buffer_get_position(q->packet);
 	buffer_skip(q->packet, sizeof(rdlength));
 
-	for (j = 0; j < rr->rdata_count; ++j) {
-		switch (rdata_atom_wireformat_type(rr->type, j)) {
-		case RDATA_WF_COMPRESSED_DNAME:
-			do_dname_data_encode(q, rdata_atom_domain(rr->rdatas[j]));
-			break;
-		case RDATA_WF_UNCOMPRESSED_DNAME:
-		{
-			const domain_name_st *dname = domain_dname(
-				rdata_atom_domain(rr->rdatas[j]));
+	/* the wire bytes as they are, the names in between */
+	for (j = 0; j < rdata->fixup_count; ++j) {
+		const rdata_fixup_type *fixup = &rdata->fixups[j];
+
+		buffer_write(q->packet, bytes + pos, fixup->offset - pos);
+		pos = fixup->offset;
+		if (fixup->compress) {
+			do_dname_data_encode(q, fixup->domain);
+		} else {
+			const domain_name_st *dname = domain_dname(fixup->domain);
 			buffer_write(q->packet,
 				     domain_name_get(dname), dname->name_size);
-			break;
-		}
-		default:
-			buffer_write(q->packet,
-				     rdata_atomdata(rr->rdatas[j]),
-				     rdata_atom_size(rr->rdatas[j]));
-			break;
 		}
 	}
+	buffer_write(q->packet, bytes + pos, rdata->size - pos);
 
 	if (buffer_get_position(q->packet) <= q->maxMsgLen){
 		rdlength = (buffer_get_position(q->packet) - rdlength_pos
@@ -91,21 +135,196 @@ packet_encode_rr(kdns_query_st *q, domain_type *owner, rr_type *rr, uint32_t ttl
 		return 1;
 	} else {
 		buffer_set_position(q->packet, truncation_mark);
-       // query_clear_dname_offsets(q, truncation_mark);
+		query_clear_dname_offsets(q, truncation_mark);
 		return 0;
 	}
 }
 
 
-static int ckeck_view_info(kdns_query_st *query, rr_type *rr)
+/*
+ * The RRs of an rrset a query sees: all of them for a client in no view,
+ * else the ones of no view followed by the ones of the client's view.
+ */
+struct rr_slices {
+	rr_type *rrs;
+	uint16_t count;
+	rr_type *view_rrs;
+	uint16_t view_count;
+};
+
+static inline void
+rr_slices_get(const kdns_query_st *query, rrset_type *rrset, struct rr_slices *slices)
 {
-    if ((strlen(query->view_name) == 0) || (strlen(rr->view_name) == 0)) {
-        return 0;
-    }
-    if (0 == strcmp(rr->view_name,DEFAULT_VIEW_NAME)){
-        return 0;
-    }
-    return strcmp(query->view_name,rr->view_name);
+	const rrset_view_type *view;
+
+	slices->rrs = rrset->rrs;
+	slices->view_rrs = NULL;
+	slices->view_count = 0;
+	if (query->view_id == 0) {
+		slices->count = rrset->rr_count;
+		return;
+	}
+	slices->count = rrset->default_count;
+	if (rrset->view_count > 0 &&
+	    (view = rrset_find_view(rrset, query->view_id)) != NULL) {
+		slices->view_rrs = &rrset->rrs[view->start];
+		slices->view_count = view->count;
+	}
+}
+
+static inline rr_type *
+rr_slices_at(const struct rr_slices *slices, uint16_t i)
+{
+	return i < slices->count ? &slices->rrs[i] : &slices->view_rrs[i - slices->count];
+}
+
+/*
+ * Answer selection state. It is thread local, so each lcore (and the tcp
+ * thread) rotates on its own without touching shared cache lines. Slots
+ * are keyed by rrset; a colliding rrset just restarts the sequence.
+ */
+#define LB_STATE_BITS	10
+#define LB_GOLDEN	2654435761U
+
+struct lb_state {
+	const rrset_type *rrset;
+	uint32_t seq;
+};
+
+static __thread struct lb_state lb_states[1 << LB_STATE_BITS];
+static __thread uint64_t lb_rand_state;
+
+static uint32_t
+lb_next_seq(const rrset_type *rrset)
+{
+	uint32_t slot = ((uint32_t)((uintptr_t)rrset >> 4) * LB_GOLDEN) >> (32 - LB_STATE_BITS);
+	struct lb_state *state = &lb_states[slot];
+
+	if (state->rrset != rrset) {
+		state->rrset = rrset;
+		state->seq = 0;
+	}
+	return state->seq++;
+}
+
+static uint32_t
+lb_rand(void)
+{
+	/* xorshift64*, seeded per thread */
+	uint64_t x = lb_rand_state;
+
+	if (x == 0)
+		x = (uintptr_t)&lb_rand_state ^ 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	lb_rand_state = x;
+	return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static uint32_t
+lb_hash(uint32_t h, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	/* fnv-1a with a murmur3 finalizer */
+	for (i = 0; i < len; i++)
+		h = (h ^ data[i]) * 16777619U;
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+/* a stride near total / phi and coprime with it, visiting every point once */
+static uint32_t
+lb_stride(uint32_t total)
+{
+	uint32_t stride = (uint32_t)(((uint64_t)total * LB_GOLDEN) >> 32) | 1;
+	uint32_t a, b, t;
+
+	for (;; stride++) {
+		for (a = total, b = stride; b != 0; t = a % b, a = b, b = t)
+			;
+		if (a == 1)
+			return stride;
+	}
+}
+
+static inline uint32_t
+lb_rr_weight(const rr_type *rr)
+{
+	return rr->lb_weight ? rr->lb_weight : 1;
+}
+
+/*
+ * Weighted rendezvous hashing: every client keeps its RR as long as that
+ * RR exists, and removing an RR only moves the clients that were on it.
+ */
+static uint16_t
+lb_select_hash(kdns_query_st *query, const struct rr_slices *slices, uint16_t total)
+{
+	uint32_t client = lb_hash(2166136261U, query->client_addr, query->client_addr_len);
+	double score, best_score = -1.0;
+	uint16_t i, j, best = 0;
+
+	for (i = 0; i < total; ++i) {
+		rr_type *rr = rr_slices_at(slices, i);
+		uint32_t h;
+
+		h = lb_hash(client, rdata_wire_bytes(rr->rdata), rr->rdata->size);
+		for (j = 0; j < rr->rdata->fixup_count; ++j) {
+			const domain_name_st *dname = domain_dname(rr->rdata->fixups[j].domain);
+			h = lb_hash(h, domain_name_get(dname), dname->name_size);
+		}
+		score = lb_rr_weight(rr) / -log((h + 1.0) / 4294967297.0);
+		if (score > best_score) {
+			best_score = score;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/*
+ * Pick the RR an answer starts with, according to the rrset lb mode.
+ * Returns an index into the total RRs of slices.
+ */
+static uint16_t
+lb_select(kdns_query_st *query, rrset_type *rrset, const struct rr_slices *slices,
+	  uint16_t total)
+{
+	uint32_t weights = 0, point;
+	uint16_t i;
+
+	switch (rrset->lb_mode) {
+	case LB_MODE_ROTATE:
+		return (uint16_t)(lb_next_seq(rrset) % total);
+	case LB_MODE_HASH:
+		if (query->client_addr_len != 0)
+			return lb_select_hash(query, slices, total);
+		break;
+	default:
+		break;
+	}
+
+	for (i = 0; i < total; ++i)
+		weights += lb_rr_weight(rr_slices_at(slices, i));
+	if (rrset->lb_mode == LB_MODE_RANDOM) {
+		point = lb_rand() % weights;
+	} else {
+		/* step through the weight space in a scattered order */
+		point = (uint32_t)(((uint64_t)lb_next_seq(rrset) * lb_stride(weights)) % weights);
+	}
+	for (i = 0; i < total; ++i) {
+		rr_type *rr = rr_slices_at(slices, i);
+		if (point < lb_rr_weight(rr))
+			return i;
+		point -= lb_rr_weight(rr);
+	}
+	return 0;
 }
 
 int
@@ -115,9 +334,10 @@ packet_encode_rrset(kdns_query_st *query, domain_type *owner,
 {
 	uint16_t i;
 	uint16_t added = 0;  
-	static uint16_t round_robin_off = 0;
 	int do_robin = (round_robin && section == ANSWER_SECTION);
-	uint16_t start;
+	uint16_t start, total;
+	struct rr_slices slices;
+	rr_type *rr;
     uint32_t maxAnswer = 65535;
     int truncate_rrset = (section == ANSWER_SECTION ||
 				section == AUTHORITY_SECTION ||
@@ -130,16 +350,18 @@ packet_encode_rrset(kdns_query_st *query, domain_type *owner,
 	assert(rrset->rr_count > 0);
     size_t truncation_mark = buffer_get_position(query->packet);
 
+	rr_slices_get(query, rrset, &slices);
+	total = slices.count + slices.view_count;
+	if (total == 0)
+		return 0;
 
-	if(do_robin && rrset->rr_count)
-		start = (uint16_t)(round_robin_off++ % rrset->rr_count);
-	else	start = 0;
-	for (i = start; i < rrset->rr_count && added < maxAnswer; ++i) {
-        if (ckeck_view_info(query,&rrset->rrs[i])){
-            continue;
-        }
-		if (packet_encode_rr(query, owner, &rrset->rrs[i],
-			rrset->rrs[i].ttl)) {
+	if (do_robin && total > 1) {
+		start = lb_select(query, rrset, &slices, total);
+		query->no_cache = 1;
+	} else	start = 0;
+	for (i = start; i < total && added < maxAnswer; ++i) {
+		rr = rr_slices_at(&slices, i);
+		if (packet_encode_rr(query, owner, rr, rr->ttl)) {
 			++added;
 		} else {
 		    all_added = 0;
@@ -148,11 +370,8 @@ packet_encode_rrset(kdns_query_st *query, domain_type *owner,
 		}
 	}
 	for (i = 0; i < start && added < maxAnswer; ++i) {
-        if (ckeck_view_info(query,&rrset->rrs[i])){
-            continue;
-        }
-		if (packet_encode_rr(query, owner, &rrset->rrs[i],
-			rrset->rrs[i].ttl)) {
+		rr = rr_slices_at(&slices, i);
+		if (packet_encode_rr(query, owner, rr, rr->ttl)) {
 			++added;
 		} else {
 		    all_added = 0;
@@ -160,6 +379,9 @@ packet_encode_rrset(kdns_query_st *query, domain_type *owner,
 		}
 	}
 
+	/* a partial rrset depends on the room this client gave us */
+	if (!all_added)
+		query->no_cache = 1;
 	if (!all_added && truncate_rrset) {
 		/* Truncate entire RRset and set truncate flag. */
 		buffer_set_position(query->packet, truncation_mark);
@@ -130,6 +130,7 @@ struct query;
 
 #define	MAXRRSPP		1024    /* Maximum number of rr's per packet */
 #define MAX_COMPRESSED_DNAMES	MAXRRSPP /* Maximum number of compressed domains. */
+#define COMPRESSION_TABLE_SIZE	(MAX_COMPRESSED_DNAMES * 2) /* power of 2, at most half full */
 #define MAX_COMPRESSION_OFFSET  0x3fff	 ///the 2 higher bits set to 0
 #define IPV4_MINIMAL_RESPONSE_SIZE 1480	 /* Recommended minimal edns size for IPv4 */
  
@@ -143,6 +144,23 @@ int packet_encode_rr(struct query *query,
 		     rr_type *rr,
 		     uint32_t ttl);
 
+/*
+ * Let DOMAIN compress to a name already at OFFSET in the packet, for
+ * names that are not in the domain table (wildcard expansions).
+ */
+void query_put_dname_offset(struct query *query, domain_type *domain,
+			    uint16_t offset);
+
+/*
+ * Answer selection modes of an rrset (REST lbMode). The rrset is rotated
+ * so the chosen RR comes first; maxAnswer bounds how many follow it.
+ */
+#define LB_MODE_ROTATE	0	/* plain round robin */
+#define LB_MODE_WRR	1	/* weighted round robin on lbWeight */
+#define LB_MODE_RANDOM	2	/* weighted random pick */
+#define LB_MODE_HASH	3	/* weighted rendezvous hash of the client address */
+#define LB_MODE_MAX	LB_MODE_HASH
+
 /*
  * Encode RRSET with OWNER as the owner name into QUERY.  Returns the
  * number of RRs successfully encoded.  If TRUNCATE_RRSET the entire
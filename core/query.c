@@ -7,6 +7,7 @@
 #include "domain_store.h"
 #include "query.h"
 #include "util.h"
+#include "view.h"
 
 struct additional_rr_types
 {
@@ -85,12 +86,38 @@ query_reset(kdns_query_st *q )
 	q->qtype = 0;
 	q->qclass = 0;
 	q->zone = NULL;
+	q->closest_match = NULL;
+	q->closest_encloser = NULL;
+	q->exact = 0;
 	q->opcode = 0;
         q->maxAnswer = 0;
         q->offset = 0;
 	q->cname_count = 0;
         q->maxMsgLen= UDP_MAX_MESSAGE_LEN;
-    memset(q->view_name,0,MAX_VIEW_NAME_LEN);
+        q->no_cache = 0;
+	q->client_addr_len = 0;
+	query_clear_dname_offsets(q, 0);
+	q->wildcard_count = 0;
+	edns_reset(&q->edns);
+    q->view_id = VIEW_ID_NONE;
+}
+
+/*
+ * Names are dropped newest first, so no name left in the table probed
+ * past a slot that is emptied here.
+ */
+void
+query_clear_dname_offsets(kdns_query_st *q, size_t max_offset)
+{
+	struct compressed_dname *entry;
+
+	while (q->compressed_count > 0) {
+		entry = &q->compression_table[q->compressed_slots[q->compressed_count - 1]];
+		if (entry->offset < max_offset)
+			break;
+		entry->domain = NULL;
+		q->compressed_count--;
+	}
 }
 
 /*
@@ -113,6 +140,42 @@ process_query_section(kdns_query_st *query)
 }
 
 
+/*
+ * Walk the additional section looking for the OPT record. The packet is
+ * left positioned at the end of the question.
+ */
+static int
+process_additional_section(kdns_query_st *query)
+{
+	size_t question_end = buffer_get_position(query->packet);
+	uint16_t arcount = GET_AR_COUNT(query->packet);
+
+	while (arcount-- > 0) {
+		if (!edns_parse_record(&query->edns, query->packet))
+			return 0;
+	}
+	buffer_set_position(query->packet, question_end);
+	return query->edns.status != EDNS_ERROR;
+}
+
+/*
+ * Answer up to the payload size the client advertised, bounded by
+ * our own, keeping room for the OPT record. TCP keeps its 64k.
+ */
+static void
+query_set_max_message_len(kdns_query_st *q)
+{
+	uint16_t size = q->edns.udp_size;
+
+	if (size < UDP_MAX_MESSAGE_LEN)
+		size = UDP_MAX_MESSAGE_LEN;
+	if (size > edns_max_udp_size())
+		size = edns_max_udp_size();
+	if (size > q->maxMsgLen)
+		q->maxMsgLen = size;
+	q->maxMsgLen -= OPT_LEN;
+}
+
 static void
 add_additional_rrsets(struct query *query, kdns_answer_st *answer,
 		      rrset_type *master_rrset, size_t rdata_index,
@@ -123,11 +186,9 @@ add_additional_rrsets(struct query *query, kdns_answer_st *answer,
 	assert(query);
 	assert(answer);
 	assert(master_rrset);
-	assert(rdata_atom_is_domain(rrset_rrtype(master_rrset), rdata_index));
-
 	for (i = 0; i < master_rrset->rr_count; ++i) {
 		int j;
-		domain_type *additional = rdata_atom_domain(master_rrset->rrs[i].rdatas[rdata_index]);
+		domain_type *additional = rr_rdata_domain(&master_rrset->rrs[i], rdata_index);
 
 		assert(additional);
 
@@ -210,7 +271,7 @@ answer_domain(struct kdns*  kdns, struct query *q, kdns_answer_st *answer,
 		assert(rrset->rr_count > 0);
 		if (added) {
 			/* only process first CNAME record */
-			domain_type *closest_match = rdata_atom_domain(rrset->rrs[0].rdatas[0]);
+			domain_type *closest_match = rr_rdata_domain(&rrset->rrs[0], 0);
 			domain_type *closest_encloser = closest_match;
 			zone_type* origzone = q->zone;
 			++q->cname_count;
@@ -242,9 +303,32 @@ answer_authoritative(struct kdns   * kdns,
 {
 	domain_type *match;
 	domain_type *original = closest_match;
+	domain_type *wildcard_child;
+
 	if (exact) {
 		match = closest_match;
-	}  else {
+	} else if ((wildcard_child = domain_wildcard_child(closest_encloser)) != NULL &&
+		   q->wildcard_count < QUERY_MAX_WILDCARDS) {
+		/* synthesize the name from the wildcard, RFC 4592 */
+		match = &q->wildcard_matches[q->wildcard_count++];
+		memset(match, 0, sizeof(domain_type));
+		match->rrsets = wildcard_child->rrsets;
+		match->maxAnswer = wildcard_child->maxAnswer;
+		match->is_existing = wildcard_child->is_existing;
+		match->wildcard_child_closest_match = match;
+		if (q->cname_count == 0) {
+			/* the qname: always a pointer to the question */
+			match->dname = wildcard_child->dname;
+			match->parent = closest_encloser;
+			query_put_dname_offset(q, match, DNS_HEAD_SIZE);
+		} else {
+			/* a cname target, it is in the domain table */
+			match->dname = closest_match->dname;
+			match->parent = closest_match->parent;
+		}
+		/* a no data answer is about the wildcard itself */
+		original = wildcard_child;
+	} else {
 		match = NULL;
 	}
 
@@ -294,34 +378,61 @@ answer_lookup_zone(struct kdns * kdns, struct query *q, kdns_answer_st *answer,
 	
 }
 
-static void query_compressed_table_clear(struct query *q){
-    int i =0;
-    for(;i < q->compressed_count; i++){
-        if (q->compressed_dnames[i] != NULL) {
-            q->compressed_dnames[i]->compressed_offset = 0;
-        }      
-    }
-    q->compressed_count = 0;    
+void
+query_lookup(kdns_query_st *q, kdns_type * kdns)
+{
+	q->exact = domain_store_lookup( kdns->db, q->qname, &q->closest_match, &q->closest_encloser);
+	/* the answer stage starts with the matched domain's rrsets */
+	__builtin_prefetch(q->closest_match);
 }
 
+void
+query_prefetch_lookup(const kdns_query_st *q, kdns_type * kdns)
+{
+	domain_store_prefetch(kdns->db, q->qname);
+}
 
-static void
-query_response(struct kdns * kdns, struct query *q)
+void
+query_prefetch_rrsets(const kdns_query_st *q)
 {
-	domain_type *closest_match;
-	domain_type *closest_encloser;
-	kdns_answer_st answer ={0};
+	rrset_type *rrset;
 
-	int exact = domain_store_lookup( kdns->db, q->qname, &closest_match, &closest_encloser);
+	if (q->closest_match == NULL) {
+		return;
+	}
+	rrset = q->closest_match->rrsets;
+	if (rrset != NULL) {
+		__builtin_prefetch(rrset);
+		__builtin_prefetch(rrset->rrs);
+	}
+}
 
-	answer_lookup_zone( kdns, q, &answer, exact, closest_match,closest_encloser);
+void
+query_answer(kdns_query_st *q, kdns_type * kdns)
+{
+	kdns_answer_st answer ={0};
+
+	answer_lookup_zone( kdns, q, &answer, q->exact, q->closest_match, q->closest_encloser);
 
     if (GET_RCODE(q->packet) != RCODE_REFUSE) {
         encode_answer(q, &answer);
-        query_compressed_table_clear(q);
+        query_add_optional(q);
     }
 }
 
+void
+query_add_optional(kdns_query_st *q)
+{
+	int rcode = GET_RCODE(q->packet);
+
+	if (q->edns.status != EDNS_OK)
+		return;
+	if (q->edns.version != EDNS_VERSION)
+		rcode = RCODE_BADVERS;
+	edns_write_record(&q->edns, q->packet, rcode);
+	SET_AR_COUNT(q->packet, GET_AR_COUNT(q->packet) + 1);
+}
+
 void
 query_prepare_response_data(kdns_query_st *q)
 {
@@ -338,10 +449,10 @@ query_prepare_response_data(kdns_query_st *q)
 }
 
 /*
- * process one query.
+ * check the header and parse the question of one query.
  *
  */
-query_state_type query_process(kdns_query_st *q, kdns_type * kdns)
+query_state_type query_parse(kdns_query_st *q)
 {
 	if ((buffer_getlimit(q->packet) < DNS_HEAD_SIZE) ||(GET_FLAG_QR(q->packet)) ){
 		return QUERY_FAIL;
@@ -361,7 +472,8 @@ query_state_type query_process(kdns_query_st *q, kdns_type * kdns)
 		return query_format_error(q);
 	}
 	/* Ignore settings of flags */
- 	if (GET_AN_COUNT(q->packet) != 0 || GET_NS_COUNT(q->packet) != 0 ||  GET_AR_COUNT(q->packet) >= 2) {
+ 	if (GET_AN_COUNT(q->packet) != 0 || GET_NS_COUNT(q->packet) != 0 ||
+		!process_additional_section(q)) {
 		return query_format_error(q);
 	}
 
@@ -370,11 +482,32 @@ query_state_type query_process(kdns_query_st *q, kdns_type * kdns)
     //
 	query_prepare_response_data(q);
 
+	if (q->edns.status == EDNS_OK) {
+		if (q->edns.version != EDNS_VERSION) {
+			/* BADVERS: the question and our OPT, nothing else */
+			SET_RCODE(q->packet, RCODE_BADVERS & RCODE_MASK);
+			SET_AR_COUNT(q->packet, 0);
+			query_add_optional(q);
+			return QUERY_SUCCESS;
+		}
+		query_set_max_message_len(q);
+	}
+
 	if (q->qclass != CLASS_IN ) {
 		return query_error(q, RCODE_REFUSE);
 	}
-    
-	query_response(kdns, q);
+	return QUERY_LOOKUP;
+}
+
+query_state_type query_process(kdns_query_st *q, kdns_type * kdns)
+{
+	query_state_type state = query_parse(q);
+
+	if (state != QUERY_LOOKUP) {
+		return state;
+	}
+	query_lookup(q, kdns);
+	query_answer(q, kdns);
 	return QUERY_SUCCESS;
 }
 
@@ -16,16 +16,20 @@
 #include "domain_store.h"
 #include "kdns.h"
 #include "packet.h"
+#include "edns.h"
 
 
 
 typedef enum query_state {
 	QUERY_SUCCESS,
 	QUERY_FAIL,
+	QUERY_LOOKUP,	/* question parsed, lookup and answer still to do */
 }query_state_type;
 
 /* Query as we pass it around */
 
+#define QUERY_MAX_WILDCARDS 4
+
 typedef struct query {
  
 	buffer_st *packet;
@@ -33,17 +37,39 @@ typedef struct query {
 	uint16_t qtype;
 	uint16_t qclass;
     uint8_t opcode;
-    char view_name[MAX_VIEW_NAME_LEN];
+    uint16_t view_id;          /* of the client address, 0: no view */
+    uint8_t client_addr[16];   /* network order, for LB_MODE_HASH */
+    uint8_t client_addr_len;   /* 4, 16 or 0 when unknown */
     
 	zone_type *zone;
+
+    /* result of query_lookup, consumed by query_answer */
+    domain_type *closest_match;
+    domain_type *closest_encloser;
+    int exact;
     
 	int cname_count;
     uint16_t offset;
     uint32_t maxAnswer;
     uint32_t maxMsgLen;
+    uint8_t  no_cache;   /* answer differs per query (rrset rotation) */
+    edns_record_st edns;
 
-    domain_type *compressed_dnames[MAXRRSPP];
+    /*
+     * Names already in the packet: an open addressing table keyed by
+     * domain pointer, and the used slots in packet order so a truncated
+     * rr can be rolled back and the table cleared cheaply.
+     */
+    struct compressed_dname {
+        const domain_type *domain;
+        uint16_t offset;
+    } compression_table[COMPRESSION_TABLE_SIZE];
+    uint16_t    compressed_slots[MAX_COMPRESSED_DNAMES];
     uint16_t    compressed_count;
+
+    /* names synthesized from wildcards (RFC 4592), one per cname step */
+    domain_type wildcard_matches[QUERY_MAX_WILDCARDS];
+    uint8_t     wildcard_count;
     
     /*
 	uint16_t     compressed_domain_name_count;
@@ -88,6 +114,28 @@ void query_reset(kdns_query_st *query );
  */
 query_state_type query_process(kdns_query_st *q,  kdns_type * kdns);
 
+/*
+ * query_process split in stages so a burst of queries can be parsed,
+ * looked up and answered one stage at a time. query_parse returns
+ * QUERY_LOOKUP when the query still needs query_lookup and query_answer,
+ * otherwise the response (if any) is already in the packet.
+ */
+query_state_type query_parse(kdns_query_st *q);
+void query_lookup(kdns_query_st *q, kdns_type * kdns);
+void query_answer(kdns_query_st *q, kdns_type * kdns);
+
+/*
+ * Prefetch the first name tree nodes query_lookup visits, issued a few
+ * queries ahead of it.
+ */
+void query_prefetch_lookup(const kdns_query_st *q, kdns_type * kdns);
+
+/*
+ * Prefetch the rrsets of the domain found by query_lookup, issued a few
+ * queries ahead of query_answer.
+ */
+void query_prefetch_rrsets(const kdns_query_st *q);
+
 /*
  * Prepare the query structure for writing the response. The packet
  * data up-to the current packet limit is preserved. This usually
@@ -103,5 +151,10 @@ void query_prepare_response_data(kdns_query_st *q);
 query_state_type query_error(kdns_query_st *q,  int rcode);
 void query_clear_dname_offsets(struct query *q, size_t max_offset);
 
+/*
+ * Append our OPT record to the response when the query carried one.
+ */
+void query_add_optional(kdns_query_st *q);
+
  
 #endif /* _QUERY_H_ */
@@ -1253,6 +1253,120 @@ struct radnode* radomain_name_search(struct radtree* rt, const uint8_t* d,
 	return NULL;
 }
 
+/* find the closest encloser of a domain name in radix tree */
+struct radnode* radomain_name_find_encloser(struct radtree* rt, const uint8_t* d,
+	size_t max)
+{
+	/* stack of labels in the domain name */
+	const uint8_t* labstart[130];
+	unsigned int lab, dpos, lpos;
+	struct radnode* n = rt->root;
+	struct radnode* found = NULL;
+	uint8_t byte;
+	uint16_t i;
+	uint8_t b;
+
+	if(max < 1 || !n)
+		return NULL;
+	/* the root encloses every name */
+	if(n->elem)
+		found = n;
+	if(d[0] == 0)
+		return found;
+
+	/* find labels stack in domain name */
+	lab = 0;
+	dpos = 0;
+	/* must have one label, since root is specialcased */
+	do {
+		if((d[dpos] & 0xc0))
+			return NULL; /* compression ptrs not allowed error */
+		labstart[lab++] = &d[dpos];
+		if(dpos + d[dpos] + 1 >= max)
+			return NULL; /* format error: outside of bounds */
+		/* skip the label contents */
+		dpos += d[dpos];
+		dpos ++;
+	} while(d[dpos] != 0);
+
+	/* walk down like radomain_name_search, remember the last element
+	 * found at the end of a label */
+	lab-=1;
+	lpos = 0;
+	while(n) {
+		/* fetch next byte this label */
+		if(lpos < *labstart[lab])
+			/* lpos+1 to skip labelstart, lpos++ to move forward */
+			byte = char_d2r(labstart[lab][++lpos]);
+		else {
+			/* n holds the name up to this label */
+			if(n->elem)
+				found = n;
+			if(lab == 0) /* last label - we're done */
+				return found;
+			/* next label, search for byte 00 */
+			lpos = 0;
+			lab--;
+			byte = 0;
+		}
+		/* find that byte in the array */
+		if(byte < n->offset)
+			return found;
+		byte -= n->offset;
+		if(byte >= n->len)
+			return found;
+		if(n->array[byte].len != 0) {
+			/* must match additional string */
+			for(i=0; i<n->array[byte].len; i++) {
+				/* next byte to match */
+				if(lpos < *labstart[lab])
+					b = char_d2r(labstart[lab][++lpos]);
+				else {
+					/* the name ends in the additional string */
+					if(lab == 0)
+						return found;
+					/* next label, search for byte 00 */
+					lpos = 0;
+					lab--;
+					b = 0;
+				}
+				if(n->array[byte].str[i] != b)
+					return found; /* not matched */
+			}
+		}
+		n = n->array[byte].node;
+	}
+	return found;
+}
+
+/* prefetch the start of the walk of radomain_name_find_less_equal */
+void radomain_name_prefetch(struct radtree* rt, const uint8_t* d, size_t max)
+{
+	struct radnode* n = rt->root;
+	struct radsel* sel;
+	size_t dpos = 0, last = 0;
+	uint8_t byte;
+
+	if(!n)
+		return;
+	__builtin_prefetch(n->array);
+	/* the walk starts at the first byte of the last label */
+	while(dpos < max && d[dpos] != 0) {
+		if((d[dpos] & 0xc0))
+			return;
+		last = dpos;
+		dpos += d[dpos] + 1;
+	}
+	if(dpos >= max || dpos == 0)
+		return;
+	byte = char_d2r(d[last + 1]);
+	if(byte < n->offset || byte - n->offset >= n->len)
+		return;
+	sel = &n->array[byte - n->offset];
+	__builtin_prefetch(sel->node);
+	__builtin_prefetch(sel->str);
+}
+
 /* find domain name or smaller or equal domain name in radix tree */
 int radomain_name_find_less_equal(struct radtree* rt, const uint8_t* d, size_t max,
         struct radnode** result)
@@ -200,6 +200,29 @@ struct radnode* radomain_name_search(struct radtree* rt, const uint8_t* d,
 int radomain_name_find_less_equal(struct radtree* rt, const uint8_t* d, size_t max,
 	struct radnode** result);
 
+/**
+ * Prefetch the first steps radomain_name_find_less_equal takes for a
+ * domain name: the root's lookup array and the node of the top label's
+ * first byte. Issued a few lookups ahead, it does not change the tree.
+ * @param rt: the radix tree.
+ * @param d: domain name, no compression pointers allowed.
+ * @param max: max length to go from d.
+ */
+void radomain_name_prefetch(struct radtree* rt, const uint8_t* d, size_t max);
+
+/**
+ * Find the closest encloser of a domain name in the tree: the element of
+ * the name itself or of its nearest parent domain, whole labels only
+ * (example.com encloses www.example.com, not wwwexample.com).
+ * The name is internally converted to a radname.
+ * @param rt: the radix tree.
+ * @param d: domain name, no compression pointers allowed.
+ * @param max: max length to go from d.
+ * @return NULL on parse error or if no element encloses the name.
+ */
+struct radnode* radomain_name_find_encloser(struct radtree* rt, const uint8_t* d,
+	size_t max);
+
 /**
  * Insert radix element by domain name.
  * @param rt: the radix tree
@@ -29,6 +29,161 @@ static view_node_t *view_tree_alloc_node(view_tree_t *tree)
 }
 
 
+static char view_names[VIEW_MAX_IDS][MAX_VIEW_NAME_LEN];
+static uint16_t view_names_count = 1;   /* id 0 is VIEW_ID_NONE */
+
+uint16_t view_id_intern(const char *view_name)
+{
+    uint16_t id;
+
+    for (id = 1; id < view_names_count; id++) {
+        if (strncmp(view_names[id], view_name, MAX_VIEW_NAME_LEN) == 0)
+            return id;
+    }
+    if (view_names_count == VIEW_MAX_IDS) {
+        log_msg(LOG_ERR, "too many views, %s not added\n", view_name);
+        return VIEW_ID_NONE;
+    }
+    snprintf(view_names[id], MAX_VIEW_NAME_LEN, "%s", view_name);
+    return view_names_count++;
+}
+
+const char *view_id_name(uint16_t view_id)
+{
+    return view_names[view_id];
+}
+
+static inline uint16_t view_node_id(view_node_t *node, uint16_t inherited)
+{
+    return node->view_data != VIEW_NULL_VALUE ? node->view_data->view_id : inherited;
+}
+
+static int view_tbl8_alloc(view_tree_t *tree)
+{
+    uint16_t *tbl8;
+    uint32_t g, groups;
+
+    if (tree->tbl8_free_count > 0)
+        return tree->tbl8_free[--tree->tbl8_free_count];
+    if (tree->tbl8_groups == VIEW_TBL8_MAX_GROUPS)
+        return -1;
+
+    /* readers use the other copy of the store, it can move */
+    groups = tree->tbl8_groups ? tree->tbl8_groups * 2 : 64;
+    if (groups > VIEW_TBL8_MAX_GROUPS)
+        groups = VIEW_TBL8_MAX_GROUPS;
+    tbl8 = realloc(tree->tbl8, groups * VIEW_TBL8_SIZE * sizeof(uint16_t));
+    if (tbl8 == NULL)
+        return -1;
+    tree->tbl8 = tbl8;
+    tbl8 = realloc(tree->tbl8_free, groups * sizeof(uint16_t));
+    if (tbl8 == NULL)
+        return -1;
+    tree->tbl8_free = tbl8;
+
+    g = tree->tbl8_groups;
+    tree->tbl8_groups = groups;
+    while (--groups > g)
+        tree->tbl8_free[tree->tbl8_free_count++] = groups;
+    return g;
+}
+
+/* set n tbl24 entries from idx to view_id, dropping their groups */
+static void view_tbl24_write(view_tree_t *tree, uint32_t idx, uint32_t n, uint16_t view_id)
+{
+    uint32_t end = idx + n;
+
+    for (; idx < end; idx++) {
+        if (tree->tbl24[idx] & VIEW_TBL_EXT)
+            tree->tbl8_free[tree->tbl8_free_count++] = tree->tbl24[idx] & ~VIEW_TBL_EXT;
+        tree->tbl24[idx] = view_id;
+    }
+}
+
+/* write the subtree of node, depth > 24, into its tbl8 group */
+static void view_tbl8_fill(uint16_t *group, view_node_t *node, uint32_t first, uint32_t depth,
+        uint16_t view_id)
+{
+    uint32_t i, n = 1U << (32 - depth);
+
+    if (node->view_data != VIEW_NULL_VALUE) {
+        view_id = node->view_data->view_id;
+        for (i = first; i < first + n; i++)
+            group[i] = view_id;
+    }
+    if (node->left)
+        view_tbl8_fill(group, node->left, first, depth + 1, view_id);
+    if (node->right)
+        view_tbl8_fill(group, node->right, first + n / 2, depth + 1, view_id);
+}
+
+/* rebuild the entries under node (NULL: no cidr there) at depth <= 24 */
+static void view_tbl24_fill(view_tree_t *tree, view_node_t *node, uint32_t addr, uint32_t depth,
+        uint16_t view_id)
+{
+    uint32_t i, idx = addr >> 8;
+    uint16_t *group;
+    int g;
+
+    if (node == NULL) {
+        view_tbl24_write(tree, idx, 1U << (24 - depth), view_id);
+        return;
+    }
+    view_id = view_node_id(node, view_id);
+    if (depth < 24) {
+        view_tbl24_fill(tree, node->left, addr, depth + 1, view_id);
+        view_tbl24_fill(tree, node->right, addr | (1U << (31 - depth)), depth + 1, view_id);
+        return;
+    }
+
+    if (node->left == NULL && node->right == NULL) {
+        view_tbl24_write(tree, idx, 1, view_id);
+        return;
+    }
+    if (tree->tbl24[idx] & VIEW_TBL_EXT) {
+        g = tree->tbl24[idx] & ~VIEW_TBL_EXT;
+    } else if ((g = view_tbl8_alloc(tree)) < 0) {
+        log_msg(LOG_ERR, "no tbl8 group for view cidrs longer than /24\n");
+        tree->tbl24[idx] = view_id;
+        return;
+    }
+    group = &tree->tbl8[(uint32_t)g * VIEW_TBL8_SIZE];
+    for (i = 0; i < VIEW_TBL8_SIZE; i++)
+        group[i] = view_id;
+    if (node->left)
+        view_tbl8_fill(group, node->left, 0, 25, view_id);
+    if (node->right)
+        view_tbl8_fill(group, node->right, VIEW_TBL8_SIZE / 2, 25, view_id);
+    tree->tbl24[idx] = VIEW_TBL_EXT | g;
+}
+
+/* bring the table in line with the trie after a change of key/nbits */
+static void view_table_update(view_tree_t *tree, uint8_t *key, size_t nbits)
+{
+    uint32_t addr, depth = nbits < 24 ? nbits : 24;
+    view_node_t *node = tree->root;
+    uint16_t view_id = VIEW_ID_NONE;
+    uint32_t d;
+
+    memcpy(&addr, key, sizeof(addr));
+    addr = ntohl(addr) & ~(0xffffffffU >> depth);
+    for (d = 0; node && d < depth; d++) {
+        view_id = view_node_id(node, view_id);
+        node = (addr & (0x80000000U >> d)) ? node->right : node->left;
+    }
+    view_tbl24_fill(tree, node, addr, depth, view_id);
+}
+
+void view_lookup_bulk(const view_tree_t *tree, const uint32_t *addrs, uint16_t *view_ids, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        __builtin_prefetch(&tree->tbl24[ntohl(addrs[i]) >> 8]);
+    for (i = 0; i < n; i++)
+        view_ids[i] = view_lookup(tree, addrs[i]);
+}
+
 static view_node_t* do_view_tree_get(view_tree_t *tree,
         uint8_t *key, size_t nbits, int flags)
 {
@@ -89,17 +244,11 @@ static int do_view_tree_insert(view_tree_t *tree, uint8_t *key, size_t nbits,
     node->view_data = view_data;
 
     tree->size++;
+    view_table_update(tree, key, nbits);
 
     return 0;
 }
 
-view_value_t* view_find(view_tree_t *tree, uint8_t *key, size_t nbits)
-{
-    view_node_t *node = do_view_tree_get(tree, key, nbits, FIND_BEST);
-
-    return node ? node->view_data : VIEW_NO_NODE;
-}
-
 static int do_view_tree_delete(view_tree_t *tree, uint8_t *key, size_t nbits)
 {
     view_node_t *node = do_view_tree_get(tree, key, nbits, 0);
@@ -109,14 +258,12 @@ static int do_view_tree_delete(view_tree_t *tree, uint8_t *key, size_t nbits)
         return -1;
     }
 
-    if (node->left || node->right || (node->parent == NULL)) {
-        node->view_data = VIEW_NULL_VALUE;
-        tree->size--;
-        return 0;
-    }
-
+    free(node->view_data);
+    node->view_data = VIEW_NULL_VALUE;
 
-    while (!node->left && !node->right) {
+    /* drop the branch that leads to no other cidr */
+    while (node->parent && !node->left && !node->right &&
+            node->view_data == VIEW_NULL_VALUE) {
         if (node->parent->left == node)
             node->parent->left = NULL;
         else
@@ -125,19 +272,11 @@ static int do_view_tree_delete(view_tree_t *tree, uint8_t *key, size_t nbits)
         node->right = tree->free;
         tree->free = node;
 
-
         node = node->parent;
-
-        if (node->view_data != VIEW_NULL_VALUE){ 
-            free(node->view_data);
-            break;
-        }
-
-        if (node->parent == NULL) 
-            break;
     }
 
     tree->size--;
+    view_table_update(tree, key, nbits);
 
     return 0;
 }
@@ -149,6 +288,11 @@ view_tree_t *view_tree_create(void)
     tree->free = NULL;
     tree->size = 0;
     tree->root = view_tree_alloc_node(tree);
+    tree->tbl24 = calloc(VIEW_TBL24_SIZE, sizeof(uint16_t));
+    if (tree->tbl24 == NULL) {
+        log_msg(LOG_ERR, "no mem for the view table\n");
+        exit(-1);
+    }
 
     return tree;
 }
@@ -225,10 +369,18 @@ int view_insert(view_tree_t *tree,char *pcidr, char *view_name){
 
     memcpy(view_data->cidrs, pcidr, strlen(pcidr));
     memcpy(view_data->view_name, view_name, strlen(view_name));
+    view_data->view_id = view_id_intern(view_name);
+    if (view_data->view_id == VIEW_ID_NONE) {
+        ret = -1;
+        goto error;
+    }
 
-    do_view_tree_insert(tree, (uint8_t *) &ip.s_addr, nbits, view_data); 
+    if (do_view_tree_insert(tree, (uint8_t *) &ip.s_addr, nbits, view_data) == 0) {
+        view_data = NULL;
+    }
    
 error:
+    free(view_data);
     free(cidr);
 
     return ret;
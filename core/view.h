@@ -18,6 +18,7 @@
 typedef struct view_value{
     char  cidrs[MAX_VIEW_NAME_LEN];
     char  view_name[MAX_VIEW_NAME_LEN];
+    uint16_t view_id;
 }view_value_t;
 
 
@@ -28,18 +29,59 @@ typedef struct _view_node {
     view_value_t * view_data;
 } view_node_t;
 
+/*
+ * The bit trie holds the cidrs (update and dump). Lookups go through a
+ * DIR-24-8 table rebuilt from the trie on every update: tbl24 is indexed
+ * by the top 24 address bits and holds either a view id or, with
+ * VIEW_TBL_EXT set, the tbl8 group holding the view ids of that /24.
+ */
+#define VIEW_TBL24_SIZE     (1U << 24)
+#define VIEW_TBL8_SIZE      256
+#define VIEW_TBL_EXT        0x8000
+#define VIEW_TBL8_MAX_GROUPS VIEW_TBL_EXT
+
 typedef struct view_tree {
     view_node_t *root;
     view_node_t *free; 
     int size;
+
+    uint16_t *tbl24;
+    uint16_t *tbl8;
+    uint32_t tbl8_groups;       /* groups allocated in tbl8 */
+    uint32_t tbl8_free_count;
+    uint16_t *tbl8_free;        /* unused groups */
 } view_tree_t;
 
+/*
+ * View names are interned to small ids by the master lcore. Ids are never
+ * reused, so a reader may keep one across updates. VIEW_ID_NONE is no view.
+ */
+#define VIEW_ID_NONE    0
+#define VIEW_MAX_IDS    4096
+
+uint16_t view_id_intern(const char *view_name);
+const char *view_id_name(uint16_t view_id);
+
 int view_insert(view_tree_t *tree,char *pcidr, char *view_name);
 int view_delete(view_tree_t *tree,char *pcidr);
 view_tree_t *view_tree_create(void);
-view_value_t* view_find(view_tree_t *tree, uint8_t *key, size_t nbits);
 void view_tree_dump(view_node_t *node,  void* arg1,void (*callback)(void*,view_value_t *));
 
+/* the view id of an ipv4 address in network order */
+static inline uint16_t view_lookup(const view_tree_t *tree, uint32_t addr)
+{
+    uint32_t ip = ntohl(addr);
+    uint16_t entry = tree->tbl24[ip >> 8];
+
+    if (entry & VIEW_TBL_EXT) {
+        entry = tree->tbl8[(uint32_t)(entry & ~VIEW_TBL_EXT) * VIEW_TBL8_SIZE + (ip & 0xff)];
+    }
+    return entry;
+}
+
+/* view_lookup for n addresses, the table loads of the burst overlap */
+void view_lookup_bulk(const view_tree_t *tree, const uint32_t *addrs, uint16_t *view_ids, unsigned n);
+
 
 
 
@@ -18,106 +18,127 @@
 #include "domain_store.h"
 
 
-uint16_t *
-alloc_rdata_init( const void *data, size_t size)
+void
+rdata_builder_init(rdata_builder_type *builder, uint16_t type)
 {
-	uint16_t *result = xalloc( sizeof(uint16_t) + size);
-	*result = size;
-	memcpy(result + 1, data, size);
-	return result;
+	builder->type = type;
+	builder->size = 0;
+	builder->field_count = 0;
+	builder->fixup_count = 0;
 }
 
+int
+rdata_add_data(rdata_builder_type *builder, const void *data, size_t size)
+{
+	if (builder->field_count >= MAXRDATALEN ||
+	    builder->size + size > sizeof(builder->data)) {
+		log_msg(LOG_ERR,"too many rdata elements");
+		return -1;
+	}
+	memcpy(builder->data + builder->size, data, size);
+	builder->size += size;
+	builder->field_count++;
+	return 0;
+}
 
-uint16_t *
-zparser_conv_serial( const char *serialstr)
+int
+rdata_add_domain(rdata_builder_type *builder, domain_type *domain)
+{
+	rdata_fixup_type *fixup;
+
+	if (builder->field_count >= MAXRDATALEN) {
+		log_msg(LOG_ERR,"too many rdata elements");
+		return -1;
+	}
+	fixup = &builder->fixups[builder->fixup_count++];
+	fixup->domain = domain;
+	fixup->offset = builder->size;
+	fixup->index = builder->field_count;
+	fixup->compress = rdata_atom_wireformat_type(builder->type,
+		builder->field_count) == RDATA_WF_COMPRESSED_DNAME;
+	builder->field_count++;
+	return 0;
+}
+
+rdata_wire_type *
+rdata_builder_finish(const rdata_builder_type *builder)
+{
+	size_t fixups_size = builder->fixup_count * sizeof(rdata_fixup_type);
+	rdata_wire_type *rdata = xalloc(sizeof(rdata_wire_type) + fixups_size + builder->size);
+
+	rdata->size = builder->size;
+	rdata->fixup_count = builder->fixup_count;
+	memcpy(rdata->fixups, builder->fixups, fixups_size);
+	memcpy(&rdata->fixups[rdata->fixup_count], builder->data, builder->size);
+	return rdata;
+}
+
+
+int
+zparser_conv_serial(rdata_builder_type *builder, const char *serialstr)
 {
-	uint16_t *r = NULL;
 	uint32_t serial;
 	const char *t;
 
 	serial = strtoserial(serialstr, &t);
 	if (*t != '\0') {
 		log_msg(LOG_ERR,"serial is expected or serial too big");
-	} else {
-		serial = htonl(serial);
-		r = alloc_rdata_init( &serial, sizeof(serial));
+		return -1;
 	}
-	return r;
+	serial = htonl(serial);
+	return rdata_add_data(builder, &serial, sizeof(serial));
 }
 
-uint16_t *
-zparser_conv_short( const char *text)
+int
+zparser_conv_short(rdata_builder_type *builder, const char *text)
 {
-	uint16_t *r = NULL;
 	uint16_t value;
 	char *end;
 
 	value = htons((uint16_t) strtol(text, &end, 10));
 	if (*end != '\0') {
 		log_msg(LOG_ERR,"integer value is expected");
-	} else {
-		r = alloc_rdata_init( &value, sizeof(value));
+		return -1;
 	}
-	return r;
+	return rdata_add_data(builder, &value, sizeof(value));
 }
 
-uint16_t *
-zparser_conv_a( const char *text)
+int
+zparser_conv_a(rdata_builder_type *builder, const char *text)
 {
 	in_addr_t address;
-	uint16_t *r = NULL;
 
 	if (inet_pton(AF_INET, text, &address) != 1) {
 		log_msg(LOG_ERR,"invalid IPv4 address '%s'", text);
-	} else {
-		r = alloc_rdata_init( &address, sizeof(address));
+		return -1;
 	}
-	return r;
+	return rdata_add_data(builder, &address, sizeof(address));
 }
 
 
  int
 zrdatacmp(uint16_t type, rr_type *a, rr_type *b)
 {
-	int i = 0;
+	uint16_t i;
 
 	assert(a);
 	assert(b);
+	(void)type;
 
 	/* One is shorter than another */
-	if (a->rdata_count != b->rdata_count)
+	if (a->rdata->size != b->rdata->size ||
+	    a->rdata->fixup_count != b->rdata->fixup_count)
 		return 1;
 
-	/* Compare element by element */
-	for (i = 0; i < a->rdata_count; ++i) {
-		if (rdata_atom_is_domain(type, i)) {
-			if (rdata_atom_domain(a->rdatas[i])
-			    != rdata_atom_domain(b->rdatas[i]))
-			{
-				return 1;
-			}
-		} else if(rdata_atom_is_literal_domain(type, i)) {
-			if (rdata_atom_size(a->rdatas[i])
-			    != rdata_atom_size(b->rdatas[i]))
-				return 1;
-			if (!domain_name_equal_nocase(rdata_atomdata(a->rdatas[i]),
-				   rdata_atomdata(b->rdatas[i]),
-				   rdata_atom_size(a->rdatas[i])))
-				return 1;
-		} else {
-			if (rdata_atom_size(a->rdatas[i])
-			    != rdata_atom_size(b->rdatas[i]))
-			{
-				return 1;
-			}
-			if (memcmp(rdata_atomdata(a->rdatas[i]),
-				   rdata_atomdata(b->rdatas[i]),
-				   rdata_atom_size(a->rdatas[i])) != 0)
-			{
-				return 1;
-			}
-		}
+	/* names are shared, equal names are the same domain */
+	for (i = 0; i < a->rdata->fixup_count; ++i) {
+		if (a->rdata->fixups[i].domain != b->rdata->fixups[i].domain ||
+		    a->rdata->fixups[i].offset != b->rdata->fixups[i].offset)
+			return 1;
 	}
+	if (memcmp(rdata_wire_bytes(a->rdata), rdata_wire_bytes(b->rdata),
+		   a->rdata->size) != 0)
+		return 1;
 
 	/* Otherwise they are equal */
 	return 0;
@@ -191,42 +212,29 @@ void domain_store_zones_check_create(struct kdns*  kdns, char* zones)
 }
 
 
-/** add an rdata (uncompressed) to the destination */
-static size_t
-add_rdata(rr_type* rr, unsigned i, uint8_t* buf, size_t buflen)
-{
-	switch(rdata_atom_wireformat_type(rr->type, i)) {
-		case RDATA_WF_COMPRESSED_DNAME:
-		case RDATA_WF_UNCOMPRESSED_DNAME:
-		{
-			const domain_name_st* dname = domain_dname(
-				rdata_atom_domain(rr->rdatas[i]));
-			if(dname->name_size > buflen)
-				return 0;
-			memmove(buf, domain_name_get(dname), dname->name_size);
-			return dname->name_size;
-		}
-		default:
-			break;
-	}
-	if(rdata_atom_size(rr->rdatas[i]) > buflen)
-		return 0;
-	memmove(buf, rdata_atomdata(rr->rdatas[i]),
-		rdata_atom_size(rr->rdatas[i]));
-	return rdata_atom_size(rr->rdatas[i]);
-}
-
 /* marshal rdata into buffer, must be MAX_RDLENGTH in size */
 size_t
 rr_marshal_rdata(rr_type* rr, uint8_t* rdata, size_t sz)
 {
-	size_t len = 0;
-	unsigned i;
+	const rdata_wire_type *wire = rr->rdata;
+	const uint8_t *bytes = rdata_wire_bytes(wire);
+	size_t len = 0, pos = 0;
+	uint16_t i;
+
 	assert(rr);
-	for(i=0; i<rr->rdata_count; i++) {
-		len += add_rdata(rr, i, rdata+len, sz-len);
+	for(i=0; i<wire->fixup_count; i++) {
+		const domain_name_st* dname = domain_dname(wire->fixups[i].domain);
+		size_t n = wire->fixups[i].offset - pos;
+		if(len + n + dname->name_size > sz)
+			return len;
+		memmove(rdata+len, bytes+pos, n);
+		len += n;
+		pos += n;
+		memmove(rdata+len, domain_name_get(dname), dname->name_size);
+		len += dname->name_size;
 	}
-	return len;
+	if(len + wire->size - pos > sz)
+		return len;
+	memmove(rdata+len, bytes+pos, wire->size - pos);
+	return len + wire->size - pos;
 }
-
-
@@ -39,13 +39,30 @@ zrdatacmp(uint16_t type, rr_type *a, rr_type *b);
 
 
 
-uint16_t *zparser_conv_serial( const char *periodstr);
-
-uint16_t *zparser_conv_short( const char *text);
-
-uint16_t *zparser_conv_a( const char *text);
-
-uint16_t *alloc_rdata_init( const void *data, size_t size);
+/*
+ * Builds the wire format rdata of one rr, field by field. Names are kept
+ * as fixups; rdata_builder_finish copies the result into one allocation.
+ */
+typedef struct rdata_builder {
+	uint16_t         type;
+	uint16_t         size;
+	uint16_t         field_count;
+	uint16_t         fixup_count;
+	rdata_fixup_type fixups[MAXRDATALEN];
+	uint8_t          data[MAX_RDLENGTH];
+}rdata_builder_type;
+
+void rdata_builder_init(rdata_builder_type *builder, uint16_t type);
+int rdata_add_data(rdata_builder_type *builder, const void *data, size_t size);
+int rdata_add_domain(rdata_builder_type *builder, domain_type *domain);
+rdata_wire_type *rdata_builder_finish(const rdata_builder_type *builder);
+
+/* parse text and add it to the rdata, 0 or -1 on a parse error */
+int zparser_conv_serial(rdata_builder_type *builder, const char *periodstr);
+
+int zparser_conv_short(rdata_builder_type *builder, const char *text);
+
+int zparser_conv_a(rdata_builder_type *builder, const char *text);
 
 
 #endif /* _ZONEC_H_ */
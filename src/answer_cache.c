@@ -0,0 +1,153 @@
+/*
+ * answer_cache.c -- per-lcore wire-format answer cache
+ */
+
+#include <string.h>
+#include <stdio.h>
+
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_jhash.h>
+#include <rte_common.h>
+
+#include "answer_cache.h"
+#include "netdev.h"
+#include "util.h"
+
+struct answer_cache_entry {
+    uint32_t generation;           /* 0: never filled */
+    uint32_t hash;
+    uint16_t qtype;
+    uint16_t qname_len;            /* wire length including the root label */
+    uint16_t body_len;             /* answer bytes following the question */
+    uint16_t view_id;
+    uint8_t  head[DNS_HEAD_SIZE - 2];  /* flags and section counts */
+    uint8_t  qname[MAXDOMAINLEN];
+    uint8_t  body[UDP_MAX_MESSAGE_LEN];
+} __rte_cache_aligned;
+
+struct answer_cache {
+    uint32_t generation;
+    uint32_t mask;
+    struct answer_cache_entry *entries;
+} __rte_cache_aligned;
+
+static struct answer_cache answer_caches[RTE_MAX_LCORE];
+
+
+int answer_cache_init(unsigned lcore_id, uint32_t size) {
+    struct answer_cache *cache = &answer_caches[lcore_id];
+
+    cache->generation = 1;
+    if (size == 0) {
+        cache->entries = NULL;
+        cache->mask = 0;
+        return 0;
+    }
+    size = rte_align32pow2(size);
+    cache->entries = rte_zmalloc_socket(NULL, size * sizeof(struct answer_cache_entry),
+        RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+    if (cache->entries == NULL) {
+        log_msg(LOG_ERR, "answer cache alloc failed for lcore %u, size %u\n", lcore_id, size);
+        return -1;
+    }
+    cache->mask = size - 1;
+    return 0;
+}
+
+void answer_cache_invalidate(unsigned lcore_id) {
+    struct answer_cache *cache = &answer_caches[lcore_id];
+
+    if (++cache->generation == 0) {
+        cache->generation = 1;
+    }
+}
+
+static inline uint32_t
+answer_cache_hash(const uint8_t *qname, uint16_t qname_len, uint16_t qtype, uint16_t view_id) {
+    return rte_jhash(qname, qname_len, ((uint32_t)view_id << 16) | qtype);
+}
+
+int answer_cache_lookup(unsigned lcore_id, kdns_query_st *query) {
+    struct answer_cache *cache = &answer_caches[lcore_id];
+    struct netif_queue_stats *stats = &netif_queue_conf_get(lcore_id)->stats;
+    buffer_st *packet = query->packet;
+    const uint8_t *qname = domain_name_get(query->qname);
+    uint16_t qname_len = query->qname->name_size;
+    struct answer_cache_entry *e;
+    uint16_t flags;
+    size_t qend;
+    uint32_t hash;
+
+    if (cache->entries == NULL) {
+        return -1;
+    }
+
+    hash = answer_cache_hash(qname, qname_len, query->qtype, query->view_id);
+    e = &cache->entries[hash & cache->mask];
+    qend = buffer_get_position(packet);
+    if (e->generation != cache->generation || e->hash != hash || e->qtype != query->qtype ||
+        e->view_id != query->view_id ||
+        e->qname_len != qname_len || memcmp(e->qname, qname, qname_len) != 0 ||
+        qend + e->body_len > query->maxMsgLen) {
+        goto miss;
+    }
+
+    flags = GET_FLAGS(packet) & 0x0100U;   /* keep the client's RD */
+    buffer_write_at(packet, 2, e->head, sizeof(e->head));
+    SET_FLAGS(packet, (GET_FLAGS(packet) & ~0x0100U) | flags);
+    buffer_write_at(packet, qend, e->body, e->body_len);
+    buffer_set_position(packet, qend + e->body_len);
+    query_add_optional(query);
+    stats->answer_cache_hits++;
+    return 0;
+
+miss:
+    stats->answer_cache_misses++;
+    return -1;
+}
+
+void answer_cache_insert(unsigned lcore_id, kdns_query_st *query) {
+    struct answer_cache *cache = &answer_caches[lcore_id];
+    buffer_st *packet = query->packet;
+    struct answer_cache_entry *e;
+    uint16_t qname_len;
+    size_t qend, len;
+    uint32_t hash;
+
+    if (cache->entries == NULL || query->no_cache) {
+        return;
+    }
+    if (GET_QD_COUNT(packet) != 1 || query->qclass != CLASS_IN || GET_FLAG_TC(packet) ||
+        (GET_RCODE(packet) != RCODE_OK && GET_RCODE(packet) != RCODE_NXDOMAIN)) {
+        return;
+    }
+    qname_len = query->qname->name_size;
+    qend = DNS_HEAD_SIZE + qname_len + 2 * sizeof(uint16_t);
+    len = buffer_get_position(packet);
+    /* the OPT record is per client, it is appended again on a hit */
+    if (query->edns.status == EDNS_OK) {
+        len -= OPT_LEN;
+    }
+    if (len < qend || len - qend > UDP_MAX_MESSAGE_LEN) {
+        return;
+    }
+
+    hash = answer_cache_hash(domain_name_get(query->qname), qname_len, query->qtype, query->view_id);
+    e = &cache->entries[hash & cache->mask];
+    e->hash = hash;
+    e->qtype = query->qtype;
+    e->qname_len = qname_len;
+    e->body_len = len - qend;
+    memcpy(e->head, buffer_at(packet, 2), sizeof(e->head));
+    if (query->edns.status == EDNS_OK) {
+        /* ar count, the last two bytes of the head */
+        uint16_t arcount = GET_AR_COUNT(packet) - 1;
+        e->head[sizeof(e->head) - 2] = arcount >> 8;
+        e->head[sizeof(e->head) - 1] = arcount & 0xff;
+    }
+    e->view_id = query->view_id;
+    memcpy(e->qname, domain_name_get(query->qname), qname_len);
+    memcpy(e->body, buffer_at(packet, qend), e->body_len);
+    e->generation = cache->generation;
+}
@@ -0,0 +1,34 @@
+#ifndef __ANSWER_CACHE_H__
+#define __ANSWER_CACHE_H__
+
+#include <stdint.h>
+#include "query.h"
+
+/*
+ * Per-lcore cache of complete wire-format answers, keyed by the lowercased
+ * qname, qtype and client view. Entries carry the generation they were built
+ * under; bumping the generation (on any zone or view update) drops them all.
+ */
+
+#define ANSWER_CACHE_DEF_SIZE 4096
+
+int answer_cache_init(unsigned lcore_id, uint32_t size);
+
+/*
+ * Look up a query query_parse left in the QUERY_LOOKUP state. On a hit the
+ * cached answer is written after the client's question, its ID and RD bit
+ * are kept, an OPT record is added for EDNS clients and 0 is returned with
+ * the packet positioned at the end of the answer (like query_process).
+ * Answers bigger than the client's payload size miss. Returns -1 on a miss.
+ */
+int answer_cache_lookup(unsigned lcore_id, kdns_query_st *query);
+
+/*
+ * Store the answer query_answer just built in query->packet, without its
+ * OPT record. Truncated answers and answers over 512 bytes are not kept.
+ */
+void answer_cache_insert(unsigned lcore_id, kdns_query_st *query);
+
+void answer_cache_invalidate(unsigned lcore_id);
+
+#endif
@@ -2,8 +2,11 @@
  * data_update.c 
  */
 #include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include "db_update.h"
 #include "util.h"
+#include "view.h"
 
 
 static rrset_type *  do_domaindata_insert(struct  domain_store *db,zone_type * zo,const domain_name_st * dname  ,rr_type *rr,uint32_t maxAnswer ){
@@ -24,11 +27,12 @@ static rrset_type *  do_domaindata_insert(struct  domain_store *db,zone_type * z
         rrset->rr_count = 1;
         rrset->rrs = (rr_type *) xalloc_zero(sizeof(rr_type));
         rrset->rrs[0] = *rr;
+        rrset_views_update(rrset);
 
         /* Add it */
         domain_add_rrset(rr->owner, rrset);
     } else {
-        int i;
+        int i, pos;
         rr_type* o;
         if (rrset->rrs[0].ttl != rr->ttl) {
             log_msg(LOG_ERR,"TTL  does not match\n");
@@ -51,13 +55,17 @@ static rrset_type *  do_domaindata_insert(struct  domain_store *db,zone_type * z
             return NULL;
         }
 
-        /* Add it... */
+        /* Add it at the end of its view... */
+        for (pos = rrset->rr_count; pos > 0 && rrset->rrs[pos - 1].view_id > rr->view_id; pos--)
+            ;
         o = rrset->rrs;
         rrset->rrs = (rr_type *) xalloc_array_zero(rrset->rr_count + 1, sizeof(rr_type));
-        memcpy(rrset->rrs, o, (rrset->rr_count) * sizeof(rr_type));
+        memcpy(rrset->rrs, o, pos * sizeof(rr_type));
+        memcpy(&rrset->rrs[pos + 1], &o[pos], (rrset->rr_count - pos) * sizeof(rr_type));
         free(o);
-        rrset->rrs[rrset->rr_count] = *rr;
+        rrset->rrs[pos] = *rr;
         ++rrset->rr_count;
+        rrset_views_update(rrset);
     } 
     return rrset ;
 }
@@ -95,8 +103,9 @@ static int  do_domaindata_delete(struct  domain_store *db,zone_type * zo,const d
              }else{
                  rr_type* rrs_orig = rrset->rrs;
     			add_rdata_to_recyclebin( &rrset->rrs[rrnum]);
-    			if(rrnum < rrset->rr_count-1)
-    				rrset->rrs[rrnum] = rrset->rrs[rrset->rr_count-1];
+    			/* close the gap, the rrs stay ordered by view */
+    			memmove(&rrset->rrs[rrnum], &rrset->rrs[rrnum + 1],
+    				(rrset->rr_count - rrnum - 1) * sizeof(rr_type));
     			memset(&rrset->rrs[rrset->rr_count-1], 0, sizeof(rr_type));
     			/* realloc the rrs array one smaller */
                 rrset->rrs = xalloc_array_zero(rrset->rr_count-1,  sizeof(rr_type));
@@ -108,6 +117,7 @@ static int  do_domaindata_delete(struct  domain_store *db,zone_type * zo,const d
                 free(rrs_orig);
                 
                 rrset->rr_count --;  
+                rrset_views_update(rrset);
              }          
         }
     } 
@@ -138,30 +148,22 @@ int do_domaindata_delete_all(struct  domain_store *db,zone_type * zo,const domai
 
 
 static void
-db_zadd_rdata_domain( struct  domain_store *db,char *domian_name,rr_type * rr_insert)
+db_zadd_rdata_domain( struct  domain_store *db,char *domian_name,rdata_builder_type *builder)
 {
 
     const domain_name_st* dname = domain_name_parse((const char*)domian_name);
     domain_type* owner = domain_table_insert(db->domains,dname,0);
 
-   	if (rr_insert->rdata_count >= MAXRDATALEN) {
-		log_msg(LOG_ERR,"too many rdata elements");
-	} else {
-        rr_insert->rdatas[rr_insert->rdata_count].domain = owner;
+    if (rdata_add_domain(builder, owner) == 0) {
         owner->usage ++; /* new reference to domain */
-        ++rr_insert->rdata_count;
-	}
+    }
 }
 
 static void
-db_zadd_rdata_wireformat(rr_type * rr_insert, uint16_t *data)
+db_zadd_rdata_short(rdata_builder_type *builder, uint16_t value)
 {
-	if (rr_insert->rdata_count >= MAXRDATALEN) {
-		log_msg(LOG_ERR,"too many rdata elements");
-	} else {
-		rr_insert->rdatas[rr_insert->rdata_count].data = data;
-		++ rr_insert->rdata_count;
-	}
+    value = htons(value);
+    rdata_add_data(builder, &value, sizeof(value));
 }
 
 
@@ -180,20 +182,22 @@ int domaindata_soa_insert(struct  domain_store *db,char *zone_name){
 
     rr_insert->klass      = CLASS_IN;
     rr_insert->type       = TYPE_SOA;
-    rr_insert->rdata_count = 0;
+
+    rdata_builder_type builder;
+    rdata_builder_init(&builder, TYPE_SOA);
 
     char z_name[64]={0};
     snprintf(z_name, sizeof(z_name), "ns1.%s", zone_name);
-    rr_insert->rdatas =  xalloc_array_zero( MAXRDATALEN, sizeof(rdata_atom_type));
 
-    db_zadd_rdata_domain(db,z_name,rr_insert);//ns
+    db_zadd_rdata_domain(db,z_name,&builder);//ns
     snprintf(z_name, sizeof(z_name), "mail.%s", zone_name);
-    db_zadd_rdata_domain(db,z_name,rr_insert);//email
-    db_zadd_rdata_wireformat(rr_insert, zparser_conv_serial("2017070809"));//serial number
-    db_zadd_rdata_wireformat(rr_insert, zparser_conv_serial("3600"));//refresh
-    db_zadd_rdata_wireformat(rr_insert, zparser_conv_serial("900"));//retry
-    db_zadd_rdata_wireformat(rr_insert, zparser_conv_serial("1209600"));//expire
-    db_zadd_rdata_wireformat(rr_insert, zparser_conv_serial("1800"));//  ttl
+    db_zadd_rdata_domain(db,z_name,&builder);//email
+    zparser_conv_serial(&builder, "2017070809");//serial number
+    zparser_conv_serial(&builder, "3600");//refresh
+    zparser_conv_serial(&builder, "900");//retry
+    zparser_conv_serial(&builder, "1209600");//expire
+    zparser_conv_serial(&builder, "1800");//  ttl
+    rr_insert->rdata = rdata_builder_finish(&builder);
 
     domain_type* owner = domain_table_insert(db->domains,zname,0);
 
@@ -224,17 +228,12 @@ int domaindata_srv_insert(struct  domain_store *db,char *zone_name,char *domian_
    rr_insert->klass      = CLASS_IN;
    rr_insert->type       = TYPE_SRV;
    rr_insert->ttl        = ttl;
-   rr_insert->rdata_count = 0;
-   
-   rr_insert->rdatas =  xalloc_array_zero( MAXRDATALEN, sizeof(rdata_atom_type));
 
-    char string[32];
-    sprintf(string,"%d",prio); 
-    db_zadd_rdata_wireformat(rr_insert, zparser_conv_short(string));//prio
-    sprintf(string,"%d",weight); 
-    db_zadd_rdata_wireformat(rr_insert, zparser_conv_short(string));//weight
-    sprintf(string,"%d",port); 
-    db_zadd_rdata_wireformat(rr_insert, zparser_conv_short(string));//port
+    rdata_builder_type builder;
+    rdata_builder_init(&builder, TYPE_SRV);
+    db_zadd_rdata_short(&builder, prio);//prio
+    db_zadd_rdata_short(&builder, weight);//weight
+    db_zadd_rdata_short(&builder, port);//port
 
     domain_type* owner = domain_table_insert(db->domains,hostDomain,maxAnswer);//domain_table_find 
     if (owner == NULL){
@@ -242,20 +241,20 @@ int domaindata_srv_insert(struct  domain_store *db,char *zone_name,char *domian_
        goto error;
     }
 
-    rr_insert->rdatas[rr_insert->rdata_count].domain = owner;
+    rdata_add_domain(&builder, owner);
 	owner->usage ++; /* new reference to domain */
-	++rr_insert->rdata_count;
+    rr_insert->rdata = rdata_builder_finish(&builder);
      
     const domain_name_st* dname = domain_name_parse((const char*)domian_name);
     rrset_type *  rrset = do_domaindata_insert(db,zo,dname, rr_insert,maxAnswer);
         
     if (rrset != NULL){
-       
+        free(rr_insert);
         return 0;
     }
 
 error:
-    free(rr_insert->rdatas);
+    add_rdata_to_recyclebin(rr_insert);
     free(rr_insert);
     return -1;
 }
@@ -276,25 +275,20 @@ uint16_t port, uint32_t ttl,uint32_t maxAnswer ){
    rr_del->klass      = CLASS_IN;
    rr_del->type       = TYPE_SRV;
    rr_del->ttl        = ttl;
-   rr_del->rdata_count = 0;
-   
-   rr_del->rdatas =  xalloc_array_zero(MAXRDATALEN, sizeof(rdata_atom_type));
 
-    char string[32];
-    sprintf(string,"%d",prio); 
-    db_zadd_rdata_wireformat(rr_del, zparser_conv_short(string));//prio
-    sprintf(string,"%d",weight); 
-    db_zadd_rdata_wireformat(rr_del, zparser_conv_short(string));//weight
-    sprintf(string,"%d",port); 
-    db_zadd_rdata_wireformat(rr_del, zparser_conv_short(string));//port
+    rdata_builder_type builder;
+    rdata_builder_init(&builder, TYPE_SRV);
+    db_zadd_rdata_short(&builder, prio);//prio
+    db_zadd_rdata_short(&builder, weight);//weight
+    db_zadd_rdata_short(&builder, port);//port
 
     domain_type* owner = domain_table_insert(db->domains,hostDomain,maxAnswer);//domain_table_find 
     if (owner == NULL){
        log_msg(LOG_ERR,"err can not find domian : %s\n",host);
     }
 
-    rr_del->rdatas[rr_del->rdata_count].domain = owner;
-	++rr_del->rdata_count;
+    rdata_add_domain(&builder, owner);
+    rr_del->rdata = rdata_builder_finish(&builder);
      
   const domain_name_st* dname = domain_name_parse((const char*)domian_name);
     
@@ -323,18 +317,17 @@ int domaindata_cname_insert(struct  domain_store *db,char *zone_name,char *domia
    rr_insert->klass      = CLASS_IN;
    rr_insert->type       = TYPE_CNAME;
    rr_insert->ttl        = ttl;
-   rr_insert->rdata_count = 0;
-   
-   rr_insert->rdatas =  xalloc_array_zero( MAXRDATALEN, sizeof(rdata_atom_type));
 
     domain_type* owner = domain_table_insert(db->domains,hostDomain,maxAnswer);//domain_table_find 
     if (owner == NULL){
         log_msg(LOG_ERR,"err can not find domian : %s\n",host);
     }
 
-    rr_insert->rdatas[rr_insert->rdata_count].domain = owner;
+    rdata_builder_type builder;
+    rdata_builder_init(&builder, TYPE_CNAME);
+    rdata_add_domain(&builder, owner);
 	owner->usage ++; /* reference to domain */
-	++rr_insert->rdata_count;
+    rr_insert->rdata = rdata_builder_finish(&builder);
      
     const domain_name_st* dname = domain_name_parse((const char*)domian_name);
     rrset_type *  rrset = do_domaindata_insert(db,zo,dname, rr_insert,maxAnswer);
@@ -343,6 +336,7 @@ int domaindata_cname_insert(struct  domain_store *db,char *zone_name,char *domia
         free (rr_insert);
         return 0;
     }
+    add_rdata_to_recyclebin(rr_insert);
     free (rr_insert);
 
     return -1;
@@ -377,16 +371,16 @@ int domaindata_ptr_insert(struct domain_store *db, char *zone_name, char *domian
     rr_insert->klass        = CLASS_IN;
     rr_insert->type         = TYPE_PTR;
     rr_insert->ttl          = ttl;
-    rr_insert->rdata_count  = 0;
-    rr_insert->rdatas       = xalloc_array_zero( MAXRDATALEN, sizeof(rdata_atom_type));
 
     domain_type* owner = domain_table_insert(db->domains, hostDomain, maxAnswer);//domain_table_find
     if (owner == NULL) {
        log_msg(LOG_ERR,"err can not find domian : %s\n", host);
     }
-    rr_insert->rdatas[rr_insert->rdata_count].domain = owner;
+    rdata_builder_type builder;
+    rdata_builder_init(&builder, TYPE_PTR);
+    rdata_add_domain(&builder, owner);
     owner->usage++; /* new reference to domain */
-    ++rr_insert->rdata_count;
+    rr_insert->rdata = rdata_builder_finish(&builder);
 
     const domain_name_st *dname = domain_name_parse((const char*)domian_name);
     rrset_type *rrset = do_domaindata_insert(db, zo, dname, rr_insert, maxAnswer);
@@ -394,6 +388,7 @@ int domaindata_ptr_insert(struct domain_store *db, char *zone_name, char *domian
         free (rr_insert);
         return 0;
     }
+    add_rdata_to_recyclebin(rr_insert);
     free (rr_insert);
 
     return -1;
@@ -413,15 +408,15 @@ int domaindata_ptr_delete(struct domain_store *db, char *zone_name, char *domian
     rr_del->klass           = CLASS_IN;
     rr_del->type            = TYPE_PTR;
     rr_del->ttl             = ttl;
-    rr_del->rdata_count     = 0;
-    rr_del->rdatas          = xalloc_array_zero(MAXRDATALEN, sizeof(rdata_atom_type));
 
     domain_type *owner = domain_table_insert(db->domains, hostDomain, maxAnswer);//domain_table_find
     if (owner == NULL) {
        log_msg(LOG_ERR,"err can not find domian : %s\n", host);
     }
-    rr_del->rdatas[rr_del->rdata_count].domain = owner;
-    ++rr_del->rdata_count;
+    rdata_builder_type builder;
+    rdata_builder_init(&builder, TYPE_PTR);
+    rdata_add_domain(&builder, owner);
+    rr_del->rdata = rdata_builder_finish(&builder);
 
     const domain_name_st *dname = domain_name_parse((const char*)domian_name);
     int ret = do_domaindata_delete(db, zo, dname, rr_del);
@@ -430,19 +425,29 @@ int domaindata_ptr_delete(struct domain_store *db, char *zone_name, char *domian
     return ret;
 }
 
-int domaindata_a_insert(struct  domain_store *db,char *zone_name,char *domian_name, char*view_name, char * ip_addr, uint32_t ttl,uint32_t maxAnswer ){
+int domaindata_a_insert(struct  domain_store *db,char *zone_name,char *domian_name, char*view_name, char * ip_addr, uint32_t ttl,uint32_t maxAnswer,
+    uint16_t lb_mode, uint16_t lb_weight){
 
     rr_type * rr_insert =  (rr_type *) xalloc_zero(sizeof(rr_type));
     rr_insert->klass      = CLASS_IN;
     rr_insert->type       = TYPE_A;
     rr_insert->ttl        = ttl;
-    snprintf(rr_insert->view_name, 32, "%s", view_name);
+    rr_insert->lb_weight  = lb_weight;
+    if (view_name[0] != '\0' && strcmp(view_name, DEFAULT_VIEW_NAME) != 0) {
+        rr_insert->view_id = view_id_intern(view_name);
+        if (rr_insert->view_id == VIEW_ID_NONE) {
+            free(rr_insert);
+            return -1;
+        }
+    }
     
-    rr_insert->rdatas =  xalloc_array_zero( MAXRDATALEN, sizeof(rdata_atom_type));
-    uint16_t * dataA = zparser_conv_a(ip_addr);
-
-    rr_insert->rdatas[0].data = dataA;
-    rr_insert->rdata_count =1; 
+    rdata_builder_type builder;
+    rdata_builder_init(&builder, TYPE_A);
+    if (zparser_conv_a(&builder, ip_addr) != 0) {
+        free (rr_insert);
+        return -1;
+    }
+    rr_insert->rdata = rdata_builder_finish(&builder);
 
     const domain_name_st* zname = domain_name_parse((const char*)zone_name);
     const domain_name_st* dname = domain_name_parse((const char*)domian_name);
@@ -451,13 +456,18 @@ int domaindata_a_insert(struct  domain_store *db,char *zone_name,char *domian_na
 	zone_type * zo = domain_store_find_zone(db, zname);
 	if(!zo) {
         log_msg(LOG_ERR," not find the zone\n");
+        add_rdata_to_recyclebin(rr_insert);
+        free (rr_insert);
         return -1;		
 	}
     rrset_type * rrset =  do_domaindata_insert(db,zo,dname, rr_insert,maxAnswer);
     if (rrset == NULL){
+        add_rdata_to_recyclebin(rr_insert);
         free (rr_insert);
         return -1;
     }
+    /* the mode is per rrset, the last record added sets it */
+    rrset->lb_mode = lb_mode;
     free (rr_insert);
     return 0;
 
@@ -469,13 +479,16 @@ int domaindata_a_delete(struct  domain_store *db,char *zone_name,char *domian_na
     rr_del->klass      = CLASS_IN;
     rr_del->type       = TYPE_A;
     rr_del->ttl        = ttl;
-    snprintf(rr_del->view_name, 32, "%s", view_name);
+    /* the address alone picks the record, as for insert duplicates */
+    (void)view_name;
     
-    rr_del->rdatas =  xalloc_array_zero(MAXRDATALEN, sizeof(rdata_atom_type));
-    uint16_t * dataA = zparser_conv_a(ip_addr);
-
-    rr_del->rdatas[0].data = dataA;
-    rr_del->rdata_count =1; 
+    rdata_builder_type builder;
+    rdata_builder_init(&builder, TYPE_A);
+    if (zparser_conv_a(&builder, ip_addr) != 0) {
+        free(rr_del);
+        return -1;
+    }
+    rr_del->rdata = rdata_builder_finish(&builder);
 
    const domain_name_st* zname = domain_name_parse((const char*) zone_name);
    const domain_name_st* dname = domain_name_parse((const char*) domian_name);
@@ -484,6 +497,7 @@ int domaindata_a_delete(struct  domain_store *db,char *zone_name,char *domian_na
 	zone_type * zo = domain_store_find_zone(db, zname);
 	if(!zo) {
         log_msg(LOG_ERR," not find the zone\n");
+        add_rdata_to_recyclebin( rr_del);
         free(rr_del);
         return -1;		
 	}
@@ -501,7 +515,8 @@ int domaindata_update(struct  domain_store *db, struct domin_info_update* update
          if (update->action == DOMAN_ACTION_DEL){
             return domaindata_a_delete(db,update->zone_name,update->domain_name,update->view_name,update->host,update->ttl);
          }else if (update->action == DOMAN_ACTION_ADD){
-            return domaindata_a_insert(db,update->zone_name,update->domain_name,update->view_name,update->host,update->ttl,update->maxAnswer);
+            return domaindata_a_insert(db,update->zone_name,update->domain_name,update->view_name,update->host,update->ttl,update->maxAnswer,
+                update->lb_mode,update->lb_weight);
          }else{
             log_msg(LOG_ERR,"err action\n");
             return -2;
@@ -44,7 +44,8 @@ int domaindata_srv_delete(struct  domain_store *db,char *zone_name,char *domian_
 uint16_t port, uint32_t ttl ,uint32_t maxAnswer);
 int domaindata_cname_insert(struct  domain_store *db,char *zone_name,char *domian_name, char * host, uint32_t ttl,uint32_t maxAnswer );
 int domaindata_cname_delete(struct  domain_store *db,char *zone_name,char *domian_name);
-int domaindata_a_insert(struct  domain_store *db,char *zone_name,char *domian_name, char* view_name,char * ip_addr, uint32_t ttl,uint32_t maxAnswer );
+int domaindata_a_insert(struct  domain_store *db,char *zone_name,char *domian_name, char* view_name,char * ip_addr, uint32_t ttl,uint32_t maxAnswer,
+    uint16_t lb_mode, uint16_t lb_weight);
 int domaindata_a_delete(struct  domain_store *db,char *zone_name,char *domian_name,char* view_name,char * ip_addr, uint32_t ttl);
 int domaindata_ptr_insert(struct domain_store *db, char *zone_name, char *domian_name, char *host, uint32_t ttl, uint32_t maxAnswer);
 int domaindata_ptr_delete(struct domain_store *db, char *zone_name, char *domian_name, char *host, uint32_t ttl, uint32_t maxAnswer);
@@ -2,10 +2,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <rte_cfgfile.h>
+#include <rte_eth_bond.h>
 #include "dns-conf.h"
 #include "util.h"
 
 #include "parser.h"
+#include "answer_cache.h"
+#include "edns.h"
+#include "netdev.h"
+#include "forward.h"
+#include "fwd_cache.h"
+#include "fwd_dpdk.h"
+#include "tcp_process.h"
+#include "rrl.h"
 
 #define DEF_CONFIG_LOG_FILE "/export/log/kdns/kdns.log"
 
@@ -19,6 +28,9 @@ dpdk_config_init(struct rte_cfgfile *cfgfile, struct dpdk_config *cfg,
                  const char *proc_name) {
     const char *entry;
     char buffer[128];
+    char *arg;
+    size_t len;
+    int i, nb_entries;
 
     /* proc name */
     cfg->argv[cfg->argc++] = strdup(proc_name);
@@ -63,6 +75,28 @@ dpdk_config_init(struct rte_cfgfile *cfgfile, struct dpdk_config *cfg,
         cfg->argv[cfg->argc++] = strdup(buffer);
     }
 
+    /* virtual ports, net_ring or net_pcap, one vdev line each */
+    nb_entries = rte_cfgfile_section_num_entries(cfgfile, "EAL");
+    if (nb_entries > 0) {
+        struct rte_cfgfile_entry entries[nb_entries];
+
+        nb_entries = rte_cfgfile_section_entries(cfgfile, "EAL", entries, nb_entries);
+        for (i = 0; i < nb_entries; i++) {
+            if (strcmp(entries[i].name, "vdev") != 0) {
+                continue;
+            }
+            if (cfg->argc + 1 >= DPDK_ARG_MAX_NUM) {
+                printf("Too many EAL/vdev options.\n");
+                exit(-1);
+            }
+            /* device arguments run long, pcap paths and all */
+            len = strlen("--vdev=") + strlen(entries[i].value) + 1;
+            arg = xalloc(len);
+            snprintf(arg, len, "--vdev=%s", entries[i].value);
+            cfg->argv[cfg->argc++] = arg;
+        }
+    }
+
 }
 
 static void
@@ -100,13 +134,240 @@ common_config_init(struct rte_cfgfile *cfgfile, struct comm_config *cfg){
         cfg->fwd_threads = 1; 
     }
 
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-timeout");
+    if (entry) {
+         if (parser_read_uint32(&cfg->fwd_timeout, entry) < 0 || cfg->fwd_timeout == 0){
+             printf("Cannot read COMMON/fwd-timeout = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->fwd_timeout = FWD_DEF_TIMEOUT; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-hedge-timeout");
+    if (entry) {
+         if (parser_read_uint32(&cfg->fwd_hedge_timeout, entry) < 0){
+             printf("Cannot read COMMON/fwd-hedge-timeout = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->fwd_hedge_timeout = FWD_DEF_HEDGE_TIMEOUT; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-cache-memory");
+    if (entry) {
+         if (parser_read_uint32(&cfg->fwd_cache_memory, entry) < 0 || cfg->fwd_cache_memory == 0){
+             printf("Cannot read COMMON/fwd-cache-memory = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->fwd_cache_memory = FWD_CACHE_DEF_MEMORY; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-cache-min-ttl");
+    if (entry) {
+         if (parser_read_uint32(&cfg->fwd_cache_min_ttl, entry) < 0){
+             printf("Cannot read COMMON/fwd-cache-min-ttl = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->fwd_cache_min_ttl = FWD_CACHE_DEF_MIN_TTL; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-cache-max-ttl");
+    if (entry) {
+         if (parser_read_uint32(&cfg->fwd_cache_max_ttl, entry) < 0 ||
+             cfg->fwd_cache_max_ttl < cfg->fwd_cache_min_ttl){
+             printf("Cannot read COMMON/fwd-cache-max-ttl = %s, should be at least fwd-cache-min-ttl.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->fwd_cache_max_ttl = cfg->fwd_cache_min_ttl > FWD_CACHE_DEF_MAX_TTL ?
+            cfg->fwd_cache_min_ttl : FWD_CACHE_DEF_MAX_TTL; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-stale-time");
+    if (entry) {
+         if (parser_read_uint32(&cfg->fwd_stale_time, entry) < 0){
+             printf("Cannot read COMMON/fwd-stale-time = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->fwd_stale_time = FWD_CACHE_DEF_STALE_TIME; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-serve-stale");
+    if (entry) {
+        cfg->fwd_serve_stale = parser_read_arg_bool(entry);
+        if (cfg->fwd_serve_stale < 0) {
+            printf("Cannot read COMMON/fwd-serve-stale = %s.\n", entry);
+            exit(-1);
+        }
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-prefetch-hits");
+    if (entry) {
+         if (parser_read_uint32(&cfg->fwd_prefetch_hits, entry) < 0){
+             printf("Cannot read COMMON/fwd-prefetch-hits = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->fwd_prefetch_hits = FWD_CACHE_DEF_PREFETCH_HITS; 
+    }
+
     
+    cfg->fwd_mode = FWD_MODE_SOCKET;
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-mode");
+    if (entry) {
+        if (strcmp(entry, "dpdk") == 0) {
+            cfg->fwd_mode = FWD_MODE_DPDK;
+        } else if (strcmp(entry, "socket") != 0) {
+            printf("Cannot read COMMON/fwd-mode = %s, should be socket or dpdk.\n", entry);
+            exit(-1);
+        }
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-src-ip");
+    if (entry && parse_ipv4_addr(entry, (struct in_addr *)&cfg->fwd_src_ip) < 0) {
+        printf("Cannot read COMMON/fwd-src-ip = %s.\n", entry);
+        exit(-1);
+    }
+
+    cfg->fwd_src_port_min = FWD_DPDK_DEF_PORT_MIN;
+    cfg->fwd_src_port_max = FWD_DPDK_DEF_PORT_MAX;
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-src-ports");
+    if (entry) {
+        char ports[32];
+        char *max;
+
+        snprintf(ports, sizeof(ports), "%s", entry);
+        max = strchr(ports, '-');
+        if (max == NULL) {
+            printf("Cannot read COMMON/fwd-src-ports = %s, should be min-max.\n", entry);
+            exit(-1);
+        }
+        *max++ = '\0';
+        if (parser_read_uint16(&cfg->fwd_src_port_min, ports) < 0 ||
+            parser_read_uint16(&cfg->fwd_src_port_max, max) < 0 ||
+            cfg->fwd_src_port_min == 0 || cfg->fwd_src_port_max < cfg->fwd_src_port_min) {
+            printf("Cannot read COMMON/fwd-src-ports = %s, should be min-max.\n", entry);
+            exit(-1);
+        }
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-gateway-mac");
+    if (entry && parse_mac_addr(entry, &cfg->fwd_gateway_mac) < 0) {
+        printf("Cannot read COMMON/fwd-gateway-mac = %s.\n", entry);
+        exit(-1);
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "tcp-thread-num");
+    if (entry) {
+         if (parser_read_uint16(&cfg->tcp_threads, entry) < 0 ||
+             cfg->tcp_threads == 0 || cfg->tcp_threads > TCP_MAX_THREADS){
+             printf("Cannot read COMMON/tcp-thread-num = %s, should be 1..%d.\n", entry, TCP_MAX_THREADS);
+             exit(-1);
+         }
+    }else{
+        cfg->tcp_threads = TCP_DEF_THREADS; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "tcp-max-conns");
+    if (entry) {
+         if (parser_read_uint32(&cfg->tcp_max_conns, entry) < 0 || cfg->tcp_max_conns == 0){
+             printf("Cannot read COMMON/tcp-max-conns = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->tcp_max_conns = TCP_DEF_MAX_CONNS; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "tcp-idle-timeout");
+    if (entry) {
+         if (parser_read_uint32(&cfg->tcp_idle_timeout, entry) < 0 || cfg->tcp_idle_timeout == 0){
+             printf("Cannot read COMMON/tcp-idle-timeout = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->tcp_idle_timeout = TCP_DEF_IDLE_TIMEOUT; 
+    }
+
     entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "web-port");
     if (entry && parser_read_uint16(&cfg->web_port, entry) < 0) {
         printf("Cannot read COMMON/web-port = %s.\n", entry);
         exit(-1);
     }
 
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "answer-cache-size");
+    if (entry) {
+         if (parser_read_uint32(&cfg->answer_cache_size, entry) < 0){
+             printf("Cannot read COMMON/answer-cache-size = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->answer_cache_size = ANSWER_CACHE_DEF_SIZE; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "edns-udp-size");
+    if (entry) {
+         if (parser_read_uint16(&cfg->edns_udp_size, entry) < 0 ||
+             cfg->edns_udp_size < UDP_MAX_MESSAGE_LEN || cfg->edns_udp_size > EDNS_MAX_MESSAGE_LEN){
+             printf("Cannot read COMMON/edns-udp-size = %s, should be %d..%d.\n", entry,
+                UDP_MAX_MESSAGE_LEN, EDNS_MAX_MESSAGE_LEN);
+             exit(-1);
+         }
+    }else{
+        cfg->edns_udp_size = EDNS_MAX_MESSAGE_LEN; 
+    }
+    edns_init(cfg->edns_udp_size);
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-rate");
+    if (entry) {
+         if (parser_read_uint32(&cfg->rrl_rate, entry) < 0 || cfg->rrl_rate > RRL_MAX_RATE){
+             printf("Cannot read COMMON/rrl-rate = %s, should be 0..%d.\n", entry, RRL_MAX_RATE);
+             exit(-1);
+         }
+    }else{
+        cfg->rrl_rate = 0; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-burst");
+    if (entry) {
+         if (parser_read_uint32(&cfg->rrl_burst, entry) < 0 || cfg->rrl_burst > RRL_MAX_RATE){
+             printf("Cannot read COMMON/rrl-burst = %s, should be 0..%d.\n", entry, RRL_MAX_RATE);
+             exit(-1);
+         }
+    }else{
+        cfg->rrl_burst = 0; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-slip");
+    if (entry) {
+         if (parser_read_uint32(&cfg->rrl_slip, entry) < 0){
+             printf("Cannot read COMMON/rrl-slip = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->rrl_slip = RRL_DEF_SLIP; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-table-size");
+    if (entry) {
+         if (parser_read_uint32(&cfg->rrl_table_size, entry) < 0){
+             printf("Cannot read COMMON/rrl-table-size = %s.\n", entry);
+             exit(-1);
+         }
+    }else{
+        cfg->rrl_table_size = RRL_DEF_TABLE_SIZE; 
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "ingress-filter");
+    if (entry) {
+         cfg->filter_enable = parser_read_arg_bool(entry);   
+    }else{
+        cfg->filter_enable = 0; 
+    }
+
     entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "ssl-enable");
     if (entry) {
          cfg->ssl_enable = parser_read_arg_bool(entry);   
@@ -155,6 +416,28 @@ netdev_config_init(struct rte_cfgfile *cfgfile, struct netdev_config *cfg) {
     }
 
 
+    cfg->bond_mode = NETIF_BOND_NONE;
+    entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "bond-mode");
+    if (entry) {
+        if (strcmp(entry, "active-backup") == 0) {
+            cfg->bond_mode = BONDING_MODE_ACTIVE_BACKUP;
+        } else if (strcmp(entry, "802.3ad") == 0) {
+            cfg->bond_mode = BONDING_MODE_8023AD;
+        } else if (strcmp(entry, "none") != 0) {
+            printf("Cannot read NETDEV/bond-mode = %s, none, active-backup or 802.3ad.\n", entry);
+            exit(-1);
+        }
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "flow-steering");
+    if (entry) {
+        cfg->flow_steering = parser_read_arg_bool(entry);
+        if (cfg->flow_steering < 0) {
+            printf("Cannot read NETDEV/flow-steering = %s.\n", entry);
+            exit(-1);
+        }
+    }
+
     entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "mbuf-num");
     if (entry && parser_read_uint16(&cfg->mbuf_num, entry) < 0) {
         printf("Cannot read NETDEV/mbuf-num = %s.\n", entry);
@@ -192,6 +475,31 @@ netdev_config_init(struct rte_cfgfile *cfgfile, struct netdev_config *cfg) {
         exit(-1);
     }
 
+    cfg->burst_size = NETIF_DEF_PKT_BURST;
+    entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "burst-size");
+    if (entry && (parser_read_uint16(&cfg->burst_size, entry) < 0 ||
+        cfg->burst_size == 0 || cfg->burst_size > NETIF_MAX_PKT_BURST)) {
+        printf("Cannot read NETDEV/burst-size = %s, range 1-%d.\n", entry, NETIF_MAX_PKT_BURST);
+        exit(-1);
+    }
+
+    cfg->prefetch_dist = NETIF_DEF_PREFETCH_DIST;
+    entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "prefetch-distance");
+    if (entry && (parser_read_uint16(&cfg->prefetch_dist, entry) < 0 ||
+        cfg->prefetch_dist > NETIF_MAX_PKT_BURST)) {
+        printf("Cannot read NETDEV/prefetch-distance = %s.\n", entry);
+        exit(-1);
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "staged-burst");
+    if (entry) {
+        cfg->staged_burst = parser_read_arg_bool(entry);
+        if (cfg->staged_burst < 0) {
+            printf("Cannot read NETDEV/staged-burst = %s.\n", entry);
+            exit(-1);
+        }
+    }
+
     entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "kni-ipv4");
     if (entry) {
         if (parse_ipv4_addr(entry, (struct in_addr *)&cfg->kni_ip) < 0) {
@@ -203,6 +511,22 @@ netdev_config_init(struct rte_cfgfile *cfgfile, struct netdev_config *cfg) {
         exit(-1);
     }
 
+    entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "kni-ipv6");
+    if (entry) {
+        char addrs[1024];
+        char *addr, *saveptr = NULL;
+
+        snprintf(addrs, sizeof(addrs), "%s", entry);
+        for (addr = strtok_r(addrs, ",", &saveptr); addr; addr = strtok_r(NULL, ",", &saveptr)) {
+            if (cfg->kni_ipv6_num >= NETDEV_MAX_IPV6_ADDRS ||
+                parse_ipv6_addr(addr, &cfg->kni_ipv6[cfg->kni_ipv6_num]) < 0) {
+                printf("Cannot read NETDEV/kni-ipv6 = %s\n", entry);
+                exit(-1);
+            }
+            cfg->kni_ipv6_num++;
+        }
+    }
+
     entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "kni-vip");
     if (entry) {
        cfg->kni_vip = strdup(entry);
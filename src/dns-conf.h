@@ -2,9 +2,12 @@
 #define __DNSCONF_H__
 
 #include <stdint.h>
+#include <netinet/in.h>
+#include <rte_ether.h>
 
 #define DPDK_ARG_MAX_NUM 32
 #define PATH_LENGTH 256
+#define NETDEV_MAX_IPV6_ADDRS 8
 
 
 struct dpdk_config {
@@ -18,10 +21,33 @@ struct comm_config {
      char *fwd_addrs;
      char *fwd_def_addrs;
      uint16_t fwd_threads;
+     uint32_t fwd_timeout;        /* ms, a forwarded query is given up after it */
+     uint32_t fwd_hedge_timeout;  /* ms, the next upstream is asked too after it */
+     uint32_t fwd_cache_memory;   /* MB */
+     uint32_t fwd_cache_min_ttl;  /* s, bounds of forward cache lifetimes */
+     uint32_t fwd_cache_max_ttl;
+     uint32_t fwd_stale_time;     /* s, expired forward cache answers are kept as long */
+     int   fwd_serve_stale;       /* answer from them right away while refreshing */
+     uint32_t fwd_prefetch_hits;  /* hits before a forward cache entry is refreshed early, 0: never */
+     int   fwd_mode;              /* FWD_MODE_SOCKET or FWD_MODE_DPDK */
+     uint32_t fwd_src_ip;         /* network order, dpdk mode source, 0: kni-ipv4 */
+     uint16_t fwd_src_port_min;   /* dpdk mode source ports, split over the data lcores */
+     uint16_t fwd_src_port_max;
+     struct ether_addr fwd_gateway_mac;  /* dpdk mode next hop, zero: the one queries came from */
+     uint16_t tcp_threads;
+     uint32_t tcp_max_conns;      /* over all tcp threads */
+     uint32_t tcp_idle_timeout;   /* ms, an idle tcp connection is closed after it */
      int   ssl_enable;
      char *key_pem_file;
      char *cert_pem_file;
      uint16_t    web_port;
+     uint32_t answer_cache_size;
+     uint16_t edns_udp_size;
+     uint32_t rrl_rate;           /* answers per second per client network, qname and rcode, 0: off */
+     uint32_t rrl_burst;          /* 0: rrl_rate */
+     uint32_t rrl_slip;           /* every slip'th limited answer goes out truncated, 0: never */
+     uint32_t rrl_table_size;     /* rate limit buckets per data lcore */
+     int   filter_enable;         /* ingress prefix and qname filter */
 };
 
 
@@ -33,11 +59,21 @@ struct netdev_config {
     uint16_t txq_desc_num;
     uint16_t rxq_num;
     uint16_t txq_num;
+    int      bond_mode;    /* bond all the ports, BONDING_MODE_*; NETIF_BOND_NONE */
+    int      flow_steering; /* rss mode: split dns from the rest with rte_flow rules */
+
+    uint16_t burst_size;
+    uint16_t prefetch_dist;
+    int      staged_burst;
     
     uint16_t kni_mbuf_num;
     uint32_t kni_ip;
     char *    kni_vip;
     uint32_t kni_gateway;  
+
+    /* ipv6 addresses answered for on the fast path (neighbor solicitation) */
+    uint16_t kni_ipv6_num;
+    struct in6_addr kni_ipv6[NETDEV_MAX_IPV6_ADDRS];
 };
 
 
@@ -13,25 +13,27 @@
 #include "util.h"
 #include "netdev.h"
 #include "view_update.h"
+#include "filter_update.h"
+#include "store_rcu.h"
+#include "fwd_cache.h"
+#include "forward.h"
 
 
 
 #define DOMAIN_HASH_SIZE  0x3FFFF
 
 #define MSG_RING_SIZE  65536
+#define MSG_BATCH_SIZE 256
 #define CORE_ID_ERR    0xFF
 
 #define DNS_STATUS_INIT    "init"
 #define DNS_STATUS_RUN     "running"
 
-extern struct kdns dpdk_dns[MAX_CORES];
-extern int tcp_domian_databd_update(struct domin_info_update* update);
-
 
 static char * kdns_status = NULL;
 
 static struct web_instance * dins ;
-static struct rte_ring *domian_msg_ring[MAX_CORES];
+static struct rte_ring *domian_msg_ring;
 
 
 //record all the domain infos,we process it in master core.
@@ -47,27 +49,6 @@ static inline unsigned get_master_lcore_id(void){
     return master_lcore;    
 }
 
-static inline struct domin_info_update * msg_copy(struct domin_info_update *src){
-
-    struct domin_info_update * dst = calloc(1,sizeof(struct domin_info_update )) ;
-    assert(dst);
-    dst->action = src->action;
-    dst->ttl    = src->ttl;
-    dst->type   = src->type;
-    dst->prio    = src->prio;
-    dst->weight  = src->weight;
-    dst->port    = src->port;
-    dst->maxAnswer = src->maxAnswer;
-    dst->lb_mode    = src->lb_mode;
-    dst->lb_weight  = src->lb_weight;
-
-    memcpy(dst->zone_name,src->zone_name,DB_MAX_NAME_LEN);
-    memcpy(dst->view_name,src->view_name,DB_MAX_NAME_LEN);
-    memcpy(dst->host,src->host,DB_MAX_NAME_LEN);
-    memcpy(dst->domain_name,src->domain_name,DB_MAX_NAME_LEN);
-    return dst;  
-}
-
 static void domain_info_preprocess(void){
     kdns_status = strdup(DNS_STATUS_INIT);
     int i ;
@@ -151,74 +132,61 @@ static void domain_info_store(struct domin_info_update *msg){
 }
 
 
-//  each master��slave call this func
+// the master core call this func
 void domain_msg_ring_create(void){
 
     if (kdns_status == NULL){
         domain_info_preprocess();    
     }
-    char ring_name[64]={0};
-    unsigned lcore_id = rte_lcore_id();
-    snprintf(ring_name, sizeof(ring_name), "msg_ring_core%d", lcore_id);
-        domian_msg_ring[lcore_id] = rte_ring_create(ring_name, MSG_RING_SIZE,
-                rte_socket_id(), 0);
-        if (unlikely(NULL == domian_msg_ring[lcore_id])) {
-            log_msg(LOG_ERR, "Fail to create ring :%s  !\n",ring_name);
-            exit(-1) ;
-        }
+    domian_msg_ring = rte_ring_create("msg_ring_master", MSG_RING_SIZE,
+            rte_socket_id(), RING_F_SC_DEQ);
+    if (unlikely(NULL == domian_msg_ring)) {
+        log_msg(LOG_ERR, "Fail to create ring :msg_ring_master  !\n");
+        exit(-1) ;
+    }
 }
 
+struct domain_msg_batch {
+    unsigned num;
+    struct domin_info_update *msgs[MSG_BATCH_SIZE];
+};
+
+static void domain_msg_batch_apply(struct kdns *kdns, void *arg){
+    struct domain_msg_batch *batch = arg;
+    unsigned i;
+
+    for (i = 0; i < batch->num; i++) {
+        domaindata_update(kdns->db, batch->msgs[i]);
+    }
+}
 
 void doman_msg_master_process(void){
     
+    struct domain_msg_batch batch;
     struct domin_info_update *msg;   
-    unsigned cid_master = get_master_lcore_id();
-    unsigned idx =0;
-    
-    while (0 == rte_ring_dequeue(domian_msg_ring[cid_master], (void **)&msg)) {
+    unsigned i;
+
+    batch.num = 0;
+    while (batch.num < MSG_BATCH_SIZE && 0 == rte_ring_dequeue(domian_msg_ring, (void **)&msg)) {
         
-        if (g_domain_num > EXTRA_DOMAIN_NUMBERS - 100){
+        if (g_domain_num + (int)batch.num > EXTRA_DOMAIN_NUMBERS - 100){
             log_msg(LOG_ERR,"domain len reach threadHold(%d): domian(%s) host(%s) \n", EXTRA_DOMAIN_NUMBERS,
                     msg->domain_name,msg->host);
             free(msg);
             continue;
          }
-        //dispatch the msg
-        for(idx =0; idx < MAX_CORES; idx ++){
-
-            // skip the master
-            if ( domian_msg_ring[idx] == NULL || idx == cid_master){
-                continue;
-            }
-            struct domin_info_update * new_msg = msg_copy(msg);
-            int res = rte_ring_enqueue(domian_msg_ring[idx], (void *)new_msg);
-
-            if (unlikely(-EDQUOT == res)) {
-                printf(" msg_ring of lcore %d quota exceeded\n", idx);
-           } else if (unlikely(-ENOBUFS == res)) {
-                log_msg(LOG_ERR," msg_ring of lcore %d is full\n", idx);
-                free(new_msg);
-           } else if (res) {
-                log_msg(LOG_ERR,"unkown error %d for rte_ring_enqueue lcore %d\n", res,idx);
-                free(new_msg);
-           }
-             
-        }
-        // last we free the msg     
-        struct domin_info_update * new_msg_tcp = msg_copy(msg);
-        tcp_domian_databd_update(new_msg_tcp);
-      
-        domain_info_store(msg); 
-    }   
-}
+        batch.msgs[batch.num++] = msg;
+    }
+    if (batch.num == 0) {
+        return;
+    }
+    // the shared store, seen by the lcores and the tcp thread
+    store_rcu_update(domain_msg_batch_apply, &batch);
 
-void doman_msg_slave_process(void){
-    struct domin_info_update *msg;   
-    unsigned cid = rte_lcore_id();    
-    while (0 == rte_ring_dequeue(domian_msg_ring[cid], (void **)&msg)) {   
-        domaindata_update(dpdk_dns[cid].db,msg);
-        free(msg); 
-    }   
+    // last we keep or free the msgs
+    for (i = 0; i < batch.num; i++) {
+        domain_info_store(batch.msgs[i]);
+    }
 }
 
 static void send_domain_msg_to_master(struct domin_info_update *msg){ 
@@ -226,7 +194,7 @@ static void send_domain_msg_to_master(struct domin_info_update *msg){
     unsigned cid_master = get_master_lcore_id();
     
     assert(msg);
-    int res = rte_ring_enqueue(domian_msg_ring[cid_master],(void *) msg);
+    int res = rte_ring_enqueue(domian_msg_ring,(void *) msg);
 
     if (unlikely(-EDQUOT == res)) {
         log_msg(LOG_ERR," msg_ring of master lcore %d quota exceeded\n", cid_master);
@@ -248,6 +216,23 @@ static inline int ipv4_address_check(const char *str)
 }
 
 
+/*
+ * RFC 4592 wildcard owner: '*' only as the whole leftmost label.
+ * Returns 1 for a wildcard name, 0 for a plain one, -1 if '*' is misplaced.
+ */
+static int domain_name_wildcard_check(const char *name)
+{
+    const char *star = strchr(name, '*');
+
+    if (star == NULL) {
+        return 0;
+    }
+    if (star != name || name[1] != '.' || name[2] == '\0' || strchr(name + 1, '*') != NULL) {
+        return -1;
+    }
+    return 1;
+}
+
 static void* domaindata_parse(enum db_action   action,struct connection_info_struct *con_info , int * len_response)
 {
     char * post_ok = strdup("OK\n");
@@ -336,6 +321,21 @@ static void* domaindata_parse(enum db_action   action,struct connection_info_str
         json_decref(json_response);
         goto parse_err;
     }
+    switch (domain_name_wildcard_check(update->domain_name)) {
+    case 0:
+        break;
+    case 1:
+        if (update->type == TYPE_A || update->type == TYPE_CNAME) {
+            break;
+        }
+        log_msg(LOG_ERR,"wildcard domainName only for A and CNAME: %s\n", update->domain_name);
+        json_decref(json_response);
+        goto parse_err;
+    default:
+        log_msg(LOG_ERR,"'*' must be the whole leftmost label: %s\n", update->domain_name);
+        json_decref(json_response);
+        goto parse_err;
+    }
     if (update->type == TYPE_A){
             /* get view name  */
            json_key = json_object_get(json_response, "viewName");
@@ -351,6 +351,11 @@ static void* domaindata_parse(enum db_action   action,struct connection_info_str
                 update->lb_mode = 0;
             }else{  
                 update->lb_mode= json_integer_value(json_key);
+                if (json_integer_value(json_key) < 0 || json_integer_value(json_key) > LB_MODE_MAX) {
+                    log_msg(LOG_ERR,"lbMode should be 0..%d\n", LB_MODE_MAX);
+                    json_decref(json_response);
+                    goto parse_err;
+                }
             }
             json_key = json_object_get(json_response, "lbWeight");
             if (!json_key || !json_is_integer(json_key))  {
@@ -381,6 +386,11 @@ static void* domaindata_parse(enum db_action   action,struct connection_info_str
            goto parse_err;
        }
        value = json_string_value(json_key);
+       if (strchr(value, '*') != NULL) {
+           log_msg(LOG_ERR,"host can not be a wildcard: %s\n", value);
+           json_decref(json_response);
+           goto parse_err;
+       }
        snprintf(update->host, strlen(value)+1, "%s", value);     
     } else if (update->type == TYPE_SRV){
         /* get host  */
@@ -629,14 +639,35 @@ struct json_stats_strings
     char dns_lens_snd[32];
     char pkt_dropped[32];
     char pkt_len_err[32];      
+    char answer_cache_hits[32];
+    char answer_cache_misses[32];
+    char fwd_cache_hits[32];
+    char fwd_cache_misses[32];
+    char fwd_cache_stale[32];
+    char fwd_cache_refreshes[32];
+    char fwd_cache_entries[32];
+    char fwd_cache_bytes[32];
+    char fwd_cache_memory[32];
+    char fwd_cache_evictions[32];
+    char fwd_cache_insert_fails[32];
+    char cycles_per_pkt[32];
+    char edns_queries[32];
+    char non_edns_queries[32];
+    char pkts_frag[32];
+    char rrl_dropped[32];
+    char rrl_slipped[32];
+    char filter_dropped[32];
+    char filter_refused[32];
 };
 
 static void* statistics_get( __attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused))char *url,int * len_response)
 {
     struct netif_queue_stats sta ={0};
+    struct fwd_cache_stats fwd_sta;
     netif_statsdata_get(&sta);
+    fwd_cache_stats_get(&fwd_sta);
 
-    struct json_stats_strings sta_string ={"","","","","","","","","",""};
+    struct json_stats_strings sta_string ={"","","","","","","","","","","","","","","","","","","","","","","","","","","","",""};
 
     sprintf(sta_string.domain_num,"%d",domain_num_get());
     sprintf(sta_string.pkts_rcv,"%ld",sta.pkts_rcv);
@@ -648,15 +679,45 @@ static void* statistics_get( __attribute__((unused)) struct connection_info_stru
     sprintf(sta_string.pkts_2kni,"%ld",sta.pkts_2kni);
     sprintf(sta_string.pkts_icmp,"%ld",sta.pkts_icmp);
     sprintf(sta_string.pkt_len_err,"%ld",sta.pkt_len_err);
+    sprintf(sta_string.answer_cache_hits,"%ld",sta.answer_cache_hits);
+    sprintf(sta_string.answer_cache_misses,"%ld",sta.answer_cache_misses);
+    sprintf(sta_string.fwd_cache_hits,"%ld",sta.fwd_cache_hits);
+    sprintf(sta_string.fwd_cache_misses,"%ld",sta.fwd_cache_misses);
+    sprintf(sta_string.fwd_cache_stale,"%ld",sta.fwd_cache_stale);
+    sprintf(sta_string.fwd_cache_refreshes,"%ld",sta.fwd_cache_refreshes);
+    sprintf(sta_string.fwd_cache_entries,"%ld",fwd_sta.entries);
+    sprintf(sta_string.fwd_cache_bytes,"%ld",fwd_sta.bytes);
+    sprintf(sta_string.fwd_cache_memory,"%ld",fwd_sta.memory);
+    sprintf(sta_string.fwd_cache_evictions,"%ld",fwd_sta.evictions);
+    sprintf(sta_string.fwd_cache_insert_fails,"%ld",fwd_sta.insert_fails);
+    sprintf(sta_string.cycles_per_pkt,"%ld",sta.burst_pkts ? sta.burst_cycles / sta.burst_pkts : 0);
+    sprintf(sta_string.edns_queries,"%ld",sta.dns_pkts_edns);
+    sprintf(sta_string.non_edns_queries,"%ld",sta.dns_pkts_no_edns);
+    sprintf(sta_string.pkts_frag,"%ld",sta.pkts_frag);
+    sprintf(sta_string.rrl_dropped,"%ld",sta.rrl_dropped);
+    sprintf(sta_string.rrl_slipped,"%ld",sta.rrl_slipped);
+    sprintf(sta_string.filter_dropped,"%ld",sta.filter_dropped);
+    sprintf(sta_string.filter_refused,"%ld",sta.filter_refused);
 
     
     json_t *value = NULL;
     
-    value = json_pack("{s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s}", 
+    value = json_pack("{s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:s}", 
             "domain_num",sta_string.domain_num, "pkts_rcv",sta_string.pkts_rcv,
             "dns_pkts_rcv",sta_string.dns_pkts_rcv,"dns_pkts_snd",sta_string.dns_pkts_snd,"pkt_dropped",sta_string.pkt_dropped,
             "pkts_2kni",sta_string.pkts_2kni,"pkts_icmp",sta_string.pkts_icmp,"pkt_len_err",sta_string.pkt_len_err,
-            "dns_lens_rcv",sta_string.dns_lens_rcv,"dns_lens_snd",sta_string.dns_lens_snd);
+            "dns_lens_rcv",sta_string.dns_lens_rcv,"dns_lens_snd",sta_string.dns_lens_snd,
+            "answer_cache_hits",sta_string.answer_cache_hits,"answer_cache_misses",sta_string.answer_cache_misses,
+            "fwd_cache_hits",sta_string.fwd_cache_hits,"fwd_cache_misses",sta_string.fwd_cache_misses,
+            "fwd_cache_stale",sta_string.fwd_cache_stale,"fwd_cache_refreshes",sta_string.fwd_cache_refreshes,
+            "fwd_cache_entries",sta_string.fwd_cache_entries,"fwd_cache_bytes",sta_string.fwd_cache_bytes,
+            "fwd_cache_memory",sta_string.fwd_cache_memory,"fwd_cache_evictions",sta_string.fwd_cache_evictions,
+            "fwd_cache_insert_fails",sta_string.fwd_cache_insert_fails,
+            "cycles_per_pkt",sta_string.cycles_per_pkt,
+            "edns_queries",sta_string.edns_queries,"non_edns_queries",sta_string.non_edns_queries,
+            "pkts_frag",sta_string.pkts_frag,
+            "rrl_dropped",sta_string.rrl_dropped,"rrl_slipped",sta_string.rrl_slipped,
+            "filter_dropped",sta_string.filter_dropped,"filter_refused",sta_string.filter_refused);
     
     if (!value){
            char * err = strdup("json_pack err");
@@ -679,6 +740,154 @@ static void* statistics_reset( __attribute__((unused)) struct connection_info_st
     return (void* )post_ok;
 }
 
+static void do_fwd_upstream_get(const domain_fwd_addrs *zone, const dns_addr_t *server, void *arg)
+{
+    const struct sockaddr_in *addr = (const struct sockaddr_in *)server->addr;
+    char addr_str[INET_ADDRSTRLEN + 8];
+    char ip[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    snprintf(addr_str, sizeof(addr_str), "%s:%u", ip, ntohs(addr->sin_port));
+    json_t *value = json_pack("{s:s, s:s, s:s, s:I, s:I, s:I, s:I, s:I}",
+            "zone", zone->domain_name, "addr", addr_str, "state", server->down_until ? "down" : "up",
+            "srtt_us", (json_int_t)server->srtt, "fails", (json_int_t)server->fails,
+            "queries", (json_int_t)server->queries, "answers", (json_int_t)server->answers,
+            "timeouts", (json_int_t)server->timeouts);
+    if (value) {
+        json_array_append_new((json_t *)arg, value);
+    }
+}
+
+static void* fwd_upstreams_get( __attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused))char *url,int * len_response)
+{
+    json_t *array = json_array();
+
+    if (!array){
+           char * err = strdup("unable to create array");
+           *len_response = strlen(err);
+           return (void* )err;;  
+    }
+    fwd_upstreams_walk(do_fwd_upstream_get, array);
+
+    char *str_ret = json_dumps(array, JSON_COMPACT);
+    json_decref(array);
+    *len_response = strlen(str_ret);
+    return (void* )str_ret;;
+}
+
+static void do_fwd_zone_get(const domain_fwd_addrs *zone, void *arg)
+{
+    char addrs[512];
+    int i, len = 0;
+
+    addrs[0] = '\0';
+    for (i = 0; i < zone->servers_len && len < (int)sizeof(addrs); i++) {
+        const struct sockaddr_in *addr = (const struct sockaddr_in *)zone->server_addrs[i].addr;
+        char ip[INET_ADDRSTRLEN];
+
+        inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+        len += snprintf(addrs + len, sizeof(addrs) - len, "%s%s:%u", i ? "," : "", ip, ntohs(addr->sin_port));
+    }
+    json_t *value = json_pack("{s:s, s:s}", "zone", zone->domain_name, "addrs", addrs);
+    if (value) {
+        json_array_append_new((json_t *)arg, value);
+    }
+}
+
+static void* fwd_zones_get( __attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused))char *url,int * len_response)
+{
+    json_t *array = json_array();
+
+    if (!array){
+           char * err = strdup("unable to create array");
+           *len_response = strlen(err);
+           return (void* )err;;  
+    }
+    fwd_zones_walk(do_fwd_zone_get, array);
+
+    char *str_ret = json_dumps(array, JSON_COMPACT);
+    json_decref(array);
+    *len_response = strlen(str_ret);
+    return (void* )str_ret;;
+}
+
+// {"zone":"example.com","addrs":"10.0.0.1:53,10.0.0.2:53"}, addrs only to add
+static void* fwd_zone_parse(int action, struct connection_info_struct *con_info, int * len_response)
+{
+    char * post_ok = strdup("OK\n");
+    char * parseErr = NULL;
+    const char * zone, * addrs;
+    json_error_t jerror;
+    json_t *json_key;
+
+    log_msg(LOG_INFO,"%s forward zone = %s\n", action == FWD_ZONE_ADD ? "add" : "del", (char *)con_info->uploaddata);
+    *len_response = strlen(post_ok);
+
+    struct fwd_zone_update *update = calloc(1,sizeof(struct fwd_zone_update));
+    update->action = action;
+    json_t *json_response = json_loads(con_info->uploaddata, 0, &jerror);
+    if (!json_response) {
+        log_msg(LOG_ERR,"load json string  failed: %s %s (line %d, col %d)\n",
+                jerror.text, jerror.source, jerror.line, jerror.column);
+        goto parse_err;
+    }
+    if (!json_is_object(json_response)) {
+        log_msg(LOG_ERR,"load json string failed: not an object!\n");
+        goto json_err;
+    }
+
+    json_key = json_object_get(json_response, "zone");
+    if (!json_key || !json_is_string(json_key))  {
+        log_msg(LOG_ERR,"zone does not exist or is not string!\n");
+        goto json_err;
+    }
+    zone = json_string_value(json_key);
+    if (strlen(zone) == 0 || strlen(zone) >= FWD_MAX_DOMAIN_NAME_LEN) {
+        log_msg(LOG_ERR,"bad zone: %s\n", zone);
+        goto json_err;
+    }
+    snprintf(update->zone, sizeof(update->zone), "%s", zone);
+
+    if (action == FWD_ZONE_ADD) {
+        json_key = json_object_get(json_response, "addrs");
+        if (!json_key || !json_is_string(json_key))  {
+            log_msg(LOG_ERR,"addrs does not exist or is not string!\n");
+            goto json_err;
+        }
+        addrs = json_string_value(json_key);
+        update->fwd_addrs = fwd_zone_create(zone, addrs);
+        if (update->fwd_addrs == NULL) {
+            goto json_err;
+        }
+    }
+    json_decref(json_response);
+
+    if (fwd_zone_update_enqueue(update) != 0) {
+        free(post_ok);
+        post_ok = strdup("busy, try again\n");
+        *len_response = strlen(post_ok);
+    }
+    return post_ok;
+
+json_err:
+    json_decref(json_response);
+parse_err:
+    free(update);
+    free(post_ok);
+    parseErr = strdup("parse data err\n");
+    *len_response = strlen(parseErr);
+    return (void* )parseErr;
+}
+
+static void* fwd_zone_post(struct connection_info_struct *con_info ,__attribute__((unused))char *url, int * len_response)
+{
+    return fwd_zone_parse(FWD_ZONE_ADD, con_info, len_response);
+}
+
+static void* fwd_zone_del(struct connection_info_struct *con_info ,__attribute__((unused))char *url, int * len_response)
+{
+    return fwd_zone_parse(FWD_ZONE_DEL, con_info, len_response);
+}
 
 
 void domian_info_exchange_run( int port){
@@ -694,11 +903,19 @@ void domian_info_exchange_run( int port){
 
     web_endpoint_add("GET","/kdns/statistics/get",dins,&statistics_get);
     web_endpoint_add("POST","/kdns/statistics/reset",dins,&statistics_reset);
+    web_endpoint_add("GET","/kdns/forward/upstreams",dins,&fwd_upstreams_get);
+    web_endpoint_add("POST","/kdns/forward/zones",dins,&fwd_zone_post);
+    web_endpoint_add("GET","/kdns/forward/zones",dins,&fwd_zones_get);
+    web_endpoint_add("DELETE","/kdns/forward/zones",dins,&fwd_zone_del);
     
     web_endpoint_add("POST","/kdns/view",dins,&view_post);
     web_endpoint_add("GET","/kdns/view",dins,&view_get);
     //web_endpoint_add("GET","/kdns/perview",dins,&domain_get);
     web_endpoint_add("DELETE","/kdns/view",dins,&view_del);
+
+    web_endpoint_add("POST","/kdns/filter",dins,&filter_post);
+    web_endpoint_add("GET","/kdns/filter",dins,&filter_get);
+    web_endpoint_add("DELETE","/kdns/filter",dins,&filter_del);
     
     webserver_run(dins);
     return;   
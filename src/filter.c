@@ -0,0 +1,484 @@
+/*
+ * filter.c -- ingress prefix and qname filter of the data lcores
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_jhash.h>
+#include <rte_common.h>
+#include <rte_lpm.h>
+#include <rte_lpm6.h>
+
+#include "filter.h"
+#include "packet.h"
+#include "util.h"
+
+#define FILTER_QNAME_SLOTS      (FILTER_MAX_QNAMES * 2)     /* power of 2 */
+#define FILTER_PREFIX_TBL8S     FILTER_MAX_PREFIXES         /* one per prefix over /24 */
+#define FILTER_PREFIX6_TBL8S    (FILTER_MAX_PREFIXES6 * 14)
+
+struct filter_qname_slot {
+    uint32_t hash;
+    uint16_t id;            /* 0: empty */
+};
+
+struct filter {
+    struct rte_lpm *lpm;
+    struct rte_lpm6 *lpm6;
+    uint32_t prefixes;
+    uint32_t prefixes6;
+    uint32_t qnames;
+    uint32_t suffixes;
+    uint16_t lpm6_ids[FILTER_MAX_PREFIXES6 + 1];    /* by lpm6 next hop */
+    struct filter_qname_slot qname_slots[FILTER_QNAME_SLOTS];
+};
+
+/* written by the master only, an id is in the tables only while its rule is set */
+static struct filter_rule filter_rules[FILTER_MAX_RULES];
+static uint64_t *filter_hits[RTE_MAX_LCORE];
+
+
+struct filter *filter_create(void) {
+    static unsigned filter_count;
+    struct rte_lpm_config config = {
+        .max_rules = FILTER_MAX_PREFIXES,
+        .number_tbl8s = FILTER_PREFIX_TBL8S,
+    };
+    struct rte_lpm6_config config6 = {
+        .max_rules = FILTER_MAX_PREFIXES6,
+        .number_tbl8s = FILTER_PREFIX6_TBL8S,
+    };
+    struct filter *f;
+    char name[RTE_LPM_NAMESIZE];
+
+    f = rte_zmalloc(NULL, sizeof(*f), RTE_CACHE_LINE_SIZE);
+    if (f == NULL) {
+        log_msg(LOG_ERR, "no mem for the ingress filter\n");
+        return NULL;
+    }
+    snprintf(name, sizeof(name), "filter_lpm%u", filter_count);
+    f->lpm = rte_lpm_create(name, SOCKET_ID_ANY, &config);
+    snprintf(name, sizeof(name), "filter_lpm6_%u", filter_count);
+    f->lpm6 = rte_lpm6_create(name, SOCKET_ID_ANY, &config6);
+    if (f->lpm == NULL || f->lpm6 == NULL) {
+        log_msg(LOG_ERR, "unable to create the ingress filter lpm tables\n");
+        rte_lpm_free(f->lpm);
+        rte_lpm6_free(f->lpm6);
+        rte_free(f);
+        return NULL;
+    }
+    filter_count++;
+    return f;
+}
+
+int filter_lcore_init(unsigned lcore_id) {
+    filter_hits[lcore_id] = rte_zmalloc_socket(NULL, FILTER_MAX_RULES * sizeof(uint64_t),
+        RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+    if (filter_hits[lcore_id] == NULL) {
+        log_msg(LOG_ERR, "filter counters alloc failed for lcore %u\n", lcore_id);
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint32_t filter_qname_hash(const uint8_t *name, uint16_t len, uint8_t suffix) {
+    return rte_jhash(name, len, suffix);
+}
+
+static int filter_qname_find(const struct filter *f, const uint8_t *name, uint16_t len, uint8_t suffix) {
+    uint32_t hash = filter_qname_hash(name, len, suffix);
+    uint32_t i = hash & (FILTER_QNAME_SLOTS - 1);
+    const struct filter_rule *rule;
+
+    for (; f->qname_slots[i].id != 0; i = (i + 1) & (FILTER_QNAME_SLOTS - 1)) {
+        if (f->qname_slots[i].hash != hash) {
+            continue;
+        }
+        rule = &filter_rules[f->qname_slots[i].id];
+        if (rule->suffix == suffix && rule->name_len == len && memcmp(rule->name, name, len) == 0) {
+            return f->qname_slots[i].id;
+        }
+    }
+    return 0;
+}
+
+/* the rule id the source address falls under, 0 if none */
+static inline int filter_prefix_lookup(const struct filter *f, const uint8_t *saddr, int saddr_len) {
+    uint32_t next_hop;
+    uint8_t addr6[16];
+    uint8_t slot;
+
+    if (saddr_len == 4 && f->prefixes) {
+        uint32_t ip;
+
+        memcpy(&ip, saddr, sizeof(ip));
+        if (rte_lpm_lookup(f->lpm, ntohl(ip), &next_hop) == 0) {
+            return next_hop;
+        }
+    } else if (saddr_len == 16 && f->prefixes6) {
+        memcpy(addr6, saddr, sizeof(addr6));
+        if (rte_lpm6_lookup(f->lpm6, addr6, &slot) == 0) {
+            return f->lpm6_ids[slot];
+        }
+    }
+    return 0;
+}
+
+/* the rule id the question name is blocked by, 0 if none */
+static int filter_qname_lookup(const struct filter *f, const uint8_t *dns, int len) {
+    uint8_t name[MAXDOMAINLEN + 4];
+    uint8_t labels[MAXDOMAINLEN / 2 + 1];
+    int pos = DNS_HEAD_SIZE, n = 0, nlabels = 0, id, i, j;
+
+    if (len < DNS_HEAD_SIZE || dns[4] != 0 || dns[5] != 1) {
+        return 0;
+    }
+    while (pos < len && dns[pos] != 0) {
+        if ((dns[pos] & 0xc0) || n + dns[pos] + 2 > MAXDOMAINLEN || pos + dns[pos] + 1 >= len) {
+            return 0;
+        }
+        labels[nlabels++] = n;
+        name[n++] = dns[pos];
+        for (i = 1; i <= dns[pos]; i++) {
+            name[n++] = tolower(dns[pos + i]);
+        }
+        pos += dns[pos] + 1;
+    }
+    if (pos >= len) {
+        return 0;
+    }
+    name[n++] = 0;
+
+    if ((id = filter_qname_find(f, name, n, 0)) != 0) {
+        return id;
+    }
+    if (f->suffixes == 0) {
+        return 0;
+    }
+    /* the longest suffix decides */
+    for (j = 0; j < nlabels; j++) {
+        if ((id = filter_qname_find(f, name + labels[j], n - labels[j], 1)) != 0) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+int filter_check(const struct filter *f, unsigned lcore_id, const uint8_t *saddr, int saddr_len,
+    const uint8_t *dns, int len) {
+    int id;
+
+    if (f == NULL) {
+        return FILTER_PASS;
+    }
+    if ((id = filter_prefix_lookup(f, saddr, saddr_len)) != 0) {
+        filter_hits[lcore_id][id]++;
+        if (filter_rules[id].action != FILTER_PASS) {
+            return filter_rules[id].action;
+        }
+    }
+    if (f->qnames && (id = filter_qname_lookup(f, dns, len)) != 0) {
+        filter_hits[lcore_id][id]++;
+        return filter_rules[id].action;
+    }
+    return FILTER_PASS;
+}
+
+int filter_refuse(uint8_t *dns, int len) {
+    int pos = DNS_HEAD_SIZE;
+
+    /* never answer answers */
+    if (len < DNS_HEAD_SIZE || (dns[2] & 0x80)) {
+        return 0;
+    }
+    if (dns[4] == 0 && dns[5] == 1) {
+        while (pos < len && dns[pos] != 0 && !(dns[pos] & 0xc0)) {
+            pos += dns[pos] + 1;
+        }
+        pos += 1 + 2 * sizeof(uint16_t);
+    }
+    if (pos > len || (pos > DNS_HEAD_SIZE && dns[pos - 5] != 0)) {
+        return 0;
+    }
+    dns[2] = (dns[2] & 0x79) | 0x80;    /* QR, opcode and RD kept */
+    dns[3] = RCODE_REFUSE;
+    if (pos == DNS_HEAD_SIZE) {
+        dns[5] = 0;
+    }
+    memset(dns + 6, 0, 6);
+    return pos;
+}
+
+/* "a.b.c" or "a.b.c." to lowercased wire format */
+static int filter_name_parse(struct filter_rule *rule, const char *value) {
+    const char *p = value;
+    const char *dot;
+    uint16_t n = 0;
+    size_t l;
+
+    while (*p) {
+        dot = strchr(p, '.');
+        l = dot ? (size_t)(dot - p) : strlen(p);
+        if (l == 0 || l > 63 || n + l + 2 > MAXDOMAINLEN) {
+            return -1;
+        }
+        rule->name[n++] = l;
+        while (l--) {
+            rule->name[n++] = tolower((unsigned char)*p++);
+        }
+        if (dot) {
+            p++;
+        }
+    }
+    rule->name[n++] = 0;
+    rule->name_len = n;
+    return 0;
+}
+
+static int filter_prefix_parse(struct filter_rule *rule, const char *value) {
+    char addr[INET6_ADDRSTRLEN + 4];
+    char *mask;
+    long depth;
+    int i;
+
+    snprintf(addr, sizeof(addr), "%s", value);
+    mask = strchr(addr, '/');
+    if (mask) {
+        *mask++ = '\0';
+    }
+    if (inet_pton(AF_INET, addr, rule->addr) == 1) {
+        rule->addr_len = 4;
+    } else if (inet_pton(AF_INET6, addr, rule->addr) == 1) {
+        rule->addr_len = 16;
+    } else {
+        return -1;
+    }
+    depth = rule->addr_len * 8;
+    if (mask) {
+        char *end;
+
+        depth = strtol(mask, &end, 10);
+        if (*mask == '\0' || *end != '\0' || depth < 1 || depth > rule->addr_len * 8) {
+            return -1;
+        }
+    }
+    rule->depth = depth;
+    for (i = 0; i < rule->addr_len; i++) {
+        if (depth >= 8) {
+            depth -= 8;
+        } else {
+            rule->addr[i] &= (uint8_t)(0xff00 >> depth);
+            depth = 0;
+        }
+    }
+    return 0;
+}
+
+int filter_rule_parse(struct filter_rule *rule, const char *type, const char *value,
+    const char *match, const char *action) {
+    memset(rule, 0, sizeof(*rule));
+    if (value == NULL || value[0] == '\0' || strlen(value) >= sizeof(rule->value)) {
+        return -1;
+    }
+    snprintf(rule->value, sizeof(rule->value), "%s", value);
+
+    if (action == NULL || strcmp(action, "drop") == 0) {
+        rule->action = FILTER_DROP;
+    } else if (strcmp(action, "refuse") == 0) {
+        rule->action = FILTER_REFUSE;
+    } else if (strcmp(action, "allow") == 0) {
+        rule->action = FILTER_PASS;
+    } else {
+        return -1;
+    }
+
+    if (type != NULL && strcmp(type, "prefix") == 0) {
+        rule->type = FILTER_RULE_PREFIX;
+        return filter_prefix_parse(rule, value);
+    }
+    if (type != NULL && strcmp(type, "qname") == 0) {
+        rule->type = FILTER_RULE_QNAME;
+        if (rule->action == FILTER_PASS) {
+            return -1;
+        }
+        if (match == NULL || strcmp(match, "exact") == 0) {
+            rule->suffix = 0;
+        } else if (strcmp(match, "suffix") == 0) {
+            rule->suffix = 1;
+        } else {
+            return -1;
+        }
+        return filter_name_parse(rule, value);
+    }
+    return -1;
+}
+
+static int filter_rule_same(const struct filter_rule *a, const struct filter_rule *b) {
+    if (a->type != b->type) {
+        return 0;
+    }
+    if (a->type == FILTER_RULE_PREFIX) {
+        return a->addr_len == b->addr_len && a->depth == b->depth &&
+            memcmp(a->addr, b->addr, a->addr_len) == 0;
+    }
+    return a->suffix == b->suffix && a->name_len == b->name_len &&
+        memcmp(a->name, b->name, a->name_len) == 0;
+}
+
+int filter_rule_find(const struct filter_rule *rule) {
+    int id;
+
+    for (id = 1; id < FILTER_MAX_RULES; id++) {
+        if (filter_rule_same(&filter_rules[id], rule)) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+int filter_rule_register(const struct filter_rule *rule) {
+    int id;
+
+    for (id = 1; id < FILTER_MAX_RULES; id++) {
+        if (filter_rules[id].type == 0) {
+            filter_rules[id] = *rule;
+            return id;
+        }
+    }
+    return -1;
+}
+
+void filter_rule_release(int id) {
+    unsigned lcore_id;
+
+    memset(&filter_rules[id], 0, sizeof(filter_rules[id]));
+    for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+        if (filter_hits[lcore_id]) {
+            filter_hits[lcore_id][id] = 0;
+        }
+    }
+}
+
+void filter_rule_set_action(int id, uint8_t action) {
+    filter_rules[id].action = action;
+}
+
+const struct filter_rule *filter_rule_get(int id) {
+    return filter_rules[id].type ? &filter_rules[id] : NULL;
+}
+
+uint64_t filter_rule_hits(int id) {
+    unsigned lcore_id;
+    uint64_t hits = 0;
+
+    for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+        if (filter_hits[lcore_id]) {
+            hits += filter_hits[lcore_id][id];
+        }
+    }
+    return hits;
+}
+
+static int filter_qname_add(struct filter *f, int id) {
+    const struct filter_rule *rule = &filter_rules[id];
+    uint32_t hash = filter_qname_hash(rule->name, rule->name_len, rule->suffix);
+    uint32_t i = hash & (FILTER_QNAME_SLOTS - 1);
+
+    if (f->qnames == FILTER_MAX_QNAMES) {
+        return -1;
+    }
+    while (f->qname_slots[i].id != 0) {
+        i = (i + 1) & (FILTER_QNAME_SLOTS - 1);
+    }
+    f->qname_slots[i].hash = hash;
+    f->qname_slots[i].id = id;
+    f->qnames++;
+    f->suffixes += rule->suffix;
+    return 0;
+}
+
+static int filter_qname_del(struct filter *f, int id) {
+    const struct filter_rule *rule = &filter_rules[id];
+    uint32_t hash = filter_qname_hash(rule->name, rule->name_len, rule->suffix);
+    uint32_t i = hash & (FILTER_QNAME_SLOTS - 1), j, home;
+
+    while (f->qname_slots[i].id != id) {
+        if (f->qname_slots[i].id == 0) {
+            return -1;
+        }
+        i = (i + 1) & (FILTER_QNAME_SLOTS - 1);
+    }
+    /* shift the following entries back over the hole, no tombstones */
+    for (j = (i + 1) & (FILTER_QNAME_SLOTS - 1); f->qname_slots[j].id != 0;
+        j = (j + 1) & (FILTER_QNAME_SLOTS - 1)) {
+        home = f->qname_slots[j].hash & (FILTER_QNAME_SLOTS - 1);
+        if (((j - home) & (FILTER_QNAME_SLOTS - 1)) >= ((j - i) & (FILTER_QNAME_SLOTS - 1))) {
+            f->qname_slots[i] = f->qname_slots[j];
+            i = j;
+        }
+    }
+    f->qname_slots[i].id = 0;
+    f->qnames--;
+    f->suffixes -= rule->suffix;
+    return 0;
+}
+
+int filter_table_add(struct filter *f, int id) {
+    const struct filter_rule *rule = &filter_rules[id];
+    uint8_t addr6[16];
+    uint32_t ip;
+    int slot;
+
+    if (rule->type == FILTER_RULE_QNAME) {
+        return filter_qname_add(f, id);
+    }
+    if (rule->addr_len == 4) {
+        memcpy(&ip, rule->addr, sizeof(ip));
+        if (f->prefixes == FILTER_MAX_PREFIXES || rte_lpm_add(f->lpm, ntohl(ip), rule->depth, id) < 0) {
+            return -1;
+        }
+        f->prefixes++;
+        return 0;
+    }
+    for (slot = 0; slot <= FILTER_MAX_PREFIXES6 && f->lpm6_ids[slot] != 0; slot++)
+        ;
+    memcpy(addr6, rule->addr, sizeof(addr6));
+    if (slot > FILTER_MAX_PREFIXES6 || rte_lpm6_add(f->lpm6, addr6, rule->depth, slot) < 0) {
+        return -1;
+    }
+    f->lpm6_ids[slot] = id;
+    f->prefixes6++;
+    return 0;
+}
+
+int filter_table_del(struct filter *f, int id) {
+    const struct filter_rule *rule = &filter_rules[id];
+    uint8_t addr6[16];
+    uint8_t slot;
+    uint32_t ip;
+
+    if (rule->type == FILTER_RULE_QNAME) {
+        return filter_qname_del(f, id);
+    }
+    if (rule->addr_len == 4) {
+        memcpy(&ip, rule->addr, sizeof(ip));
+        if (rte_lpm_delete(f->lpm, ntohl(ip), rule->depth) < 0) {
+            return -1;
+        }
+        f->prefixes--;
+        return 0;
+    }
+    memcpy(addr6, rule->addr, sizeof(addr6));
+    if (rte_lpm6_is_rule_present(f->lpm6, addr6, rule->depth, &slot) != 1 ||
+        rte_lpm6_delete(f->lpm6, addr6, rule->depth) < 0) {
+        return -1;
+    }
+    f->lpm6_ids[slot] = 0;
+    f->prefixes6--;
+    return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stdint.h>
+
+#include "kdns.h"
+
+/*
+ * Ingress filter, checked on the data lcores before a udp query is parsed.
+ * Source prefixes are looked up in an LPM table (rte_lpm, rte_lpm6 for
+ * ipv6), the most specific prefix rule decides; an allow rule opens a hole
+ * in a broader deny. Queries from sources the prefixes let through are
+ * checked against the qname blocklist, a hash of exact names and of
+ * suffixes (the name and everything under it), found at each label.
+ *
+ * Every copy of the shared store (store_rcu) has its own tables and is
+ * updated by the master lcore like the views, so an lcore sees a rule set
+ * change between two bursts. The rules themselves, and their ids, are kept
+ * once by the master; an id is only reused after no lcore can hold it.
+ * Hits are counted per lcore and rule.
+ */
+
+#define FILTER_MAX_RULES         8192   /* ids, 0 is none */
+#define FILTER_MAX_PREFIXES      4096
+#define FILTER_MAX_PREFIXES6     255    /* rte_lpm6 next hops are 8 bits */
+#define FILTER_MAX_QNAMES        4096
+#define FILTER_VALUE_LEN         (MAXDOMAINLEN + 2)
+
+enum filter_action {
+    FILTER_PASS = 0,
+    FILTER_DROP,
+    FILTER_REFUSE,
+};
+
+enum filter_rule_type {
+    FILTER_RULE_PREFIX = 1,
+    FILTER_RULE_QNAME,
+};
+
+struct filter_rule {
+    uint8_t type;           /* FILTER_RULE_*, 0: unused */
+    uint8_t action;         /* FILTER_PASS (allow), FILTER_DROP or FILTER_REFUSE */
+    uint8_t suffix;         /* qname: the name and all names under it */
+    uint8_t depth;          /* prefix length */
+    uint8_t addr_len;       /* 4 or 16 */
+    uint8_t addr[16];       /* network order, masked to depth */
+    uint16_t name_len;      /* qname: wire length including the root label */
+    uint8_t name[MAXDOMAINLEN];   /* lowercased */
+    char value[FILTER_VALUE_LEN]; /* as it was given, for the api */
+};
+
+struct filter;
+
+/* tables for one copy of the store */
+struct filter *filter_create(void);
+/* hit counters of a data lcore */
+int filter_lcore_init(unsigned lcore_id);
+
+/* FILTER_PASS, FILTER_DROP or FILTER_REFUSE for the query at dns, len bytes from saddr */
+int filter_check(const struct filter *f, unsigned lcore_id, const uint8_t *saddr, int saddr_len,
+    const uint8_t *dns, int len);
+/* turn the query into its REFUSED answer in place, its length, 0 if it can't be */
+int filter_refuse(uint8_t *dns, int len);
+
+/* fill a rule from the api strings, no shared state is touched; 0 or -1 */
+int filter_rule_parse(struct filter_rule *rule, const char *type, const char *value,
+    const char *match, const char *action);
+
+/*
+ * The rule registry, master lcore only. A rule gets its id before it is
+ * added to the copies and releases it once it is out of both of them.
+ */
+int filter_rule_find(const struct filter_rule *rule);
+int filter_rule_register(const struct filter_rule *rule);
+void filter_rule_release(int id);
+void filter_rule_set_action(int id, uint8_t action);
+const struct filter_rule *filter_rule_get(int id);
+uint64_t filter_rule_hits(int id);
+
+/* add or remove rule id in the tables of one copy; 0 or -1 */
+int filter_table_add(struct filter *f, int id);
+int filter_table_del(struct filter *f, int id);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * filter_update.c -- ingress filter rules api
+ */
+
+#include <rte_ring.h>
+#include <rte_rwlock.h>
+#include <jansson.h>
+
+#include "filter_update.h"
+#include "store_rcu.h"
+#include "dns-conf.h"
+#include "util.h"
+
+#define FILTER_MSG_RING_SIZE   4096
+#define FILTER_MSG_BATCH_SIZE  256
+
+static struct rte_ring *filter_msg_ring;
+/* the rule registry, read by the api while the master changes it */
+static rte_rwlock_t filter_lock;
+
+static const char *filter_action_names[] = {
+    [FILTER_PASS] = "allow",
+    [FILTER_DROP] = "drop",
+    [FILTER_REFUSE] = "refuse",
+};
+
+
+static const char *filter_json_string(json_t *obj, const char *key) {
+    json_t *value = json_object_get(obj, key);
+
+    return (value && json_is_string(value)) ? json_string_value(value) : NULL;
+}
+
+// {"type":"prefix","value":"10.0.0.0/8","action":"drop"}
+// {"type":"qname","value":"example.com","match":"suffix","action":"refuse"}
+static void* filter_parse(int action, struct connection_info_struct *con_info, int * len_response)
+{
+    char * post_ok = strdup("OK\n");
+    char * parseErr = NULL;
+    json_error_t jerror;
+    int res;
+
+    log_msg(LOG_INFO,"%s filter rule = %s\n", action == FILTER_RULE_ADD ? "add" : "del", (char *)con_info->uploaddata);
+    if (!g_dns_cfg->comm.filter_enable) {
+        free(post_ok);
+        parseErr = strdup("ingress-filter is off\n");
+        *len_response = strlen(parseErr);
+        return (void* )parseErr;
+    }
+    *len_response = strlen(post_ok);
+
+    struct filter_update *update = calloc(1,sizeof(struct filter_update));
+    update->action = action;
+    json_t *json_response = json_loads(con_info->uploaddata, 0, &jerror);
+    if (!json_response) {
+        log_msg(LOG_ERR,"load json string  failed: %s %s (line %d, col %d)\n",
+                jerror.text, jerror.source, jerror.line, jerror.column);
+        goto parse_err;
+    }
+    if (!json_is_object(json_response) ||
+        filter_rule_parse(&update->rule, filter_json_string(json_response, "type"),
+            filter_json_string(json_response, "value"), filter_json_string(json_response, "match"),
+            filter_json_string(json_response, "action")) != 0) {
+        log_msg(LOG_ERR,"bad filter rule: %s\n", (char *)con_info->uploaddata);
+        json_decref(json_response);
+        goto parse_err;
+    }
+    json_decref(json_response);
+
+    res = rte_ring_enqueue(filter_msg_ring, update);
+    if (res == -ENOBUFS) {
+        log_msg(LOG_ERR,"filter msg ring of the master lcore is full\n");
+        free(update);
+        free(post_ok);
+        post_ok = strdup("busy, try again\n");
+        *len_response = strlen(post_ok);
+    }
+    return post_ok;
+
+parse_err:
+    free(update);
+    free(post_ok);
+    parseErr = strdup("parse data err\n");
+    *len_response = strlen(parseErr);
+    return (void* )parseErr;
+}
+
+void* filter_post(struct connection_info_struct *con_info, __attribute__((unused))char *url, int * len_response)
+{
+    return filter_parse(FILTER_RULE_ADD, con_info, len_response);
+}
+
+void* filter_del(struct connection_info_struct *con_info, __attribute__((unused))char *url, int * len_response)
+{
+    return filter_parse(FILTER_RULE_DEL, con_info, len_response);
+}
+
+void* filter_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused))char *url, int * len_response)
+{
+    const struct filter_rule *rule;
+    json_t *array = json_array();
+    json_t *value;
+    int id;
+
+    if (!array){
+        char * err = strdup("unable to create array");
+        *len_response = strlen(err);
+        return (void* )err;
+    }
+    rte_rwlock_read_lock(&filter_lock);
+    for (id = 1; id < FILTER_MAX_RULES; id++) {
+        if ((rule = filter_rule_get(id)) == NULL) {
+            continue;
+        }
+        value = json_pack("{s:s, s:s, s:s, s:I}",
+            "type", rule->type == FILTER_RULE_PREFIX ? "prefix" : "qname", "value", rule->value,
+            "action", filter_action_names[rule->action], "hits", (json_int_t)filter_rule_hits(id));
+        if (value && rule->type == FILTER_RULE_QNAME) {
+            json_object_set_new(value, "match", json_string(rule->suffix ? "suffix" : "exact"));
+        }
+        json_array_append_new(array, value);
+    }
+    rte_rwlock_read_unlock(&filter_lock);
+
+    char *str_ret = json_dumps(array, JSON_COMPACT);
+    json_decref(array);
+    *len_response = strlen(str_ret);
+    return (void* )str_ret;
+}
+
+// the master core call this func
+void filter_msg_ring_create(void)
+{
+    rte_rwlock_init(&filter_lock);
+    filter_msg_ring = rte_ring_create("filter_ring_master", FILTER_MSG_RING_SIZE,
+            rte_socket_id(), RING_F_SC_DEQ);
+    if (unlikely(NULL == filter_msg_ring)) {
+        log_msg(LOG_ERR, "Fail to create ring :filter_ring_master  !\n");
+        exit(-1);
+    }
+}
+
+struct filter_msg_batch {
+    unsigned num;
+    struct filter_update *msgs[FILTER_MSG_BATCH_SIZE];
+    int ids[FILTER_MSG_BATCH_SIZE];         /* 0: nothing to do for the copies */
+    uint8_t failed[FILTER_MSG_BATCH_SIZE];  /* the first copy could not take it */
+};
+
+static void filter_msg_batch_apply(struct kdns *kdns, void *arg)
+{
+    struct filter_msg_batch *batch = arg;
+    unsigned i;
+
+    for (i = 0; i < batch->num; i++) {
+        if (batch->ids[i] == 0 || batch->failed[i]) {
+            continue;
+        }
+        if (batch->msgs[i]->action == FILTER_RULE_ADD) {
+            if (filter_table_add(kdns->filter, batch->ids[i]) != 0) {
+                log_msg(LOG_ERR, "filter table full, rule %s not added\n", batch->msgs[i]->rule.value);
+                batch->failed[i] = 1;
+            }
+        } else {
+            filter_table_del(kdns->filter, batch->ids[i]);
+        }
+    }
+}
+
+/* the latest op of the first num in the batch still to be applied to rule id, -1 if none */
+static int filter_msg_batch_pending(const struct filter_msg_batch *batch, unsigned num, int id)
+{
+    int i;
+
+    for (i = (int)num - 1; i >= 0; i--) {
+        if (batch->ids[i] == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void filter_msg_master_process(void)
+{
+    struct filter_msg_batch batch;
+    struct filter_update *msg;
+    unsigned i;
+    int id, prev;
+
+    batch.num = rte_ring_dequeue_burst(filter_msg_ring, (void **)batch.msgs, FILTER_MSG_BATCH_SIZE);
+    if (batch.num == 0) {
+        return;
+    }
+    memset(batch.failed, 0, sizeof(batch.failed));
+
+    rte_rwlock_write_lock(&filter_lock);
+    for (i = 0; i < batch.num; i++) {
+        msg = batch.msgs[i];
+        batch.ids[i] = 0;
+        id = filter_rule_find(&msg->rule);
+        /* ops on the same rule take effect in order, rules stay registered until the batch is applied */
+        prev = id > 0 ? filter_msg_batch_pending(&batch, i, id) : -1;
+        if (msg->action == FILTER_RULE_DEL) {
+            if (id < 0 || (prev >= 0 && batch.msgs[prev]->action == FILTER_RULE_DEL)) {
+                log_msg(LOG_ERR, "no filter rule %s to delete\n", msg->rule.value);
+            } else {
+                batch.ids[i] = id;
+            }
+        } else if (id > 0) {
+            /* the same prefix or name again: only its action changes, and a delete before it is undone */
+            filter_rule_set_action(id, msg->rule.action);
+            if (prev >= 0 && batch.msgs[prev]->action == FILTER_RULE_DEL) {
+                batch.ids[prev] = 0;
+            }
+        } else if ((batch.ids[i] = filter_rule_register(&msg->rule)) < 0) {
+            log_msg(LOG_ERR, "too many filter rules, %s not added\n", msg->rule.value);
+            batch.ids[i] = 0;
+        }
+    }
+    rte_rwlock_write_unlock(&filter_lock);
+
+    // the shared store, seen by the lcores
+    store_rcu_update(filter_msg_batch_apply, &batch);
+
+    // no lcore holds the deleted rules any more
+    rte_rwlock_write_lock(&filter_lock);
+    for (i = 0; i < batch.num; i++) {
+        if (batch.ids[i] != 0 && (batch.msgs[i]->action == FILTER_RULE_DEL || batch.failed[i])) {
+            filter_rule_release(batch.ids[i]);
+        }
+        free(batch.msgs[i]);
+    }
+    rte_rwlock_write_unlock(&filter_lock);
+}
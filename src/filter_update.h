@@ -0,0 +1,24 @@
+#ifndef __FILTER_UPDATE_H__
+#define __FILTER_UPDATE_H__
+
+#include "filter.h"
+#include "webserver.h"
+
+enum filter_update_action {
+    FILTER_RULE_ADD,
+    FILTER_RULE_DEL,
+};
+
+struct filter_update {
+    int action;
+    struct filter_rule rule;
+};
+
+void filter_msg_ring_create(void);
+void filter_msg_master_process(void);
+
+void* filter_post(struct connection_info_struct *con_info, __attribute__((unused))char *url, int * len_response);
+void* filter_del(struct connection_info_struct *con_info, __attribute__((unused))char *url, int * len_response);
+void* filter_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused))char *url, int * len_response);
+
+#endif
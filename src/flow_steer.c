@@ -0,0 +1,217 @@
+/*
+ * flow_steer.c -- rte_flow rules splitting dns from exception traffic
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include <rte_ethdev.h>
+#include <rte_flow.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+
+#include "dns-conf.h"
+#include "util.h"
+#include "forward.h"
+#include "flow_steer.h"
+
+#define FLOW_DNS_PORT    53
+
+static const struct rte_flow_attr flow_attr_dns = { .priority = 0, .ingress = 1 };
+static const struct rte_flow_attr flow_attr_rest = { .priority = 1, .ingress = 1 };
+
+static int flow_rule_add(uint8_t port_id, const struct rte_flow_attr *attr,
+    const struct rte_flow_item *pattern, const struct rte_flow_action *actions, const char *what) {
+    struct rte_flow_error error;
+
+    memset(&error, 0, sizeof(error));
+    if (rte_flow_validate(port_id, attr, pattern, actions, &error) != 0 ||
+        rte_flow_create(port_id, attr, pattern, actions, &error) == NULL) {
+        log_msg(LOG_INFO, "port %u: no flow rule for %s: %s\n", port_id, what,
+            error.message ? error.message : "not supported");
+        return -1;
+    }
+    log_msg(LOG_INFO, "port %u: flow rule for %s\n", port_id, what);
+    return 0;
+}
+
+/* udp to port 53 over l3 (ipv4 or ipv6) */
+static int flow_rule_udp53(uint8_t port_id, enum rte_flow_item_type l3,
+    const struct rte_flow_action *actions, const char *what) {
+    struct rte_flow_item_udp spec, mask;
+
+    memset(&spec, 0, sizeof(spec));
+    memset(&mask, 0, sizeof(mask));
+    spec.hdr.dst_port = htons(FLOW_DNS_PORT);
+    mask.hdr.dst_port = 0xffff;
+    const struct rte_flow_item pattern[] = {
+        { .type = RTE_FLOW_ITEM_TYPE_ETH },
+        { .type = l3 },
+        { .type = RTE_FLOW_ITEM_TYPE_UDP, .spec = &spec, .mask = &mask },
+        { .type = RTE_FLOW_ITEM_TYPE_END },
+    };
+    return flow_rule_add(port_id, &flow_attr_dns, pattern, actions, what);
+}
+
+/* udp to the source ports of dpdk forwarding over ipv4, the upstream answers */
+static int flow_rule_fwd_answers(uint8_t port_id, const struct rte_flow_action *actions) {
+    uint16_t min = g_dns_cfg->comm.fwd_src_port_min;
+    uint16_t max = g_dns_cfg->comm.fwd_src_port_max;
+    uint16_t span = max - min;
+    struct rte_flow_item_udp spec, last, mask;
+
+    memset(&spec, 0, sizeof(spec));
+    memset(&last, 0, sizeof(last));
+    memset(&mask, 0, sizeof(mask));
+    spec.hdr.dst_port = htons(min);
+    mask.hdr.dst_port = 0xffff;
+    struct rte_flow_item pattern[] = {
+        { .type = RTE_FLOW_ITEM_TYPE_ETH },
+        { .type = RTE_FLOW_ITEM_TYPE_IPV4 },
+        { .type = RTE_FLOW_ITEM_TYPE_UDP, .spec = &spec, .mask = &mask },
+        { .type = RTE_FLOW_ITEM_TYPE_END },
+    };
+    /* an aligned power of two block is a mask, which more NICs take than a range */
+    if ((span & (span + 1)) == 0 && (min & span) == 0) {
+        mask.hdr.dst_port = htons((uint16_t)~span);
+    } else {
+        last.hdr.dst_port = htons(max);
+        pattern[2].last = &last;
+    }
+    return flow_rule_add(port_id, &flow_attr_dns, pattern, actions, "upstream answers");
+}
+
+/* any l4 packet over l3 */
+static int flow_rule_l4(uint8_t port_id, enum rte_flow_item_type l3, enum rte_flow_item_type l4,
+    const struct rte_flow_action *actions, const char *what) {
+    const struct rte_flow_item pattern[] = {
+        { .type = RTE_FLOW_ITEM_TYPE_ETH },
+        { .type = l3 },
+        { .type = l4 },
+        { .type = RTE_FLOW_ITEM_TYPE_END },
+    };
+    return flow_rule_add(port_id, &flow_attr_dns, pattern, actions, what);
+}
+
+/* udp 53 spread over the data queues, everything else to the exception queue */
+static int flow_steer_full(uint8_t port_id, uint16_t nb_data) {
+    struct rte_flow_action_queue exception = { .index = nb_data };
+    struct rte_flow_action_queue queue0 = { .index = 0 };
+    struct rte_flow_action_rss *rss;
+    struct rte_flow_action dns_actions[2];
+    uint16_t i;
+    int ret = -1;
+
+    rss = calloc(1, sizeof(*rss) + nb_data * sizeof(rss->queue[0]));
+    if (rss == NULL) {
+        return -1;
+    }
+    rss->rss_conf = NULL;       /* the port's hash */
+    rss->num = nb_data;
+    for (i = 0; i < nb_data; i++) {
+        rss->queue[i] = i;
+    }
+    memset(dns_actions, 0, sizeof(dns_actions));
+    if (nb_data == 1) {
+        dns_actions[0].type = RTE_FLOW_ACTION_TYPE_QUEUE;
+        dns_actions[0].conf = &queue0;
+    } else {
+        dns_actions[0].type = RTE_FLOW_ACTION_TYPE_RSS;
+        dns_actions[0].conf = rss;
+    }
+    dns_actions[1].type = RTE_FLOW_ACTION_TYPE_END;
+
+    const struct rte_flow_action rest_actions[] = {
+        { .type = RTE_FLOW_ACTION_TYPE_QUEUE, .conf = &exception },
+        { .type = RTE_FLOW_ACTION_TYPE_END },
+    };
+    const struct rte_flow_item rest_pattern[] = {
+        { .type = RTE_FLOW_ITEM_TYPE_ETH },
+        { .type = RTE_FLOW_ITEM_TYPE_END },
+    };
+
+    if (flow_rule_udp53(port_id, RTE_FLOW_ITEM_TYPE_IPV4, dns_actions, "ipv4 dns queries") != 0 ||
+        flow_rule_udp53(port_id, RTE_FLOW_ITEM_TYPE_IPV6, dns_actions, "ipv6 dns queries") != 0) {
+        goto out;
+    }
+    if (g_dns_cfg->comm.fwd_mode == FWD_MODE_DPDK && flow_rule_fwd_answers(port_id, dns_actions) != 0) {
+        goto out;
+    }
+    ret = flow_rule_add(port_id, &flow_attr_rest, rest_pattern, rest_actions, "exception traffic");
+
+out:
+    free(rss);
+    return ret;
+}
+
+/* keep RSS off the exception queue */
+static int flow_reta_data(uint8_t port_id, uint16_t nb_data) {
+    struct rte_eth_rss_reta_entry64 reta_conf[ETH_RSS_RETA_SIZE_512 / RTE_RETA_GROUP_SIZE];
+    struct rte_eth_dev_info dev_info;
+    uint16_t i;
+
+    memset(&dev_info, 0, sizeof(dev_info));
+    rte_eth_dev_info_get(port_id, &dev_info);
+    if (dev_info.reta_size == 0 || dev_info.reta_size > ETH_RSS_RETA_SIZE_512) {
+        return -1;
+    }
+    memset(reta_conf, 0, sizeof(reta_conf));
+    for (i = 0; i < dev_info.reta_size; i++) {
+        reta_conf[i / RTE_RETA_GROUP_SIZE].mask |= 1ULL << (i % RTE_RETA_GROUP_SIZE);
+        reta_conf[i / RTE_RETA_GROUP_SIZE].reta[i % RTE_RETA_GROUP_SIZE] = i % nb_data;
+    }
+    return rte_eth_dev_rss_reta_update(port_id, reta_conf, dev_info.reta_size);
+}
+
+/* the classes the data lcores would only hand to the kni, each as far as the NIC goes */
+static int flow_steer_classes(uint8_t port_id, uint16_t nb_data) {
+    struct rte_flow_action_queue exception = { .index = nb_data };
+    struct rte_flow_item_eth arp_spec, arp_mask;
+    int nb_rules = 0;
+
+    const struct rte_flow_action actions[] = {
+        { .type = RTE_FLOW_ACTION_TYPE_QUEUE, .conf = &exception },
+        { .type = RTE_FLOW_ACTION_TYPE_END },
+    };
+    memset(&arp_spec, 0, sizeof(arp_spec));
+    memset(&arp_mask, 0, sizeof(arp_mask));
+    arp_spec.type = htons(ETHER_TYPE_ARP);
+    arp_mask.type = 0xffff;
+    const struct rte_flow_item arp_pattern[] = {
+        { .type = RTE_FLOW_ITEM_TYPE_ETH, .spec = &arp_spec, .mask = &arp_mask },
+        { .type = RTE_FLOW_ITEM_TYPE_END },
+    };
+
+    nb_rules += flow_rule_add(port_id, &flow_attr_dns, arp_pattern, actions, "arp") == 0;
+    /* dns over tcp is the kernel's too, tcp_process.c */
+    nb_rules += flow_rule_l4(port_id, RTE_FLOW_ITEM_TYPE_IPV4, RTE_FLOW_ITEM_TYPE_TCP, actions, "ipv4 tcp") == 0;
+    nb_rules += flow_rule_l4(port_id, RTE_FLOW_ITEM_TYPE_IPV6, RTE_FLOW_ITEM_TYPE_TCP, actions, "ipv6 tcp") == 0;
+    nb_rules += flow_rule_l4(port_id, RTE_FLOW_ITEM_TYPE_IPV4, RTE_FLOW_ITEM_TYPE_ICMP, actions, "icmp") == 0;
+    if (nb_rules == 0) {
+        return -1;
+    }
+    if (flow_reta_data(port_id, nb_data) != 0) {
+        log_msg(LOG_ERR, "port %u: cannot keep rss off the exception queue\n", port_id);
+        return -1;
+    }
+    return 0;
+}
+
+int flow_steer_port(uint8_t port_id, uint16_t nb_data) {
+    struct rte_flow_error error;
+
+    if (flow_steer_full(port_id, nb_data) == 0) {
+        log_msg(LOG_INFO, "port %u: dns steered to %u data queues, the rest to queue %u\n",
+            port_id, nb_data, nb_data);
+        return FLOW_STEER_FULL;
+    }
+    rte_flow_flush(port_id, &error);
+
+    if (flow_steer_classes(port_id, nb_data) == 0) {
+        log_msg(LOG_INFO, "port %u: exception classes steered to queue %u\n", port_id, nb_data);
+        return FLOW_STEER_CLASSES;
+    }
+    rte_flow_flush(port_id, &error);
+    return FLOW_STEER_NONE;
+}
@@ -0,0 +1,37 @@
+#ifndef __FLOW_STEER_H__
+#define __FLOW_STEER_H__
+
+#include <stdint.h>
+
+/*
+ * Hardware steering with rte_flow rules (flow-steering, rss mode). A
+ * steered port gets one rx queue more than the data lcores use, the
+ * exception queue, which only the master polls and hands to the kni, so
+ * the data lcores neither classify that traffic nor pass it through the
+ * kni ring.
+ *
+ * Where the NIC can spread a rule over queues (RSS action), udp port 53,
+ * and the upstream answers of dpdk forwarding (udp to fwd-src-ports), go
+ * to the data queues and a lower priority rule sends everything else to
+ * the exception queue. Otherwise the classes the data lcores only pass
+ * on to the kernel (arp, tcp, icmp) are steered to the exception queue,
+ * each one as far as the NIC takes its rule, and RSS spreads the rest over
+ * the data queues; what is left over is classified in software as before.
+ * A port that takes no rule at all is set up again without the exception
+ * queue.
+ */
+
+enum {
+    FLOW_STEER_NONE = 0,    /* software path only */
+    FLOW_STEER_CLASSES,     /* some classes to the exception queue */
+    FLOW_STEER_FULL,        /* dns to the data queues, the rest to the exception queue */
+};
+
+/*
+ * Program a started port whose data queues are 0..nb_data-1 and whose
+ * exception queue is nb_data; FLOW_STEER_*, no rule is left on
+ * FLOW_STEER_NONE.
+ */
+int flow_steer_port(uint8_t port_id, uint16_t nb_data);
+
+#endif
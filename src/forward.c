@@ -6,12 +6,13 @@
 #include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <time.h>
+#include <ctype.h>
 
 #include <rte_mbuf.h>
 #include <rte_ether.h> 
@@ -22,256 +23,196 @@
 #include <arpa/inet.h>
 #include <rte_byteorder.h>
 #include <rte_ethdev.h>
+#include <rte_cycles.h>
+#include <rte_jhash.h>
 #include "netdev.h"
+#include "dns-conf.h"
+#include "packet.h"
 #include "util.h"
 #include "forward.h"
+#include "fwd_cache.h"
+#include "radtree.h"
 
 struct fwd_pkt_input {
     struct rte_mbuf *pkt;
     uint16_t old_id;
     uint16_t qtype;
     char  domain_name[FWD_MAX_DOMAIN_NAME_LEN];
+    int refresh;                    /* no client, it only refreshes the cache */
+    struct fwd_pkt_input *next;     /* the next client waiting on the same query */
 };
 
+#define FWD_SOCKS_PER_THREAD      4
+#define FWD_MAX_PENDING           4096
+#define FWD_PENDING_HASH_BITS     13
+#define FWD_PENDING_HASH_MASK     ((1 << FWD_PENDING_HASH_BITS) - 1)
+#define FWD_BURST                 32
+#define FWD_POLL_MS               1
+#define FWD_PROBE_RATE            64      /* one query in it tries another upstream first */
+#define FWD_SERVER_MAX_FAILS      3       /* unanswered in a row before an upstream is down */
+#define FWD_SERVER_DOWN_MS        10000   /* a down upstream is probed this often */
+#define FWD_SERVER_LATE_MS        250     /* no answer after this and 4 srtt is a failure */
 
-typedef struct {
-   char *zone_name;
-   char *fwd_addrs;
- } zone_fwd_input_tmp;
-
-
-typedef struct domin_fwd_cache{
-    char  domain_name[FWD_MAX_DOMAIN_NAME_LEN];
-    char  data[512];
-    int   data_len;
-    unsigned int     hashValue ;
-    uint16_t         qtype;
-    time_t time_expired;
-    struct domin_fwd_cache *next;  
-}domin_fwd_cache_st;
-
+/*
+ * A query sent upstream, matched back by (socket, id, upstream, question).
+ * Identical queries (same qname, qtype, zone and EDNS: OPT, DO bit and udp
+ * size, which the answer depends on) arriving while it is in flight wait
+ * on it instead of going upstream again.
+ */
+struct fwd_pending {
+    struct fwd_pkt_input *etm;  /* the query sent, then the waiters */
+    struct fwd_upstreams ups;
+    uint16_t qid;
+    int sock;                   /* index in fwd_thread.socks */
+    int query_len;
+    int question_len;
+    int heap_idx;
+    uint64_t deadline;          /* ms, next hedge or expire */
+    uint64_t expire;            /* ms, the query fails after it */
+    char *stale;                /* expired cache data, answered on failure */
+    int stale_len;
+    uint32_t key_hash;          /* of qname, qtype, edns and zone */
+    uint32_t edns_key;          /* OPT present, DO and udp size of the query sent */
+    struct fwd_pending *hash_next;  /* also links the free list */
+    struct fwd_pending *key_next;
+};
 
-#define FORWARD_HASH_SIZE                0x3FFFF
-// 
-#define FORWARD_CACHE_TIME_OUT_SCAN_NUM  0xFFFF
+struct fwd_thread {
+    struct rte_ring *ring;      /* the queries of this thread */
+    int epfd;
+    int socks[FWD_SOCKS_PER_THREAD];
+    int next_sock;
+    uint32_t rand;
+    uint32_t timeout_ms;
+    uint32_t hedge_ms;
+    struct fwd_pending *free_list;
+    struct fwd_pending *hash[1 << FWD_PENDING_HASH_BITS];
+    struct fwd_pending *keys[1 << FWD_PENDING_HASH_BITS];     /* by key_hash */
+    struct fwd_pending *heap[FWD_MAX_PENDING];  /* min-heap on deadline */
+    int heap_len;
+    struct fwd_pending pendings[FWD_MAX_PENDING];
+    uint8_t buf[65535];
+};
 
-#define FORWARD_CACHE_FIND            0
-#define FORWARD_CACHE_NOT_FIND       -1
-#define FORWARD_CACHE_DATA_EXPIRED   -2
 
-   
 #define BUF_SIZE 512
 
 #define FWD_RING_SIZE     65536
+#define FWD_ZONE_RING_SIZE    1024
+#define FWD_ZONE_BURST        32
+#define FWD_ZONE_RETIRE_MS    60000   /* after fwd-timeout, for late timers */
 
 static domain_fwd_addrs *default_fwd_addrs = NULL ;
 
-static domain_fwd_addrs **zones_fwd_addrs = NULL ;
-static int g_fwd_zone_num = 0;
+/*
+ * The forward zones by name, looked up by closest encloser. The master
+ * lcore replaces the tree as a whole on every change, what it replaced is
+ * freed FWD_ZONE_RETIRE_MS past fwd-timeout: lookups do not lock, and
+ * pending queries keep their zone for up to their timeout.
+ */
+static struct radtree * volatile fwd_zone_tree;
 
+struct fwd_zone_retired {
+    struct radtree *tree;
+    domain_fwd_addrs *zone;     /* removed or replaced, NULL if none */
+    uint64_t at;                /* ms */
+    struct fwd_zone_retired *next;
+};
 
-extern struct rte_mempool *pkt_mbuf_pool;
-struct rte_ring *master_fwd_pkt_ex_ring;
-struct rte_ring *fwd_pkt_to_process_ring;
+static struct fwd_zone_retired *fwd_zone_retired_head;
+static struct fwd_zone_retired *fwd_zone_retired_tail;
+static struct rte_ring *fwd_zone_msg_ring;
 
 
+extern struct rte_mempool *pkt_mbuf_pool;
+struct rte_ring *master_fwd_pkt_ex_ring;
+/* one per forward thread, a name always goes to the same one */
+static struct rte_ring **fwd_pkt_to_process_rings;
+static int fwd_rings_num;
 
-static domain_fwd_addrs * resolve_dns_servers(char * domain_suffix,char * dns_addrs);
-static void *thread_fwd_pkt_process(void *socket);
-static void *thread_fwd_cache_expired_cleanup(void *arg);
 
 
-static struct domin_fwd_cache *g_fwd_cache_hash_list[FORWARD_HASH_SIZE + 1 ] ;
-static rte_rwlock_t fwd_cache_list_lock;
+static domain_fwd_addrs * resolve_dns_servers(const char * domain_suffix,char * dns_addrs);
+static void *thread_fwd_pkt_process(void *arg);
+static struct fwd_thread *fwd_thread_create(struct rte_ring *ring);
 
 
+/* wire length of a name domain_name_parse_wire made */
+static int fwd_dname_len(const uint8_t *dname) {
+    int len = 0;
 
-static void parse_dns_fwd_zones(char * fwd_addrs) {
-    int zone_idx = 1;
-    char *zone_info = NULL;
-    char buf[BUF_SIZE];
-    char zone_name[64];
-    char zone_addr[BUF_SIZE];
-    zone_fwd_input_tmp * fwd_input_tmp = NULL;
-    if (strlen(fwd_addrs) == 0){
-        return;
+    while (dname[len] != 0) {
+        len += dname[len] + 1;
     }
-    log_msg(LOG_INFO, "parse_dns_fwd_zones fwd_addrs %s\n", fwd_addrs);
-    char *pch = strchr(fwd_addrs, '%');
-    while (pch != NULL) {
-        zone_idx++;
-        pch = strchr(pch + 1, '%');
-    }
-    zones_fwd_addrs = calloc(zone_idx, sizeof(domain_fwd_addrs*));
-    // in order to use resolve_dns_servers(),use fwd_input_tmp instead of strtok_r
-    fwd_input_tmp = calloc(zone_idx, sizeof(zone_fwd_input_tmp));
-    g_fwd_zone_num = zone_idx;
-    zone_idx = 0;
-    zone_info = strtok(fwd_addrs, "%");
-    while (zone_info) {
-        char *pos;
-        memset(buf, 0, BUF_SIZE);
-        memset(zone_name, 0, 64);
-        memset(zone_addr, 0, BUF_SIZE);
-        strncpy(buf, zone_info, BUF_SIZE - 1);
-        pos = (strrchr(buf, '@'));
-        if (pos) {
-            memcpy(zone_name,buf,pos - buf);
-            memcpy(zone_addr,pos+1, strlen(buf)+ buf - pos -1 );  
-            fwd_input_tmp[zone_idx].zone_name = strdup(zone_name);
-            fwd_input_tmp[zone_idx].fwd_addrs = strdup(zone_addr);
-        }else{
-            log_msg(LOG_ERR, "wrong fmt %s\n", zone_info);
-            exit(-1);
-        } 
-        zone_idx++;
-        zone_info = strtok(NULL, "%");    
-    }
-    for (zone_idx =0; zone_idx < g_fwd_zone_num; zone_idx++ ){
-        zones_fwd_addrs[zone_idx] = resolve_dns_servers(fwd_input_tmp[zone_idx].zone_name,fwd_input_tmp[zone_idx].fwd_addrs);
-        free(fwd_input_tmp[zone_idx].zone_name);
-        free(fwd_input_tmp[zone_idx].fwd_addrs);
-    }
-    free(fwd_input_tmp); 
+    return len + 1;
 }
 
-static void fwd_cache_init(void){
-    int i ;
-    for (i=0; i <= FORWARD_HASH_SIZE; i++){
-        g_fwd_cache_hash_list[i] = NULL;
-    }
-    
-    rte_rwlock_init(&fwd_cache_list_lock);  
-}
-
-
-static unsigned int elfHash(char* str, unsigned int len)  
-{  
-   unsigned int hash = 0;  
-   unsigned int x    = 0;  
-   unsigned int i    = 0;  
-   for(i = 0; i < len; str++, i++)  
-   {  
-      hash = (hash << 4) + (*str);  
-      if((x = hash & 0xF0000000L) != 0)  
-      {  
-         hash ^= (x >> 24);  
-      }  
-      hash &= ~x;  
-   }  
-   return hash;  
-}  
-
-
-static void fwd_cache_insert(char *domain,uint16_t qtype,char *data, int data_len ){
-    domin_fwd_cache_st *find;
- 
-    unsigned int  hashValue = elfHash(domain, strlen(domain));
-    unsigned int hashId  = hashValue&FORWARD_HASH_SIZE; 
-    
-    rte_rwlock_write_lock(&fwd_cache_list_lock);
-    find = g_fwd_cache_hash_list[hashId];
+static int fwd_zone_tree_insert(struct radtree *tree, domain_fwd_addrs *zone) {
+    uint8_t dname[MAXDOMAINLEN];
 
-    while(find){
-        if (find->hashValue == hashValue &&
-            find->qtype   == qtype &&
-            strcmp(find->domain_name,domain)==0){
-            break;
-        }
-        find = find->next;
-    }
-    if (find == NULL){
-        //add to head
-        domin_fwd_cache_st * newNode = xalloc_zero(sizeof(domin_fwd_cache_st));
-        newNode->hashValue = hashValue;
-        memcpy(newNode->domain_name,domain,strlen(domain));
-        newNode->data_len = data_len;
-        newNode->qtype = qtype;
-        memcpy(newNode->data,data,data_len);
-        newNode->time_expired = time(NULL)+ 60; //second
-        newNode->next = g_fwd_cache_hash_list[hashId];
-        g_fwd_cache_hash_list[hashId] = newNode;
-       
+    if (domain_name_parse_wire(dname, zone->domain_name) == 0) {
+        return -1;
     }
-    rte_rwlock_write_unlock(&fwd_cache_list_lock);    
+    return radomain_name_insert(tree, dname, fwd_dname_len(dname), zone) ? 0 : -1;
 }
 
+static void fwd_zone_free(domain_fwd_addrs *zone) {
+    int i;
 
-static void fwd_cache_del(char *domain,uint16_t qtype){
-    domin_fwd_cache_st *pre;
-    domin_fwd_cache_st *find;
-
-    unsigned int  hashValue = elfHash(domain, strlen(domain));
-    unsigned int hashId  = hashValue&FORWARD_HASH_SIZE; 
-
-    rte_rwlock_write_lock(&fwd_cache_list_lock);
-
-    pre = find = g_fwd_cache_hash_list[hashId];
-
-    while(find){
-        if (find->hashValue == hashValue &&
-            find->qtype   == qtype &&
-            strcmp(find->domain_name,domain)==0){
-            break;
-        }
-        pre = find;
-        find = find->next;
-    }
-
-    if (find != NULL && pre != NULL ){
-        pre->next = find->next;
-        if (find == g_fwd_cache_hash_list[hashId]){
-            g_fwd_cache_hash_list[hashId] = find->next;
-        }
-       // free(find->data);
-        free(find);
+    for (i = 0; i < zone->servers_len; i++) {
+        free(zone->server_addrs[i].addr);
     }
-    rte_rwlock_write_unlock(&fwd_cache_list_lock);    
+    free(zone->server_addrs);
+    free(zone);
 }
 
-static int  fwd_cache_lookup(char *domain,uint16_t qtype,char *dataGet,int *data_len,char *expired_recrds){
-    domin_fwd_cache_st *find;
-    int status = FORWARD_CACHE_NOT_FIND;
-    unsigned int  hashValue = elfHash(domain, strlen(domain));
-    unsigned int hashId  = hashValue&FORWARD_HASH_SIZE; 
-    
-
-    rte_rwlock_read_lock(&fwd_cache_list_lock);
+static void parse_dns_fwd_zones(char * fwd_addrs) {
+    char *zone_info, *save = NULL;
+    struct radtree *tree = radix_tree_create();
 
-   find = g_fwd_cache_hash_list[hashId];
+    fwd_zone_tree = tree;
+    if (strlen(fwd_addrs) == 0){
+        return;
+    }
+    log_msg(LOG_INFO, "parse_dns_fwd_zones fwd_addrs %s\n", fwd_addrs);
+    for (zone_info = strtok_r(fwd_addrs, "%", &save); zone_info; zone_info = strtok_r(NULL, "%", &save)) {
+        domain_fwd_addrs *zone;
+        char *pos = strrchr(zone_info, '@');
 
-    while(find){
-        if (find->hashValue == hashValue &&
-            find->qtype == qtype &&
-            strcmp(find->domain_name,domain)==0){
-            break;
+        if (pos == NULL) {
+            log_msg(LOG_ERR, "wrong fmt %s\n", zone_info);
+            exit(-1);
+        }
+        *pos = '\0';
+        zone = resolve_dns_servers(zone_info, pos + 1);
+        if (zone == NULL) {
+            exit(-1);
+        }
+        if (fwd_zone_tree_insert(tree, zone) != 0) {
+            log_msg(LOG_ERR, "bad or duplicate forward zone %s\n", zone_info);
+            exit(-1);
         }
-        find = find->next;
-    }
-    if (find != NULL){
-        if  (find->time_expired > time(NULL)){
-            memcpy(dataGet,find->data,find->data_len);
-            *data_len = find->data_len;           
-            status = FORWARD_CACHE_FIND;
-        }else{
-             memcpy(expired_recrds,find->data,find->data_len);
-            *data_len = find->data_len;
-            find->time_expired = time(NULL)+ 60; //will be del or used next 60 second
-            status = FORWARD_CACHE_DATA_EXPIRED;
-        }     
     }
-    rte_rwlock_read_unlock(&fwd_cache_list_lock);    
-    return status;
 }
 
-
-
-
 int remote_sock_init(char * fwd_addrs, char * fwd_def_addr,int fwd_threads){
 
-    fwd_cache_init();
+    struct fwd_cache_conf cache_conf = {
+        .memory = (uint64_t)g_dns_cfg->comm.fwd_cache_memory << 20,
+        .min_ttl = g_dns_cfg->comm.fwd_cache_min_ttl,
+        .max_ttl = g_dns_cfg->comm.fwd_cache_max_ttl,
+        .stale_time = g_dns_cfg->comm.fwd_stale_time,
+        .prefetch_hits = g_dns_cfg->comm.fwd_prefetch_hits,
+        .serve_stale = g_dns_cfg->comm.fwd_serve_stale,
+    };
+    if (fwd_cache_init(&cache_conf) != 0) {
+        exit(-1);
+    }
 
     default_fwd_addrs = resolve_dns_servers("defulat.zone",fwd_def_addr);
+    if (default_fwd_addrs == NULL) {
+        exit(-1);
+    }
     parse_dns_fwd_zones(fwd_addrs);
     
     master_fwd_pkt_ex_ring = rte_ring_create("master_fwd_pkt_ex_ring", FWD_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
@@ -279,46 +220,49 @@ int remote_sock_init(char * fwd_addrs, char * fwd_def_addr,int fwd_threads){
         log_msg(LOG_ERR, "Cannot create ring master_fwd_pkt_ex_ring  %s\n", rte_strerror(rte_errno));
         exit(-1);
     }
-
-    fwd_pkt_to_process_ring = rte_ring_create("fwd_pkt_to_process_ring", FWD_RING_SIZE, rte_socket_id(), 0); 
-    if (!fwd_pkt_to_process_ring) {
-        log_msg(LOG_ERR, "Cannot create ring fwd_pkt_to_process_ring  %s\n", rte_strerror(rte_errno));
+    fwd_zone_msg_ring = rte_ring_create("fwd_zone_msg_ring", FWD_ZONE_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+    if (!fwd_zone_msg_ring) {
+        log_msg(LOG_ERR, "Cannot create ring fwd_zone_msg_ring  %s\n", rte_strerror(rte_errno));
         exit(-1);
     }
 
-    /* create a separate thread to send task status as quick as possible */
+    /* the data lcores forward themselves, see fwd_dpdk_init */
+    if (g_dns_cfg->comm.fwd_mode == FWD_MODE_DPDK) {
+        return 0;
+    }
+
+    /* each forward thread multiplexes its queries over a few sockets */
+    fwd_rings_num = fwd_threads;
+    fwd_pkt_to_process_rings = xalloc_array_zero(fwd_threads, sizeof(struct rte_ring *));
     int i =0;
     for( ;i< fwd_threads;i++){
-          int * remote_sock =    (int *)  xalloc(sizeof(int));
-          pthread_t *thread_id = (pthread_t *)  xalloc(sizeof(pthread_t));  
-         *remote_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP); 
-         struct timeval tv = {2, 0};
-         
-         if (setsockopt(*remote_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {  
-             
-             log_msg(LOG_ERR,"socket option  SO_RCVTIMEO not support\n");  
-             exit(-1);  
-         } 
-
-         pthread_create(thread_id, NULL, thread_fwd_pkt_process, (void*)remote_sock);
+         char ring_name[RTE_RING_NAMESIZE];
+         snprintf(ring_name, sizeof(ring_name), "fwd_process_ring_%d", i);
+         fwd_pkt_to_process_rings[i] = rte_ring_create(ring_name, FWD_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+         if (!fwd_pkt_to_process_rings[i]) {
+             log_msg(LOG_ERR, "Cannot create ring %s  %s\n", ring_name, rte_strerror(rte_errno));
+             exit(-1);
+         }
+         pthread_t *thread_id = (pthread_t *)  xalloc(sizeof(pthread_t));  
+         pthread_create(thread_id, NULL, thread_fwd_pkt_process, (void*)fwd_thread_create(fwd_pkt_to_process_rings[i]));
     }
  
-     // cache date expired clean up thread
-     pthread_t *thread_cache_expired = (pthread_t *)  xalloc(sizeof(pthread_t));  
-     pthread_create(thread_cache_expired, NULL, thread_fwd_cache_expired_cleanup, (void*)NULL);
- 
     return 0;
 }
 
-static domain_fwd_addrs * resolve_dns_servers(char * domain_suffix,char * dns_addrs) {
+static domain_fwd_addrs * resolve_dns_servers(const char * domain_suffix,char * dns_addrs) {
     
     char buf[BUF_SIZE];
     struct addrinfo *addr_ip;
     struct addrinfo hints;
-    char* token;
+    char *token, *save = NULL;
 
     int i=0,r = 0;
 
+    if (strlen(domain_suffix) >= FWD_MAX_DOMAIN_NAME_LEN) {
+        log_msg(LOG_ERR,"forward zone name too long: %s\n",domain_suffix);
+        return NULL;
+    }
     domain_fwd_addrs *fwd_addrs = calloc(1, sizeof(domain_fwd_addrs));
     fwd_addrs->servers_len =1;
     memcpy(fwd_addrs->domain_name,domain_suffix,strlen(domain_suffix));
@@ -335,157 +279,207 @@ static domain_fwd_addrs * resolve_dns_servers(char * domain_suffix,char * dns_ad
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_DGRAM; /* Datagram socket */
-    token = strtok(dns_addrs, ",");
+    token = strtok_r(dns_addrs, ",", &save);
     while (token) {
-        char *port;
+        const char *port;
+        char *sep;
         memset(buf, 0, BUF_SIZE);
         strncpy(buf, token, BUF_SIZE - 1);
-        port = (strrchr(buf, ':'));
-        if (port) {
-        *port = '\0';
-        port++;
+        sep = (strrchr(buf, ':'));
+        if (sep) {
+            *sep = '\0';
+            port = sep + 1;
         } else {
-            port = strdup("53");
+            port = "53";
         }
         if (0 != (r = getaddrinfo(buf, port, &hints, &addr_ip))) {
-            log_msg(LOG_ERR,"err  getaddrinfo \n");
-            exit(-1);
+            log_msg(LOG_ERR,"err  getaddrinfo %s: %s\n", token, gai_strerror(r));
+            fwd_addrs->servers_len = i;
+            fwd_zone_free(fwd_addrs);
+            return NULL;
         }
-        fwd_addrs->server_addrs[i].addr = addr_ip->ai_addr;
+        fwd_addrs->server_addrs[i].addr = xalloc(addr_ip->ai_addrlen);
+        memcpy(fwd_addrs->server_addrs[i].addr, addr_ip->ai_addr, addr_ip->ai_addrlen);
         fwd_addrs->server_addrs[i].addrlen = addr_ip->ai_addrlen;
+        freeaddrinfo(addr_ip);
+        rte_spinlock_init(&fwd_addrs->server_addrs[i].lock);
         i++;
-        token = strtok(0, ",");    
+        token = strtok_r(NULL, ",", &save);
+    }
+    /* empty entries, ",," or a trailing ',' */
+    fwd_addrs->servers_len = i;
+    if (i == 0) {
+        log_msg(LOG_ERR,"no upstream for %s\n",domain_suffix);
+        fwd_zone_free(fwd_addrs);
+        return NULL;
     }
     return fwd_addrs;
 }
 
-static int dns_do_remote_query(int remote_sock_t, char *buf,ssize_t len,dns_addr_t *id_addr ) {
+domain_fwd_addrs *fwd_zone_create(const char *zone, const char *addrs) {
+    char buf[BUF_SIZE];
+    uint8_t dname[MAXDOMAINLEN];
 
-    remote_sock_t = remote_sock_t;
-    
-    int remote_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP); 
-    struct timeval tv = {2, 0};
-    
-    if (remote_sock == -1) {
-        return -1;
+    if (strlen(addrs) >= BUF_SIZE || domain_name_parse_wire(dname, zone) == 0) {
+        log_msg(LOG_ERR,"bad forward zone %s@%s\n",zone,addrs);
+        return NULL;
     }
-    if (setsockopt(remote_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {  
-        
-        log_msg(LOG_ERR,"socket option  SO_RCVTIMEO not support\n");  
-        close(remote_sock);
-        return -1;  
-    } 
-     if (-1 == sendto(remote_sock, buf, len, 0,id_addr->addr,id_addr->addrlen)){
-        log_msg(LOG_ERR,"send err\n");
-        close(remote_sock);
-        return -1;
-     }
-     struct sockaddr src_addr;
-     socklen_t src_len = sizeof(struct sockaddr);
-     
-     len = recvfrom(remote_sock, buf, BUF_SIZE, 0, &src_addr, &src_len);
-     if (len <0) {
-         log_msg(LOG_ERR,"recvfrom errno  =%d errinfo =%s\n",errno,strerror(errno));
-    }
-    close(remote_sock);
-    return len;
+    snprintf(buf, sizeof(buf), "%s", addrs);
+    return resolve_dns_servers(zone, buf);
 }
 
-domain_fwd_addrs * find_zone_fwd_addrs(char * domain_name){
-    int i =0;
-    for(;i< g_fwd_zone_num; i++){
-        int zone_len = strlen(zones_fwd_addrs[i]->domain_name);
-        int domain_len = strlen(domain_name);
-        if ((domain_len >= zone_len) && strncmp (domain_name + domain_len - zone_len ,zones_fwd_addrs[i]->domain_name,strlen(zones_fwd_addrs[i]->domain_name)) == 0 ){
-            return zones_fwd_addrs[i];
-        }
-    }
-    return default_fwd_addrs;  
-}
-
-static int  do_dns_handle_remote(int socket, struct rte_mbuf *pkt,uint16_t old_id,uint16_t qtype,char *doamin) {
-    struct ether_hdr *eth_hdr = NULL;
-    struct ipv4_hdr  *ip4_hdr = NULL;
-    struct udp_hdr   *udp_hdr = NULL; 
-    struct ether_addr *src_mac, *dst_mac;
-    uint32_t src_addr, dst_addr;
-    uint16_t src_port, dst_port;
-    char *buf_data;
-    char expired_recrds[512]={0};
-    int data_len = 0;
-
-    eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr*); 
-    ip4_hdr = rte_pktmbuf_mtod_offset(pkt, struct ipv4_hdr *, sizeof(struct ether_hdr));
-    udp_hdr = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr*, sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr));
-    buf_data = rte_pktmbuf_mtod_offset(pkt, char*, sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)+ sizeof(struct udp_hdr));
-
-    src_mac = &(eth_hdr->d_addr);
-    dst_mac = &(eth_hdr->s_addr);
-    src_addr = ip4_hdr->dst_addr;
-    dst_addr = ip4_hdr->src_addr;
-    src_port = udp_hdr->dst_port;
-    dst_port = udp_hdr->src_port;
-
-    // find in cache
-    int status = fwd_cache_lookup(doamin,qtype, buf_data,&data_len,expired_recrds);
-    // not cached 
-    if (status < 0 ){
-    int len  = rte_be_to_cpu_16(udp_hdr->dgram_len) - sizeof(struct udp_hdr);
-
-    domain_fwd_addrs * fwd_addrs = find_zone_fwd_addrs(doamin);
-    int i =0;
-        int retfwd =0;
-    for (;i < fwd_addrs->servers_len; i++){
-            retfwd = dns_do_remote_query(socket,buf_data,len,&fwd_addrs->server_addrs[i]);
-            if (retfwd >0){
-            break;
-        }
+void fwd_zones_walk(void (*fn)(const domain_fwd_addrs *zone, void *arg), void *arg){
+    struct radtree *tree = fwd_zone_tree;
+    struct radnode *n;
+
+    fn(default_fwd_addrs, arg);
+    for (n = radix_first(tree); n; n = radix_next(n)) {
+        fn((const domain_fwd_addrs *)n->elem, arg);
     }
-        // when we get data we del the cache
-        if (retfwd >0 ){
-            if (status == FORWARD_CACHE_DATA_EXPIRED){
-            fwd_cache_del(doamin,qtype);
+}
+
+struct fwd_upstreams_walk_arg {
+    void (*fn)(const domain_fwd_addrs *zone, const dns_addr_t *server, void *arg);
+    void *arg;
+};
+
+static void fwd_upstreams_walk_zone(const domain_fwd_addrs *zone, void *arg){
+    struct fwd_upstreams_walk_arg *w = arg;
+    int i;
+
+    for (i = 0; i < zone->servers_len; i++) {
+        w->fn(zone, &zone->server_addrs[i], w->arg);
+    }
+}
+
+void fwd_upstreams_walk(void (*fn)(const domain_fwd_addrs *zone, const dns_addr_t *server, void *arg), void *arg){
+    struct fwd_upstreams_walk_arg w = {fn, arg};
+
+    fwd_zones_walk(fwd_upstreams_walk_zone, &w);
+}
+
+domain_fwd_addrs *fwd_zone_find(const uint8_t *dname, size_t len){
+    struct radnode *n = radomain_name_find_encloser(fwd_zone_tree, dname, len);
+
+    return n ? (domain_fwd_addrs *)n->elem : default_fwd_addrs;
+}
+
+domain_fwd_addrs * find_zone_fwd_addrs(const char * domain_name){
+    uint8_t dname[MAXDOMAINLEN];
+
+    if (domain_name_parse_wire(dname, domain_name) == 0) {
+        return default_fwd_addrs;
+    }
+    return fwd_zone_find(dname, fwd_dname_len(dname));
+}
+
+int fwd_zone_update_enqueue(struct fwd_zone_update *msg){
+    int res = rte_ring_enqueue(fwd_zone_msg_ring, (void *)msg);
+
+    if (res == -ENOBUFS) {
+        log_msg(LOG_ERR, "fwd_zone_msg_ring is full\n");
+        if (msg->fwd_addrs) {
+            fwd_zone_free(msg->fwd_addrs);
         }
-            
-            fwd_cache_insert(doamin, qtype,buf_data, retfwd);
-            data_len = retfwd;
-        }else{ // use the last record
-             memcpy(buf_data,expired_recrds,data_len);
-        }    
-        
+        free(msg);
+        return -1;
     }
+    return 0;
+}
 
-    
-    if (data_len >0) {
-        
-        struct ether_hdr pkt_eth_hdr;
-        struct ipv4_hdr pkt_ipv4_hdr;
-        struct udp_hdr pkt_udp_hdr;
-  
-        init_eth_header(&pkt_eth_hdr, src_mac, dst_mac, ETHER_TYPE_IPv4);
-        init_ipv4_header(&pkt_ipv4_hdr, src_addr, dst_addr, sizeof(struct udp_hdr) + data_len);
-        init_udp_header(&pkt_udp_hdr, src_port, dst_port, data_len);
+static void fwd_zone_retire(struct radtree *tree, domain_fwd_addrs *zone){
+    struct fwd_zone_retired *r = xalloc_zero(sizeof(*r));
 
-         memcpy(eth_hdr,&pkt_eth_hdr, sizeof(struct ether_hdr));
-         memcpy(ip4_hdr,&pkt_ipv4_hdr, sizeof(struct ipv4_hdr));
-         memcpy(udp_hdr,&pkt_udp_hdr, sizeof(struct udp_hdr));
-         pkt->pkt_len = data_len + sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr);
-         pkt->data_len = pkt->pkt_len;
-         pkt->l2_len = sizeof(struct ether_hdr);
-         pkt->vlan_tci  = ETHER_TYPE_IPv4;
-         pkt->l3_len = sizeof(struct ipv4_hdr); 
+    r->tree = tree;
+    r->zone = zone;
+    r->at = fwd_now_ms();
+    if (fwd_zone_retired_tail) {
+        fwd_zone_retired_tail->next = r;
+    } else {
+        fwd_zone_retired_head = r;
+    }
+    fwd_zone_retired_tail = r;
+}
 
-         // change the fag and  queryId
-         uint16_t ns_old_id = htons(old_id);
-         memcpy(buf_data, &ns_old_id, 2);
-     }
+static void fwd_zone_reclaim(void){
+    struct fwd_zone_retired *r;
+    uint64_t now, delay;
 
-    return data_len;
+    if (fwd_zone_retired_head == NULL) {
+        return;
+    }
+    now = fwd_now_ms();
+    delay = (uint64_t)g_dns_cfg->comm.fwd_timeout + FWD_ZONE_RETIRE_MS;
+    while ((r = fwd_zone_retired_head) != NULL && r->at + delay <= now) {
+        fwd_zone_retired_head = r->next;
+        if (fwd_zone_retired_head == NULL) {
+            fwd_zone_retired_tail = NULL;
+        }
+        radix_tree_delete(r->tree);
+        if (r->zone) {
+            fwd_zone_free(r->zone);
+        }
+        free(r);
+    }
 }
 
+/* a copy of the zone tree with msg applied, published in place of the old one */
+static void fwd_zone_apply(struct fwd_zone_update *msg){
+    struct radtree *old = fwd_zone_tree;
+    struct radtree *tree;
+    struct radnode *n;
+    domain_fwd_addrs *replaced = NULL;
+    uint8_t dname[MAXDOMAINLEN];
+    const char *name = msg->action == FWD_ZONE_ADD ? msg->fwd_addrs->domain_name : msg->zone;
+
+    if (domain_name_parse_wire(dname, name) == 0) {
+        log_msg(LOG_ERR, "bad forward zone %s\n", name);
+        goto err;
+    }
+    n = radomain_name_search(old, dname, fwd_dname_len(dname));
+    if (n) {
+        replaced = n->elem;
+    } else if (msg->action == FWD_ZONE_DEL) {
+        log_msg(LOG_ERR, "forward zone %s does not exist\n", name);
+        return;
+    }
 
+    tree = radix_tree_create();
+    for (n = radix_first(old); n; n = radix_next(n)) {
+        if (n->elem != replaced) {
+            fwd_zone_tree_insert(tree, n->elem);
+        }
+    }
+    if (msg->action == FWD_ZONE_ADD) {
+        fwd_zone_tree_insert(tree, msg->fwd_addrs);
+    }
+    /* the tree is complete before anyone can see it */
+    rte_smp_wmb();
+    fwd_zone_tree = tree;
+    fwd_zone_retire(old, replaced);
+    log_msg(LOG_INFO, "forward zone %s %s\n", name, msg->action == FWD_ZONE_ADD ? "set" : "deleted");
+    return;
+
+err:
+    if (msg->action == FWD_ZONE_ADD) {
+        fwd_zone_free(msg->fwd_addrs);
+    }
+}
 
-int dns_handle_remote(struct rte_mbuf *pkt,uint16_t old_id,uint16_t qtype,char *domain){
+// the master core call this func
+void fwd_zone_msg_master_process(void){
+    struct fwd_zone_update *msgs[FWD_ZONE_BURST];
+    unsigned i, num;
+
+    num = rte_ring_dequeue_burst(fwd_zone_msg_ring, (void **)msgs, FWD_ZONE_BURST);
+    for (i = 0; i < num; i++) {
+        fwd_zone_apply(msgs[i]);
+        free(msgs[i]);
+    }
+    fwd_zone_reclaim();
+}
+
+static int fwd_pkt_enqueue(struct rte_mbuf *pkt,uint16_t old_id,uint16_t qtype,const char *domain,int refresh){
 
     struct fwd_pkt_input *etm = calloc(sizeof(struct fwd_pkt_input),1);
     if (!etm){
@@ -495,8 +489,14 @@ int dns_handle_remote(struct rte_mbuf *pkt,uint16_t old_id,uint16_t qtype,char *
     etm->pkt = pkt;
     etm->old_id = old_id;
     etm->qtype = qtype;
+    etm->refresh = refresh;
     memcpy(etm->domain_name,domain,strlen(domain));
-    int ret = rte_ring_mp_enqueue(fwd_pkt_to_process_ring, (void*)etm);
+    /* identical queries meet on one thread, which sends them upstream once */
+    uint32_t hash = qtype;
+    for (; *domain; domain++) {
+        hash = hash * 31 + tolower((unsigned char)*domain);
+    }
+    int ret = rte_ring_mp_enqueue(fwd_pkt_to_process_rings[(hash * 2654435761U) % fwd_rings_num], (void*)etm);
     if (ret != 0) {
         rte_pktmbuf_free(pkt);
         free(etm);
@@ -505,6 +505,23 @@ int dns_handle_remote(struct rte_mbuf *pkt,uint16_t old_id,uint16_t qtype,char *
     return 0;   
 }
 
+int dns_handle_remote(struct rte_mbuf *pkt,uint16_t old_id,uint16_t qtype,char *domain){
+    return fwd_pkt_enqueue(pkt, old_id, qtype, domain, 0);
+}
+
+int dns_handle_refresh(struct rte_mbuf *pkt,uint16_t qtype,const char *domain){
+    struct rte_mbuf *copy = rte_pktmbuf_alloc(pkt->pool);
+
+    if (!copy){
+        return -1;
+    }
+    /* only the headers and the question are used, the forward thread rebuilds the rest */
+    memcpy(rte_pktmbuf_mtod(copy, char *), rte_pktmbuf_mtod(pkt, char *), rte_pktmbuf_data_len(pkt));
+    copy->data_len = rte_pktmbuf_data_len(pkt);
+    copy->pkt_len = copy->data_len;
+    return fwd_pkt_enqueue(copy, 0, qtype, domain, 1);
+}
+
 uint16_t fwd_pkts_dequeue(struct rte_mbuf **mbufs,uint16_t pkts_len)
 {
 
@@ -517,97 +534,653 @@ uint16_t fwd_pkts_dequeue(struct rte_mbuf **mbufs,uint16_t pkts_len)
 }
 
 
-static void *thread_fwd_pkt_process(void *socket){
-    
-     log_msg(LOG_INFO,"Starting thread_fwd_pkt_process \n");
-     struct fwd_pkt_input *etm ;
+uint64_t fwd_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t fwd_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint32_t fwd_pending_hash(int sock, uint16_t qid) {
+    return ((((uint32_t)sock << 16) | qid) * 2654435761U) >> (32 - FWD_PENDING_HASH_BITS);
+}
+
+static struct fwd_pending *fwd_pending_find(struct fwd_thread *th, int sock, uint16_t qid) {
+    struct fwd_pending *p = th->hash[fwd_pending_hash(sock, qid)];
+
+    while (p && (p->sock != sock || p->qid != qid)) {
+        p = p->hash_next;
+    }
+    return p;
+}
+
+static void fwd_pending_unhash(struct fwd_thread *th, struct fwd_pending *p) {
+    struct fwd_pending **pp = &th->hash[fwd_pending_hash(p->sock, p->qid)];
+
+    while (*pp != p) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = p->hash_next;
+}
+
+static void fwd_heap_swap(struct fwd_thread *th, int i, int j) {
+    struct fwd_pending *tmp = th->heap[i];
+
+    th->heap[i] = th->heap[j];
+    th->heap[j] = tmp;
+    th->heap[i]->heap_idx = i;
+    th->heap[j]->heap_idx = j;
+}
+
+static void fwd_heap_up(struct fwd_thread *th, int i) {
+    while (i > 0 && th->heap[(i - 1) / 2]->deadline > th->heap[i]->deadline) {
+        fwd_heap_swap(th, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void fwd_heap_down(struct fwd_thread *th, int i) {
+    for (;;) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < th->heap_len && th->heap[l]->deadline < th->heap[min]->deadline) {
+            min = l;
+        }
+        if (r < th->heap_len && th->heap[r]->deadline < th->heap[min]->deadline) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+        fwd_heap_swap(th, i, min);
+        i = min;
+    }
+}
+
+static void fwd_heap_remove(struct fwd_thread *th, struct fwd_pending *p) {
+    int i = p->heap_idx;
 
-     int * remote_sock  = (int *)socket;
+    th->heap_len--;
+    if (i != th->heap_len) {
+        fwd_heap_swap(th, i, th->heap_len);
+        fwd_heap_up(th, i);
+        fwd_heap_down(th, th->heap[i]->heap_idx);
+    }
+}
 
-     while (1){
+static void fwd_pending_free(struct fwd_thread *th, struct fwd_pending *p) {
+    struct fwd_pending **pp = &th->keys[p->key_hash & FWD_PENDING_HASH_MASK];
 
-        int ret = rte_ring_mc_dequeue(fwd_pkt_to_process_ring, (void **)&etm);
-        if (ret != 0){
-            //100ms
-            usleep(10);
+    while (*pp != p) {
+        pp = &(*pp)->key_next;
+    }
+    *pp = p->key_next;
+    fwd_pending_unhash(th, p);
+    fwd_heap_remove(th, p);
+    free(p->stale);
+    p->stale = NULL;
+    while (p->etm != NULL) {
+        struct fwd_pkt_input *etm = p->etm;
+
+        p->etm = etm->next;
+        free(etm);
+    }
+    p->hash_next = th->free_list;
+    th->free_list = p;
+}
+
+static char *fwd_pkt_dns_data(struct rte_mbuf *pkt) {
+    return rte_pktmbuf_mtod_offset(pkt, char *, packet_udp_data_offset(pkt));
+}
+
+static int fwd_pkt_room(struct rte_mbuf *pkt) {
+    return pkt->buf_len - pkt->data_off - packet_udp_data_offset(pkt);
+}
+
+/* the lowercased qname of a question, the cache key */
+static uint16_t fwd_pkt_qname(const uint8_t *data, int question_len, uint8_t *qname) {
+    int i, len = question_len - 2 * sizeof(uint16_t);
+
+    for (i = 0; i < len; i++) {
+        qname[i] = tolower(data[DNS_HEAD_SIZE + i]);
+    }
+    return len;
+}
+
+uint32_t fwd_query_edns_key(const uint8_t *data, int len, int question_len) {
+    int opt = fwd_query_opt(data, len, question_len);
+
+    if (opt < 0) {
+        return 0;
+    }
+    /* the DO bit is the top bit of the flags, after the extended rcode and version */
+    return FWD_EDNS_OPT | (data[opt + 4] & 0x80 ? FWD_EDNS_DO : 0) | (uint32_t)data[opt] << 8 | data[opt + 1];
+}
+
+/* the query in flight with the same question (the qname case aside), edns and zone */
+static struct fwd_pending *fwd_pending_key_find(struct fwd_thread *th, uint32_t key_hash, uint32_t edns_key,
+    const uint8_t *question, int question_len, const domain_fwd_addrs *fwd_addrs) {
+    struct fwd_pending *p = th->keys[key_hash & FWD_PENDING_HASH_MASK];
+    int qname_len = question_len - 2 * sizeof(uint16_t);
+    int i;
+
+    for (; p != NULL; p = p->key_next) {
+        const uint8_t *q = (const uint8_t *)fwd_pkt_dns_data(p->etm->pkt) + DNS_HEAD_SIZE;
+
+        if (p->key_hash != key_hash || p->edns_key != edns_key || p->ups.fwd_addrs != fwd_addrs ||
+            p->question_len != question_len ||
+            memcmp(q + qname_len, question + qname_len, 2 * sizeof(uint16_t)) != 0) {
             continue;
         }
-        int  fwd_len = do_dns_handle_remote(*remote_sock,etm->pkt,etm->old_id,etm->qtype,etm->domain_name);
-        
-        if (unlikely(fwd_len <= 0)){
-            log_msg(LOG_ERR,"can not get rte_mbuf from do_dns_handle_remote\n");
-            rte_pktmbuf_free(etm->pkt);
-            free(etm); 
-        }else{
-            int ret = rte_ring_mp_enqueue(master_fwd_pkt_ex_ring, (void*)etm->pkt);
-            if (ret != 0) {
-                log_msg(LOG_ERR,"can not en queue  master_fwd_pkt_ex_ring\n");
-                rte_pktmbuf_free(etm->pkt);      
-            }
-            
-            free(etm); 
+        for (i = 0; i < qname_len && tolower(q[i]) == tolower(question[i]); i++) {
+        }
+        if (i == qname_len) {
+            return p;
         }
     }
-     return NULL;
+    return NULL;
+}
+
+static void fwd_pkt_reply(struct rte_mbuf *pkt, uint16_t old_id, int data_len) {
+    uint16_t ns_old_id = htons(old_id);
+
+    memcpy(fwd_pkt_dns_data(pkt), &ns_old_id, 2);
+    packet_udp_reply_build(pkt, data_len);
+    if (rte_ring_mp_enqueue(master_fwd_pkt_ex_ring, (void *)pkt) != 0) {
+        log_msg(LOG_ERR, "can not en queue  master_fwd_pkt_ex_ring\n");
+        rte_pktmbuf_free(pkt);
+    }
+}
 
+/* wire length of the question of a query kdns already parsed, 0 if unusable */
+int fwd_question_len(const uint8_t *data, int len) {
+    int pos = DNS_HEAD_SIZE;
+
+    while (pos < len && data[pos] != 0) {
+        if (data[pos] & 0xc0) {
+            return 0;
+        }
+        pos += data[pos] + 1;
+    }
+    if (pos + 1 - DNS_HEAD_SIZE > MAXDOMAINLEN) {
+        return 0;
+    }
+    pos += 1 + 2 * sizeof(uint16_t);
+    return pos <= len ? pos - DNS_HEAD_SIZE : 0;
 }
 
-static void do_fwd_cache_expired_cleanup(int idx_start, int idx_end){
+int fwd_query_opt(const uint8_t *data, int len, int question_len) {
+    int records = (data[6] << 8 | data[7]) + (data[8] << 8 | data[9]) + (data[10] << 8 | data[11]);
+    int pos = DNS_HEAD_SIZE + question_len;
+    int owner, i;
 
-    domin_fwd_cache_st *pre;
-    domin_fwd_cache_st *node;
-    domin_fwd_cache_st *node_del;
-    int idx = idx_start;
-    time_t time_now = time(NULL);
-    int del_num = 0;
-    int all_num = 0;
-    
-    log_msg(LOG_INFO,"do_fwd_cache_expired_cleanup  enter\n");
-    
-    rte_rwlock_write_lock(&fwd_cache_list_lock);
-    for (;idx < idx_end ;idx ++){
-        pre = node = g_fwd_cache_hash_list[idx];
-
-        while(node){ 
-            all_num++;
-            // 60S time_expired,we del it 3600s later
-            if (node->time_expired + 3600 < time_now){
-                pre->next = node->next;
-                if (node == g_fwd_cache_hash_list[idx]){
-                    g_fwd_cache_hash_list[idx] = node->next;
-                }
-                node_del = node;
-                node = node->next;
-                free(node_del);
-                del_num++;
+    for (i = 0; i < records; i++) {
+        owner = pos;
+        while (pos < len && data[pos] != 0 && (data[pos] & 0xc0) != 0xc0) {
+            pos += data[pos] + 1;
+        }
+        pos += (pos < len && data[pos] != 0) ? 2 : 1;
+        if (pos + 10 > len) {
+            return -1;
+        }
+        if (data[owner] == 0 && (data[pos] << 8 | data[pos + 1]) == TYPE_OPT) {
+            return pos + 2;
+        }
+        pos += 10 + (data[pos + 8] << 8 | data[pos + 9]);
+    }
+    return -1;
+}
+
+/* the response must carry our question back, the qname case aside */
+int fwd_question_match(const uint8_t *query, const uint8_t *resp, int resp_len, int qlen) {
+    int i;
+
+    if (resp_len < DNS_HEAD_SIZE + qlen || resp[4] != 0 || resp[5] != 1) {
+        return 0;
+    }
+    for (i = DNS_HEAD_SIZE; i < DNS_HEAD_SIZE + qlen; i++) {
+        if (tolower(query[i]) != tolower(resp[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int fwd_upstreams_match(const struct fwd_upstreams *u, uint32_t ip, uint16_t port) {
+    int i;
+
+    for (i = 0; i < u->next; i++) {
+        const struct sockaddr_in *addr = (const struct sockaddr_in *)u->fwd_addrs->server_addrs[u->order[i]].addr;
+
+        if (addr->sin_addr.s_addr == ip && addr->sin_port == port) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint32_t fwd_rand(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+const char *fwd_server_name(const dns_addr_t *server, char *buf, size_t len) {
+    const struct sockaddr_in *addr = (const struct sockaddr_in *)server->addr;
+    char ip[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    snprintf(buf, len, "%s:%u", ip, ntohs(addr->sin_port));
+    return buf;
+}
+
+/* a down upstream whose time came is probed by one query only */
+static int fwd_server_probe_claim(dns_addr_t *server, uint64_t now) {
+    int claimed = 0;
+
+    rte_spinlock_lock(&server->lock);
+    if (server->down_until != 0 && server->down_until <= now) {
+        server->down_until = now + FWD_SERVER_DOWN_MS;
+        claimed = 1;
+    }
+    rte_spinlock_unlock(&server->lock);
+    return claimed;
+}
+
+/*
+ * Order the upstreams of a query by expected latency: the smoothed rtt,
+ * doubled for every failure in a row, down upstreams last. Upstreams not
+ * measured yet come first. One query in FWD_PROBE_RATE, and one per
+ * FWD_SERVER_DOWN_MS for every down upstream, asks another upstream first
+ * so its rtt stays known.
+ */
+void fwd_upstreams_order(struct fwd_upstreams *u, domain_fwd_addrs *fwd_addrs, uint32_t *rand, uint64_t now) {
+    uint64_t score[FWD_MAX_UPSTREAMS];
+    int i, j, probe = -1;
+
+    u->fwd_addrs = fwd_addrs;
+    u->next = 0;
+    u->num = RTE_MIN(fwd_addrs->servers_len, FWD_MAX_UPSTREAMS);
+    for (i = 0; i < u->num; i++) {
+        dns_addr_t *server = &fwd_addrs->server_addrs[i];
+        uint64_t s = (uint64_t)server->srtt << RTE_MIN(server->fails, 16U);
+
+        if (server->down_until != 0) {
+            if (probe < 0 && fwd_server_probe_claim(server, now)) {
+                probe = i;
+            }
+            s = UINT64_MAX;
+        }
+        for (j = i; j > 0 && score[j - 1] > s; j--) {
+            score[j] = score[j - 1];
+            u->order[j] = u->order[j - 1];
+        }
+        score[j] = s;
+        u->order[j] = i;
+    }
+    if (probe < 0 && u->num > 1 && fwd_rand(rand) % FWD_PROBE_RATE == 0) {
+        j = 1 + fwd_rand(rand) % (u->num - 1);
+        if (score[j] != UINT64_MAX) {
+            probe = u->order[j];
+        }
+    }
+    if (probe >= 0) {
+        for (j = 0; u->order[j] != probe; j++) {
+        }
+        for (; j > 0; j--) {
+            u->order[j] = u->order[j - 1];
+        }
+        u->order[0] = probe;
+    }
+}
+
+/*
+ * Account a finished query to the upstreams it asked: the one that
+ * answered (at position answered, -1 if none did) gets an rtt sample. The
+ * others get the time they had as a lower bound, and a failure if that
+ * was plenty.
+ */
+void fwd_upstreams_account(struct fwd_upstreams *u, int answered, uint64_t now_us) {
+    char name[64];
+    int i;
+
+    for (i = 0; i < u->next; i++) {
+        dns_addr_t *server = &u->fwd_addrs->server_addrs[u->order[i]];
+        uint64_t elapsed = now_us - u->sent_us[i];
+        uint32_t rtt = RTE_MIN(elapsed, (uint64_t)UINT32_MAX);
+
+        rte_spinlock_lock(&server->lock);
+        if (i == answered) {
+            server->answers++;
+            server->srtt = server->srtt ? (7 * (uint64_t)server->srtt + rtt) / 8 : rtt;
+            server->fails = 0;
+            if (server->down_until != 0) {
+                server->down_until = 0;
+                log_msg(LOG_INFO, "upstream %s of %s is up\n",
+                    fwd_server_name(server, name, sizeof(name)), u->fwd_addrs->domain_name);
+            }
+        } else {
+            int late = answered < 0 ||
+                elapsed >= RTE_MAX(4 * (uint64_t)server->srtt, (uint64_t)FWD_SERVER_LATE_MS * 1000);
+
+            /* its rtt is at least what it had so far */
+            if (rtt > server->srtt) {
+                server->srtt = (7 * (uint64_t)server->srtt + rtt) / 8;
+            }
+            if (!late) {
+                rte_spinlock_unlock(&server->lock);
                 continue;
-            }      
-            pre = node;
-            node = node->next;
+            }
+            server->timeouts++;
+            server->fails++;
+            if (server->fails >= FWD_SERVER_MAX_FAILS && server->down_until == 0) {
+                server->down_until = now_us / 1000 + FWD_SERVER_DOWN_MS;
+                log_msg(LOG_ERR, "upstream %s of %s is down\n",
+                    fwd_server_name(server, name, sizeof(name)), u->fwd_addrs->domain_name);
+            }
         }
+        rte_spinlock_unlock(&server->lock);
     }
-    rte_rwlock_write_unlock(&fwd_cache_list_lock);   
-    log_msg(LOG_INFO,"idx[%d : %d ]: %d record scaned and %d deleted\n",idx_start,idx_end,all_num,del_num);
 }
 
-static void *thread_fwd_cache_expired_cleanup(void *arg){
+dns_addr_t *fwd_upstreams_next(struct fwd_upstreams *u) {
+    dns_addr_t *addr;
 
-     int last_idx = 0;
-     int idx_start,idx_end;
-     while (1){
-        sleep(600);
-        idx_start = last_idx;
-        if (idx_start + FORWARD_CACHE_TIME_OUT_SCAN_NUM > FORWARD_HASH_SIZE){
-            idx_end = FORWARD_HASH_SIZE;
-            last_idx = 0;
-         }else{
-             idx_end = idx_start + FORWARD_CACHE_TIME_OUT_SCAN_NUM;
-             last_idx = idx_end;       
-         }     
-         do_fwd_cache_expired_cleanup( idx_start,idx_end );     
+    if (u->next >= u->num) {
+        return NULL;
     }
-     return NULL;
+    addr = &u->fwd_addrs->server_addrs[u->order[u->next]];
+    u->sent_us[u->next++] = fwd_now_us();
+    rte_spinlock_lock(&addr->lock);
+    addr->queries++;
+    rte_spinlock_unlock(&addr->lock);
+    return addr;
+}
+
+/* ask the next upstream and schedule the next hedge or the final timeout */
+static void fwd_pending_send(struct fwd_thread *th, struct fwd_pending *p, uint64_t now) {
+    char *buf_data = fwd_pkt_dns_data(p->etm->pkt);
+    dns_addr_t *addr;
 
+    while ((addr = fwd_upstreams_next(&p->ups)) != NULL) {
+        if (sendto(th->socks[p->sock], buf_data, p->query_len, 0, addr->addr, addr->addrlen) < 0) {
+            log_msg(LOG_ERR, "send to upstream of %s err: %s\n", p->ups.fwd_addrs->domain_name, strerror(errno));
+            continue;
+        }
+        if (th->hedge_ms != 0) {
+            break;
+        }
+    }
+    if (p->ups.next < p->ups.num && now + th->hedge_ms < p->expire) {
+        p->deadline = now + th->hedge_ms;
+    } else {
+        p->deadline = p->expire;
+    }
 }
 
+static void fwd_query_start(struct fwd_thread *th, struct fwd_pkt_input *etm, uint64_t now) {
+    struct rte_mbuf *pkt = etm->pkt;
+    struct udp_hdr *udp_hdr;
+    struct fwd_pending *p;
+    uint8_t *buf_data = (uint8_t *)fwd_pkt_dns_data(pkt);
+    uint8_t qname[MAXDOMAINLEN];
+    uint8_t data[FWD_CACHE_DATA_LEN];
+    uint16_t data_len = 0, qname_len;
+    domain_fwd_addrs *fwd_addrs;
+    int query_len, question_len, reply_len;
+    uint32_t key_hash, edns_key;
+    uint16_t ns_qid;
+    int status;
+
+    udp_hdr = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr *, packet_udp_data_offset(pkt) - sizeof(struct udp_hdr));
+    query_len = rte_be_to_cpu_16(udp_hdr->dgram_len) - sizeof(struct udp_hdr);
+    question_len = fwd_question_len(buf_data, query_len);
+    if (question_len == 0) {
+        rte_pktmbuf_free(pkt);
+        free(etm);
+        return;
+    }
+    if (etm->refresh) {
+        /* a bare query, what followed the question was overwritten by the cached answer */
+        memset(buf_data + 2, 0, DNS_HEAD_SIZE - 2);
+        buf_data[2] = 0x01;
+        buf_data[5] = 1;
+        query_len = DNS_HEAD_SIZE + question_len;
+    }
 
+    qname_len = fwd_pkt_qname(buf_data, question_len, qname);
+    edns_key = fwd_query_edns_key(buf_data, query_len, question_len);
+    status = (edns_key & FWD_EDNS_DO) ? FORWARD_CACHE_NOT_FIND :
+        fwd_cache_get(qname, qname_len, etm->qtype, data, &data_len, NULL);
+    if (!etm->refresh && status == FORWARD_CACHE_FIND && (reply_len =
+        fwd_cache_splice(buf_data, question_len - 4, data, data_len, fwd_pkt_room(pkt), edns_key != 0)) > 0) {
+        fwd_pkt_reply(pkt, etm->old_id, reply_len);
+        free(etm);
+        return;
+    }
+
+    fwd_addrs = fwd_zone_find(qname, qname_len);
+    key_hash = rte_jhash(qname, qname_len, etm->qtype ^ edns_key) ^ (uint32_t)((uintptr_t)fwd_addrs >> 4);
+    p = fwd_pending_key_find(th, key_hash, edns_key, buf_data + DNS_HEAD_SIZE, question_len, fwd_addrs);
+    if (p != NULL) {
+        if (etm->refresh) {
+            rte_pktmbuf_free(pkt);
+            free(etm);
+            return;
+        }
+        etm->next = p->etm->next;
+        p->etm->next = etm;
+        return;
+    }
+
+    p = th->free_list;
+    if (p == NULL) {
+        log_msg(LOG_ERR, "too many forwarded queries in flight, %s dropped\n", etm->domain_name);
+        rte_pktmbuf_free(pkt);
+        free(etm);
+        return;
+    }
+    th->free_list = p->hash_next;
+
+    p->etm = etm;
+    etm->next = NULL;
+    p->key_hash = key_hash;
+    p->edns_key = edns_key;
+    p->key_next = th->keys[key_hash & FWD_PENDING_HASH_MASK];
+    th->keys[key_hash & FWD_PENDING_HASH_MASK] = p;
+    fwd_upstreams_order(&p->ups, fwd_addrs, &th->rand, now);
+    p->query_len = query_len;
+    p->question_len = question_len;
+    /* a refresh keeps the answer it replaces too, for the clients that join it */
+    if (status == FORWARD_CACHE_DATA_EXPIRED || (etm->refresh && status == FORWARD_CACHE_FIND)) {
+        p->stale = xalloc(data_len);
+        p->stale_len = data_len;
+        memcpy(p->stale, data, data_len);
+    }
+
+    /* a fresh random id per query keeps spoofed answers out */
+    p->sock = th->next_sock;
+    th->next_sock = (th->next_sock + 1) % FWD_SOCKS_PER_THREAD;
+    do {
+        p->qid = (uint16_t)fwd_rand(&th->rand);
+    } while (fwd_pending_find(th, p->sock, p->qid) != NULL);
+    ns_qid = htons(p->qid);
+    memcpy(buf_data, &ns_qid, 2);
+
+    p->hash_next = th->hash[fwd_pending_hash(p->sock, p->qid)];
+    th->hash[fwd_pending_hash(p->sock, p->qid)] = p;
+
+    p->expire = now + th->timeout_ms;
+    fwd_pending_send(th, p, now);
+    p->heap_idx = th->heap_len;
+    th->heap[th->heap_len++] = p;
+    fwd_heap_up(th, p->heap_idx);
+}
+
+/* answer the query and everyone waiting on it, each with its own id and question */
+static void fwd_query_answer(struct fwd_thread *th, struct fwd_pending *p, int answered, const uint8_t *resp, int len) {
+    struct fwd_pkt_input *etm;
+    uint8_t qname[MAXDOMAINLEN];
+
+    fwd_upstreams_account(&p->ups, answered, fwd_now_us());
+    if (!(p->edns_key & FWD_EDNS_DO)) {
+        fwd_cache_insert(qname, fwd_pkt_qname((uint8_t *)fwd_pkt_dns_data(p->etm->pkt), p->question_len, qname),
+            p->etm->qtype, resp, len);
+    }
+    for (etm = p->etm; etm != NULL; etm = etm->next) {
+        uint8_t *buf_data = (uint8_t *)fwd_pkt_dns_data(etm->pkt);
+        int data_len;
+
+        if (etm->refresh) {
+            rte_pktmbuf_free(etm->pkt);
+            continue;
+        }
+        /* the upstream's OPT is for this edns, the waiters all share it */
+        data_len = fwd_cache_splice(buf_data, p->question_len - 4, resp, len, fwd_pkt_room(etm->pkt), 0);
+        if (data_len < 0) {
+            /* keep our question, the client retries over tcp */
+            memcpy(buf_data + 2, resp + 2, 2);
+            buf_data[2] |= 0x02;
+            memset(buf_data + 6, 0, 6);
+            data_len = DNS_HEAD_SIZE + p->question_len;
+        }
+        fwd_pkt_reply(etm->pkt, etm->old_id, data_len);
+        etm->pkt = NULL;
+    }
+    fwd_pending_free(th, p);
+}
+
+static void fwd_sock_drain(struct fwd_thread *th, int sock) {
+    struct sockaddr_in from;
+    socklen_t from_len;
+    struct fwd_pending *p;
+    ssize_t len;
+    int answered;
+
+    for (;;) {
+        from_len = sizeof(from);
+        len = recvfrom(th->socks[sock], th->buf, sizeof(th->buf), 0, (struct sockaddr *)&from, &from_len);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_msg(LOG_ERR, "recvfrom errno  =%d errinfo =%s\n", errno, strerror(errno));
+            }
+            return;
+        }
+        if (len < DNS_HEAD_SIZE || from.sin_family != AF_INET) {
+            continue;
+        }
+        p = fwd_pending_find(th, sock, ((uint16_t)th->buf[0] << 8) | th->buf[1]);
+        if (p == NULL || (answered = fwd_upstreams_match(&p->ups, from.sin_addr.s_addr, from.sin_port)) < 0 ||
+            !fwd_question_match((uint8_t *)fwd_pkt_dns_data(p->etm->pkt), th->buf, len, p->question_len)) {
+            continue;
+        }
+        fwd_query_answer(th, p, answered, th->buf, len);
+    }
+}
+
+static void fwd_timers_run(struct fwd_thread *th, uint64_t now) {
+    struct fwd_pkt_input *etm;
+    struct fwd_pending *p;
+    int len;
+
+    while (th->heap_len > 0 && th->heap[0]->deadline <= now) {
+        p = th->heap[0];
+        if (now < p->expire && p->ups.next < p->ups.num) {
+            fwd_pending_send(th, p, now);
+            fwd_heap_down(th, 0);
+            continue;
+        }
+        fwd_upstreams_account(&p->ups, -1, fwd_now_us());
+        if (p->stale == NULL) {
+            log_msg(LOG_ERR, "forward %s timed out\n", p->etm->domain_name);
+        }
+        for (etm = p->etm; etm != NULL; etm = etm->next) {
+            if (!etm->refresh && p->stale != NULL && (len = fwd_cache_splice((uint8_t *)fwd_pkt_dns_data(etm->pkt),
+                    p->question_len - 4, (uint8_t *)p->stale, p->stale_len, fwd_pkt_room(etm->pkt),
+                    p->edns_key != 0)) > 0) {
+                // use the last record
+                fwd_pkt_reply(etm->pkt, etm->old_id, len);
+            } else {
+                rte_pktmbuf_free(etm->pkt);
+            }
+        }
+        fwd_pending_free(th, p);
+    }
+}
+
+static struct fwd_thread *fwd_thread_create(struct rte_ring *ring) {
+    struct fwd_thread *th = xalloc_zero(sizeof(struct fwd_thread));
+    struct epoll_event ev;
+    int i;
+
+    th->ring = ring;
+    th->timeout_ms = g_dns_cfg->comm.fwd_timeout;
+    th->hedge_ms = g_dns_cfg->comm.fwd_hedge_timeout;
+    th->rand = (uint32_t)time(NULL) ^ ((uintptr_t)th >> 4) ^ (uint32_t)rte_rdtsc();
+    if (th->rand == 0) {
+        th->rand = 1;
+    }
+    for (i = FWD_MAX_PENDING - 1; i >= 0; i--) {
+        th->pendings[i].hash_next = th->free_list;
+        th->free_list = &th->pendings[i];
+    }
+
+    th->epfd = epoll_create1(0);
+    if (th->epfd < 0) {
+        log_msg(LOG_ERR, "epoll_create1 err: %s\n", strerror(errno));
+        exit(-1);
+    }
+    for (i = 0; i < FWD_SOCKS_PER_THREAD; i++) {
+        th->socks[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+        if (th->socks[i] < 0) {
+            log_msg(LOG_ERR, "create forward socket err: %s\n", strerror(errno));
+            exit(-1);
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        if (epoll_ctl(th->epfd, EPOLL_CTL_ADD, th->socks[i], &ev) < 0) {
+            log_msg(LOG_ERR, "epoll_ctl err: %s\n", strerror(errno));
+            exit(-1);
+        }
+    }
+    return th;
+}
+
+static void *thread_fwd_pkt_process(void *arg){
+    struct fwd_thread *th = (struct fwd_thread *)arg;
+    struct fwd_pkt_input *etms[FWD_BURST];
+    struct epoll_event events[FWD_SOCKS_PER_THREAD];
+    unsigned nb, i;
+    int nev, timeout, j;
+    uint64_t now;
+
+    log_msg(LOG_INFO,"Starting thread_fwd_pkt_process \n");
+    while (1){
+        now = fwd_now_ms();
+        nb = rte_ring_sc_dequeue_burst(th->ring, (void **)etms, FWD_BURST);
+        for (i = 0; i < nb; i++) {
+            fwd_query_start(th, etms[i], now);
+        }
+
+        /* the ring can not wake us, so never sleep longer than FWD_POLL_MS */
+        timeout = nb > 0 ? 0 : FWD_POLL_MS;
+        if (timeout > 0 && th->heap_len > 0 && th->heap[0]->deadline < now + timeout) {
+            timeout = th->heap[0]->deadline > now ? (int)(th->heap[0]->deadline - now) : 0;
+        }
+        nev = epoll_wait(th->epfd, events, FWD_SOCKS_PER_THREAD, timeout);
+        for (j = 0; j < nev; j++) {
+            fwd_sock_drain(th, events[j].data.u32);
+        }
+        fwd_timers_run(th, fwd_now_ms());
+    }
+    return NULL;
+}
@@ -3,13 +3,31 @@
 #ifndef	_FORWARD_H_
 #define	_FORWARD_H_
 
+#include <stdint.h>
 #include <arpa/inet.h>
+#include <rte_spinlock.h>
 
 #define FWD_MAX_DOMAIN_NAME_LEN  128
 
+#define FWD_DEF_TIMEOUT          2000   /* ms */
+#define FWD_DEF_HEDGE_TIMEOUT    300    /* ms */
+
+#define FWD_MAX_UPSTREAMS        8      /* asked per query at most */
+
+#define FWD_MODE_SOCKET          0      /* forward threads, kernel sockets */
+#define FWD_MODE_DPDK            1      /* the data lcores, out of the port, see fwd_dpdk.h */
+
 typedef struct {
    struct sockaddr *addr;
    socklen_t addrlen;
+   /* health, kept by the forward threads */
+   rte_spinlock_t lock;
+   uint32_t srtt;           /* us, smoothed rtt, 0: not measured yet */
+   uint32_t fails;          /* queries left unanswered in a row */
+   uint64_t down_until;     /* ms, 0: up; probed again once it passed */
+   uint64_t queries;
+   uint64_t answers;
+   uint64_t timeouts;
  } dns_addr_t;
 
 typedef struct {
@@ -18,11 +36,72 @@ typedef struct {
    dns_addr_t *server_addrs;
  } domain_fwd_addrs;
 
+#define FWD_ZONE_ADD             0      /* set, replacing a zone of the same name */
+#define FWD_ZONE_DEL             1
+
+/* a forward zone change from the api, applied by the master lcore */
+struct fwd_zone_update {
+   int action;
+   domain_fwd_addrs *fwd_addrs;             /* FWD_ZONE_ADD, from fwd_zone_create */
+   char zone[FWD_MAX_DOMAIN_NAME_LEN];      /* FWD_ZONE_DEL */
+ };
+
+/* the upstreams of one forwarded query, in the order they are asked */
+struct fwd_upstreams {
+   domain_fwd_addrs *fwd_addrs;
+   int next;                /* upstreams before it in order have been asked */
+   int num;
+   uint8_t order[FWD_MAX_UPSTREAMS];     /* server_addrs index, best first */
+   uint64_t sent_us[FWD_MAX_UPSTREAMS];
+ };
+
+uint64_t fwd_now_ms(void);
+uint64_t fwd_now_us(void);
+uint32_t fwd_rand(uint32_t *state);
+/* "ip:port" of an upstream, for logs */
+const char *fwd_server_name(const dns_addr_t *server, char *buf, size_t len);
+/* wire length of the question of a query kdns already parsed, 0 if unusable */
+int fwd_question_len(const uint8_t *data, int len);
+/*
+ * Offset in data of the udp size (the class) of the query's OPT record,
+ * after the question_len bytes of question; -1 if it has none.
+ */
+int fwd_query_opt(const uint8_t *data, int len, int question_len);
+/*
+ * What the upstream answer depends on besides the question: FWD_EDNS_OPT,
+ * FWD_EDNS_DO and the udp size of the query's OPT record, 0 without one.
+ */
+#define FWD_EDNS_OPT    (1U << 31)
+#define FWD_EDNS_DO     (1U << 23)
+uint32_t fwd_query_edns_key(const uint8_t *data, int len, int question_len);
+/* the response must carry our question back, the qname case aside */
+int fwd_question_match(const uint8_t *query, const uint8_t *resp, int resp_len, int qlen);
+
+void fwd_upstreams_order(struct fwd_upstreams *u, domain_fwd_addrs *fwd_addrs, uint32_t *rand, uint64_t now);
+/* the next upstream to ask, NULL once all were asked */
+dns_addr_t *fwd_upstreams_next(struct fwd_upstreams *u);
+/* position in order of the upstream (network byte order) an answer came from, -1 if not asked */
+int fwd_upstreams_match(const struct fwd_upstreams *u, uint32_t ip, uint16_t port);
+/* answered: the position that answered, -1 if none did */
+void fwd_upstreams_account(struct fwd_upstreams *u, int answered, uint64_t now_us);
+
 int remote_sock_init(char * fwd_addrs, char * fwd_def_addr,int fwd_threads);
 int dns_handle_remote(struct rte_mbuf *pkt,uint16_t old_id,uint16_t qtype,char *domain);
+/* refresh the cache entry a query was just answered from, pkt is copied and kept by the caller */
+int dns_handle_refresh(struct rte_mbuf *pkt,uint16_t qtype,const char *domain);
 uint16_t fwd_pkts_dequeue(struct rte_mbuf **mbufs,uint16_t pkts_len);
-domain_fwd_addrs * find_zone_fwd_addrs(char * domain_name);
-int dns_tcp_process_init(char *ip);
+/* the zone of the closest enclosing forward zone name, or the default one */
+domain_fwd_addrs *fwd_zone_find(const uint8_t *dname, size_t len);
+domain_fwd_addrs * find_zone_fwd_addrs(const char * domain_name);
+/* a zone with the upstreams "ip[:port],...", NULL on error */
+domain_fwd_addrs *fwd_zone_create(const char *zone, const char *addrs);
+/* msg is the master's, or freed and -1 if the queue is full */
+int fwd_zone_update_enqueue(struct fwd_zone_update *msg);
+void fwd_zone_msg_master_process(void);
+/* call fn on every forward zone, the default zone first */
+void fwd_zones_walk(void (*fn)(const domain_fwd_addrs *zone, void *arg), void *arg);
+/* call fn on every upstream of every forward zone, the default zone first */
+void fwd_upstreams_walk(void (*fn)(const domain_fwd_addrs *zone, const dns_addr_t *server, void *arg), void *arg);
 
 
 
@@ -0,0 +1,721 @@
+/*
+ * fwd_cache.c -- forwarded response cache
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <rte_atomic.h>
+#include <rte_common.h>
+#include <rte_jhash.h>
+#include <rte_malloc.h>
+#include <rte_spinlock.h>
+
+#include "dns.h"
+#include "edns.h"
+#include "fwd_cache.h"
+#include "util.h"
+
+#define FWD_CACHE_WAYS        4
+#define FWD_CACHE_MAX_RRS     48      /* more than fit in FWD_CACHE_DATA_LEN */
+#define FWD_CACHE_SHARDS      16
+#define FWD_CACHE_PAGE_SIZE   (64 * 1024)
+#define FWD_CACHE_CLASSES     4       /* blocks of 128, 256, 512 and 1024 bytes */
+#define FWD_CACHE_MIN_BLOCK   128
+#define FWD_CACHE_AVG_BLOCK   256     /* sizes the index for a memory cap */
+#define FWD_CACHE_STALE_TTL   30      /* of stale answers, RFC 8767 */
+#define FWD_CACHE_REFRESH_RETRY 5     /* seconds before a refresh that got nothing is tried again */
+
+/*
+ * A cached response lives in a block of a shard's slab; the index entry
+ * pointing to it sits in one of the 4 ways of a set. Blocks of the same
+ * size class are carved from the same pages and evicted in CLOCK order.
+ */
+struct fwd_cache_block {
+    struct fwd_cache_block *next_free;
+    uint32_t set;                 /* index entry pointing here, UINT32_MAX: free */
+    uint8_t  way;
+    uint16_t qname_len;
+    uint16_t data_len;
+    uint16_t ttl_count;
+    uint8_t  body[];              /* ttl offsets, qname, data */
+};
+
+struct fwd_cache_entry {
+    uint32_t hash;
+    uint16_t qtype;
+    uint16_t qname_len;           /* 0: empty */
+    uint8_t  cls;                 /* of the block */
+    volatile uint8_t referenced;  /* set by readers, cleared by the clock hand */
+    volatile uint16_t hits;       /* counted by readers, roughly */
+    volatile uint32_t refreshed;  /* when a reader last took on refreshing it */
+    time_t   time_inserted;
+    time_t   time_expired;
+    struct fwd_cache_block *block;
+};
+
+struct fwd_cache_set {
+    volatile uint32_t seq;        /* odd while a writer changes the set */
+    struct fwd_cache_entry entries[FWD_CACHE_WAYS];
+} __rte_cache_aligned;
+
+struct fwd_cache_class {
+    struct fwd_cache_block *free_list;
+    uint32_t page_num;
+    uint32_t hand_page;           /* clock hand: a page of the shard and a block in it */
+    uint32_t hand_block;
+};
+
+struct fwd_cache_shard {
+    rte_spinlock_t lock;          /* writers of the sets and slab of the shard */
+    uint32_t page_num;
+    uint32_t page_max;
+    uint32_t steal_hand;
+    uint8_t **pages;
+    uint8_t *page_class;
+    struct fwd_cache_class classes[FWD_CACHE_CLASSES];
+    struct fwd_cache_stats stats;
+} __rte_cache_aligned;
+
+static struct fwd_cache_set *fwd_cache_sets;
+static uint32_t fwd_cache_mask;
+static struct fwd_cache_shard fwd_cache_shards[FWD_CACHE_SHARDS];
+static struct fwd_cache_conf fwd_cache_conf;
+
+
+int fwd_cache_init(const struct fwd_cache_conf *conf) {
+    uint32_t sets = rte_align32pow2(RTE_MAX(conf->memory / FWD_CACHE_AVG_BLOCK / FWD_CACHE_WAYS,
+        (uint64_t)FWD_CACHE_SHARDS));
+    uint32_t page_max = RTE_MAX(conf->memory / FWD_CACHE_PAGE_SIZE / FWD_CACHE_SHARDS, (uint64_t)FWD_CACHE_CLASSES);
+    int i;
+
+    fwd_cache_sets = rte_zmalloc(NULL, sets * sizeof(struct fwd_cache_set), RTE_CACHE_LINE_SIZE);
+    if (fwd_cache_sets == NULL) {
+        log_msg(LOG_ERR, "forward cache alloc failed, %u sets\n", sets);
+        return -1;
+    }
+    fwd_cache_mask = sets - 1;
+    for (i = 0; i < FWD_CACHE_SHARDS; i++) {
+        struct fwd_cache_shard *shard = &fwd_cache_shards[i];
+
+        rte_spinlock_init(&shard->lock);
+        shard->page_max = page_max;
+        shard->pages = xalloc_array_zero(page_max, sizeof(uint8_t *));
+        shard->page_class = xalloc_array_zero(page_max, sizeof(uint8_t));
+    }
+    fwd_cache_conf = *conf;
+    return 0;
+}
+
+void fwd_cache_stats_get(struct fwd_cache_stats *stats) {
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < FWD_CACHE_SHARDS; i++) {
+        const struct fwd_cache_stats *st = &fwd_cache_shards[i].stats;
+
+        stats->entries += st->entries;
+        stats->bytes += st->bytes;
+        stats->memory += st->memory;
+        stats->evictions += st->evictions;
+        stats->insert_fails += st->insert_fails;
+    }
+}
+
+static inline uint32_t fwd_block_size(int cls) {
+    return FWD_CACHE_MIN_BLOCK << cls;
+}
+
+/* the smallest class holding such a block */
+static inline int fwd_block_class(uint16_t qname_len, uint16_t ttl_count, uint16_t data_len) {
+    uint32_t size = sizeof(struct fwd_cache_block) + ttl_count * sizeof(uint16_t) + qname_len + data_len;
+    int cls = 0;
+
+    while (fwd_block_size(cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+static inline uint16_t *fwd_block_ttl_offs(struct fwd_cache_block *b) {
+    return (uint16_t *)b->body;
+}
+
+static inline uint8_t *fwd_block_qname(struct fwd_cache_block *b) {
+    return b->body + b->ttl_count * sizeof(uint16_t);
+}
+
+static inline uint8_t *fwd_block_data(struct fwd_cache_block *b) {
+    return fwd_block_qname(b) + b->qname_len;
+}
+
+static inline uint16_t fwd_read16(const uint8_t *p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static inline uint32_t fwd_read32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void fwd_write32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* position after the possibly compressed name at pos, -1 if it runs off */
+static int fwd_dname_skip(const uint8_t *data, int len, int pos) {
+    while (pos < len) {
+        if ((data[pos] & 0xc0) == 0xc0) {
+            return pos + 2 <= len ? pos + 2 : -1;
+        }
+        if (data[pos] == 0) {
+            return pos + 1;
+        }
+        pos += data[pos] + 1;
+    }
+    return -1;
+}
+
+/*
+ * Take the OPT record out of a response, it is the upstream's and written
+ * for our query. Returns -1 for a response with an extended rcode.
+ */
+static int fwd_opt_strip(uint8_t *data, uint16_t *len) {
+    uint16_t ancount, nscount, arcount, i, type, rdlen;
+    int pos, rr, end;
+
+    ancount = fwd_read16(data + 6);
+    nscount = fwd_read16(data + 8);
+    arcount = fwd_read16(data + 10);
+    pos = fwd_dname_skip(data, *len, 12);
+    if (pos < 0 || pos + 4 > *len) {
+        return -1;
+    }
+    pos += 4;
+    for (i = 0; i < ancount + nscount + arcount; i++) {
+        rr = fwd_dname_skip(data, *len, pos);
+        if (rr < 0 || rr + 10 > *len) {
+            return -1;
+        }
+        type = fwd_read16(data + rr);
+        rdlen = fwd_read16(data + rr + 8);
+        end = rr + 10 + rdlen;
+        if (end > *len) {
+            return -1;
+        }
+        if (type == TYPE_OPT && i >= ancount + nscount) {
+            /* the extended rcode is the top byte of the ttl */
+            if (data[rr + 4] != 0) {
+                return -1;
+            }
+            memmove(data + pos, data + end, *len - end);
+            *len -= end - pos;
+            arcount--;
+            data[10] = arcount >> 8;
+            data[11] = arcount & 0xff;
+            return 0;
+        }
+        pos = end;
+    }
+    return 0;
+}
+
+static uint32_t fwd_ttl_clamp(uint32_t ttl) {
+    /* RFC 2181: a TTL with the top bit set means 0 */
+    if (ttl & 0x80000000U) {
+        ttl = 0;
+    }
+    if (ttl < fwd_cache_conf.min_ttl) {
+        return fwd_cache_conf.min_ttl;
+    }
+    return ttl > fwd_cache_conf.max_ttl ? fwd_cache_conf.max_ttl : ttl;
+}
+
+/*
+ * How long a response may be cached, 0 if it may not. The TTLs of data are
+ * clamped in place and their offsets stored in ttl_offs.
+ */
+static uint32_t fwd_cache_lifetime(uint8_t *data, uint16_t len, uint16_t *ttl_offs, uint16_t *ttl_count) {
+    uint16_t ancount, nscount, arcount, i;
+    uint32_t answer_ttl = UINT32_MAX, negative_ttl = UINT32_MAX, lifetime;
+    int soa_off = -1;
+    int pos;
+    uint8_t rcode;
+
+    if (len < 12 || (data[2] & 0x02) || fwd_read16(data + 4) != 1) {
+        return 0;
+    }
+    ancount = fwd_read16(data + 6);
+    nscount = fwd_read16(data + 8);
+    arcount = fwd_read16(data + 10);
+    pos = fwd_dname_skip(data, len, 12);
+    if (pos < 0 || pos + 4 > len) {
+        return 0;
+    }
+    pos += 4;
+
+    *ttl_count = 0;
+    for (i = 0; i < ancount + nscount + arcount; i++) {
+        uint16_t type, rdlen;
+        uint32_t ttl;
+
+        pos = fwd_dname_skip(data, len, pos);
+        if (pos < 0 || pos + 10 > len) {
+            return 0;
+        }
+        type = fwd_read16(data + pos);
+        ttl = fwd_ttl_clamp(fwd_read32(data + pos + 4));
+        rdlen = fwd_read16(data + pos + 8);
+        if (pos + 10 + rdlen > len) {
+            return 0;
+        }
+        /* the ttl of an OPT record holds flags */
+        if (type != TYPE_OPT) {
+            if (*ttl_count == FWD_CACHE_MAX_RRS) {
+                return 0;
+            }
+            ttl_offs[(*ttl_count)++] = pos + 4;
+            fwd_write32(data + pos + 4, ttl);
+            if (i < ancount) {
+                answer_ttl = RTE_MIN(answer_ttl, ttl);
+            } else if (i < ancount + nscount && type == TYPE_SOA && rdlen >= 5 * sizeof(uint32_t)) {
+                negative_ttl = fwd_ttl_clamp(RTE_MIN(fwd_read32(data + pos + 4),
+                    fwd_read32(data + pos + 10 + rdlen - sizeof(uint32_t))));
+                soa_off = pos + 4;
+            }
+        }
+        pos += 10 + rdlen;
+    }
+
+    rcode = data[3] & 0x0f;
+    if (rcode == RCODE_OK && ancount > 0) {
+        lifetime = answer_ttl;
+    } else if ((rcode == RCODE_OK || rcode == RCODE_NXDOMAIN) && soa_off >= 0) {
+        lifetime = negative_ttl;
+        fwd_write32(data + soa_off, lifetime);
+    } else {
+        return 0;
+    }
+    return lifetime;
+}
+
+static inline uint32_t fwd_cache_hash(const uint8_t *qname, uint16_t qname_len, uint16_t qtype) {
+    return rte_jhash(qname, qname_len, qtype);
+}
+
+static inline struct fwd_cache_shard *fwd_cache_shard_of(uint32_t set) {
+    return &fwd_cache_shards[set & (FWD_CACHE_SHARDS - 1)];
+}
+
+/* one reader at a time takes on a refresh, again only if it got nothing */
+static int fwd_entry_refresh_claim(struct fwd_cache_entry *e, time_t now) {
+    uint32_t last = e->refreshed;
+
+    return (uint32_t)now - last >= FWD_CACHE_REFRESH_RETRY &&
+        rte_atomic32_cmpset(&e->refreshed, last, (uint32_t)now);
+}
+
+int fwd_cache_get(const uint8_t *qname, uint16_t qname_len, uint16_t qtype,
+    uint8_t *data, uint16_t *data_len, int *refresh) {
+    uint32_t hash = fwd_cache_hash(qname, qname_len, qtype);
+    struct fwd_cache_set *set = &fwd_cache_sets[hash & fwd_cache_mask];
+    struct fwd_cache_block *block;
+    struct fwd_cache_entry *entry;
+    time_t now = time(NULL);
+    time_t time_inserted, time_expired;
+    uint16_t ttl_offs[FWD_CACHE_MAX_RRS];
+    uint16_t ttl_count;
+    uint32_t seq, age, ttl;
+    uint16_t len, hits;
+    int i, due;
+
+    do {
+        seq = set->seq;
+        if (seq & 1) {
+            rte_pause();
+            continue;
+        }
+        rte_smp_rmb();
+        block = NULL;
+        len = 0;
+        ttl_count = 0;
+        time_inserted = 0;
+        time_expired = 0;
+        for (i = 0; i < FWD_CACHE_WAYS; i++) {
+            const struct fwd_cache_entry *e = &set->entries[i];
+            const volatile struct fwd_cache_block *vb;
+            uint16_t b_qname_len, b_ttl_count, b_data_len;
+            const uint8_t *body;
+
+            if (e->hash != hash || e->qtype != qtype || e->qname_len != qname_len ||
+                (block = e->block) == NULL || e->cls >= FWD_CACHE_CLASSES) {
+                block = NULL;
+                continue;
+            }
+            /*
+             * The block may be evicted and reused while it is read, the
+             * sequence check below catches that; its lengths are read once
+             * and bounded so the copies stay inside the block the entry had.
+             */
+            vb = block;
+            b_qname_len = vb->qname_len;
+            b_ttl_count = vb->ttl_count;
+            b_data_len = vb->data_len;
+            body = block->body + b_ttl_count * sizeof(uint16_t);
+            if (b_qname_len == qname_len && b_ttl_count <= FWD_CACHE_MAX_RRS &&
+                b_data_len <= FWD_CACHE_DATA_LEN && sizeof(struct fwd_cache_block) +
+                    b_ttl_count * sizeof(uint16_t) + b_qname_len + b_data_len <= fwd_block_size(e->cls) &&
+                memcmp(body, qname, qname_len) == 0) {
+                len = b_data_len;
+                ttl_count = b_ttl_count;
+                time_inserted = e->time_inserted;
+                time_expired = e->time_expired;
+                memcpy(data, body + b_qname_len, len);
+                memcpy(ttl_offs, block->body, ttl_count * sizeof(uint16_t));
+                break;
+            }
+            block = NULL;
+        }
+        rte_smp_rmb();
+    } while ((seq & 1) || set->seq != seq);
+
+    if (len == 0 || time_expired + fwd_cache_conf.stale_time <= now) {
+        return FORWARD_CACHE_NOT_FIND;
+    }
+    /*
+     * The way may hold another entry by now, which then only gets a second
+     * chance, a hit or a refresh claim more than it should.
+     */
+    entry = &set->entries[i];
+    if (!entry->referenced) {
+        entry->referenced = 1;
+    }
+    hits = entry->hits;
+    if (hits != UINT16_MAX) {
+        entry->hits = ++hits;
+    }
+
+    if (refresh != NULL) {
+        /* stale answers are refreshed when served, hot ones in the last tenth of their life */
+        if (time_expired <= now) {
+            due = fwd_cache_conf.serve_stale;
+        } else {
+            due = fwd_cache_conf.prefetch_hits != 0 && hits >= fwd_cache_conf.prefetch_hits &&
+                time_expired - now <= RTE_MAX((time_expired - time_inserted) / 10, (time_t)1);
+        }
+        *refresh = due && fwd_entry_refresh_claim(entry, now);
+    }
+
+    age = now > time_inserted ? now - time_inserted : 0;
+    for (i = 0; i < ttl_count; i++) {
+        if (ttl_offs[i] + sizeof(uint32_t) <= len) {
+            ttl = fwd_read32(data + ttl_offs[i]);
+            if (time_expired <= now) {
+                ttl = FWD_CACHE_STALE_TTL;
+            } else {
+                ttl = ttl > age ? ttl - age : 0;
+            }
+            fwd_write32(data + ttl_offs[i], ttl);
+        }
+    }
+    *data_len = len;
+    return time_expired > now ? FORWARD_CACHE_FIND : FORWARD_CACHE_DATA_EXPIRED;
+}
+
+static inline void fwd_set_write_begin(struct fwd_cache_set *set) {
+    set->seq++;
+    rte_smp_wmb();
+}
+
+static inline void fwd_set_write_end(struct fwd_cache_set *set) {
+    rte_smp_wmb();
+    set->seq++;
+}
+
+static void fwd_block_free(struct fwd_cache_shard *shard, struct fwd_cache_block *b, int cls) {
+    b->set = UINT32_MAX;
+    b->next_free = shard->classes[cls].free_list;
+    shard->classes[cls].free_list = b;
+    shard->stats.entries--;
+    shard->stats.bytes -= fwd_block_size(cls);
+}
+
+/* drop an index entry and free its block, the caller writes the set */
+static void fwd_entry_unlink(struct fwd_cache_shard *shard, struct fwd_cache_entry *e) {
+    struct fwd_cache_block *b = e->block;
+
+    e->qname_len = 0;
+    e->block = NULL;
+    fwd_block_free(shard, b, e->cls);
+}
+
+static void fwd_block_evict(struct fwd_cache_shard *shard, struct fwd_cache_block *b) {
+    struct fwd_cache_set *set = &fwd_cache_sets[b->set];
+
+    fwd_set_write_begin(set);
+    fwd_entry_unlink(shard, &set->entries[b->way]);
+    fwd_set_write_end(set);
+    shard->stats.evictions++;
+}
+
+static void fwd_page_carve(struct fwd_cache_shard *shard, uint32_t page_idx, int cls) {
+    uint32_t size = fwd_block_size(cls);
+    uint8_t *page = shard->pages[page_idx];
+    uint32_t off;
+
+    shard->page_class[page_idx] = cls;
+    shard->classes[cls].page_num++;
+    for (off = 0; off + size <= FWD_CACHE_PAGE_SIZE; off += size) {
+        struct fwd_cache_block *b = (struct fwd_cache_block *)(page + off);
+
+        b->set = UINT32_MAX;
+        b->next_free = shard->classes[cls].free_list;
+        shard->classes[cls].free_list = b;
+    }
+}
+
+static int fwd_shard_add_page(struct fwd_cache_shard *shard, int cls) {
+    uint8_t *page;
+
+    if (shard->page_num == shard->page_max) {
+        return -1;
+    }
+    page = rte_malloc(NULL, FWD_CACHE_PAGE_SIZE, RTE_CACHE_LINE_SIZE);
+    if (page == NULL) {
+        return -1;
+    }
+    shard->pages[shard->page_num] = page;
+    shard->stats.memory += FWD_CACHE_PAGE_SIZE;
+    fwd_page_carve(shard, shard->page_num++, cls);
+    return 0;
+}
+
+/*
+ * A class that got no page before the cap was reached takes one from a
+ * class with several: the next such page in round robin order is emptied
+ * and carved again.
+ */
+static int fwd_shard_steal_page(struct fwd_cache_shard *shard, int cls) {
+    struct fwd_cache_block **pp;
+    uint32_t page_idx = 0, size, off;
+    int old;
+
+    for (off = 0; off < shard->page_num; off++) {
+        page_idx = shard->steal_hand;
+        shard->steal_hand = (shard->steal_hand + 1) % shard->page_num;
+        if (shard->classes[shard->page_class[page_idx]].page_num > 1) {
+            break;
+        }
+    }
+    if (off == shard->page_num) {
+        return -1;
+    }
+    old = shard->page_class[page_idx];
+    shard->classes[old].page_num--;
+    size = fwd_block_size(old);
+    for (off = 0; off + size <= FWD_CACHE_PAGE_SIZE; off += size) {
+        struct fwd_cache_block *b = (struct fwd_cache_block *)(shard->pages[page_idx] + off);
+        if (b->set != UINT32_MAX) {
+            fwd_block_evict(shard, b);
+        }
+    }
+    /* the page's blocks are all on the free list of its old class now */
+    pp = &shard->classes[old].free_list;
+    while (*pp != NULL) {
+        if ((uint8_t *)*pp >= shard->pages[page_idx] &&
+            (uint8_t *)*pp < shard->pages[page_idx] + FWD_CACHE_PAGE_SIZE) {
+            *pp = (*pp)->next_free;
+        } else {
+            pp = &(*pp)->next_free;
+        }
+    }
+    fwd_page_carve(shard, page_idx, cls);
+    return 0;
+}
+
+/* second chance: skip and clear referenced blocks, evict the first other one */
+static struct fwd_cache_block *fwd_shard_clock_evict(struct fwd_cache_shard *shard, int cls) {
+    struct fwd_cache_class *c = &shard->classes[cls];
+    uint32_t size = fwd_block_size(cls);
+    uint32_t per_page = FWD_CACHE_PAGE_SIZE / size;
+    uint32_t steps, max_steps = 2 * shard->page_num * per_page;
+
+    if (shard->page_num == 0) {
+        return NULL;
+    }
+    for (steps = 0; steps < max_steps; steps++) {
+        struct fwd_cache_block *b;
+
+        if (++c->hand_block >= per_page) {
+            c->hand_block = 0;
+            c->hand_page = (c->hand_page + 1) % shard->page_num;
+        }
+        if (shard->page_class[c->hand_page] != cls) {
+            c->hand_block = per_page;
+            continue;
+        }
+        b = (struct fwd_cache_block *)(shard->pages[c->hand_page] + c->hand_block * size);
+        if (b->set == UINT32_MAX) {
+            continue;
+        }
+        if (fwd_cache_sets[b->set].entries[b->way].referenced) {
+            fwd_cache_sets[b->set].entries[b->way].referenced = 0;
+            continue;
+        }
+        fwd_block_evict(shard, b);
+        /* take it back off the free list it was just put on */
+        c->free_list = b->next_free;
+        return b;
+    }
+    return NULL;
+}
+
+static struct fwd_cache_block *fwd_block_alloc(struct fwd_cache_shard *shard, int cls) {
+    struct fwd_cache_class *c = &shard->classes[cls];
+    struct fwd_cache_block *b;
+
+    if (c->free_list == NULL && fwd_shard_add_page(shard, cls) != 0) {
+        b = fwd_shard_clock_evict(shard, cls);
+        if (b != NULL || fwd_shard_steal_page(shard, cls) != 0) {
+            return b;
+        }
+    }
+    b = c->free_list;
+    c->free_list = b->next_free;
+    return b;
+}
+
+void fwd_cache_insert(const uint8_t *qname, uint16_t qname_len, uint16_t qtype,
+    const uint8_t *data, uint16_t data_len) {
+    uint32_t hash = fwd_cache_hash(qname, qname_len, qtype);
+    uint32_t set_idx = hash & fwd_cache_mask;
+    struct fwd_cache_set *set = &fwd_cache_sets[set_idx];
+    struct fwd_cache_shard *shard = fwd_cache_shard_of(set_idx);
+    struct fwd_cache_entry *victim = NULL;
+    struct fwd_cache_block *block;
+    int same = 0;
+    uint8_t buf[FWD_CACHE_DATA_LEN];
+    uint16_t ttl_offs[FWD_CACHE_MAX_RRS];
+    uint16_t ttl_count;
+    uint32_t lifetime;
+    time_t now;
+    int i, cls;
+
+    if (data_len > FWD_CACHE_DATA_LEN || qname_len > MAXDOMAINLEN) {
+        return;
+    }
+    memcpy(buf, data, data_len);
+    if (data_len < 12 || fwd_opt_strip(buf, &data_len) != 0) {
+        return;
+    }
+    lifetime = fwd_cache_lifetime(buf, data_len, ttl_offs, &ttl_count);
+    if (lifetime == 0) {
+        return;
+    }
+    cls = fwd_block_class(qname_len, ttl_count, data_len);
+    now = time(NULL);
+
+    rte_spinlock_lock(&shard->lock);
+    block = fwd_block_alloc(shard, cls);
+    if (block == NULL) {
+        shard->stats.insert_fails++;
+        rte_spinlock_unlock(&shard->lock);
+        return;
+    }
+    /* no index entry points to the block yet, readers can not see it */
+    block->qname_len = qname_len;
+    block->data_len = data_len;
+    block->ttl_count = ttl_count;
+    memcpy(fwd_block_ttl_offs(block), ttl_offs, ttl_count * sizeof(uint16_t));
+    memcpy(fwd_block_qname(block), qname, qname_len);
+    memcpy(fwd_block_data(block), buf, data_len);
+
+    fwd_set_write_begin(set);
+    /* the same key, else an empty way, else the entry expiring first */
+    for (i = 0; i < FWD_CACHE_WAYS; i++) {
+        struct fwd_cache_entry *e = &set->entries[i];
+        if (e->qname_len != 0 && e->hash == hash && e->qtype == qtype && e->qname_len == qname_len &&
+            memcmp(fwd_block_qname(e->block), qname, qname_len) == 0) {
+            victim = e;
+            same = 1;
+            break;
+        }
+        if (victim == NULL || (victim->qname_len != 0 &&
+            (e->qname_len == 0 || e->time_expired < victim->time_expired))) {
+            victim = e;
+        }
+    }
+    if (victim->qname_len != 0) {
+        if (!same) {
+            shard->stats.evictions++;
+        }
+        fwd_entry_unlink(shard, victim);
+    }
+    block->set = set_idx;
+    block->way = victim - set->entries;
+    victim->hash = hash;
+    victim->qtype = qtype;
+    victim->qname_len = qname_len;
+    victim->cls = cls;
+    victim->referenced = 0;
+    victim->hits = 0;
+    victim->refreshed = 0;
+    victim->time_inserted = now;
+    victim->time_expired = now + lifetime;
+    victim->block = block;
+    fwd_set_write_end(set);
+
+    shard->stats.entries++;
+    shard->stats.bytes += fwd_block_size(cls);
+    rte_spinlock_unlock(&shard->lock);
+}
+
+int fwd_cache_splice(uint8_t *dns, uint16_t qname_len, const uint8_t *data, uint16_t data_len,
+    uint16_t room, int opt) {
+    /* the cached question has the same length, only its case may differ */
+    uint16_t qend = 12 + qname_len + 2 * sizeof(uint16_t);
+    uint16_t len = data_len + (opt ? OPT_LEN : 0);
+    uint16_t arcount, udp_size;
+    uint8_t *rr;
+
+    if (data_len < qend || len > room) {
+        return -1;
+    }
+    memcpy(dns + 2, data + 2, 10);
+    memcpy(dns + qend, data + qend, data_len - qend);
+    if (opt) {
+        /* as edns_write_record: root owner, our udp size, no rcode bits, flags or options */
+        rr = dns + data_len;
+        udp_size = edns_max_udp_size();
+        memset(rr, 0, OPT_LEN);
+        rr[1] = TYPE_OPT >> 8;
+        rr[2] = TYPE_OPT & 0xff;
+        rr[3] = udp_size >> 8;
+        rr[4] = udp_size & 0xff;
+        arcount = fwd_read16(dns + 10) + 1;
+        dns[10] = arcount >> 8;
+        dns[11] = arcount & 0xff;
+    }
+    return len;
+}
+
+int fwd_cache_answer(uint8_t *dns, const uint8_t *qname, uint16_t qname_len, uint16_t qtype,
+    uint16_t room, int opt, int *flags) {
+    uint8_t data[FWD_CACHE_DATA_LEN];
+    uint16_t data_len;
+    int status, refresh, len;
+
+    *flags = 0;
+    status = fwd_cache_get(qname, qname_len, qtype, data, &data_len, &refresh);
+    if (status == FORWARD_CACHE_NOT_FIND || (status == FORWARD_CACHE_DATA_EXPIRED && !fwd_cache_conf.serve_stale)) {
+        return -1;
+    }
+    len = fwd_cache_splice(dns, qname_len, data, data_len, room, opt);
+    if (len >= 0) {
+        *flags = (status == FORWARD_CACHE_DATA_EXPIRED ? FWD_CACHE_ANSWER_STALE : 0) |
+            (refresh ? FWD_CACHE_ANSWER_REFRESH : 0);
+    }
+    return len;
+}
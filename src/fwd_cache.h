@@ -0,0 +1,104 @@
+#ifndef __FWD_CACHE_H__
+#define __FWD_CACHE_H__
+
+#include <stdint.h>
+
+/*
+ * Cache of upstream responses, shared by the forward threads that fill it
+ * and the data lcores that answer from it. Entries are keyed by the
+ * lowercased wire qname and qtype and indexed by fixed 4-way sets; each set
+ * is guarded by a sequence counter, so readers never lock. The sets are
+ * split over shards, each with its own writer lock and a slab of 128 to
+ * 1024 byte blocks holding the responses. A shard never takes more than its
+ * part of the memory cap; once there, blocks are evicted in CLOCK order,
+ * readers only mark the blocks they hit.
+ *
+ * An answer is kept for the smallest TTL of its answer section, a negative
+ * answer (NXDOMAIN or NODATA) for the TTL of its SOA, at most the SOA
+ * minimum (RFC 2308), both within [min_ttl, max_ttl]. The TTLs handed out
+ * are counted down by the age of the entry.
+ *
+ * Responses are kept without their OPT record, fwd_cache_splice adds ours
+ * for clients that sent one. Answers to DO queries, which may carry
+ * DNSSEC records, are neither cached nor answered from the cache.
+ *
+ * Expired answers are kept for stale_time more seconds, for when the
+ * upstreams fail and, with serve_stale, to answer right away while one
+ * reader refreshes the entry (RFC 8767); stale answers carry a TTL of 30.
+ * Entries hit prefetch_hits times are refreshed by a reader in the last
+ * tenth of their life, before anyone has to wait for them.
+ */
+
+#define FWD_CACHE_DEF_MEMORY    64      /* MB */
+#define FWD_CACHE_DATA_LEN      512
+#define FWD_CACHE_DEF_MIN_TTL   0
+#define FWD_CACHE_DEF_MAX_TTL   86400
+#define FWD_CACHE_DEF_STALE_TIME     3600
+#define FWD_CACHE_DEF_PREFETCH_HITS  8
+
+#define FORWARD_CACHE_FIND            0
+#define FORWARD_CACHE_NOT_FIND       -1
+#define FORWARD_CACHE_DATA_EXPIRED   -2
+
+#define FWD_CACHE_ANSWER_STALE       0x1     /* answered from an expired entry */
+#define FWD_CACHE_ANSWER_REFRESH     0x2     /* the caller has to refresh the entry */
+
+struct fwd_cache_conf {
+    uint64_t memory;         /* bytes */
+    uint32_t min_ttl;
+    uint32_t max_ttl;
+    uint32_t stale_time;     /* s, expired answers are kept as long */
+    uint32_t prefetch_hits;  /* 0: no prefetch */
+    int serve_stale;
+};
+
+struct fwd_cache_stats {
+    uint64_t entries;
+    uint64_t bytes;          /* in the blocks of the entries */
+    uint64_t memory;         /* in slab pages */
+    uint64_t evictions;      /* live entries dropped for room */
+    uint64_t insert_fails;   /* responses not cached for lack of room */
+};
+
+int fwd_cache_init(const struct fwd_cache_conf *conf);
+
+/* the counters summed over the shards, read without locking */
+void fwd_cache_stats_get(struct fwd_cache_stats *stats);
+
+/*
+ * Copy the cached response for qname/qtype to data, at least
+ * FWD_CACHE_DATA_LEN bytes, with its TTLs lowered by the time it spent in
+ * the cache. Expired responses are copied too, with TTLs of 30, as long as
+ * they are not older than stale_time. If refresh is not NULL, it is set
+ * when the caller took on refreshing the entry: a stale one with
+ * serve_stale, or a hot one about to expire.
+ */
+int fwd_cache_get(const uint8_t *qname, uint16_t qname_len, uint16_t qtype,
+    uint8_t *data, uint16_t *data_len, int *refresh);
+
+/*
+ * Store a response, replacing any for the same qname/qtype. Responses that
+ * are truncated, malformed, neither an answer nor a negative answer with a
+ * SOA, carry an extended rcode, or would live 0 seconds are not kept.
+ */
+void fwd_cache_insert(const uint8_t *qname, uint16_t qname_len, uint16_t qtype,
+    const uint8_t *data, uint16_t data_len);
+
+/*
+ * Write the response data over the query in dns, keeping the query's ID
+ * and question; with opt, our OPT record is added for a query that had
+ * one (data from the cache has none). Returns the new length, or -1 if it
+ * does not fit in room bytes.
+ */
+int fwd_cache_splice(uint8_t *dns, uint16_t qname_len, const uint8_t *data, uint16_t data_len,
+    uint16_t room, int opt);
+
+/*
+ * Answer the query in dns from a fresh cache entry, or a stale one with
+ * serve_stale, see fwd_cache_splice. flags tell a stale answer and a
+ * refresh the caller has to send. Returns -1 if there is none.
+ */
+int fwd_cache_answer(uint8_t *dns, const uint8_t *qname, uint16_t qname_len, uint16_t qtype,
+    uint16_t room, int opt, int *flags);
+
+#endif
@@ -0,0 +1,452 @@
+/*
+ * fwd_dpdk.c -- forwarding out of the port from the data lcores
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+#include <rte_cycles.h>
+#include <rte_ether.h>
+#include <rte_errno.h>
+
+#include "dns-conf.h"
+#include "packet.h"
+#include "dns.h"
+#include "util.h"
+#include "forward.h"
+#include "fwd_cache.h"
+#include "fwd_dpdk.h"
+
+#define FWD_DPDK_MAX_PENDING     4096    /* source ports of an lcore at most */
+#define FWD_DPDK_QUERY_LEN       512     /* longer queries are sent bare */
+#define FWD_DPDK_RING_SIZE       1024
+#define FWD_DPDK_BURST           32      /* hand-offs and timers per poll */
+
+/* a query sent upstream, its slot is its source port */
+struct fwd_dpdk_pending {
+    struct rte_mbuf *pkt;       /* the client's query, NULL for a refresh */
+    struct fwd_upstreams ups;
+    struct ether_addr next_hop;
+    uint8_t eth_port;           /* sent out of the port the query came in on */
+    uint16_t port;              /* source port */
+    uint16_t qid;
+    uint16_t qtype;
+    uint16_t query_len;
+    uint16_t question_len;
+    uint32_t edns_key;          /* of the client's query, fwd_query_edns_key */
+    int heap_idx;               /* -1: slot free */
+    uint64_t deadline;          /* ms, next hedge or expire */
+    uint64_t expire;            /* ms, the query fails after it */
+    uint8_t query[FWD_DPDK_QUERY_LEN];    /* as sent, with our id */
+};
+
+struct fwd_dpdk_lcore {
+    struct rte_ring *ring;      /* responses received by other lcores */
+    uint16_t port_base;
+    uint16_t port_num;
+    uint32_t rand;
+    uint16_t free_num;
+    uint16_t free[FWD_DPDK_MAX_PENDING];    /* free slots */
+    int heap_len;
+    struct fwd_dpdk_pending *heap[FWD_DPDK_MAX_PENDING];  /* min-heap on deadline */
+    struct fwd_dpdk_pending pendings[FWD_DPDK_MAX_PENDING];
+} __rte_cache_aligned;
+
+extern struct rte_mempool *pkt_mbuf_pool;
+
+static int fwd_dpdk_enabled;
+static uint32_t fwd_src_ip;
+static uint16_t fwd_port_min;
+static uint16_t fwd_port_share;     /* source ports per lcore */
+static unsigned fwd_share_num;
+static unsigned fwd_share_lcores[RTE_MAX_LCORE];
+static struct fwd_dpdk_lcore *fwd_lcores[RTE_MAX_LCORE];
+static uint32_t fwd_timeout_ms;
+static uint32_t fwd_hedge_ms;
+
+
+int fwd_dpdk_init(void) {
+    struct comm_config *cfg = &g_dns_cfg->comm;
+    uint32_t ports = cfg->fwd_src_port_max - cfg->fwd_src_port_min + 1;
+    unsigned lcore_id;
+    int i;
+
+    if (cfg->fwd_mode != FWD_MODE_DPDK) {
+        return 0;
+    }
+    fwd_share_num = rte_lcore_count() - 1;
+    if (fwd_share_num == 0 || ports < fwd_share_num) {
+        log_msg(LOG_ERR, "fwd-src-ports: %u ports for %u data lcores\n", ports, fwd_share_num);
+        return -1;
+    }
+    fwd_src_ip = cfg->fwd_src_ip != 0 ? cfg->fwd_src_ip : g_dns_cfg->netdev.kni_ip;
+    fwd_port_min = cfg->fwd_src_port_min;
+    fwd_port_share = RTE_MIN(ports / fwd_share_num, (uint32_t)FWD_DPDK_MAX_PENDING);
+    fwd_timeout_ms = cfg->fwd_timeout;
+    fwd_hedge_ms = cfg->fwd_hedge_timeout;
+
+    fwd_share_num = 0;
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        unsigned socket_id = rte_lcore_to_socket_id(lcore_id);
+        struct fwd_dpdk_lcore *lc;
+        char ring_name[RTE_RING_NAMESIZE];
+
+        lc = rte_zmalloc_socket(NULL, sizeof(struct fwd_dpdk_lcore), RTE_CACHE_LINE_SIZE, socket_id);
+        if (lc == NULL) {
+            log_msg(LOG_ERR, "forward state alloc failed for lcore %u\n", lcore_id);
+            return -1;
+        }
+        snprintf(ring_name, sizeof(ring_name), "fwd_dpdk_ring_%u", lcore_id);
+        lc->ring = rte_ring_create(ring_name, FWD_DPDK_RING_SIZE, socket_id, RING_F_SC_DEQ);
+        if (lc->ring == NULL) {
+            log_msg(LOG_ERR, "Cannot create ring %s  %s\n", ring_name, rte_strerror(rte_errno));
+            return -1;
+        }
+        lc->port_base = fwd_port_min + fwd_share_num * fwd_port_share;
+        lc->port_num = fwd_port_share;
+        lc->rand = (uint32_t)time(NULL) ^ (lcore_id << 16) ^ (uint32_t)rte_rdtsc();
+        if (lc->rand == 0) {
+            lc->rand = 1;
+        }
+        for (i = 0; i < lc->port_num; i++) {
+            lc->pendings[i].heap_idx = -1;
+            lc->pendings[i].port = lc->port_base + i;
+            lc->free[i] = i;
+        }
+        lc->free_num = lc->port_num;
+        fwd_lcores[lcore_id] = lc;
+        fwd_share_lcores[fwd_share_num++] = lcore_id;
+        log_msg(LOG_INFO, "lcore %u forwards from ports %u-%u\n", lcore_id,
+            lc->port_base, lc->port_base + lc->port_num - 1);
+    }
+    fwd_dpdk_enabled = 1;
+    return 0;
+}
+
+static void fwd_dpdk_heap_swap(struct fwd_dpdk_lcore *lc, int i, int j) {
+    struct fwd_dpdk_pending *tmp = lc->heap[i];
+
+    lc->heap[i] = lc->heap[j];
+    lc->heap[j] = tmp;
+    lc->heap[i]->heap_idx = i;
+    lc->heap[j]->heap_idx = j;
+}
+
+static void fwd_dpdk_heap_up(struct fwd_dpdk_lcore *lc, int i) {
+    while (i > 0 && lc->heap[(i - 1) / 2]->deadline > lc->heap[i]->deadline) {
+        fwd_dpdk_heap_swap(lc, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void fwd_dpdk_heap_down(struct fwd_dpdk_lcore *lc, int i) {
+    for (;;) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < lc->heap_len && lc->heap[l]->deadline < lc->heap[min]->deadline) {
+            min = l;
+        }
+        if (r < lc->heap_len && lc->heap[r]->deadline < lc->heap[min]->deadline) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+        fwd_dpdk_heap_swap(lc, i, min);
+        i = min;
+    }
+}
+
+static void fwd_dpdk_pending_free(struct fwd_dpdk_lcore *lc, struct fwd_dpdk_pending *p) {
+    int i = p->heap_idx;
+
+    lc->heap_len--;
+    if (i != lc->heap_len) {
+        fwd_dpdk_heap_swap(lc, i, lc->heap_len);
+        fwd_dpdk_heap_up(lc, i);
+        fwd_dpdk_heap_down(lc, lc->heap[i]->heap_idx);
+    }
+    p->heap_idx = -1;
+    p->pkt = NULL;
+    lc->free[lc->free_num++] = p->port - lc->port_base;
+}
+
+static uint8_t *fwd_dpdk_client_data(struct rte_mbuf *pkt) {
+    return rte_pktmbuf_mtod_offset(pkt, uint8_t *, packet_udp_data_offset(pkt));
+}
+
+/* build the query packet to an upstream and queue it, the udp checksum is left 0 */
+static void fwd_dpdk_send(struct netif_queue_conf *conf, struct fwd_dpdk_pending *p, const dns_addr_t *server) {
+    const struct sockaddr_in *addr = (const struct sockaddr_in *)server->addr;
+    struct rte_mbuf *m = rte_pktmbuf_alloc(pkt_mbuf_pool);
+    struct ether_hdr *eth_hdr;
+    struct ipv4_hdr *ip_hdr;
+    struct udp_hdr *udp_hdr;
+
+    if (m == NULL) {
+        conf->stats.pkt_dropped++;
+        return;
+    }
+    eth_hdr = (struct ether_hdr *)rte_pktmbuf_append(m, sizeof(struct ether_hdr) +
+        sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr) + p->query_len);
+    if (eth_hdr == NULL) {
+        conf->stats.pkt_dropped++;
+        rte_pktmbuf_free(m);
+        return;
+    }
+    ip_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+    udp_hdr = (struct udp_hdr *)(ip_hdr + 1);
+    init_eth_header(eth_hdr, netif_port_hwaddr(p->eth_port), &p->next_hop, ETHER_TYPE_IPv4);
+    init_ipv4_header(ip_hdr, fwd_src_ip, addr->sin_addr.s_addr, sizeof(struct udp_hdr) + p->query_len);
+    init_udp_header(udp_hdr, rte_cpu_to_be_16(p->port), addr->sin_port, p->query_len);
+    memcpy(udp_hdr + 1, p->query, p->query_len);
+    m->l2_len = sizeof(struct ether_hdr);
+    m->l3_len = sizeof(struct ipv4_hdr);
+    m->port = p->eth_port;
+    packet_tx_enqueue(conf, m);
+}
+
+/* ask the next upstream and schedule the next hedge or the final timeout */
+static void fwd_dpdk_pending_send(struct netif_queue_conf *conf, struct fwd_dpdk_pending *p, uint64_t now) {
+    const dns_addr_t *server;
+
+    while ((server = fwd_upstreams_next(&p->ups)) != NULL) {
+        fwd_dpdk_send(conf, p, server);
+        if (fwd_hedge_ms != 0) {
+            break;
+        }
+    }
+    if (p->ups.next < p->ups.num && now + fwd_hedge_ms < p->expire) {
+        p->deadline = now + fwd_hedge_ms;
+    } else {
+        p->deadline = p->expire;
+    }
+}
+
+/*
+ * Start forwarding the query in dns (a client's, or a refresh when pkt is
+ * NULL) from a random free slot. Queries that do not fit the slot, and
+ * refreshes, whose data was overwritten by the cached answer, go upstream
+ * as the bare question; the edns udp size of the others is cut to what the
+ * port takes unfragmented.
+ */
+static int fwd_dpdk_start(struct netif_queue_conf *conf, struct rte_mbuf *pkt, const uint8_t *dns, int dns_len,
+    uint8_t eth_port, const struct ether_addr *from, uint16_t qtype, const char *domain) {
+    struct fwd_dpdk_lcore *lc = fwd_lcores[rte_lcore_id()];
+    struct fwd_dpdk_pending *p;
+    int question_len, i;
+    uint64_t now;
+    uint16_t udp_max;
+    int opt;
+
+    question_len = fwd_question_len(dns, dns_len);
+    if (lc == NULL || question_len == 0) {
+        return -1;
+    }
+    if (lc->free_num == 0) {
+        log_msg(LOG_ERR, "too many forwarded queries in flight on lcore %u, %s dropped\n", rte_lcore_id(), domain);
+        return -1;
+    }
+    i = fwd_rand(&lc->rand) % lc->free_num;
+    p = &lc->pendings[lc->free[i]];
+    lc->free[i] = lc->free[--lc->free_num];
+
+    if (pkt == NULL || dns_len > FWD_DPDK_QUERY_LEN) {
+        memset(p->query, 0, DNS_HEAD_SIZE);
+        p->query[2] = 0x01;
+        p->query[5] = 1;
+        memcpy(p->query + DNS_HEAD_SIZE, dns + DNS_HEAD_SIZE, question_len);
+        p->query_len = DNS_HEAD_SIZE + question_len;
+    } else {
+        memcpy(p->query, dns, dns_len);
+        p->query_len = dns_len;
+        /* nothing reassembles fragments here, so the answer must fit the mtu */
+        udp_max = kdns_net_device.mtu - sizeof(struct ipv4_hdr) - sizeof(struct udp_hdr);
+        opt = fwd_query_opt(p->query, dns_len, question_len);
+        if (opt >= 0 && (p->query[opt] << 8 | p->query[opt + 1]) > udp_max) {
+            p->query[opt] = udp_max >> 8;
+            p->query[opt + 1] = udp_max & 0xff;
+        }
+    }
+    /* a fresh random id and source port per query keep spoofed answers out */
+    p->qid = (uint16_t)fwd_rand(&lc->rand);
+    p->query[0] = p->qid >> 8;
+    p->query[1] = p->qid & 0xff;
+    p->pkt = pkt;
+    p->qtype = qtype;
+    p->question_len = question_len;
+    p->edns_key = pkt != NULL ? fwd_query_edns_key(dns, dns_len, question_len) : 0;
+    p->eth_port = eth_port;
+    if (!is_zero_ether_addr(&g_dns_cfg->comm.fwd_gateway_mac)) {
+        ether_addr_copy(&g_dns_cfg->comm.fwd_gateway_mac, &p->next_hop);
+    } else {
+        ether_addr_copy(from, &p->next_hop);
+    }
+
+    now = fwd_now_ms();
+    fwd_upstreams_order(&p->ups, fwd_zone_find(dns + DNS_HEAD_SIZE, question_len - 4), &lc->rand, now);
+    p->expire = now + fwd_timeout_ms;
+    fwd_dpdk_pending_send(conf, p, now);
+    p->heap_idx = lc->heap_len;
+    lc->heap[lc->heap_len++] = p;
+    fwd_dpdk_heap_up(lc, p->heap_idx);
+    return 0;
+}
+
+int fwd_dpdk_query(struct netif_queue_conf *conf, struct rte_mbuf *pkt, uint16_t qtype, const char *domain) {
+    struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+    uint16_t offset = packet_udp_data_offset(pkt);
+    struct udp_hdr *udp_hdr = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr *, offset - sizeof(struct udp_hdr));
+
+    if (fwd_dpdk_start(conf, pkt, fwd_dpdk_client_data(pkt),
+            rte_be_to_cpu_16(udp_hdr->dgram_len) - sizeof(struct udp_hdr), pkt->port, &eth_hdr->s_addr, qtype, domain) != 0) {
+        conf->stats.pkt_dropped++;
+        rte_pktmbuf_free(pkt);
+        return -1;
+    }
+    return 0;
+}
+
+int fwd_dpdk_refresh(struct netif_queue_conf *conf, struct rte_mbuf *pkt, uint16_t qtype, const char *domain) {
+    struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+    uint16_t offset = packet_udp_data_offset(pkt);
+    struct udp_hdr *udp_hdr = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr *, offset - sizeof(struct udp_hdr));
+
+    return fwd_dpdk_start(conf, NULL, fwd_dpdk_client_data(pkt),
+        rte_be_to_cpu_16(udp_hdr->dgram_len) - sizeof(struct udp_hdr), pkt->port, &eth_hdr->s_addr, qtype, domain);
+}
+
+/* the lowercased qname of the question, the cache key */
+static uint16_t fwd_dpdk_qname(const struct fwd_dpdk_pending *p, uint8_t *qname) {
+    int i, len = p->question_len - 2 * sizeof(uint16_t);
+
+    for (i = 0; i < len; i++) {
+        qname[i] = tolower(p->query[DNS_HEAD_SIZE + i]);
+    }
+    return len;
+}
+
+/* write data, the upstream's answer or a cached one (opt), over the client's query and queue the answer */
+static void fwd_dpdk_client_reply(struct netif_queue_conf *conf, struct fwd_dpdk_pending *p,
+    const uint8_t *data, int len, int opt) {
+    struct rte_mbuf *pkt = p->pkt;
+    uint8_t *dns = fwd_dpdk_client_data(pkt);
+    int data_len;
+
+    data_len = fwd_cache_splice(dns, p->question_len - 4, data, len,
+        pkt->buf_len - pkt->data_off - packet_udp_data_offset(pkt), opt);
+    if (data_len < 0) {
+        /* keep the question, the client retries over tcp */
+        memcpy(dns + 2, data + 2, 2);
+        dns[2] |= 0x02;
+        memset(dns + 6, 0, 6);
+        data_len = DNS_HEAD_SIZE + p->question_len;
+    }
+    packet_udp_reply_build(pkt, data_len);
+    conf->stats.dns_lens_snd += pkt->pkt_len;
+    packet_tx_enqueue(conf, pkt);
+}
+
+static void fwd_dpdk_answer(struct netif_queue_conf *conf, struct fwd_dpdk_lcore *lc, struct rte_mbuf *m) {
+    struct ipv4_hdr *ip_hdr = rte_pktmbuf_mtod_offset(m, struct ipv4_hdr *, sizeof(struct ether_hdr));
+    struct udp_hdr *udp_hdr = (struct udp_hdr *)(ip_hdr + 1);
+    const uint8_t *resp = (const uint8_t *)(udp_hdr + 1);
+    int len = (int)rte_be_to_cpu_16(udp_hdr->dgram_len) - (int)sizeof(struct udp_hdr);
+    struct fwd_dpdk_pending *p = &lc->pendings[rte_be_to_cpu_16(udp_hdr->dst_port) - lc->port_base];
+    uint8_t qname[MAXDOMAINLEN];
+    int answered;
+
+    if (len < DNS_HEAD_SIZE || p->heap_idx < 0 || p->qid != (((uint16_t)resp[0] << 8) | resp[1]) ||
+        (answered = fwd_upstreams_match(&p->ups, ip_hdr->src_addr, udp_hdr->src_port)) < 0 ||
+        !fwd_question_match(p->query, resp, len, p->question_len)) {
+        conf->stats.pkt_dropped++;
+        rte_pktmbuf_free(m);
+        return;
+    }
+    fwd_upstreams_account(&p->ups, answered, fwd_now_us());
+    if (!(p->edns_key & FWD_EDNS_DO)) {
+        fwd_cache_insert(qname, fwd_dpdk_qname(p, qname), p->qtype, resp, len);
+    }
+    if (p->pkt != NULL) {
+        fwd_dpdk_client_reply(conf, p, resp, len, 0);
+    }
+    fwd_dpdk_pending_free(lc, p);
+    rte_pktmbuf_free(m);
+}
+
+int fwd_dpdk_response(struct netif_queue_conf *conf, struct rte_mbuf *pkt,
+    const struct ipv4_hdr *ip_hdr, const struct udp_hdr *udp_hdr) {
+    uint16_t port = rte_be_to_cpu_16(udp_hdr->dst_port);
+    unsigned share, owner;
+
+    if (!fwd_dpdk_enabled || ip_hdr->dst_addr != fwd_src_ip || port < fwd_port_min ||
+        (ip_hdr->version_ihl & 0xf) != IP_HDRLEN) {
+        return -1;
+    }
+    share = (port - fwd_port_min) / fwd_port_share;
+    if (share >= fwd_share_num) {
+        return -1;
+    }
+    owner = fwd_share_lcores[share];
+    if (owner != rte_lcore_id()) {
+        if (rte_ring_mp_enqueue(fwd_lcores[owner]->ring, pkt) != 0) {
+            conf->stats.pkt_dropped++;
+            rte_pktmbuf_free(pkt);
+        }
+        return 0;
+    }
+    fwd_dpdk_answer(conf, fwd_lcores[owner], pkt);
+    return 0;
+}
+
+void fwd_dpdk_poll(struct netif_queue_conf *conf) {
+    struct fwd_dpdk_lcore *lc = fwd_lcores[rte_lcore_id()];
+    struct rte_mbuf *pkts[FWD_DPDK_BURST];
+    uint8_t data[FWD_CACHE_DATA_LEN];
+    uint8_t qname[MAXDOMAINLEN];
+    struct fwd_dpdk_pending *p;
+    uint16_t data_len;
+    unsigned nb, i;
+    uint64_t now;
+
+    if (lc == NULL) {
+        return;
+    }
+    nb = rte_ring_sc_dequeue_burst(lc->ring, (void **)pkts, FWD_DPDK_BURST);
+    for (i = 0; i < nb; i++) {
+        fwd_dpdk_answer(conf, lc, pkts[i]);
+    }
+    if (lc->heap_len == 0) {
+        return;
+    }
+
+    /* a few timers at a time, they share the tx burst with the answers */
+    now = fwd_now_ms();
+    for (i = 0; i < FWD_DPDK_BURST && lc->heap_len > 0 && lc->heap[0]->deadline <= now; i++) {
+        p = lc->heap[0];
+        if (now < p->expire && p->ups.next < p->ups.num) {
+            fwd_dpdk_pending_send(conf, p, now);
+            fwd_dpdk_heap_down(lc, 0);
+            continue;
+        }
+        fwd_upstreams_account(&p->ups, -1, fwd_now_us());
+        if (p->pkt != NULL) {
+            // use the last record
+            if (!(p->edns_key & FWD_EDNS_DO) &&
+                fwd_cache_get(qname, fwd_dpdk_qname(p, qname), p->qtype, data, &data_len, NULL) !=
+                    FORWARD_CACHE_NOT_FIND) {
+                fwd_dpdk_client_reply(conf, p, data, data_len, p->edns_key != 0);
+            } else {
+                conf->stats.pkt_dropped++;
+                rte_pktmbuf_free(p->pkt);
+            }
+        }
+        fwd_dpdk_pending_free(lc, p);
+    }
+}
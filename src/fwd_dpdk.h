@@ -0,0 +1,44 @@
+#ifndef __FWD_DPDK_H__
+#define __FWD_DPDK_H__
+
+#include <stdint.h>
+#include <rte_mbuf.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+
+#include "netdev.h"
+
+/*
+ * Forwarding from the data lcores themselves (fwd-mode = dpdk). A refused
+ * query is sent upstream from fwd-src-ip, out of the port it came in on;
+ * its source port, taken from the lcore's share of fwd-src-ports, is the
+ * slot of the pending query. The response is recognized in packet_l3_handle by that
+ * address and port, matched on id, upstream and question, cached and
+ * written into the client's own mbuf. A response the NIC hands to another
+ * lcore (RSS) is passed on to the owner through its ring. Neither the
+ * forward threads nor the kernel see any of it.
+ *
+ * fwd-src-ip has to be an address of the kni interface (kni-ipv4 by
+ * default), so the kernel answers ARP for it. The upstreams are reached
+ * through fwd-gateway-mac, or the next hop the query came from.
+ */
+
+#define FWD_DPDK_DEF_PORT_MIN    20000
+#define FWD_DPDK_DEF_PORT_MAX    29999
+
+int fwd_dpdk_init(void);
+
+/* forward the refused query in pkt, which is answered or freed later */
+int fwd_dpdk_query(struct netif_queue_conf *conf, struct rte_mbuf *pkt, uint16_t qtype, const char *domain);
+
+/* refresh the cache entry a query was just answered from, pkt stays the caller's */
+int fwd_dpdk_refresh(struct netif_queue_conf *conf, struct rte_mbuf *pkt, uint16_t qtype, const char *domain);
+
+/* take an ipv4 udp packet that may be an upstream response, -1 if it is not one */
+int fwd_dpdk_response(struct netif_queue_conf *conf, struct rte_mbuf *pkt,
+    const struct ipv4_hdr *ip_hdr, const struct udp_hdr *udp_hdr);
+
+/* responses handed over by other lcores, hedges and timeouts; every loop */
+void fwd_dpdk_poll(struct netif_queue_conf *conf);
+
+#endif
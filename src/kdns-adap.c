@@ -11,13 +11,22 @@
 #include "dns-conf.h"
 #include "db_update.h"
 #include "view.h"
+#include "answer_cache.h"
+#include "rrl.h"
+#include "filter.h"
+#include "netdev.h"
+#include "store_rcu.h"
 
 
 #define MAX_CORES 64
-#define EDNS_MAX_MESSAGE_LEN 4096
 
-static struct query *queries[MAX_CORES];
-struct kdns dpdk_dns[MAX_CORES];
+static struct query *queries[MAX_CORES][NETIF_MAX_PKT_BURST];
+
+/* the shared store copy each lcore reads until its next quiescent state */
+static struct lcore_store {
+    struct kdns *kdns;
+    uint64_t epoch;
+} __rte_cache_aligned lcore_stores[MAX_CORES];
 
 extern void domain_store_zones_check_create(struct kdns*  kdns, char *zones);
 
@@ -31,14 +40,25 @@ static int dnsdata_prepare(struct kdns * kdns) {
     domain_store_zones_check_create( kdns,g_dns_cfg->comm.zones);
 
     kdns_zones_soa_create( kdns->db,g_dns_cfg->comm.zones);
+    kdns->db->viewtree = view_tree_create();
+    if (g_dns_cfg->comm.filter_enable && (kdns->filter = filter_create()) == NULL) {
+        exit(-1);
+    }
     return 0;
 }
 
 static int  kdns_query_init(unsigned lcore_id) {
-    queries[lcore_id] = query_create();
+    int i;
+    for (i = 0; i < NETIF_MAX_PKT_BURST; i++) {
+        queries[lcore_id][i] = query_create();
+    }
     return 0;
 }
 
+kdns_query_st *dns_query_get(unsigned lcore_id, int idx) {
+    return queries[lcore_id][idx];
+}
+
 void write_pid(const char *pid_file)
 {
     /* get pid string */
@@ -104,47 +124,140 @@ void kdns_zones_soa_create(struct  domain_store *db,char * zonesName){
 }
 
 
-int kdns_init(unsigned lcore_id) {
-
-    struct kdns * lcore_kdns = &dpdk_dns[lcore_id]; 
-    memset(lcore_kdns, 0, sizeof(struct kdns));
-    if (dnsdata_prepare(lcore_kdns) != 0) {
+int kdns_store_init(void) {
+    if (store_rcu_init(dnsdata_prepare) != 0) {
         log_msg(LOG_ERR,"server preparation failed,could not be started");
         return -1;
     }
-    
+    return 0;
+}
+
+int kdns_init(unsigned lcore_id) {
+
      kdns_query_init(lcore_id);
 
+    if (answer_cache_init(lcore_id, g_dns_cfg->comm.answer_cache_size) != 0) {
+        return -1;
+    }
+    if (rrl_init(lcore_id, g_dns_cfg->comm.rrl_rate, g_dns_cfg->comm.rrl_burst,
+            g_dns_cfg->comm.rrl_slip, g_dns_cfg->comm.rrl_table_size) != 0) {
+        return -1;
+    }
+    if (filter_lcore_init(lcore_id) != 0) {
+        return -1;
+    }
     return 0;
 }
 
+void kdns_quiescent(unsigned lcore_id) {
+    struct lcore_store *ls = &lcore_stores[lcore_id];
+    uint64_t epoch = store_rcu_quiescent(lcore_id);
 
+    /* cached answers may come from the store before the update */
+    if (unlikely(epoch != ls->epoch)) {
+        ls->epoch = epoch;
+        answer_cache_invalidate(lcore_id);
+    }
+    ls->kdns = store_rcu_get();
+}
 
-kdns_query_st * dns_packet_proess(struct rte_mbuf *pkt , uint32_t sip,int offset, int received) {
-    unsigned lcore_id = rte_lcore_id();
-    char *rdata = NULL;
+int dns_packet_filter(unsigned lcore_id, const uint8_t *saddr, int saddr_len, const uint8_t *dns, int len) {
+    return filter_check(lcore_stores[lcore_id].kdns->filter, lcore_id, saddr, saddr_len, dns, len);
+}
 
-    kdns_query_st *query = queries[lcore_id];
 
-    if(received < 0) {
-        return NULL;
-    }
+query_state_type dns_packet_parse(kdns_query_st *query, struct rte_mbuf *pkt,
+    const uint8_t *saddr, int saddr_len, int offset, int received) {
+    unsigned lcore_id = rte_lcore_id();
+    struct netif_queue_stats *stats = &netif_queue_conf_get(lcore_id)->stats;
+    char *rdata = NULL;
+    query_state_type state;
 
     query_reset(query);
 
     rdata = rte_pktmbuf_mtod_offset(pkt, char *, offset);
     query->packet->data = (uint8_t *)rdata;
     query->packet->position += received;
-    view_value_t* data = view_find(dpdk_dns[lcore_id].db->viewtree, (uint8_t *)&sip,32);
-    if (data != VIEW_NO_NODE){
-        snprintf(query->view_name,MAX_VIEW_NAME_LEN,"%s",data->view_name);
+    if (saddr_len <= (int)sizeof(query->client_addr)) {
+        memcpy(query->client_addr, saddr, saddr_len);
+        query->client_addr_len = saddr_len;
     }
    
     buffer_flip(query->packet);
 
-    if(query_process(query, &dpdk_dns[lcore_id]) != QUERY_FAIL) {
+    state = query_parse(query);
+    if (query->edns.status == EDNS_NOT_PRESENT) {
+        stats->dns_pkts_no_edns++;
+    } else {
+        stats->dns_pkts_edns++;
+    }
+    if (state == QUERY_SUCCESS) {
         buffer_flip(query->packet);
     }
+    return state;
+}
+
+void dns_packet_views(unsigned lcore_id, int num) {
+    const view_tree_t *viewtree = lcore_stores[lcore_id].kdns->db->viewtree;
+    kdns_query_st *v4_queries[NETIF_MAX_PKT_BURST];
+    uint32_t addrs[NETIF_MAX_PKT_BURST];
+    uint16_t view_ids[NETIF_MAX_PKT_BURST];
+    int i, v4_num = 0;
+
+    /* views are ipv4 only, ipv6 clients get the default answers */
+    for (i = 0; i < num; i++) {
+        kdns_query_st *query = queries[lcore_id][i];
+        if (query->client_addr_len == sizeof(uint32_t)) {
+            memcpy(&addrs[v4_num], query->client_addr, sizeof(uint32_t));
+            v4_queries[v4_num++] = query;
+        }
+    }
+    if (v4_num == 0) {
+        return;
+    }
+    view_lookup_bulk(viewtree, addrs, view_ids, v4_num);
+    for (i = 0; i < v4_num; i++) {
+        v4_queries[i]->view_id = view_ids[i];
+    }
+}
+
+int dns_packet_cached(kdns_query_st *query) {
+    if (answer_cache_lookup(rte_lcore_id(), query) == 0) {
+        buffer_flip(query->packet);
+        return 1;
+    }
+    return 0;
+}
+
+void dns_packet_prefetch(kdns_query_st *query) {
+    query_prefetch_lookup(query, lcore_stores[rte_lcore_id()].kdns);
+}
+
+void dns_packet_lookup(kdns_query_st *query) {
+    query_lookup(query, lcore_stores[rte_lcore_id()].kdns);
+}
+
+void dns_packet_answer(kdns_query_st *query) {
+    unsigned lcore_id = rte_lcore_id();
+
+    query_answer(query, lcore_stores[lcore_id].kdns);
+    answer_cache_insert(lcore_id, query);
+    buffer_flip(query->packet);
+}
+
+kdns_query_st * dns_packet_proess(struct rte_mbuf *pkt, const uint8_t *saddr, int saddr_len, int offset, int received) {
+    kdns_query_st *query = queries[rte_lcore_id()][0];
+
+    if(received < 0) {
+        return NULL;
+    }
 
+    if (dns_packet_parse(query, pkt, saddr, saddr_len, offset, received) == QUERY_LOOKUP) {
+        dns_packet_views(rte_lcore_id(), 1);
+        if (!dns_packet_cached(query)) {
+            dns_packet_lookup(query);
+            dns_packet_answer(query);
+        }
+    }
     return query;
 }
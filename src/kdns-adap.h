@@ -6,9 +6,29 @@
 #include "util.h"
 
 
+/* build the shared domain store, once before the lcores start */
+int kdns_store_init(void);
 int kdns_init(unsigned lcore_id);
+/* between bursts: nothing from the shared store is held across this */
+void kdns_quiescent(unsigned lcore_id);
 
-kdns_query_st* dns_packet_proess(struct rte_mbuf *pkt ,uint32_t sip, int offset, int received); 
+/* the ingress filter verdict for a udp query, FILTER_PASS, FILTER_DROP or FILTER_REFUSE */
+int dns_packet_filter(unsigned lcore_id, const uint8_t *saddr, int saddr_len, const uint8_t *dns, int len);
+
+kdns_query_st* dns_packet_proess(struct rte_mbuf *pkt, const uint8_t *saddr, int saddr_len, int offset, int received); 
+
+/* staged burst processing, see query_parse/query_lookup/query_answer */
+kdns_query_st *dns_query_get(unsigned lcore_id, int idx);
+query_state_type dns_packet_parse(kdns_query_st *query, struct rte_mbuf *pkt,
+    const uint8_t *saddr, int saddr_len, int offset, int received);
+/* the views of the first num queries of the lcore, by client address */
+void dns_packet_views(unsigned lcore_id, int num);
+/* 1 if the answer came from the answer cache, the query is done */
+int dns_packet_cached(kdns_query_st *query);
+/* the start of the name tree walk of dns_packet_lookup, a few queries ahead */
+void dns_packet_prefetch(kdns_query_st *query);
+void dns_packet_lookup(kdns_query_st *query);
+void dns_packet_answer(kdns_query_st *query);
 int check_pid(const char *pid_file);
 void write_pid(const char *pid_file);
 void kdns_zones_soa_create(struct  domain_store *db,char * zonesName);
@@ -17,6 +17,8 @@
 #include "dns-conf.h"
 #include "util.h"
 #include "forward.h"
+#include "fwd_dpdk.h"
+#include "tcp_process.h"
 #include "domain_update.h" 
 
 #define VERSION "0.2.1"
@@ -134,6 +136,10 @@ int  main(int argc, char **argv)
     unsigned lcore_id = rte_lcore_id();
 
     remote_sock_init(g_dns_cfg->comm.fwd_addrs,g_dns_cfg->comm.fwd_def_addrs,g_dns_cfg->comm.fwd_threads);
+    if (fwd_dpdk_init() != 0) {
+        log_msg(LOG_ERR, "Error:fwd_dpdk_init\n");
+        exit(-1);
+    }
 
 
     netif_queue_core_bind();
@@ -142,6 +148,11 @@ int  main(int argc, char **argv)
 	/* Setup the signal handling... */
    init_signals();
    rte_pdump_init("/var/run/.dpdk");
+
+    if (kdns_store_init() < 0) {
+        log_msg(LOG_ERR, "Error:kdns_store_init\n");
+        exit(-1);
+    }
     
 
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {     
@@ -11,12 +11,15 @@
 #include "rte_mbuf.h"
 #include "rte_ethdev.h"
 #include "rte_kni.h"
+#include <rte_eth_bond.h>
 #include <rte_ip.h>
 #include <rte_udp.h>
+#include <rte_ip_frag.h>
 #include "netdev.h"
 #include "dns-conf.h"
 #include "util.h"
 #include "process.h"
+#include "flow_steer.h"
 
 
 #define KNI_ENET_HEADER_SIZE    14
@@ -29,12 +32,19 @@
 
 #define MBUF_CACHE_DEF    256
 
-struct rte_kni  *master_kni;
+/* answers up to the edns payload size are written in place in the query mbuf */
+#define PKT_MBUF_SLACK    1024
+#define PKT_MBUF_BUF_SIZE(udp_size) RTE_MAX((size_t)RTE_MBUF_DEFAULT_BUF_SIZE, \
+    RTE_PKTMBUF_HEADROOM + sizeof(struct ether_hdr) + sizeof(struct ipv6_hdr) + \
+    sizeof(struct udp_hdr) + (udp_size) + PKT_MBUF_SLACK)
 
 struct rte_mempool *pkt_mbuf_pool;
 
 struct rte_mempool *kni_mbuf_pool;
 
+/* indirect mbufs pointing at the payload of fragmented answers */
+struct rte_mempool *frag_mbuf_pool;
+
 struct rte_ring *master_kni_pkt_ring;
 
 struct net_device  kdns_net_device ={0};
@@ -206,12 +216,13 @@ static int kni_change_mtu(uint8_t port_id, unsigned new_mtu)
 	return 0;
 }
 
-static int kni_alloc(uint8_t port_id)
+static int kni_alloc(uint16_t idx)
 {
 	struct rte_kni_conf conf;
 	struct rte_kni_ops ops;
 	struct rte_eth_dev_info dev_info;
 	struct ether_addr eth_addr;
+	uint8_t port_id = kdns_net_device.port_ids[idx];
 
 	/* Clear conf at first */
 	memset(&conf, 0, sizeof(conf));
@@ -220,20 +231,27 @@ static int kni_alloc(uint8_t port_id)
     conf.force_bind = 1;
     conf.mbuf_size = KNI_DEF_MBUF_SIZE;
     conf.group_id = (uint16_t)0;
-    snprintf(conf.name, sizeof(conf.name),"%s",g_dns_cfg->netdev.name_prefix);
+    if (idx == 0) {
+        snprintf(conf.name, sizeof(conf.name),"%s",g_dns_cfg->netdev.name_prefix);
+    } else {
+        snprintf(conf.name, sizeof(conf.name),"%s%u",g_dns_cfg->netdev.name_prefix, idx);
+    }
 
 	memset(&dev_info, 0, sizeof(dev_info));
 	rte_eth_dev_info_get(port_id, &dev_info);
-	conf.addr = dev_info.pci_dev->addr;
-	conf.id = dev_info.pci_dev->id;
+	/* virtual devices and bonds have no pci address */
+	if (dev_info.pci_dev) {
+		conf.addr = dev_info.pci_dev->addr;
+		conf.id = dev_info.pci_dev->id;
+	}
 
 	memset(&ops, 0, sizeof(ops));
 	ops.port_id = port_id;
 	ops.change_mtu = kni_change_mtu;
 	ops.config_network_if = kni_config_network_interface;
 
-	master_kni = rte_kni_alloc(kni_mbuf_pool, &conf, &ops);
-	if (!master_kni){
+	kdns_net_device.kni[idx] = rte_kni_alloc(kni_mbuf_pool, &conf, &ops);
+	if (!kdns_net_device.kni[idx]){
 		log_msg(LOG_ERR,"Fail to create kni for port: %d\n", port_id);
 		rte_exit(-1, "Fail to create kni for port: %d\n", port_id);
 	}
@@ -252,8 +270,11 @@ static int kni_alloc(uint8_t port_id)
 
 int kni_free_kni(uint8_t port_id)
 {
-    if (rte_kni_release(master_kni))
+    uint16_t idx = kdns_net_device.port_idx[port_id];
+
+    if (rte_kni_release(kdns_net_device.kni[idx]))
 		log_msg(LOG_ERR,"Fail to release kni\n");	
+	kdns_net_device.kni[idx] = NULL;
 	rte_eth_dev_stop(port_id);
 	return 0;
 }
@@ -263,6 +284,8 @@ int kni_free_kni(uint8_t port_id)
 static void init_port(uint8_t port,uint16_t rx_rings, uint16_t tx_rings)
 {
 	int ret,q;
+	struct rte_eth_dev_info dev_info;
+	struct rte_eth_txconf txconf;
 
 	/* Initialise device and RX/TX queues */
 	log_msg(LOG_INFO, "Initialising port %u ...\n", (unsigned)port);
@@ -293,10 +316,15 @@ static void init_port(uint8_t port,uint16_t rx_rings, uint16_t tx_rings)
         }
 	}
 
+	/* fragmented answers are chains of a header mbuf and indirect mbufs */
+	rte_eth_dev_info_get(port, &dev_info);
+	txconf = dev_info.default_txconf;
+	txconf.txq_flags &= ~(ETH_TXQ_FLAGS_NOMULTSEGS | ETH_TXQ_FLAGS_NOREFCOUNT);
+
 	/* Allocate and set up 1 TX queue per Ethernet port. */
 	for (q = 0; q < tx_rings; q++) {
 		ret = rte_eth_tx_queue_setup(port, q,  g_dns_cfg->netdev.txq_desc_num,
-				rte_eth_dev_socket_id(port), NULL);
+				rte_eth_dev_socket_id(port), &txconf);
 		if (ret < 0){
             log_msg(LOG_ERR,"rte_eth_tx_queue_setup err\n");
 		    rte_exit(-1, "rte_eth_tx_queue_setup err\n");
@@ -342,6 +370,74 @@ uint16_t dns_kni_dequeue(struct rte_mbuf **mbufs,uint16_t pkts_len){
    return pkts_len;
 }
 
+void dns_kni_tx(struct rte_mbuf **mbufs, uint16_t nb_pkts) {
+    struct rte_mbuf *pkts[NETIF_MAX_PORTS][NETIF_MAX_PKT_BURST];
+    uint16_t nb[NETIF_MAX_PORTS] = {0};
+    uint16_t idx, i, ntx;
+
+    for (i = 0; i < nb_pkts; i++) {
+        idx = kdns_net_device.port_idx[mbufs[i]->port];
+        pkts[idx][nb[idx]++] = mbufs[i];
+    }
+    for (idx = 0; idx < kdns_net_device.nb_ports; idx++) {
+        /* with nothing to send it still frees what the kernel is done with */
+        ntx = rte_kni_tx_burst(kdns_net_device.kni[idx], pkts[idx], nb[idx]);
+        for (i = ntx; i < nb[idx]; i++)
+            rte_pktmbuf_free(pkts[idx][i]);
+    }
+}
+
+void netif_master_tx(struct rte_mbuf **mbufs, uint16_t nb_pkts) {
+    struct rte_mbuf *pkts[NETIF_MAX_PORTS][NETIF_MAX_PKT_BURST];
+    uint16_t nb[NETIF_MAX_PORTS] = {0};
+    uint16_t idx, i, ntx;
+
+    for (i = 0; i < nb_pkts; i++) {
+        idx = kdns_net_device.port_idx[mbufs[i]->port];
+        pkts[idx][nb[idx]++] = mbufs[i];
+    }
+    for (idx = 0; idx < kdns_net_device.nb_ports; idx++) {
+        /* an 802.3ad bond sends its LACPDUs from the tx burst, keep calling it */
+        if (nb[idx] == 0 && kdns_net_device.bond_mode != BONDING_MODE_8023AD)
+            continue;
+        ntx = rte_eth_tx_burst(kdns_net_device.port_ids[idx], 0, pkts[idx], nb[idx]);
+        for (i = ntx; i < nb[idx]; i++)
+            rte_pktmbuf_free(pkts[idx][i]);
+    }
+}
+
+/* serve port_id as the next port */
+static void netif_port_add(uint8_t port_id)
+{
+    uint16_t idx = kdns_net_device.nb_ports++;
+
+    kdns_net_device.port_ids[idx] = port_id;
+    kdns_net_device.port_idx[port_id] = idx;
+}
+
+/* one bonded port over all the ports found, its slaves are started with it */
+static void netif_bond_create(uint8_t nb_slaves)
+{
+    int bond_id;
+    uint8_t port;
+
+    bond_id = rte_eth_bond_create(NETIF_BOND_NAME, (uint8_t)g_dns_cfg->netdev.bond_mode, rte_socket_id());
+    if (bond_id < 0) {
+        log_msg(LOG_ERR, "Could not create bond %s\n", NETIF_BOND_NAME);
+        rte_exit(-1, "Could not create bond %s\n", NETIF_BOND_NAME);
+    }
+    for (port = 0; port < nb_slaves; port++) {
+        if (rte_eth_bond_slave_add((uint8_t)bond_id, port) != 0) {
+            log_msg(LOG_ERR, "Could not add port %u to bond %s\n", port, NETIF_BOND_NAME);
+            rte_exit(-1, "Could not add port %u to bond %s\n", port, NETIF_BOND_NAME);
+        }
+        /* a slave's packets are the bond's */
+        kdns_net_device.port_idx[port] = kdns_net_device.nb_ports;
+    }
+    log_msg(LOG_INFO, "bond %s: port %d, mode %d, %u slaves\n", NETIF_BOND_NAME,
+        bond_id, g_dns_cfg->netdev.bond_mode, nb_slaves);
+    netif_port_add((uint8_t)bond_id);
+}
 
 
 static char *
@@ -395,15 +491,24 @@ void dns_dpdk_init(void){
         log_msg(LOG_ERR, "EAL init failed.\n");
         rte_exit(-1, "EAL init failed.\n");
     }
-    uint8_t nb_sys_ports;
+    uint8_t nb_sys_ports, port;
+    uint16_t idx;
+    uint32_t port_mask = 0;
 
     pkt_mbuf_pool = rte_pktmbuf_pool_create("mbuf_pool", g_dns_cfg->netdev.mbuf_num,
-                MBUF_CACHE_DEF, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+                MBUF_CACHE_DEF, 0, PKT_MBUF_BUF_SIZE(g_dns_cfg->comm.edns_udp_size), rte_socket_id());
     if (pkt_mbuf_pool == NULL) {
         log_msg(LOG_ERR, "Could not initialise mbuf pool\n");
         rte_exit(-1, "Could not initialise mbuf pool\n");
     }
 
+    frag_mbuf_pool = rte_pktmbuf_pool_create("frag_mbuf_pool", g_dns_cfg->netdev.mbuf_num,
+                MBUF_CACHE_DEF, 0, 0, rte_socket_id());
+    if (frag_mbuf_pool == NULL) {
+        log_msg(LOG_ERR, "Could not initialise frag mbuf pool\n");
+        rte_exit(-1, "Could not initialise frag mbuf pool\n");
+    }
+
     kni_mbuf_pool = rte_pktmbuf_pool_create("kni_mbuf_pool", g_dns_cfg->netdev.kni_mbuf_num,
                 MBUF_CACHE_DEF, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
     if (!kni_mbuf_pool){
@@ -425,22 +530,59 @@ void dns_dpdk_init(void){
         rte_exit(-1, "No supported Ethernet device found.\n");
     }
     
-    if (nb_sys_ports != 1){
-        log_msg(LOG_ERR, "now just one port supported\n");
-        rte_exit(-1, "now just one port supported\n");
+    kdns_net_device.bond_mode = g_dns_cfg->netdev.bond_mode;
+    if (kdns_net_device.bond_mode != NETIF_BOND_NONE) {
+        netif_bond_create(nb_sys_ports);
+    } else {
+        if (nb_sys_ports > NETIF_MAX_PORTS){
+            log_msg(LOG_ERR, "%u ports found, at most %d supported\n", nb_sys_ports, NETIF_MAX_PORTS);
+            rte_exit(-1, "%u ports found, at most %d supported\n", nb_sys_ports, NETIF_MAX_PORTS);
+        }
+        for (port = 0; port < nb_sys_ports; port++) {
+            netif_port_add(port);
+        }
     }
 
-    rte_kni_init(nb_sys_ports);
+    rte_kni_init(kdns_net_device.nb_ports);
     
-    init_port(0,g_dns_cfg->netdev.rxq_num,g_dns_cfg->netdev.txq_num);
-    kni_alloc(0);
+    kdns_net_device.mtu = 0;
+    for (idx = 0; idx < kdns_net_device.nb_ports; idx++) {
+        uint16_t mtu;
+
+        port = kdns_net_device.port_ids[idx];
+        port_mask |= 1 << port;
+        if (g_dns_cfg->netdev.flow_steering && strcmp(g_dns_cfg->netdev.mode,"rss") == 0) {
+            /* the exception queue comes after the data queues */
+            kdns_net_device.exception_queue = g_dns_cfg->netdev.rxq_num;
+            init_port(port,g_dns_cfg->netdev.rxq_num + 1,g_dns_cfg->netdev.txq_num);
+            kdns_net_device.flow_steer[idx] = flow_steer_port(port, g_dns_cfg->netdev.rxq_num);
+            if (kdns_net_device.flow_steer[idx] == FLOW_STEER_NONE) {
+                log_msg(LOG_INFO, "port %u: no flow steering, classified in software\n", port);
+                rte_eth_dev_stop(port);
+                init_port(port,g_dns_cfg->netdev.rxq_num,g_dns_cfg->netdev.txq_num);
+            }
+        } else {
+            init_port(port,g_dns_cfg->netdev.rxq_num,g_dns_cfg->netdev.txq_num);
+        }
+        kni_alloc(idx);
 
-    check_all_ports_link_status(nb_sys_ports, 1);
+        rte_eth_macaddr_get(port, &kdns_net_device.hwaddr[idx]);
+        if (rte_eth_dev_get_mtu(port, &mtu) != 0 || mtu == 0) {
+            mtu = ETHER_MTU;
+        }
+        /* one fragment size for all the ports */
+        if (kdns_net_device.mtu == 0 || mtu < kdns_net_device.mtu) {
+            kdns_net_device.mtu = mtu;
+        }
+        log_msg(LOG_INFO,"port %u mtu %u\n", port, mtu);
+    }
+
+    check_all_ports_link_status(rte_eth_dev_count(), port_mask);
 
     struct rte_eth_dev_info dev_info;
  
 	memset(&dev_info, 0, sizeof(dev_info));
-	rte_eth_dev_info_get(0, &dev_info);
+	rte_eth_dev_info_get(kdns_net_device.port_ids[0], &dev_info);
     
     log_msg(LOG_INFO,"flow_type_rss_offloads = %ld\n",dev_info.flow_type_rss_offloads);
 
@@ -453,9 +595,6 @@ void dns_dpdk_init(void){
 		p = flowtype_to_str(i);
 		log_msg(LOG_INFO,"  %s\n", (p ? p : "unknown"));
 	}
-                            
-    rte_eth_macaddr_get(0, &kdns_net_device.hwaddr);
-
 }
 
 
@@ -469,6 +608,8 @@ void dns_dpdk_init(void){
         packet_l3_handle(pkt,conf);
         break;
     case ETHER_TYPE_IPv6:
+        packet_l3_ipv6_handle(pkt,conf);
+        break;
     default:
         conf->kni_mbufs[conf->kni_len]= pkt;
         conf->kni_len ++;
@@ -478,14 +619,16 @@ void dns_dpdk_init(void){
  }
     
     
- static void netif_queue_conf_init(uint16_t lcore_id, uint16_t port_id,uint16_t rx_queue_id,uint16_t tx_queue_id)
+ static void netif_queue_conf_init(uint16_t lcore_id, uint16_t rx_queue_id,uint16_t tx_queue_id)
  {
-     log_msg(LOG_INFO,"core queue info: coreId(%d) portID(%d) rxQueueId(%d) txQueueId(%d)\n",
-        lcore_id,port_id,rx_queue_id,tx_queue_id);
+     log_msg(LOG_INFO,"core queue info: coreId(%d) ports(%d) rxQueueId(%d) txQueueId(%d)\n",
+        lcore_id,kdns_net_device.nb_ports,rx_queue_id,tx_queue_id);
      memset(&kdns_net_device.l_netif_queue_conf[lcore_id],0,sizeof(struct netif_queue_conf));
-     kdns_net_device.l_netif_queue_conf[lcore_id].port_id = port_id;
      kdns_net_device.l_netif_queue_conf[lcore_id].rx_queue_id = rx_queue_id;
      kdns_net_device.l_netif_queue_conf[lcore_id].tx_queue_id = tx_queue_id;
+     kdns_net_device.l_netif_queue_conf[lcore_id].burst_size = g_dns_cfg->netdev.burst_size;
+     kdns_net_device.l_netif_queue_conf[lcore_id].prefetch_dist = g_dns_cfg->netdev.prefetch_dist;
+     kdns_net_device.l_netif_queue_conf[lcore_id].staged = g_dns_cfg->netdev.staged_burst;
  }
 
 void netif_queue_core_bind(void)
@@ -496,7 +639,7 @@ void netif_queue_core_bind(void)
         tx_id = 1; 
     unsigned lcore_id;
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {     
-        netif_queue_conf_init(lcore_id,0,rx_id,tx_id);
+        netif_queue_conf_init(lcore_id,rx_id,tx_id);
         rx_id++;
         tx_id++;
     }
@@ -521,6 +664,21 @@ void netif_statsdata_get(struct netif_queue_stats *sta){
         sta->dns_lens_snd +=  sta_lcore->dns_lens_snd;
         sta->pkt_dropped      +=  sta_lcore->pkt_dropped;
         sta->pkt_len_err  +=  sta_lcore->pkt_len_err;
+        sta->answer_cache_hits   +=  sta_lcore->answer_cache_hits;
+        sta->answer_cache_misses +=  sta_lcore->answer_cache_misses;
+        sta->fwd_cache_hits      +=  sta_lcore->fwd_cache_hits;
+        sta->fwd_cache_misses    +=  sta_lcore->fwd_cache_misses;
+        sta->fwd_cache_stale     +=  sta_lcore->fwd_cache_stale;
+        sta->fwd_cache_refreshes +=  sta_lcore->fwd_cache_refreshes;
+        sta->dns_pkts_edns    +=  sta_lcore->dns_pkts_edns;
+        sta->dns_pkts_no_edns +=  sta_lcore->dns_pkts_no_edns;
+        sta->pkts_frag    +=  sta_lcore->pkts_frag;
+        sta->rrl_dropped  +=  sta_lcore->rrl_dropped;
+        sta->rrl_slipped  +=  sta_lcore->rrl_slipped;
+        sta->filter_dropped +=  sta_lcore->filter_dropped;
+        sta->filter_refused +=  sta_lcore->filter_refused;
+        sta->burst_cycles +=  sta_lcore->burst_cycles;
+        sta->burst_pkts   +=  sta_lcore->burst_pkts;
     }  
     return;
 }
@@ -539,6 +697,21 @@ void netif_statsdata_reset(void){
         sta_lcore->dns_lens_snd = 0 ;
         sta_lcore->pkt_dropped  = 0 ;
         sta_lcore->pkt_len_err  = 0 ;
+        sta_lcore->answer_cache_hits   = 0 ;
+        sta_lcore->answer_cache_misses = 0 ;
+        sta_lcore->fwd_cache_hits      = 0 ;
+        sta_lcore->fwd_cache_misses    = 0 ;
+        sta_lcore->fwd_cache_stale     = 0 ;
+        sta_lcore->fwd_cache_refreshes = 0 ;
+        sta_lcore->dns_pkts_edns    = 0 ;
+        sta_lcore->dns_pkts_no_edns = 0 ;
+        sta_lcore->pkts_frag    = 0 ;
+        sta_lcore->rrl_dropped  = 0 ;
+        sta_lcore->rrl_slipped  = 0 ;
+        sta_lcore->filter_dropped = 0 ;
+        sta_lcore->filter_refused = 0 ;
+        sta_lcore->burst_cycles = 0 ;
+        sta_lcore->burst_pkts   = 0 ;
     }  
     return;
 }
@@ -595,6 +768,19 @@ uint16_t init_ipv4_header(struct ipv4_hdr *ip_hdr, uint32_t src_addr,
 }
 
 
+uint16_t init_ipv6_header(struct ipv6_hdr *ip_hdr, const uint8_t *src_addr,
+    const uint8_t *dst_addr, uint8_t proto, uint16_t pktdata_len)
+{
+    ip_hdr->vtc_flow = rte_cpu_to_be_32(IP6_VERSION);
+    ip_hdr->payload_len = rte_cpu_to_be_16(pktdata_len);
+    ip_hdr->proto = proto;
+    ip_hdr->hop_limits = IP_DEFTTL;
+    memmove(ip_hdr->src_addr, src_addr, sizeof(ip_hdr->src_addr));
+    memmove(ip_hdr->dst_addr, dst_addr, sizeof(ip_hdr->dst_addr));
+
+    return (uint16_t) (pktdata_len + sizeof(struct ipv6_hdr));
+}
+
 uint16_t init_udp_header(struct udp_hdr *udp_hdr, uint16_t src_port,
     uint16_t dst_port, uint16_t pktdata_len)
 {
@@ -610,3 +796,147 @@ uint16_t init_udp_header(struct udp_hdr *udp_hdr, uint16_t src_port,
     return pkt_len;
 }
 
+
+
+uint16_t packet_udp_data_offset(struct rte_mbuf *pkt) {
+    struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+
+    if (eth_hdr->ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv6)) {
+        return sizeof(struct ether_hdr) + sizeof(struct ipv6_hdr) + sizeof(struct udp_hdr);
+    }
+    return sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr);
+}
+
+void packet_udp_reply_build(struct rte_mbuf *pkt, uint16_t data_len) {
+    struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+    struct ether_hdr tmp_eth_hdr;
+    uint16_t ether_type = rte_be_to_cpu_16(eth_hdr->ether_type);
+
+    init_eth_header(&tmp_eth_hdr, &eth_hdr->d_addr, &eth_hdr->s_addr, ether_type);
+    memcpy(eth_hdr, &tmp_eth_hdr, sizeof(struct ether_hdr));
+
+    if (ether_type == ETHER_TYPE_IPv6) {
+        struct ipv6_hdr *ip6_hdr = (struct ipv6_hdr *)(eth_hdr + 1);
+        struct udp_hdr *udp_hdr = (struct udp_hdr *)(ip6_hdr + 1);
+        uint8_t client_addr[16];
+
+        memcpy(client_addr, ip6_hdr->src_addr, sizeof(client_addr));
+        init_ipv6_header(ip6_hdr, ip6_hdr->dst_addr, client_addr, IPPROTO_UDP, sizeof(struct udp_hdr) + data_len);
+        init_udp_header(udp_hdr, udp_hdr->dst_port, udp_hdr->src_port, data_len);
+        /* the udp checksum is mandatory over ipv6 */
+        udp_hdr->dgram_cksum = rte_ipv6_udptcp_cksum(ip6_hdr, udp_hdr);
+        pkt->l3_len = sizeof(struct ipv6_hdr);
+    } else {
+        struct ipv4_hdr *ip_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+        struct udp_hdr *udp_hdr = (struct udp_hdr *)(ip_hdr + 1);
+        struct ipv4_hdr tmp_ipv4_hdr;
+        struct udp_hdr tmp_udp_hdr;
+
+        init_ipv4_header(&tmp_ipv4_hdr, ip_hdr->dst_addr, ip_hdr->src_addr, sizeof(struct udp_hdr) + data_len);
+        init_udp_header(&tmp_udp_hdr, udp_hdr->dst_port, udp_hdr->src_port, data_len);
+        memcpy(ip_hdr, &tmp_ipv4_hdr, sizeof(struct ipv4_hdr));
+        memcpy(udp_hdr, &tmp_udp_hdr, sizeof(struct udp_hdr));
+        pkt->l3_len = sizeof(struct ipv4_hdr);
+    }
+    pkt->pkt_len = data_len + sizeof(struct ether_hdr) + pkt->l3_len + sizeof(struct udp_hdr);
+    pkt->data_len = pkt->pkt_len;
+    pkt->l2_len = sizeof(struct ether_hdr);
+    pkt->vlan_tci  = ether_type;
+}
+
+/*
+ * Split an ipv4/ipv6 reply bigger than the port mtu. The fragments get
+ * the ethernet header of the reply back and a fresh ip id; the reply
+ * itself is only referenced by the fragments afterwards.
+ */
+static int packet_fragment(struct netif_queue_conf *conf, struct rte_mbuf *pkt,
+    struct rte_mbuf **frags, uint16_t nb_frags_max) {
+    struct ether_hdr eth_hdr;
+    uint16_t mtu = kdns_net_device.mtu;
+    uint16_t frag_id = conf->frag_id++;
+    int ipv6, nb_frags, i;
+
+    memcpy(&eth_hdr, rte_pktmbuf_mtod(pkt, struct ether_hdr *), sizeof(eth_hdr));
+    ipv6 = (eth_hdr.ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv6));
+    rte_pktmbuf_adj(pkt, sizeof(struct ether_hdr));
+
+    if (ipv6) {
+        /* the fragment payload, after the fragment header, is a multiple of 8 */
+        uint16_t hdr_len = sizeof(struct ipv6_hdr) + sizeof(struct ipv6_extension_fragment);
+        nb_frags = rte_ipv6_fragment_packet(pkt, frags, nb_frags_max,
+            RTE_ALIGN_FLOOR(mtu - hdr_len, 8) + hdr_len, pkt_mbuf_pool, frag_mbuf_pool);
+    } else {
+        rte_pktmbuf_mtod(pkt, struct ipv4_hdr *)->packet_id = rte_cpu_to_be_16(frag_id);
+        nb_frags = rte_ipv4_fragment_packet(pkt, frags, nb_frags_max,
+            RTE_ALIGN_FLOOR(mtu - sizeof(struct ipv4_hdr), 8) + sizeof(struct ipv4_hdr),
+            pkt_mbuf_pool, frag_mbuf_pool);
+    }
+    rte_pktmbuf_free(pkt);
+    if (nb_frags < 0) {
+        return nb_frags;
+    }
+
+    for (i = 0; i < nb_frags; i++) {
+        struct rte_mbuf *frag = frags[i];
+        struct ether_hdr *hdr = (struct ether_hdr *)rte_pktmbuf_prepend(frag, sizeof(struct ether_hdr));
+
+        memcpy(hdr, &eth_hdr, sizeof(eth_hdr));
+        frag->l2_len = sizeof(struct ether_hdr);
+        if (ipv6) {
+            struct ipv6_extension_fragment *fh =
+                (struct ipv6_extension_fragment *)((struct ipv6_hdr *)(hdr + 1) + 1);
+            fh->id = rte_cpu_to_be_32(frag_id);
+            frag->l3_len = sizeof(struct ipv6_hdr);
+        } else {
+            struct ipv4_hdr *ip_hdr = (struct ipv4_hdr *)(hdr + 1);
+            ip_hdr->hdr_checksum = rte_ipv4_cksum(ip_hdr);
+            frag->l3_len = sizeof(struct ipv4_hdr);
+        }
+    }
+    return nb_frags;
+}
+
+void packet_tx_enqueue(struct netif_queue_conf *conf, struct rte_mbuf *pkt) {
+    /* the fragments do not keep the port, they are queued by the reply's */
+    struct netif_tx_buf *tx = &conf->tx[kdns_net_device.port_idx[pkt->port]];
+    uint16_t room = NETIF_MAX_TX_BURST - tx->len;
+    int nb_frags;
+
+    if (likely(pkt->pkt_len <= kdns_net_device.mtu + sizeof(struct ether_hdr))) {
+        if (unlikely(room == 0)) {
+            conf->stats.pkt_dropped++;
+            rte_pktmbuf_free(pkt);
+            return;
+        }
+        tx->mbufs[tx->len++] = pkt;
+        return;
+    }
+
+    nb_frags = packet_fragment(conf, pkt, &tx->mbufs[tx->len], room);
+    if (unlikely(nb_frags < 0)) {
+        conf->stats.pkt_dropped++;
+        return;
+    }
+    conf->stats.pkts_frag++;
+    tx->len += nb_frags;
+}
+
+void packet_tx_flush(struct netif_queue_conf *conf) {
+    struct netif_tx_buf *tx;
+    uint16_t idx, i, ntx;
+
+    for (idx = 0; idx < kdns_net_device.nb_ports; idx++) {
+        tx = &conf->tx[idx];
+        if (tx->len == 0)
+            continue;
+        ntx = rte_eth_tx_burst(kdns_net_device.port_ids[idx], conf->tx_queue_id, tx->mbufs, tx->len);
+        conf->stats.dns_pkts_snd += ntx;
+        if (unlikely(ntx != tx->len)) {
+            printf("  port=%u tx=%d  real tx =%d\n", kdns_net_device.port_ids[idx], tx->len, ntx);
+            for (i = ntx; i < tx->len; i++)
+                rte_pktmbuf_free(tx->mbufs[i]);
+            conf->stats.pkt_dropped += tx->len - ntx;
+        }
+        tx->len = 0;
+    }
+}
@@ -6,15 +6,33 @@
 #include <rte_mempool.h>
 #include <rte_udp.h>
 #include <rte_ip.h>
-
-
-#define NETIF_MAX_PKT_BURST         32
+#include <rte_kni.h>
+
+
+#define NETIF_MAX_PKT_BURST         64
+#define NETIF_DEF_PKT_BURST         32
+#define NETIF_DEF_PREFETCH_DIST     3
+/* tx room for a burst of answers, each split in up to 4 ip fragments */
+#define NETIF_MAX_TX_BURST          (NETIF_MAX_PKT_BURST * 4)
+
+/*
+ * Every port found (or the bond of them, bond-mode) is served the same
+ * way: a data lcore polls its rx queue on each port in turn and answers
+ * out of its tx queue of the port the query came in on, the master sends
+ * what the kernel and the forward threads have on tx queue 0. Each port
+ * has its own kni interface, name-prefix for the first one and
+ * name-prefix<index> for the others.
+ */
+#define NETIF_MAX_PORTS             4
+#define NETIF_BOND_NONE             (-1)
+#define NETIF_BOND_NAME             "net_bonding0"
 
 #define UDP_PORT_53 0x3500 // port 53
 #define IP_DEFTTL  64   /* from RFC 1340. */
 #define IP_VERSION 0x40
 #define IP_HDRLEN  0x05 /* default IP header length == five 32-bits words. */
 #define IP_VHL_DEF (IP_VERSION | IP_HDRLEN)
+#define IP6_VERSION 0x60000000
 
 
 
@@ -31,22 +49,55 @@ struct netif_queue_stats
 
     uint64_t dns_lens_rcv; /* Total lens of  received packets. */
     uint64_t dns_lens_snd; /* Total lens of  transmitted packets. */
+
+    uint64_t answer_cache_hits;   /* Queries answered from the answer cache. */
+    uint64_t answer_cache_misses; /* Queries that went through the lookup. */
+    uint64_t fwd_cache_hits;      /* Refused queries answered from the forward cache. */
+    uint64_t fwd_cache_misses;    /* Refused queries handed to the forwarder. */
+    uint64_t fwd_cache_stale;     /* Of the hits, answered from expired entries. */
+    uint64_t fwd_cache_refreshes; /* Cache entries sent to be refreshed. */
+
+    uint64_t dns_pkts_edns;    /* Queries carrying an OPT record. */
+    uint64_t dns_pkts_no_edns; /* Queries without OPT record. */
+    uint64_t pkts_frag;        /* Answers sent in ip fragments. */
+    uint64_t rrl_dropped;      /* Answers dropped by the rate limit. */
+    uint64_t rrl_slipped;      /* Answers sent truncated by the rate limit. */
+    uint64_t filter_dropped;   /* Queries dropped by the ingress filter. */
+    uint64_t filter_refused;   /* Queries refused by the ingress filter. */
+
+    uint64_t burst_cycles; /* TSC cycles spent handling non-empty rx bursts. */
+    uint64_t burst_pkts;   /* Packets handled in those bursts. */
        
 } __rte_cache_aligned;
 
 
+/* replies waiting for tx on one port */
+struct netif_tx_buf
+{
+    uint16_t len;
+    struct rte_mbuf *mbufs[NETIF_MAX_TX_BURST];
+};
+
 /* RX/TX queue conf for lcore */
 struct netif_queue_conf
 {
-    uint16_t port_id;
-    uint16_t rx_queue_id;   
+    uint16_t rx_queue_id;   /* the same queues on every port */
     uint16_t tx_queue_id;
+    uint16_t port_idx;      /* the port polled next */
+    uint16_t burst_size;
+    uint16_t prefetch_dist;
+    uint8_t  staged;        /* parse/lookup/answer the burst stage by stage */
     struct netif_queue_stats stats;
-    uint16_t tx_len;
-    struct rte_mbuf *tx_mbufs[NETIF_MAX_PKT_BURST];
+    struct netif_tx_buf tx[NETIF_MAX_PORTS];   /* by port index */
+    uint16_t frag_id;       /* ip id of the next fragmented answer */
     
     uint16_t kni_len;
     struct rte_mbuf *kni_mbufs[NETIF_MAX_PKT_BURST];   
+
+    /* parsed dns queries waiting for the lookup and answer stages */
+    uint16_t dns_len;
+    struct rte_mbuf *dns_mbufs[NETIF_MAX_PKT_BURST];
+    uint16_t dns_flags[NETIF_MAX_PKT_BURST];
 } __rte_cache_aligned;
 
 
@@ -56,12 +107,27 @@ struct net_device {
     uint16_t max_tx_queues;
     uint16_t max_rx_desc;
     uint16_t max_tx_desc;
-    struct ether_addr hwaddr;
+    uint16_t mtu;             /* the smallest of the ports */
+
+    uint16_t nb_ports;        /* ports served, a bond is one */
+    int bond_mode;            /* BONDING_MODE_*, NETIF_BOND_NONE */
+    uint8_t port_ids[NETIF_MAX_PORTS];
+    uint8_t port_idx[RTE_MAX_ETHPORTS];      /* port id -> index */
+    struct ether_addr hwaddr[NETIF_MAX_PORTS];
+    struct rte_kni *kni[NETIF_MAX_PORTS];
+    uint8_t flow_steer[NETIF_MAX_PORTS];     /* FLOW_STEER_*, flow_steer.h */
+    uint16_t exception_queue;                /* rx queue of the steered ports the master polls */
 
     struct netif_queue_conf l_netif_queue_conf[RTE_MAX_LCORE];
 };
 
-//extern struct net_device  kdns_net_device;
+extern struct net_device  kdns_net_device;
+
+/* the mac address of the port a packet came in on */
+static inline struct ether_addr *netif_port_hwaddr(uint8_t port_id) {
+    return &kdns_net_device.hwaddr[kdns_net_device.port_idx[port_id]];
+}
+
 void netif_statsdata_get(struct netif_queue_stats *sta);
 void netif_statsdata_reset(void);
 
@@ -75,13 +141,35 @@ void init_eth_header(struct ether_hdr *eth_hdr, struct ether_addr *src_mac, \
     struct ether_addr *dst_mac, uint16_t ether_type);
 uint16_t init_ipv4_header(struct ipv4_hdr *ip_hdr, uint32_t src_addr,
     uint32_t dst_addr, uint16_t pktdata_len);
+uint16_t init_ipv6_header(struct ipv6_hdr *ip_hdr, const uint8_t *src_addr,
+    const uint8_t *dst_addr, uint8_t proto, uint16_t pktdata_len);
 uint16_t init_udp_header(struct udp_hdr *udp_hdr, uint16_t src_port,
     uint16_t dst_port, uint16_t pktdata_len);
 
+/* offset of the udp payload in a received ipv4 or ipv6 udp packet */
+uint16_t packet_udp_data_offset(struct rte_mbuf *pkt);
+/*
+ * Turn a received ipv4/ipv6 udp packet into the reply to its sender,
+ * carrying the data_len payload bytes already written in place.
+ */
+void packet_udp_reply_build(struct rte_mbuf *pkt, uint16_t data_len);
+/*
+ * Queue a reply for tx on the lcore, split in ip fragments when it does
+ * not fit the port mtu (large edns answers).
+ */
+void packet_tx_enqueue(struct netif_queue_conf *conf, struct rte_mbuf *pkt);
+
+/* send replies out of the ports they came in on, lcore tx queue; frees what is left */
+void packet_tx_flush(struct netif_queue_conf *conf);
+/* the same from the master lcore, tx queue 0 */
+void netif_master_tx(struct rte_mbuf **pkts, uint16_t nb_pkts);
+
 int kni_free_kni(uint8_t port_id);
 
 void dns_kni_enqueue(struct netif_queue_conf *conf,struct rte_mbuf **mbufs,uint16_t rx_len);
 uint16_t dns_kni_dequeue(struct rte_mbuf **mbufs,uint16_t pkts_len);
+/* hand packets the lcores queued for the kernel to the kni of their port */
+void dns_kni_tx(struct rte_mbuf **mbufs, uint16_t nb_pkts);
 void dns_dpdk_init(void);
 
 
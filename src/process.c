@@ -20,17 +20,45 @@
 #include "netdev.h"
 
 #include "forward.h"
+#include "fwd_cache.h"
+#include "fwd_dpdk.h"
 #include "domain_update.h"
 #include "view_update.h"
+#include "store_rcu.h"
+#include "rrl.h"
+#include "filter_update.h"
+#include "flow_steer.h"
 
 
 
 
 extern struct dns_config *g_dns_cfg;
 extern struct rte_mempool *pkt_mbuf_pool;
-extern struct rte_kni     *master_kni;
-extern struct net_device  kdns_net_device;
 static void packet_icmp_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf);
+static int packet_icmp6_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf);
+
+#define ICMP6_ECHO_REQUEST_TYPE   128
+#define ICMP6_ECHO_REPLY_TYPE     129
+#define ICMP6_NEIGH_SOLICIT_TYPE  135
+#define ICMP6_NEIGH_ADVERT_TYPE   136
+#define ICMP6_OPT_TARGET_LLADDR   2
+#define ICMP6_NA_FLAG_SOLICITED   0x40000000
+#define ICMP6_NA_FLAG_OVERRIDE    0x20000000
+
+/* neighbor solicitation / advertisement, RFC 4861 */
+struct icmp6_nd_hdr {
+    uint8_t  icmp_type;
+    uint8_t  icmp_code;
+    uint16_t icmp_cksum;
+    uint32_t flags;
+    uint8_t  target[16];
+} __attribute__((__packed__));
+
+struct icmp6_nd_lladdr_opt {
+    uint8_t  type;
+    uint8_t  len;   /* in units of 8 bytes */
+    struct ether_addr addr;
+} __attribute__((__packed__));
 
 #if 0
 static void print_ip(uint32_t sip, uint32_t dip) {
@@ -51,23 +79,140 @@ static void print_ip(uint32_t sip, uint32_t dip) {
 
 #endif
 
+/*
+ * Turn the query mbuf into the response built in query->packet and queue it
+ * for tx. Refused queries are answered from the forward cache, or handed to
+ * the forwarder when it has nothing fresh (or stale, with serve-stale). A
+ * hit the cache wants refreshed also sends a copy of the query upstream.
+ * In dpdk forward mode the lcore forwards them itself. Answers over the
+ * rrl rate are dropped or sent truncated.
+ */
+static void packet_dns_reply(struct rte_mbuf *pkt, kdns_query_st *query, struct netif_queue_conf *conf, uint16_t flags_old) {
+
+    int retLen = buffer_remaining(query->packet);
+    int cache_flags;
+
+    if(GET_RCODE(query->packet) == RCODE_REFUSE ) {
+           char * bufdata = rte_pktmbuf_mtod_offset(pkt, char*, packet_udp_data_offset(pkt));
+           memcpy(bufdata + 2, &flags_old, 2);  
+           /* answers to DO queries are not cached, they may carry dnssec records */
+           retLen = query->edns.dnssec_ok ? -1 : fwd_cache_answer((uint8_t *)bufdata, domain_name_get(query->qname),
+               query->qname->name_size, query->qtype, pkt->buf_len - pkt->data_off - packet_udp_data_offset(pkt),
+               query->edns.status == EDNS_OK, &cache_flags);
+           if (retLen < 0) {
+               conf->stats.fwd_cache_misses++;
+               if (g_dns_cfg->comm.fwd_mode == FWD_MODE_DPDK) {
+                   fwd_dpdk_query(conf, pkt, query->qtype, domain_name_to_string(query->qname, NULL));
+               } else {
+                   dns_handle_remote(pkt,GET_ID(query->packet),query->qtype,(char *)domain_name_to_string(query->qname, NULL));
+               }
+               return;
+           }
+           conf->stats.fwd_cache_hits++;
+           if (cache_flags & FWD_CACHE_ANSWER_STALE) {
+               conf->stats.fwd_cache_stale++;
+           }
+           if ((cache_flags & FWD_CACHE_ANSWER_REFRESH) &&
+               (g_dns_cfg->comm.fwd_mode == FWD_MODE_DPDK ?
+                   fwd_dpdk_refresh(conf, pkt, query->qtype, domain_name_to_string(query->qname, NULL)) :
+                   dns_handle_refresh(pkt, query->qtype, domain_name_to_string(query->qname, NULL))) == 0) {
+               conf->stats.fwd_cache_refreshes++;
+           }
+    }
+    if (retLen > 0 && g_dns_cfg->comm.rrl_rate) {
+        uint8_t *resp = rte_pktmbuf_mtod_offset(pkt, uint8_t *, packet_udp_data_offset(pkt));
+        int qlen;
+
+        switch (rrl_check(rte_lcore_id(), query->client_addr, query->client_addr_len,
+                domain_name_get(query->qname), query->qname->name_size, resp[3] & 0x0f)) {
+        case RRL_DROP:
+            conf->stats.rrl_dropped++;
+            rte_pktmbuf_free(pkt);
+            return;
+        case RRL_SLIP:
+            /* header and question only, TC set: a real client comes back over tcp */
+            qlen = (resp[4] | resp[5]) ? fwd_question_len(resp, retLen) : 0;
+            if (qlen == 0 && (resp[4] | resp[5])) {
+                conf->stats.rrl_dropped++;
+                rte_pktmbuf_free(pkt);
+                return;
+            }
+            retLen = DNS_HEAD_SIZE + qlen;
+            resp[2] |= 0x02;
+            memset(resp + 6, 0, 6);
+            conf->stats.rrl_slipped++;
+            break;
+        default:
+            break;
+        }
+    }
+    if(retLen > 0) {
+        packet_udp_reply_build(pkt, retLen);
+        conf->stats.dns_lens_snd += pkt->pkt_len;
+        packet_tx_enqueue(conf, pkt);
+       // printf("snd len =%d\n",pkt->pkt_len);
+    }
+}
+
+/*
+ * Handle one udp/53 query of either address family: answer it right away,
+ * or in staged mode park it for the lookup and answer stages of the burst.
+ */
+static void packet_dns_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf,
+    const uint8_t *saddr, int saddr_len, uint16_t udp_hdr_offset, int received) {
+
+    kdns_query_st *query;
+    uint16_t flags_old ;
+    char * bufdata = rte_pktmbuf_mtod_offset(pkt, char*, udp_hdr_offset);
+
+    conf->stats.dns_pkts_rcv++;
+   // printf("rvc len =%d\n",pkt->pkt_len);
+    conf->stats.dns_lens_rcv += pkt->pkt_len;
+
+    /* shed what the ingress filter denies before paying for the parse */
+    switch (dns_packet_filter(rte_lcore_id(), saddr, saddr_len, (uint8_t *)bufdata, received)) {
+    case FILTER_PASS:
+        break;
+    case FILTER_REFUSE:
+        if ((received = filter_refuse((uint8_t *)bufdata, received)) > 0) {
+            conf->stats.filter_refused++;
+            packet_udp_reply_build(pkt, received);
+            conf->stats.dns_lens_snd += pkt->pkt_len;
+            packet_tx_enqueue(conf, pkt);
+            return;
+        }
+        /* fall through */
+    default:
+        conf->stats.filter_dropped++;
+        rte_pktmbuf_free(pkt);
+        return;
+    }
+    memcpy(&flags_old,bufdata+2 , 2);
+
+    if (conf->staged) {
+        /* parse stage, views, lookup and answer run once the whole burst is parsed */
+        query = dns_query_get(rte_lcore_id(), conf->dns_len);
+        if (dns_packet_parse(query, pkt, saddr, saddr_len, udp_hdr_offset, received) == QUERY_LOOKUP) {
+            conf->dns_mbufs[conf->dns_len] = pkt;
+            conf->dns_flags[conf->dns_len] = flags_old;
+            conf->dns_len++;
+            return;
+        }
+    } else {
+        query = dns_packet_proess(pkt, saddr, saddr_len, udp_hdr_offset, received);
+    }
+    packet_dns_reply(pkt, query, conf, flags_old);
+}
+
 int packet_l3_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf) {
     
-    struct ether_hdr *eth_hdr_in = NULL;
     struct ipv4_hdr  *ip_hdr_in = NULL;
     struct udp_hdr   *udp_hdr_in = NULL; 
     
-    struct ether_hdr tmp_eth_hdr;
-    struct ipv4_hdr  tmp_ipv4_hdr;
-    struct udp_hdr   tmp_udp_hdr;
-    
     uint16_t ether_hdr_offset = sizeof(struct ether_hdr);
     uint16_t ip_hdr_offset    = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr);
     uint16_t udp_hdr_offset   = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr);
    
-
-    kdns_query_st *query;
-    
     ip_hdr_in = rte_pktmbuf_mtod_offset(pkt, struct ipv4_hdr *, ether_hdr_offset);
 
     int ip_headlen           = (ip_hdr_in->version_ihl & 0xF)<<2 ;
@@ -90,7 +235,6 @@ int packet_l3_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf) {
 
     switch(ip_hdr_in->next_proto_id) {
     case IPPROTO_UDP:
-        eth_hdr_in = rte_pktmbuf_mtod(pkt, struct ether_hdr*);
         udp_hdr_in = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr*, ip_hdr_offset);
         if(ip_total_length != ip_headlen + ntohs(udp_hdr_in->dgram_len)) {
              conf->stats.pkt_len_err++;
@@ -99,53 +243,17 @@ int packet_l3_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf) {
         }
         
         if(udp_hdr_in->dst_port == UDP_PORT_53) { // port 53
-
-            conf->stats.dns_pkts_rcv++;
-           // printf("rvc len =%d\n",pkt->pkt_len);
-            conf->stats.dns_lens_rcv += pkt->pkt_len;
             int received = rte_be_to_cpu_16(udp_hdr_in->dgram_len) - sizeof(struct udp_hdr);
-
-            uint16_t flags_old ;
-            char * bufdata = rte_pktmbuf_mtod_offset(pkt, char*, udp_hdr_offset);
-            memcpy(&flags_old,bufdata+2 , 2);
-              
-            query = dns_packet_proess(pkt, ip_hdr_in->src_addr,udp_hdr_offset, received);
-            int retLen = buffer_remaining(query->packet);
-
-            if(GET_RCODE(query->packet) == RCODE_REFUSE ) {
-                   memcpy(bufdata + 2, &flags_old, 2);  
-                   dns_handle_remote(pkt,GET_ID(query->packet),query->qtype,(char *)domain_name_to_string(query->qname, NULL));
-                  return 0;
-            }
-            if(query != NULL && retLen > 0) {
-                init_eth_header(&tmp_eth_hdr, &eth_hdr_in->d_addr, &eth_hdr_in->s_addr, ETHER_TYPE_IPv4);
-                init_ipv4_header(&tmp_ipv4_hdr, ip_hdr_in->dst_addr, ip_hdr_in->src_addr, sizeof(struct udp_hdr) + retLen);
-                init_udp_header(&tmp_udp_hdr, udp_hdr_in->dst_port, udp_hdr_in->src_port, retLen);
-
-                memcpy(eth_hdr_in,&tmp_eth_hdr, sizeof(struct ether_hdr));
-                memcpy(ip_hdr_in,&tmp_ipv4_hdr, sizeof(struct ipv4_hdr));
-                memcpy(udp_hdr_in,&tmp_udp_hdr, sizeof(struct udp_hdr));
-                pkt->pkt_len = retLen + udp_hdr_offset;
-                pkt->data_len = pkt->pkt_len;
-                pkt->l2_len = sizeof(struct ether_hdr);
-                pkt->vlan_tci  = ETHER_TYPE_IPv4;
-                pkt->l3_len = sizeof(struct ipv4_hdr);  
-                
-                conf->tx_mbufs[conf->tx_len] = pkt;
-                conf->tx_len++;
-                conf->stats.dns_lens_snd += pkt->pkt_len;
-               // printf("snd len =%d\n",pkt->pkt_len);
-            }
-            
-        }else{
+            packet_dns_handle(pkt, conf, (uint8_t *)&ip_hdr_in->src_addr, sizeof(ip_hdr_in->src_addr),
+                udp_hdr_offset, received);
+        }else if (fwd_dpdk_response(conf, pkt, ip_hdr_in, udp_hdr_in) != 0) {
             conf->stats.pkt_dropped++;
              rte_pktmbuf_free(pkt);     
         }
         return 0;
     case IPPROTO_ICMP:
         packet_icmp_handle(pkt,conf);
-        conf->tx_mbufs[conf->tx_len] = pkt;
-        conf->tx_len++;
+        packet_tx_enqueue(conf, pkt);
         return 0;
     default:
         conf->kni_mbufs[conf->kni_len]= pkt;
@@ -159,6 +267,108 @@ cleanup:
     return 0;
 }
 
+int packet_l3_ipv6_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf) {
+
+    struct ipv6_hdr  *ip6_hdr_in = NULL;
+    struct udp_hdr   *udp_hdr_in = NULL; 
+
+    uint16_t ether_hdr_offset = sizeof(struct ether_hdr);
+    uint16_t ip_hdr_offset    = sizeof(struct ether_hdr) + sizeof(struct ipv6_hdr);
+    uint16_t udp_hdr_offset   = sizeof(struct ether_hdr) + sizeof(struct ipv6_hdr) + sizeof(struct udp_hdr);
+
+    ip6_hdr_in = rte_pktmbuf_mtod_offset(pkt, struct ipv6_hdr *, ether_hdr_offset);
+    uint16_t payload_len = rte_be_to_cpu_16(ip6_hdr_in->payload_len);
+
+    //check the pkt
+    if(pkt->pkt_len < payload_len + ip_hdr_offset)
+    {
+        conf->stats.pkt_len_err++;
+        printf("pkt_len  err: pkt->pkt_len(%d)< payload_len(%d)+ ip6_hdr_offset(%d)\n",pkt->pkt_len , payload_len,ip_hdr_offset);
+        goto cleanup;
+    }
+
+    /* extension headers are left to the kernel */
+    switch(ip6_hdr_in->proto) {
+    case IPPROTO_UDP:
+        udp_hdr_in = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr*, ip_hdr_offset);
+        if(payload_len < sizeof(struct udp_hdr) || payload_len != ntohs(udp_hdr_in->dgram_len)) {
+             conf->stats.pkt_len_err++;
+             printf("udp_hdr_in->dgram_len  err: payload_len (%d) != dgram_len(%d)\n",payload_len,ntohs(udp_hdr_in->dgram_len));
+             goto cleanup; 
+        }
+
+        if(udp_hdr_in->dst_port == UDP_PORT_53) { // port 53
+            int received = payload_len - sizeof(struct udp_hdr);
+            packet_dns_handle(pkt, conf, ip6_hdr_in->src_addr, sizeof(ip6_hdr_in->src_addr),
+                udp_hdr_offset, received);
+            return 0;
+        }
+        break;
+    case IPPROTO_ICMPV6:
+        if (packet_icmp6_handle(pkt, conf) == 0) {
+            packet_tx_enqueue(conf, pkt);
+            return 0;
+        }
+        break;
+    default:
+        break;
+    }
+    conf->kni_mbufs[conf->kni_len]= pkt;
+    conf->kni_len ++;
+    return 0;
+
+cleanup:
+    conf->stats.pkt_dropped++;
+    rte_pktmbuf_free(pkt);
+    return 0;
+}
+
+/*
+ * Lookup and answer stages for the queries parsed from one burst. Each
+ * stage runs over the whole burst so the domain and rrset fetches of the
+ * queries prefetch_dist ahead overlap with the work on the current one.
+ */
+static void packet_dns_burst_handle(struct netif_queue_conf *conf) {
+    unsigned lcore_id = rte_lcore_id();
+    uint16_t dist = conf->prefetch_dist;
+    uint8_t cached[NETIF_MAX_PKT_BURST];
+    int i;
+
+    dns_packet_views(lcore_id, conf->dns_len);
+    for (i = 0; i < conf->dns_len; i++) {
+        cached[i] = dns_packet_cached(dns_query_get(lcore_id, i));
+    }
+    for (i = 0; i < conf->dns_len && i < dist; i++) {
+        if (!cached[i]) {
+            dns_packet_prefetch(dns_query_get(lcore_id, i));
+        }
+    }
+    for (i = 0; i < conf->dns_len; i++) {
+        if (i + dist < conf->dns_len && !cached[i + dist]) {
+            dns_packet_prefetch(dns_query_get(lcore_id, i + dist));
+        }
+        if (!cached[i]) {
+            dns_packet_lookup(dns_query_get(lcore_id, i));
+        }
+    }
+    for (i = 0; i < conf->dns_len && i < dist; i++) {
+        if (!cached[i]) {
+            query_prefetch_rrsets(dns_query_get(lcore_id, i));
+        }
+    }
+    for (i = 0; i < conf->dns_len; i++) {
+        kdns_query_st *query = dns_query_get(lcore_id, i);
+        if (i + dist < conf->dns_len && !cached[i + dist]) {
+            query_prefetch_rrsets(dns_query_get(lcore_id, i + dist));
+        }
+        if (!cached[i]) {
+            dns_packet_answer(query);
+        }
+        packet_dns_reply(conf->dns_mbufs[i], query, conf, conf->dns_flags[i]);
+    }
+    conf->dns_len = 0;
+}
+
 #define is_multicast_ipv4_addr(ipv4_addr) \
 	(((rte_be_to_cpu_32((ipv4_addr)) >> 24) & 0x000000FF) == 0xE0)
 
@@ -206,7 +416,7 @@ static void packet_icmp_handle(struct rte_mbuf *pkt, struct netif_queue_conf *co
     	/* Use source MAC address as destination MAC address. */
     	ether_addr_copy(&eth_h->s_addr, &eth_h->d_addr);
     	/* Set source MAC address with MAC address of TX port */
-    	ether_addr_copy(&kdns_net_device.hwaddr,&eth_h->s_addr);
+    	ether_addr_copy(netif_port_hwaddr(pkt->port),&eth_h->s_addr);
 
     	arp_h->arp_op = rte_cpu_to_be_16(ARP_OP_REPLY);
 
@@ -253,53 +463,152 @@ static void packet_icmp_handle(struct rte_mbuf *pkt, struct netif_queue_conf *co
 }
 
 
+static int ipv6_addr_is_local(const uint8_t *addr) {
+    int i;
+    for (i = 0; i < g_dns_cfg->netdev.kni_ipv6_num; i++) {
+        if (memcmp(addr, &g_dns_cfg->netdev.kni_ipv6[i], sizeof(struct in6_addr)) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Answer ICMPv6 echo requests and neighbor solicitations for our own
+ * addresses in place. Returns -1 for anything the kernel has to see.
+ */
+static int packet_icmp6_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf) {
+
+    struct ether_hdr *eth_h;
+    struct ipv6_hdr *ip6_h;
+    struct icmp_hdr *icmp_h;
+    struct ether_addr eth_addr;
+    uint8_t ip6_addr[16];
+    uint16_t payload_len;
+
+    eth_h = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+    ip6_h = (struct ipv6_hdr *) ((char *)eth_h + sizeof(struct ether_hdr));
+    icmp_h = (struct icmp_hdr *) ((char *)ip6_h + sizeof(struct ipv6_hdr));
+    payload_len = rte_be_to_cpu_16(ip6_h->payload_len);
+    if (payload_len < sizeof(struct icmp_hdr))
+        return -1;
+
+    switch (icmp_h->icmp_type) {
+    case ICMP6_ECHO_REQUEST_TYPE:
+        if (ip6_h->dst_addr[0] == 0xff)
+            return -1;
+        ether_addr_copy(&eth_h->s_addr, &eth_addr);
+        ether_addr_copy(&eth_h->d_addr, &eth_h->s_addr);
+        ether_addr_copy(&eth_addr, &eth_h->d_addr);
+        memcpy(ip6_addr, ip6_h->src_addr, sizeof(ip6_addr));
+        memcpy(ip6_h->src_addr, ip6_h->dst_addr, sizeof(ip6_addr));
+        memcpy(ip6_h->dst_addr, ip6_addr, sizeof(ip6_addr));
+        ip6_h->hop_limits = IP_DEFTTL;
+        icmp_h->icmp_type = ICMP6_ECHO_REPLY_TYPE;
+        break;
+
+    case ICMP6_NEIGH_SOLICIT_TYPE: {
+        /* the advertisement is built over the solicitation, target stays in place */
+        struct icmp6_nd_hdr *nd = (struct icmp6_nd_hdr *)icmp_h;
+        struct icmp6_nd_lladdr_opt *opt = (struct icmp6_nd_lladdr_opt *)(nd + 1);
+        static const uint8_t all_nodes[16] = {0xff, 0x02, [15] = 0x01};
+        static const uint8_t unspecified[16];
+        int dad;
+
+        if (payload_len < sizeof(struct icmp6_nd_hdr) || ip6_h->hop_limits != 255 ||
+            nd->icmp_code != 0 || !ipv6_addr_is_local(nd->target))
+            return -1;
+
+        /* duplicate address detection probes come from :: and get a multicast answer */
+        dad = memcmp(ip6_h->src_addr, unspecified, sizeof(unspecified)) == 0;
+
+        nd->icmp_type = ICMP6_NEIGH_ADVERT_TYPE;
+        nd->flags = rte_cpu_to_be_32(dad ? ICMP6_NA_FLAG_OVERRIDE :
+            (ICMP6_NA_FLAG_SOLICITED | ICMP6_NA_FLAG_OVERRIDE));
+        opt->type = ICMP6_OPT_TARGET_LLADDR;
+        opt->len = 1;
+        ether_addr_copy(netif_port_hwaddr(pkt->port), &opt->addr);
+        payload_len = sizeof(struct icmp6_nd_hdr) + sizeof(struct icmp6_nd_lladdr_opt);
+
+        if (dad) {
+            static const struct ether_addr all_nodes_mac = {
+                .addr_bytes = {0x33, 0x33, 0x00, 0x00, 0x00, 0x01} };
+            memcpy(ip6_h->dst_addr, all_nodes, sizeof(all_nodes));
+            ether_addr_copy(&all_nodes_mac, &eth_h->d_addr);
+        } else {
+            memcpy(ip6_h->dst_addr, ip6_h->src_addr, sizeof(ip6_addr));
+            ether_addr_copy(&eth_h->s_addr, &eth_h->d_addr);
+        }
+        memcpy(ip6_h->src_addr, nd->target, sizeof(ip6_addr));
+        ether_addr_copy(netif_port_hwaddr(pkt->port), &eth_h->s_addr);
+        ip6_h->payload_len = rte_cpu_to_be_16(payload_len);
+        ip6_h->hop_limits = 255;
+        pkt->pkt_len = sizeof(struct ether_hdr) + sizeof(struct ipv6_hdr) + payload_len;
+        pkt->data_len = pkt->pkt_len;
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    conf->stats.pkts_icmp ++;
+    icmp_h->icmp_cksum = 0;
+    icmp_h->icmp_cksum = rte_ipv6_udptcp_cksum(ip6_h, icmp_h);
+    return 0;
+}
+
+
 int process_slave(__attribute__((unused)) void *arg) {
     unsigned lcore_id = rte_lcore_id();
 
     int t,k;
     struct netif_queue_conf *conf = netif_queue_conf_get(lcore_id);    
     printf("Starting core %u conf:  rx=%d, tx=%d \n", lcore_id,conf->rx_queue_id,conf->tx_queue_id);
-    domain_msg_ring_create();
-    view_msg_ring_create();
+    store_rcu_online(lcore_id);
     
     while (1){
-        view_msg_slave_process();
-        doman_msg_slave_process();
+        kdns_quiescent(lcore_id);
         struct rte_mbuf *mbufs[NETIF_MAX_PKT_BURST] ={0};
         uint16_t rx_count;
+        uint64_t start_tsc;
+        uint8_t port;
+
+        conf->kni_len = conf->dns_len = 0;
+        /* upstream answers other lcores received, hedges and timeouts */
+        fwd_dpdk_poll(conf);
     
-        rx_count = rte_eth_rx_burst(conf->port_id, conf->rx_queue_id, mbufs, NETIF_MAX_PKT_BURST);
+        /* one burst from each port in turn */
+        port = kdns_net_device.port_ids[conf->port_idx];
+        if (++conf->port_idx == kdns_net_device.nb_ports)
+            conf->port_idx = 0;
+        rx_count = rte_eth_rx_burst(port, conf->rx_queue_id, mbufs, conf->burst_size);
 
         if (unlikely(rx_count == 0)) {
+           packet_tx_flush(conf);
            continue;
         } 
-        conf->tx_len = conf->kni_len =0;
-        memset(conf->tx_mbufs,0,sizeof(conf->tx_mbufs));
-        memset(conf->kni_mbufs,0,sizeof(conf->kni_mbufs));
+        start_tsc = rte_rdtsc();
 
         /* prefetch packets */
-        for (t = 0; t < rx_count && t < 3; t++)
+        for (t = 0; t < rx_count && t < conf->prefetch_dist; t++)
              rte_prefetch0(rte_pktmbuf_mtod(mbufs[t], void *));
         
         for (k = 0; k < rx_count; k++) {
+                /* a bond leaves the slave's id, the replies go out of the bond */
+                mbufs[k]->port = port;
                 packet_l2_handle(mbufs[k],conf);      
                 if (t < rx_count) {
                     rte_prefetch0(rte_pktmbuf_mtod(mbufs[t], void *));
                     t++;
                 } 
         }
-        // send the pkts
-        if (likely(conf->tx_len >0)){
-               int ntx = rte_eth_tx_burst(conf->port_id,conf->tx_queue_id, conf->tx_mbufs, conf->tx_len);
-               conf->stats.dns_pkts_snd += ntx;
-               if (unlikely(ntx != conf->tx_len)){
-                   printf("  rx =%d tx=%d  real tx =%d\n",rx_count,conf->tx_len,ntx);
-                   int i =0;
-                   for (i = ntx; i < conf->tx_len; i++)
-                       rte_pktmbuf_free(conf->tx_mbufs[i]);
-                   conf->stats.pkt_dropped += ntx;
-               }
+        if (conf->dns_len > 0) {
+            packet_dns_burst_handle(conf);
         }
+        conf->stats.burst_cycles += rte_rdtsc() - start_tsc;
+        conf->stats.burst_pkts += rx_count;
+
+        // send the pkts
+        packet_tx_flush(conf);
         // snd to master
         if (unlikely(conf->kni_len > 0)){
             dns_kni_enqueue(conf,conf->kni_mbufs,conf->kni_len);
@@ -313,52 +622,47 @@ void process_master(__attribute__((unused)) void *arg) {
     
      domain_msg_ring_create();
      view_msg_ring_create();
+     filter_msg_ring_create();
 
      domian_info_exchange_run(g_dns_cfg->comm.web_port);
 
     while(1) {
         struct rte_mbuf *pkts_kni_rx[NETIF_MAX_PKT_BURST];
-        unsigned pkt_num;
+        uint16_t idx;
         view_msg_master_process();
         doman_msg_master_process();
+        fwd_zone_msg_master_process();
+        filter_msg_master_process();
         uint16_t rx_count = dns_kni_dequeue(pkts_kni_rx,NETIF_MAX_PKT_BURST);
-        if (rx_count == 0){
-            rte_kni_tx_burst(master_kni,NULL , 0); 
-           // rte_delay_ms(30);
-        }else{
-            pkt_num = rte_kni_tx_burst(master_kni, pkts_kni_rx, rx_count);          
-            if (unlikely(pkt_num < rx_count)) {
-                int i =0;
-                for(i = pkt_num; i < rx_count; i ++  )
-                    rte_pktmbuf_free(pkts_kni_rx[i]);
-            }
+        dns_kni_tx(pkts_kni_rx, rx_count);
+
+        // what the flow rules steered past the data lcores, straight to the kernel
+        for (idx = 0; idx < kdns_net_device.nb_ports; idx++) {
+            if (kdns_net_device.flow_steer[idx] == FLOW_STEER_NONE)
+                continue;
+            rx_count = rte_eth_rx_burst(kdns_net_device.port_ids[idx], kdns_net_device.exception_queue,
+                pkts_kni_rx, NETIF_MAX_PKT_BURST);
+            if (rx_count > 0)
+                dns_kni_tx(pkts_kni_rx, rx_count);
         }
 
         // kni 
-        rte_kni_handle_request(master_kni);
-
-        struct rte_mbuf *kni_pkts_tx[NETIF_MAX_PKT_BURST];
-        unsigned npkts = rte_kni_rx_burst(master_kni, kni_pkts_tx, NETIF_MAX_PKT_BURST);
-        if(npkts > 0) {
-            uint16_t nb_tx = rte_eth_tx_burst(0, 0, kni_pkts_tx, (uint16_t)npkts);
-            if(nb_tx < npkts){
-                uint16_t i =0;
-                for(i = nb_tx; i < npkts; i++  )
-                    rte_pktmbuf_free(kni_pkts_tx[i]);
-           }
-        }   
+        for (idx = 0; idx < kdns_net_device.nb_ports; idx++) {
+            struct rte_kni *kni = kdns_net_device.kni[idx];
+            struct rte_mbuf *kni_pkts_tx[NETIF_MAX_PKT_BURST];
+            unsigned npkts, i;
+
+            rte_kni_handle_request(kni);
+            npkts = rte_kni_rx_burst(kni, kni_pkts_tx, NETIF_MAX_PKT_BURST);
+            for (i = 0; i < npkts; i++)
+                kni_pkts_tx[i]->port = kdns_net_device.port_ids[idx];
+            netif_master_tx(kni_pkts_tx, (uint16_t)npkts);
+        }
 
-        //fwd
+        //fwd, the answers go out of the ports their queries came in on
         struct rte_mbuf *fwd_pkts_tx[NETIF_MAX_PKT_BURST];
         uint16_t fwd_count = fwd_pkts_dequeue(fwd_pkts_tx,NETIF_MAX_PKT_BURST);
-        if (fwd_count != 0){
-            int nb_tx = rte_eth_tx_burst(0, 0, fwd_pkts_tx, (uint16_t)fwd_count);
-            if(nb_tx < fwd_count){
-                int i =0;
-                for(i = nb_tx; i < fwd_count; i ++  )
-                    rte_pktmbuf_free(fwd_pkts_tx[i]);
-           }
-        }
+        netif_master_tx(fwd_pkts_tx, fwd_count);
     }
     
     return ;
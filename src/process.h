@@ -4,6 +4,7 @@
 #include "netdev.h"
 
 int packet_l3_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf);
+int packet_l3_ipv6_handle(struct rte_mbuf *pkt, struct netif_queue_conf *conf);
 int process_slave(__attribute__((unused)) void *arg);
 void process_master(__attribute__((unused)) void *arg);
 
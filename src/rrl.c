@@ -0,0 +1,141 @@
+/*
+ * rrl.c -- per-lcore response rate limiting
+ */
+
+#include <string.h>
+#include <stdio.h>
+
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_jhash.h>
+#include <rte_common.h>
+#include <rte_cycles.h>
+
+#include "rrl.h"
+#include "util.h"
+
+#define RRL_WAYS        4
+#define RRL_TOKEN       1000    /* one answer, buckets count milli-answers */
+
+struct rrl_entry {
+    uint32_t tag;       /* key hash, 0: empty */
+    uint32_t stamp;     /* ms of the last refill */
+    int32_t  tokens;
+    uint32_t limited;   /* answers over the rate, for the slip */
+};
+
+struct rrl_set {
+    struct rrl_entry way[RRL_WAYS];
+} __rte_cache_aligned;
+
+struct rrl_table {
+    uint32_t rate;          /* answers per second, 0: off */
+    int32_t  burst;         /* in milli-answers */
+    uint32_t slip;
+    uint32_t mask;
+    uint64_t ms_cycles;
+    struct rrl_set *sets;
+} __rte_cache_aligned;
+
+static struct rrl_table rrl_tables[RTE_MAX_LCORE];
+
+
+int rrl_init(unsigned lcore_id, uint32_t rate, uint32_t burst, uint32_t slip, uint32_t size) {
+    struct rrl_table *t = &rrl_tables[lcore_id];
+    uint32_t nsets;
+
+    t->sets = NULL;
+    t->rate = 0;
+    if (rate == 0 || size == 0) {
+        return 0;
+    }
+    nsets = rte_align32pow2(RTE_MAX(size / RRL_WAYS, 1U));
+    t->sets = rte_zmalloc_socket(NULL, nsets * sizeof(struct rrl_set),
+        RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+    if (t->sets == NULL) {
+        log_msg(LOG_ERR, "rrl table alloc failed for lcore %u, size %u\n", lcore_id, nsets * RRL_WAYS);
+        return -1;
+    }
+    t->mask = nsets - 1;
+    t->rate = rate;
+    t->burst = (int32_t)(burst ? burst : rate) * RRL_TOKEN;
+    t->slip = slip;
+    t->ms_cycles = RTE_MAX(rte_get_timer_hz() / 1000, 1ULL);
+    return 0;
+}
+
+static inline uint32_t
+rrl_hash(const uint8_t *addr, int addr_len, const uint8_t *qname, uint16_t qname_len, uint8_t rcode) {
+    uint8_t prefix[8] = {0};
+    uint32_t hash;
+
+    /* the client's /24 or /56 */
+    if (addr_len == 4) {
+        memcpy(prefix, addr, 3);
+    } else if (addr_len == 16) {
+        memcpy(prefix, addr, 7);
+        prefix[7] = 6;
+    }
+    hash = rte_jhash(qname, qname_len, rcode);
+    hash = rte_jhash_2words(*(uint32_t *)prefix, *(uint32_t *)(prefix + 4), hash);
+    return hash ? hash : 1;
+}
+
+int rrl_check(unsigned lcore_id, const uint8_t *addr, int addr_len,
+    const uint8_t *qname, uint16_t qname_len, uint8_t rcode) {
+    struct rrl_table *t = &rrl_tables[lcore_id];
+    struct rrl_entry *e, *oldest;
+    struct rrl_set *set;
+    uint32_t hash, now, elapsed;
+    int i;
+
+    if (t->sets == NULL) {
+        return RRL_PASS;
+    }
+    hash = rrl_hash(addr, addr_len, qname, qname_len, rcode);
+    now = (uint32_t)(rte_get_timer_cycles() / t->ms_cycles);
+    set = &t->sets[hash & t->mask];
+
+    /* else the first empty way, else the one used longest ago */
+    e = NULL;
+    oldest = NULL;
+    for (i = 0; i < RRL_WAYS; i++) {
+        if (set->way[i].tag == hash) {
+            e = &set->way[i];
+            break;
+        }
+        if (oldest != NULL && oldest->tag == 0) {
+            continue;
+        }
+        if (oldest == NULL || set->way[i].tag == 0 || (int32_t)(set->way[i].stamp - oldest->stamp) < 0) {
+            oldest = &set->way[i];
+        }
+    }
+    if (e == NULL) {
+        /* a new key starts with a full bucket */
+        e = oldest;
+        e->tag = hash;
+        e->stamp = now;
+        e->tokens = t->burst;
+        e->limited = 0;
+    } else {
+        elapsed = now - e->stamp;
+        if (elapsed >= (uint32_t)t->burst / t->rate + 1) {
+            e->tokens = t->burst;
+        } else {
+            e->tokens = RTE_MIN((int64_t)e->tokens + (int64_t)elapsed * t->rate, (int64_t)t->burst);
+        }
+        e->stamp = now;
+    }
+
+    if (e->tokens >= RRL_TOKEN) {
+        e->tokens -= RRL_TOKEN;
+        e->limited = 0;
+        return RRL_PASS;
+    }
+    e->limited++;
+    if (t->slip && e->limited % t->slip == 0) {
+        return RRL_SLIP;
+    }
+    return RRL_DROP;
+}
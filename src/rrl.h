@@ -0,0 +1,35 @@
+#ifndef __RRL_H__
+#define __RRL_H__
+
+#include <stdint.h>
+
+/*
+ * Response rate limiting on the data lcores. Every answer is charged to a
+ * token bucket keyed by the client's network (/24, or /56 for ipv6), the
+ * qname and the rcode, so one spoofed victim network asking one name is
+ * limited without touching anyone else. The buckets live in a per-lcore
+ * table of 4-way sets, one cache line each; a key that misses takes the
+ * least recently used way of its set. Nothing is shared, RSS keeps a client
+ * on one lcore. Over its rate an answer is dropped, except every rrl-slip'th
+ * one which goes out truncated (TC=1, no records) so a real client can
+ * retry over TCP.
+ */
+
+#define RRL_DEF_TABLE_SIZE   65536
+#define RRL_DEF_SLIP         2
+#define RRL_MAX_RATE         1000000
+
+enum {
+    RRL_PASS = 0,
+    RRL_DROP,
+    RRL_SLIP,
+};
+
+/* rate 0 turns it off, size is rounded up to a power of 2 */
+int rrl_init(unsigned lcore_id, uint32_t rate, uint32_t burst, uint32_t slip, uint32_t size);
+
+/* charge one answer, addr is the client address in network order (4 or 16 bytes) */
+int rrl_check(unsigned lcore_id, const uint8_t *addr, int addr_len,
+    const uint8_t *qname, uint16_t qname_len, uint8_t rcode);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * store_rcu.c -- the domain store shared by the data lcores
+ */
+
+#include <rte_common.h>
+
+#include "store_rcu.h"
+#include "util.h"
+
+static struct kdns stores[2];
+
+struct kdns * volatile store_rcu_active = &stores[0];
+volatile uint64_t store_rcu_epoch = 1;
+struct store_rcu_reader store_rcu_readers[STORE_RCU_MAX_READERS];
+
+
+int store_rcu_init(store_rcu_prepare_fn prepare) {
+    if (prepare(&stores[0]) != 0 || prepare(&stores[1]) != 0) {
+        log_msg(LOG_ERR, "unable to prepare the domain store\n");
+        return -1;
+    }
+    store_rcu_active = &stores[0];
+    return 0;
+}
+
+void store_rcu_online(unsigned reader) {
+    store_rcu_readers[reader].epoch = store_rcu_epoch;
+    /* pairs with the barrier in store_rcu_synchronize */
+    rte_smp_mb();
+}
+
+void store_rcu_offline(unsigned reader) {
+    rte_smp_mb();
+    store_rcu_readers[reader].epoch = 0;
+}
+
+/* wait until every online reader passed a quiescent state */
+static void store_rcu_synchronize(void) {
+    uint64_t target, epoch;
+    unsigned i;
+
+    target = store_rcu_epoch + 1;
+    store_rcu_epoch = target;
+    rte_smp_mb();
+
+    for (i = 0; i < STORE_RCU_MAX_READERS; i++) {
+        while ((epoch = store_rcu_readers[i].epoch) != 0 && epoch < target) {
+            rte_pause();
+        }
+    }
+}
+
+void store_rcu_update(store_rcu_update_fn fn, void *arg) {
+    struct kdns *old = store_rcu_active;
+    struct kdns *standby = (old == &stores[0]) ? &stores[1] : &stores[0];
+
+    fn(standby, arg);
+    rte_smp_wmb();
+    store_rcu_active = standby;
+
+    store_rcu_synchronize();
+    fn(old, arg);
+}
@@ -0,0 +1,71 @@
+#ifndef __STORE_RCU_H__
+#define __STORE_RCU_H__
+
+#include <stdint.h>
+#include <rte_atomic.h>
+#include <rte_memory.h>
+
+#include "kdns.h"
+#include "tcp_process.h"
+
+/*
+ * The domain store shared by all lcores and the tcp threads.
+ *
+ * Readers never lock. The master lcore is the only writer; it keeps two
+ * copies of the store (left-right): an update is applied to the copy no
+ * reader uses, that copy is published, and once every reader has passed a
+ * quiescent state the same update is applied to the old copy. Readers
+ * report a quiescent state between bursts (quiescent-state based
+ * reclamation), so nothing they loaded before it is used after it.
+ *
+ * Reader ids are lcore ids, tcp thread i uses STORE_RCU_TCP_READER + i.
+ */
+
+#define STORE_RCU_MAX_READERS   (MAX_CORES + TCP_MAX_THREADS)
+#define STORE_RCU_TCP_READER    MAX_CORES
+
+struct store_rcu_reader {
+    volatile uint64_t epoch;    /* last epoch seen, 0: offline */
+} __rte_cache_aligned;
+
+extern struct kdns * volatile store_rcu_active;
+extern volatile uint64_t store_rcu_epoch;
+extern struct store_rcu_reader store_rcu_readers[STORE_RCU_MAX_READERS];
+
+typedef int (*store_rcu_prepare_fn)(struct kdns *kdns);
+typedef void (*store_rcu_update_fn)(struct kdns *kdns, void *arg);
+
+/* build both copies with prepare, before any reader starts */
+int store_rcu_init(store_rcu_prepare_fn prepare);
+
+/* the copy to read from, only valid until the next quiescent state */
+static inline struct kdns *store_rcu_get(void) {
+    return store_rcu_active;
+}
+
+/*
+ * Report a quiescent state: the reader holds nothing it got from
+ * store_rcu_get. Returns the current epoch, it changes with every update.
+ */
+static inline uint64_t store_rcu_quiescent(unsigned reader) {
+    uint64_t epoch = store_rcu_epoch;
+
+    /* the epoch is read before anything loaded after the quiescent state */
+    rte_smp_rmb();
+    if (store_rcu_readers[reader].epoch != epoch) {
+        store_rcu_readers[reader].epoch = epoch;
+    }
+    return epoch;
+}
+
+/* readers that may block (the tcp threads) go offline while they do */
+void store_rcu_online(unsigned reader);
+void store_rcu_offline(unsigned reader);
+
+/*
+ * Apply an update to the store, master lcore only. fn is called twice,
+ * once per copy, and must change both the same way.
+ */
+void store_rcu_update(store_rcu_update_fn fn, void *arg);
+
+#endif
@@ -1,14 +1,16 @@
 /*
- * tcp+process.c 
+ * tcp_process.c -- dns over tcp on the kni address
  */
 
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <netdb.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <stdio.h>
 
@@ -21,118 +23,591 @@
 #include "db_update.h"
 #include "query.h"
 #include "kdns-adap.h"
+#include "store_rcu.h"
+#include "tcp_process.h"
 
 
+#define TCP_LISTEN_BACKLOG      1024
+#define TCP_EVENTS              64
+#define TCP_TICK_MS             100
+#define TCP_IDLE_SCAN_MS        1000
+#define TCP_BUF_LEN             512             /* first read buffer, grown to the message */
+#define TCP_CONN_MAX_INFLIGHT   32              /* forwarded queries of a connection at once */
+#define TCP_CONN_MAX_UNSENT     (256 * 1024)    /* no more queries are read while more is unsent */
+
 
 extern  struct dns_config *g_dns_cfg;
-extern void domain_store_zones_check_create(struct kdns*  kdns, char *zones);
 
-int tcp_domian_databd_update(struct domin_info_update* update);
-static int dns_handle_tcp_remote(int sndsock, char *snd_pkt,uint16_t old_id,int snd_len,char *domain);
+enum tcp_ev_type {
+    TCP_EV_LISTEN,
+    TCP_EV_CONN,
+    TCP_EV_FWD,
+};
+
+/* the epoll data of every socket starts with it */
+struct tcp_ev {
+    int type;
+};
+
+struct tcp_buf {
+    uint8_t *data;
+    uint32_t pos;               /* consumed or sent before it */
+    uint32_t len;
+    uint32_t cap;
+};
+
+struct tcp_conn {
+    struct tcp_ev ev;
+    int fd;                     /* -1: free */
+    uint32_t gen;               /* changes on close, forwards of an older one drop their answer */
+    uint32_t client_ip;         /* network order */
+    uint32_t events;            /* in epoll */
+    int eof;                    /* the client sent all its queries */
+    int inflight;               /* queries being forwarded */
+    int serving;                /* in tcp_conn_serve, answers are only queued */
+    uint64_t last_active;       /* ms */
+    struct tcp_buf in;
+    struct tcp_buf out;
+    struct tcp_conn *next_free;
+};
+
+/* a refused query forwarded over tcp, to one upstream after the other */
+struct tcp_fwd {
+    struct tcp_ev ev;
+    int fd;                     /* to the upstream asked, -1: none */
+    int connected;
+    struct tcp_conn *conn;
+    uint32_t gen;               /* of conn */
+    struct fwd_upstreams ups;
+    uint64_t deadline;          /* ms, this upstream is given up after it */
+    uint64_t expire;            /* ms, the query fails after it */
+    struct tcp_buf query;       /* the client's message with its length, pos: sent */
+    struct tcp_buf resp;
+    struct tcp_fwd *prev;
+    struct tcp_fwd *next;
+};
+
+struct tcp_worker {
+    struct tcp_ev ev;           /* of the listening socket */
+    unsigned id;
+    int listen_fd;
+    int epfd;
+    int max_conns;
+    uint32_t idle_ms;
+    uint32_t rand;
+    uint64_t next_idle_scan;
+    uint64_t rejected;          /* connections over max_conns */
+    struct tcp_conn *conns;
+    struct tcp_conn *free_conns;
+    struct tcp_fwd *fwds;
+    kdns_query_st *query;
+    uint8_t *buf;               /* of query, the message and its answer */
+};
+
+static struct tcp_worker tcp_workers[TCP_MAX_THREADS];
+
+static void tcp_fwd_next(struct tcp_worker *w, struct tcp_fwd *f, uint64_t now);
+
+
+static inline uint16_t tcp_read16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
 
+/* room for len more bytes after what was not consumed yet */
+static void tcp_buf_reserve(struct tcp_buf *b, uint32_t room) {
+    if (b->cap - b->len >= room) {
+        return;
+    }
+    if (b->pos > 0) {
+        memmove(b->data, b->data + b->pos, b->len - b->pos);
+        b->len -= b->pos;
+        b->pos = 0;
+    }
+    if (b->cap - b->len < room) {
+        b->cap = b->len + room;
+        b->data = xrealloc(b->data, b->cap);
+    }
+}
 
+static void tcp_buf_free(struct tcp_buf *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
 
-char host_name[64]={0};
+static void tcp_epoll_ctl(struct tcp_worker *w, int op, int fd, uint32_t events, void *ptr) {
+    struct epoll_event ev;
 
-static struct	kdns kdns_tcp;
-static struct  query *query_tcp = NULL;
+    ev.events = events;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(w->epfd, op, fd, &ev) != 0) {
+        log_msg(LOG_ERR, "tcp thread %u epoll_ctl %d on %d: %s\n", w->id, op, fd, strerror(errno));
+    }
+}
 
-int tcp_domian_databd_update(struct domin_info_update* update){
-    
-    return domaindata_update(kdns_tcp.db,update);
+static void tcp_conn_close(struct tcp_worker *w, struct tcp_conn *c) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->gen++;
+    tcp_buf_free(&c->in);
+    tcp_buf_free(&c->out);
+    c->next_free = w->free_conns;
+    w->free_conns = c;
 }
 
+/* queue a message with its length for the client */
+static void tcp_conn_reply(struct tcp_conn *c, const uint8_t *msg, uint16_t len) {
+    tcp_buf_reserve(&c->out, 2 + len);
+    c->out.data[c->out.len] = len >> 8;
+    c->out.data[c->out.len + 1] = len & 0xff;
+    memcpy(c->out.data + c->out.len + 2, msg, len);
+    c->out.len += 2 + len;
+    c->last_active = fwd_now_ms();
+}
 
-static int dns_do_remote_tcp_query(int sock_fd,char *domain, char *snd_buf,ssize_t snd_len,char *rvc_buf,ssize_t rcv_len,dns_addr_t *id_addr ) {
+/* the question of msg back with SERVFAIL */
+static void tcp_conn_servfail(struct tcp_conn *c, const uint8_t *msg, uint16_t len) {
+    uint8_t buf[DNS_HEAD_SIZE + MAXDOMAINLEN + 2 * sizeof(uint16_t)];
+    int qlen = fwd_question_len(msg, len);
 
-    int connResult = connect(sock_fd, (struct sockaddr *) id_addr->addr, id_addr->addrlen); 
-    if ( -1 == connResult ) { 
-        log_msg(LOG_ERR,"connect error: %s\n",domain);
-        return -1;
-    } 
+    if (qlen == 0) {
+        return;
+    }
+    memcpy(buf, msg, DNS_HEAD_SIZE + qlen);
+    buf[2] = (buf[2] & 0x79) | 0x80;    /* QR, opcode and RD kept */
+    buf[3] = RCODE_SERVFAIL;
+    buf[4] = 0;
+    buf[5] = 1;
+    memset(buf + 6, 0, 6);
+    tcp_conn_reply(c, buf, DNS_HEAD_SIZE + qlen);
+}
 
-    int ret = send(sock_fd, snd_buf, snd_len, 0);
-    if (ret <= 0){
-        log_msg(LOG_ERR,"send error: %s\n",domain);
-        return ret;
+static void tcp_fwd_start(struct tcp_worker *w, struct tcp_conn *c, const uint8_t *msg, uint16_t len,
+    const uint8_t *qname, uint16_t qname_len) {
+    struct tcp_fwd *f = xalloc_zero(sizeof(*f));
+    uint64_t now = fwd_now_ms();
+
+    f->ev.type = TCP_EV_FWD;
+    f->fd = -1;
+    f->conn = c;
+    f->gen = c->gen;
+    tcp_buf_reserve(&f->query, 2 + len);
+    f->query.data[0] = len >> 8;
+    f->query.data[1] = len & 0xff;
+    memcpy(f->query.data + 2, msg, len);
+    f->query.len = 2 + len;
+    fwd_upstreams_order(&f->ups, fwd_zone_find(qname, qname_len), &w->rand, now);
+    f->expire = now + g_dns_cfg->comm.fwd_timeout;
+
+    f->next = w->fwds;
+    if (w->fwds) {
+        w->fwds->prev = f;
     }
+    w->fwds = f;
+    c->inflight++;
+    tcp_fwd_next(w, f, now);
+}
 
-    memset(rvc_buf, 0, rcv_len);
-    ret = recv(sock_fd, rvc_buf, rcv_len - 1, 0);
-    if (ret <=0){
-        log_msg(LOG_ERR,"recv error: %s\n",domain);
-        return ret;
+static void tcp_query(struct tcp_worker *w, struct tcp_conn *c, const uint8_t *msg, uint16_t len) {
+    kdns_query_st *query = w->query;
+    unsigned reader = STORE_RCU_TCP_READER + w->id;
+    query_state_type state;
+
+    query_reset(query);
+    query->maxMsgLen = TCP_MAX_MESSAGE_LEN;
+    query->packet->data = w->buf;
+    memcpy(w->buf, msg, len);
+    query->packet->position += len;
+    buffer_flip(query->packet);
+    memcpy(query->client_addr, &c->client_ip, sizeof(c->client_ip));
+    query->client_addr_len = sizeof(c->client_ip);
+
+    store_rcu_online(reader);
+    view_query_tcp(query, c->client_ip);
+    state = query_process(query, store_rcu_get());
+    store_rcu_offline(reader);
+    if (state == QUERY_FAIL) {
+        return;
     }
-    return ret;
+    buffer_flip(query->packet);
+
+    if (GET_RCODE(query->packet) == RCODE_REFUSE) {
+        /* the client's own message goes upstream, the answer carries its id */
+        tcp_fwd_start(w, c, msg, len, domain_name_get(query->qname), query->qname->name_size);
+        return;
+    }
+    tcp_conn_reply(c, buffer_begin(query->packet), buffer_remaining(query->packet));
 }
 
+/* answer the whole messages read, as long as the connection may take more; -1 on a bad one */
+static int tcp_conn_serve(struct tcp_worker *w, struct tcp_conn *c) {
+    c->serving = 1;
+    while (c->inflight < TCP_CONN_MAX_INFLIGHT && c->out.len - c->out.pos < TCP_CONN_MAX_UNSENT &&
+        c->in.len - c->in.pos >= 2) {
+        uint8_t *p = c->in.data + c->in.pos;
+        uint16_t len = tcp_read16(p);
+
+        if (len < DNS_HEAD_SIZE) {
+            c->serving = 0;
+            return -1;
+        }
+        if (c->in.len - c->in.pos < 2U + len) {
+            tcp_buf_reserve(&c->in, 2U + len - (c->in.len - c->in.pos));
+            break;
+        }
+        tcp_query(w, c, p + 2, len);
+        c->in.pos += 2 + len;
+    }
+    if (c->in.pos == c->in.len) {
+        c->in.pos = c->in.len = 0;
+    }
+    c->serving = 0;
+    return 0;
+}
 
-static int dns_handle_tcp_remote(int sndsock, char *snd_pkt,uint16_t old_id,int snd_len,char *domain){
+static int tcp_conn_flush(struct tcp_conn *c) {
+    while (c->out.pos < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out.pos, c->out.len - c->out.pos, MSG_NOSIGNAL | MSG_DONTWAIT);
 
-    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd == -1){      
-        log_msg(LOG_ERR,"dns_handle_tcp_remote sock() error");
-        return -1;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        c->out.pos += n;
     }
-    struct timeval tv = {2, 0};
-    
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {  
-        log_msg(LOG_ERR," dns_handle_tcp_remote socket option  SO_RCVTIMEO not support\n");  
-        close(sock_fd);
-        return -1;  
-    } 
-    
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {  
-        log_msg(LOG_ERR,"dns_handle_tcp_remote socket option  SO_SNDTIMEO not support\n");  
-          close(sock_fd);
-        return -1;  
-    } 
+    c->out.pos = c->out.len = 0;
+    return 0;
+}
 
+/*
+ * After anything happened on c: answer what was held back, send what is
+ * queued, then close c or wait for what it can take next.
+ */
+static void tcp_conn_update(struct tcp_worker *w, struct tcp_conn *c) {
+    uint32_t events = 0;
+
+    if (tcp_conn_serve(w, c) != 0 || tcp_conn_flush(c) != 0) {
+        tcp_conn_close(w, c);
+        return;
+    }
+    if (c->eof && c->inflight == 0 && c->out.len == 0) {
+        tcp_conn_close(w, c);
+        return;
+    }
+    if (!c->eof && c->inflight < TCP_CONN_MAX_INFLIGHT && c->out.len - c->out.pos < TCP_CONN_MAX_UNSENT) {
+        events |= EPOLLIN;
+    }
+    if (c->out.len > c->out.pos) {
+        events |= EPOLLOUT;
+    }
+    if (events != c->events) {
+        tcp_epoll_ctl(w, EPOLL_CTL_MOD, c->fd, events, c);
+        c->events = events;
+    }
+}
+
+static void tcp_conn_event(struct tcp_worker *w, struct tcp_conn *c, uint32_t events) {
+    ssize_t n;
+
+    if (c->fd < 0) {
+        return;     /* closed earlier in this round */
+    }
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+        tcp_conn_close(w, c);
+        return;
+    }
+    if (events & EPOLLIN) {
+        if (c->in.cap == c->in.len) {
+            tcp_buf_reserve(&c->in, TCP_BUF_LEN);
+        }
+        n = recv(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len, MSG_DONTWAIT);
+        if (n > 0) {
+            c->in.len += n;
+            c->last_active = fwd_now_ms();
+        } else if (n == 0) {
+            c->eof = 1;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            tcp_conn_close(w, c);
+            return;
+        }
+    }
+    tcp_conn_update(w, c);
+}
 
-    domain_fwd_addrs * fwd_addrs = find_zone_fwd_addrs(domain);
-    int i =0;
-    int retfwd =0;
-    char recv_buf[16384] = {0};
-    for (;i < fwd_addrs->servers_len; i++){
-            retfwd = dns_do_remote_tcp_query(sock_fd,domain,snd_pkt,snd_len,recv_buf,16384,&fwd_addrs->server_addrs[i]);
-            if (retfwd >0){
+static void tcp_worker_accept(struct tcp_worker *w) {
+    struct sockaddr_in pin;
+    socklen_t pin_len;
+    struct tcp_conn *c;
+    int fd, one = 1;
+
+    while (1) {
+        pin_len = sizeof(pin);
+        fd = accept(w->listen_fd, (struct sockaddr *)&pin, &pin_len);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_msg(LOG_ERR, "tcp thread %u accept: %s\n", w->id, strerror(errno));
+            }
+            return;
+        }
+        c = w->free_conns;
+        if (c == NULL) {
+            if ((w->rejected++ & 1023) == 0) {
+                log_msg(LOG_ERR, "tcp thread %u has %d connections, %lu refused\n",
+                    w->id, w->max_conns, (unsigned long)w->rejected);
+            }
+            close(fd);
+            continue;
+        }
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        w->free_conns = c->next_free;
+        c->fd = fd;
+        c->client_ip = pin.sin_addr.s_addr;
+        c->eof = 0;
+        c->inflight = 0;
+        c->last_active = fwd_now_ms();
+        c->events = EPOLLIN;
+        tcp_epoll_ctl(w, EPOLL_CTL_ADD, fd, EPOLLIN, c);
+    }
+}
+
+static void tcp_fwd_close(struct tcp_worker *w, struct tcp_fwd *f) {
+    if (f->fd >= 0) {
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, f->fd, NULL);
+        close(f->fd);
+        f->fd = -1;
+    }
+}
+
+/* answer the client with resp, or SERVFAIL if NULL, and drop f */
+static void tcp_fwd_finish(struct tcp_worker *w, struct tcp_fwd *f, const uint8_t *resp, uint16_t len) {
+    struct tcp_conn *c = f->conn;
+
+    tcp_fwd_close(w, f);
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        w->fwds = f->next;
+    }
+    if (f->next) {
+        f->next->prev = f->prev;
+    }
+    if (c->gen == f->gen) {
+        c->inflight--;
+        if (resp) {
+            tcp_conn_reply(c, resp, len);
+        } else {
+            tcp_conn_servfail(c, f->query.data + 2, f->query.len - 2);
+        }
+        if (!c->serving) {
+            tcp_conn_update(w, c);
+        }
+    }
+    tcp_buf_free(&f->query);
+    tcp_buf_free(&f->resp);
+    free(f);
+}
+
+/* connect to the next upstream, the query fails once there is none */
+static void tcp_fwd_next(struct tcp_worker *w, struct tcp_fwd *f, uint64_t now) {
+    dns_addr_t *server;
+    char name[64];
+
+    tcp_fwd_close(w, f);
+    while (f->ups.next < f->ups.num && now < f->expire) {
+        server = &f->ups.fwd_addrs->server_addrs[f->ups.order[f->ups.next++]];
+        f->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (f->fd < 0) {
+            log_msg(LOG_ERR, "tcp forward socket: %s\n", strerror(errno));
             break;
         }
+        if (fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+            (connect(f->fd, server->addr, server->addrlen) < 0 && errno != EINPROGRESS)) {
+            log_msg(LOG_ERR, "tcp forward to %s: %s\n", fwd_server_name(server, name, sizeof(name)), strerror(errno));
+            close(f->fd);
+            f->fd = -1;
+            continue;
+        }
+        f->connected = 0;
+        f->query.pos = 0;
+        f->resp.len = 0;
+        /* the upstreams left share the time left */
+        f->deadline = now + (f->expire - now) / (f->ups.num - f->ups.next + 1);
+        tcp_epoll_ctl(w, EPOLL_CTL_ADD, f->fd, EPOLLOUT, f);
+        return;
     }
-    if (retfwd >0){
-         uint16_t  len = htons(retfwd);
-         memcpy(recv_buf,&len,2);
-         if(send(sndsock,recv_buf,retfwd +2,0) == -1){   
-             log_msg(LOG_ERR," last send error %s\n",domain);
-         } 
-    }  
-    close(sock_fd);
-    return 0;   
+    tcp_fwd_finish(w, f, NULL, 0);
 }
 
+static void tcp_fwd_event(struct tcp_worker *w, struct tcp_fwd *f, uint32_t events) {
+    uint64_t now = fwd_now_ms();
+    uint32_t need;
+    ssize_t n;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
 
-static void *dns_tcp_process(void *arg) {     
-          
-    struct sockaddr_in sin,pin;
-    char *ip  = (char*)arg;
-    int sock_descriptor,temp_sock_descriptor,address_size;  
-    char buf[16384]; 
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+        tcp_fwd_next(w, f, now);
+        return;
+    }
+    if (!f->connected) {
+        if (getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0) {
+            tcp_fwd_next(w, f, now);
+            return;
+        }
+        f->connected = 1;
+    }
+    if (f->query.pos < f->query.len) {
+        n = send(f->fd, f->query.data + f->query.pos, f->query.len - f->query.pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                tcp_fwd_next(w, f, now);
+            }
+            return;
+        }
+        f->query.pos += n;
+        if (f->query.pos == f->query.len) {
+            tcp_epoll_ctl(w, EPOLL_CTL_MOD, f->fd, EPOLLIN, f);
+        }
+        return;
+    }
+    if (!(events & EPOLLIN)) {
+        return;
+    }
 
+    need = f->resp.len < 2 ? TCP_BUF_LEN : 2U + tcp_read16(f->resp.data) - f->resp.len;
+    tcp_buf_reserve(&f->resp, need);
+    n = recv(f->fd, f->resp.data + f->resp.len, f->resp.cap - f->resp.len, MSG_DONTWAIT);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            tcp_fwd_next(w, f, now);
+        }
+        return;
+    }
+    f->resp.len += n;
+    if (f->resp.len < 2 || f->resp.len < 2U + tcp_read16(f->resp.data)) {
+        return;
+    }
+    /* one answer per connection, to our query */
+    if (tcp_read16(f->resp.data) < DNS_HEAD_SIZE || memcmp(f->resp.data + 2, f->query.data + 2, 2) != 0) {
+        tcp_fwd_next(w, f, now);
+        return;
+    }
+    tcp_fwd_finish(w, f, f->resp.data + 2, tcp_read16(f->resp.data));
+}
 
-    memset(&kdns_tcp,0,sizeof(kdns_tcp));
+static void tcp_worker_timers(struct tcp_worker *w, uint64_t now) {
+    struct tcp_fwd *f, *next;
+    int i;
 
-    if (( kdns_tcp.db = domain_store_open()) == NULL) {
-        log_msg(LOG_ERR,"unable to open the database \n");
-        exit(-1);
-    } 
+    for (f = w->fwds; f; f = next) {
+        next = f->next;
+        if (now >= f->expire) {
+            tcp_fwd_finish(w, f, NULL, 0);
+        } else if (now >= f->deadline) {
+            tcp_fwd_next(w, f, now);
+        }
+    }
 
-    domain_store_zones_check_create( &kdns_tcp,g_dns_cfg->comm.zones);
+    if (now < w->next_idle_scan) {
+        return;
+    }
+    w->next_idle_scan = now + TCP_IDLE_SCAN_MS;
+    for (i = 0; i < w->max_conns; i++) {
+        struct tcp_conn *c = &w->conns[i];
+
+        if (c->fd >= 0 && c->inflight == 0 && now - c->last_active >= w->idle_ms) {
+            tcp_conn_close(w, c);
+        }
+    }
+}
+
+static void *tcp_worker_run(void *arg) {
+    struct tcp_worker *w = (struct tcp_worker *)arg;
+    struct epoll_event events[TCP_EVENTS];
+    int i, n;
+
+    while (1) {
+        n = epoll_wait(w->epfd, events, TCP_EVENTS, TCP_TICK_MS);
+        for (i = 0; i < n; i++) {
+            struct tcp_ev *ev = (struct tcp_ev *)events[i].data.ptr;
+
+            switch (ev->type) {
+            case TCP_EV_LISTEN:
+                tcp_worker_accept(w);
+                break;
+            case TCP_EV_CONN:
+                tcp_conn_event(w, (struct tcp_conn *)ev, events[i].events);
+                break;
+            case TCP_EV_FWD:
+                tcp_fwd_event(w, (struct tcp_fwd *)ev, events[i].events);
+                break;
+            }
+        }
+        tcp_worker_timers(w, fwd_now_ms());
+    }
+    return NULL;
+}
+
+static void tcp_worker_init(struct tcp_worker *w, unsigned id, const char *ip, int max_conns) {
+    struct sockaddr_in sin;
+    int i, one = 1;
+
+    w->ev.type = TCP_EV_LISTEN;
+    w->id = id;
+    w->max_conns = max_conns;
+    w->idle_ms = g_dns_cfg->comm.tcp_idle_timeout;
+    w->rand = (uint32_t)fwd_now_us() ^ (id << 16) ^ 0x9e3779b9;
+    w->query = query_create();
+    w->buf = xalloc(QIOBUFSZ);
+    w->conns = xalloc_array_zero(max_conns, sizeof(struct tcp_conn));
+    for (i = max_conns - 1; i >= 0; i--) {
+        w->conns[i].ev.type = TCP_EV_CONN;
+        w->conns[i].fd = -1;
+        w->conns[i].next_free = w->free_conns;
+        w->free_conns = &w->conns[i];
+    }
+
+    /* every thread listens itself, the kernel spreads the connections */
+    w->listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (w->listen_fd < 0 ||
+        setsockopt(w->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        setsockopt(w->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        log_msg(LOG_ERR, "tcp thread %u socket: %s\n", id, strerror(errno));
+        exit(1);
+    }
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(ip);
+    sin.sin_port = htons(53);
+    if (bind(w->listen_fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+        log_msg(LOG_ERR, "call bind err %s\n", strerror(errno));
+        exit(1);
+    }
+    if (listen(w->listen_fd, TCP_LISTEN_BACKLOG) == -1 ||
+        fcntl(w->listen_fd, F_SETFL, fcntl(w->listen_fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        log_msg(LOG_ERR, "call listen err %s\n", strerror(errno));
+        exit(1);
+    }
 
-    kdns_zones_soa_create( kdns_tcp.db,g_dns_cfg->comm.zones);
+    w->epfd = epoll_create(TCP_EVENTS);
+    if (w->epfd < 0) {
+        log_msg(LOG_ERR, "tcp thread %u epoll_create: %s\n", id, strerror(errno));
+        exit(1);
+    }
+    tcp_epoll_ctl(w, EPOLL_CTL_ADD, w->listen_fd, EPOLLIN, &w->ev);
+}
 
+static void *dns_tcp_process(void *arg) {
+    char *ip = (char *)arg;
+    unsigned i, threads = g_dns_cfg->comm.tcp_threads;
+    int max_conns = (g_dns_cfg->comm.tcp_max_conns + threads - 1) / threads;
 
-    query_tcp = query_create();
-    
     sleep(3);
     int ret = linux_set_if_ip(g_dns_cfg->netdev.name_prefix, ip);
     if (ret != 0) {
@@ -140,85 +615,20 @@ static void *dns_tcp_process(void *arg) {
         exit(-1);
     }
 
-    sock_descriptor = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
-    bzero(&sin,sizeof(sin)); 
-    sin.sin_family = AF_INET; 
-    sin.sin_addr.s_addr = inet_addr(ip);;  
-    sin.sin_port = htons(53);  
-    if(bind(sock_descriptor,(struct sockaddr *)&sin,sizeof(sin)) == -1)
-    {  
-        log_msg(LOG_ERR,"call bind err \n");  
-        exit(1);  
-    }  
-    if(listen(sock_descriptor,100) == -1)
-    {  
-        log_msg(LOG_ERR,"call listen err \n");  
-        exit(1);  
-    }  
-    printf("Accpting connections...\n");  
-
-
-    while(1)  
-    {  
-            address_size = sizeof(pin);  
-            temp_sock_descriptor = accept(sock_descriptor,(struct sockaddr *)&pin,&address_size);
-            if (temp_sock_descriptor == -1)
-            {  
-                log_msg(LOG_ERR,"call  accept error\n");  
-                continue;  
-            } 
-            int recv_len = recv(temp_sock_descriptor,buf,16384,0);
-            if(recv_len == -1)
-            {  
-                 log_msg(LOG_ERR,"call  recv error\n");  
-                  continue;  
-            }  
-            inet_ntop(AF_INET,&pin.sin_addr,host_name,sizeof(host_name));  
-          //  printf("received from client(%s):%d\n",host_name,recv_len);  
-
-            query_reset(query_tcp);
-            query_tcp->maxMsgLen = TCP_MAX_MESSAGE_LEN;
-
-            query_tcp->packet->data = (uint8_t *)(buf+2); // skip len
-
-            uint16_t flags_old ;
-            memcpy(&flags_old,query_tcp->packet->data +2 , 2);
-            
-            query_tcp->packet->position += recv_len;
-            buffer_flip(query_tcp->packet);
-
-            view_query_tcp(query_tcp, *(uint32_t *)&pin.sin_addr);
-
-            if(query_process(query_tcp, &kdns_tcp) != QUERY_FAIL) {
-                buffer_flip(query_tcp->packet);
-            }
-            
-            if(GET_RCODE(query_tcp->packet) == RCODE_REFUSE ) {
-                   memcpy((buf+2) + 2, &flags_old, 2);  
-                   dns_handle_tcp_remote(temp_sock_descriptor,buf,GET_ID(query_tcp->packet),recv_len,(char *)domain_name_to_string(query_tcp->qname, NULL));
-                   close(temp_sock_descriptor); 
-                  continue;
-            }
-
-
-             int retLen = buffer_remaining(query_tcp->packet);
-             if (retLen > 0) {
-                 uint16_t  len = htons(retLen);
-                 memcpy(buf,&len,2);
-                 if(send(temp_sock_descriptor,buf,retLen+2,0) == -1){   
-                        log_msg(LOG_ERR," send error\n");
-                 } 
-                
-             }
- 
-            close(temp_sock_descriptor);  
-    }   
-}  
+    for (i = 0; i < threads; i++) {
+        tcp_worker_init(&tcp_workers[i], i, ip, max_conns);
+    }
+    for (i = 1; i < threads; i++) {
+        pthread_t thread_id;
+        pthread_create(&thread_id, NULL, tcp_worker_run, &tcp_workers[i]);
+    }
+    log_msg(LOG_INFO, "dns over tcp on %s:53, %u threads, %d connections each\n", ip, threads, max_conns);
+    return tcp_worker_run(&tcp_workers[0]);
+}
 
 int dns_tcp_process_init(char *ip){
 
-    pthread_t *thread_cache_expired = (pthread_t *)  xalloc(sizeof(pthread_t));  
-    pthread_create(thread_cache_expired, NULL, dns_tcp_process, (void*)ip);
+    pthread_t *thread_tcp = (pthread_t *)  xalloc(sizeof(pthread_t));
+    pthread_create(thread_tcp, NULL, dns_tcp_process, (void*)ip);
     return 0;
 }
-
@@ -0,0 +1,22 @@
+#ifndef __TCP_PROCESS_H__
+#define __TCP_PROCESS_H__
+
+/*
+ * DNS over TCP on the kni address (RFC 7766), where clients retry the
+ * answers that were truncated over UDP. Each tcp thread runs its own
+ * epoll loop and its own listening socket (SO_REUSEPORT), so the kernel
+ * spreads the connections over them. A connection stays open for more
+ * queries until it is idle for tcp-idle-timeout; its queries are read as
+ * length-prefixed messages and may be pipelined. Local answers are sent
+ * right away, refused queries are forwarded over TCP without blocking and
+ * answered as their upstream answers, so out of order.
+ */
+
+#define TCP_MAX_THREADS          16
+#define TCP_DEF_THREADS          2
+#define TCP_DEF_MAX_CONNS        4096     /* over all tcp threads */
+#define TCP_DEF_IDLE_TIMEOUT     10000    /* ms */
+
+int dns_tcp_process_init(char *ip);
+
+#endif
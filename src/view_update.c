@@ -8,15 +8,15 @@
 #include "domain_store.h"
 #include "view_update.h"
 #include "kdns.h"
+#include "store_rcu.h"
  
 #define MSG_RING_SIZE  65536
+#define MSG_BATCH_SIZE 256
 
 
-extern struct kdns dpdk_dns[MAX_CORES];
+static struct rte_ring *view_msg_ring;
 
-static struct rte_ring *view_msg_ring[MAX_CORES];
-
-static view_tree_t * view_tree_master = NULL;
+/* the api dumps the view tree of the store, the master changes it under this lock */
 static rte_rwlock_t view_lock_master;
 
 
@@ -25,7 +25,7 @@ static void send_view_msg_to_master(struct view_info_update *msg){
     unsigned cid_master = rte_get_master_lcore();
     
     assert(msg);
-    int res = rte_ring_enqueue(view_msg_ring[cid_master],(void *) msg);
+    int res = rte_ring_enqueue(view_msg_ring,(void *) msg);
 
     if (unlikely(-EDQUOT == res)) {
         log_msg(LOG_ERR," msg_ring of master lcore %d quota exceeded\n", cid_master);
@@ -142,7 +142,7 @@ void* view_get( __attribute__((unused)) struct connection_info_struct *con_info,
         goto err_out;
     }
     rte_rwlock_read_lock(&view_lock_master);
-    view_tree_dump(view_tree_master->root, (void *) array, do_view_info_get);
+    view_tree_dump(store_rcu_get()->db->viewtree->root, (void *) array, do_view_info_get);
 
     rte_rwlock_read_unlock(&view_lock_master);
     
@@ -161,101 +161,54 @@ err_out:
  
 }
 
+// the master core call this func
 void view_msg_ring_create(void){
 
-    char ring_name[64]={0};
-    unsigned lcore_id = rte_lcore_id();
-    // slave core
-    if (dpdk_dns[lcore_id].db != NULL && (dpdk_dns[lcore_id].db->viewtree == NULL)) {
-        dpdk_dns[lcore_id].db->viewtree = view_tree_create();
-    }
-    if (view_tree_master == NULL) {
-        rte_rwlock_init(&view_lock_master); 
-        view_tree_master = view_tree_create();
-    }
-    snprintf(ring_name, sizeof(ring_name), "view_ring_core%d", lcore_id);
-    view_msg_ring[lcore_id] = rte_ring_create(ring_name, MSG_RING_SIZE,
-            rte_socket_id(), 0);
-    if (unlikely(NULL == view_msg_ring[lcore_id])) {
-        log_msg(LOG_ERR, "Fail to create ring :%s  !\n",ring_name);
+    rte_rwlock_init(&view_lock_master);
+    view_msg_ring = rte_ring_create("view_ring_master", MSG_RING_SIZE,
+            rte_socket_id(), RING_F_SC_DEQ);
+    if (unlikely(NULL == view_msg_ring)) {
+        log_msg(LOG_ERR, "Fail to create ring :view_ring_master  !\n");
         exit(-1) ;
     }
 }
 
-static inline struct view_info_update * vmsg_copy(struct view_info_update *src){
+struct view_msg_batch {
+    unsigned num;
+    struct view_info_update *msgs[MSG_BATCH_SIZE];
+};
 
-    struct view_info_update * dst = calloc(1,sizeof(struct view_info_update )) ;
-    assert(dst);
-    dst->action = src->action;
+static void view_msg_batch_apply(struct kdns *kdns, void *arg){
+    struct view_msg_batch *batch = arg;
+    unsigned i;
 
-    memcpy(dst->cidrs,src->cidrs,MAX_VIEW_NAME_LEN);
-    memcpy(dst->view_name,src->view_name,MAX_VIEW_NAME_LEN);
-    return dst;  
+    for (i = 0; i < batch->num; i++) {
+        do_view_msg_update(kdns->db->viewtree, batch->msgs[i]);
+    }
 }
 
 
 void view_msg_master_process(void){
     
-    struct view_info_update *msg;   
-    unsigned cid_master = rte_get_master_lcore();    
-    
-    unsigned idx =0;
-    
-    while (0 == rte_ring_dequeue(view_msg_ring[cid_master], (void **)&msg)) {
-        
-        //dispatch the msg
-        for(idx =0; idx < MAX_CORES; idx ++){
-
-            // skip the no bind core
-            if ( view_msg_ring[idx] == NULL){
-                continue;
-            }
-            // skip the no bind core
-
-             if(idx == cid_master){
-                struct view_info_update * new_msg = vmsg_copy(msg);
-                rte_rwlock_write_lock(&view_lock_master);
-                do_view_msg_update(view_tree_master,new_msg);
-                rte_rwlock_write_unlock(&view_lock_master);
-                free(new_msg);
-                continue;
-            }    
-            struct view_info_update * new_msg = vmsg_copy(msg);
-            int res = rte_ring_enqueue(view_msg_ring[idx], (void *)new_msg);
-
-            if (unlikely(-EDQUOT == res)) {
-                printf(" msg_ring of lcore %d quota exceeded\n", idx);
-           } else if (unlikely(-ENOBUFS == res)) {
-                log_msg(LOG_ERR," msg_ring of lcore %d is full\n", idx);
-                free(new_msg);
-           } else if (res) {
-                log_msg(LOG_ERR,"unkown error %d for rte_ring_enqueue lcore %d\n", res,idx);
-                free(new_msg);
-           }
-             
-        }
-        // tcp use view_tree_master    
-
-    }   
-}
+    struct view_msg_batch batch;
+    unsigned i;
 
-void view_msg_slave_process(void){
-    struct view_info_update *msg;   
-    unsigned cid = rte_lcore_id();    
-    while (0 == rte_ring_dequeue(view_msg_ring[cid], (void **)&msg)) {   
-        do_view_msg_update(dpdk_dns[cid].db->viewtree,msg);
-        free(msg); 
-    }   
-}
+    batch.num = rte_ring_dequeue_burst(view_msg_ring, (void **)batch.msgs, MSG_BATCH_SIZE);
+    if (batch.num == 0) {
+        return;
+    }
+    // the shared store, seen by the lcores and the tcp thread; both copies change, the api waits
+    rte_rwlock_write_lock(&view_lock_master);
+    store_rcu_update(view_msg_batch_apply, &batch);
+    rte_rwlock_write_unlock(&view_lock_master);
 
+    for (i = 0; i < batch.num; i++) {
+        free(batch.msgs[i]);
+    }
+}
 
 
+// the caller must be a store_rcu reader
 void view_query_tcp(struct  query *query_tcp,uint32_t sip){
-    rte_rwlock_read_lock(&view_lock_master);
-    view_value_t* data = view_find(view_tree_master, (uint8_t *)&sip,32);
-        if (data != VIEW_NO_NODE){
-           snprintf(query_tcp->view_name,MAX_VIEW_NAME_LEN,"%s",data->view_name);
-   }
-   rte_rwlock_read_unlock(&view_lock_master);          
+    query_tcp->view_id = view_lookup(store_rcu_get()->db->viewtree, sip);
 }
-
@@ -22,7 +22,6 @@ typedef struct view_info_update{
     struct view_info_update *next;  
 }view_info_update_st;
 
-void view_msg_slave_process(void);
 void view_msg_master_process(void);
 void view_msg_ring_create(void);
 void* view_post(struct connection_info_struct *con_info ,__attribute__((unused))char *url, int * len_response);